@@ -0,0 +1,385 @@
+#ifndef _ANIMATED_SURFACE_H
+#define _ANIMATED_SURFACE_H
+
+#include <math.h>
+#include <stdio.h>
+#include "GLDriver.h"
+#include "Shader.h"
+#include "Simd.h"
+#include "StreamBuffer.h"
+#include "Timer.h"
+#include "WorkerPool.h"
+
+/*
+ * One sinusoid of an animated surface,
+ * amplitude * sin(waveX * x + waveZ * z + speed * t + phase)
+ * in world units and seconds. Layers with no speed do not move.
+ */
+struct WaveLayer {
+	float amplitude;
+	float waveX, waveZ;
+	float speed;
+	float phase;
+};
+
+/*
+ * Per frame statistics of the animated surface
+ */
+struct AnimatedSurfaceStats {
+	int evaluateTime;
+	int uploadBytes;
+	int fenceWaits;
+};
+
+/*
+ * Heightfield that is a sum of wave layers, evaluated from scratch every
+ * frame for water and drifting dunes.
+ *
+ * Rows of samples are split across the worker pool, and along a row four
+ * samples are evaluated at once with the polynomial sine of Simd.h. The
+ * heights are quantized to 16 bits and written straight into a ring of
+ * pixel unpack buffers, from which the texture is updated on the GPU
+ * timeline. As long as the ring holds more frames than are in flight,
+ * neither side waits for the other.
+ *
+ * One grid tile is drawn instanced over the whole surface, the vertex
+ * shader fetches the heights and the normal from the texture like the
+ * clipmap does. Texture x is grid x, rows are grid z.
+ */
+class AnimatedSurface {
+public:
+
+	enum {
+		MAX_LAYERS = 16,
+		TILE = 31,
+		GRAIN = 8,
+		STREAM_FRAMES = 4,
+	};
+
+	/*
+	 * size samples per side, scale world units between them
+	 */
+	AnimatedSurface(int size, float scale, const WaveLayer* layers, int layerCount)
+		: size(size), scale(scale), time(0), program(0), texture(0),
+		  tiles(0), stream(NULL), samples(NULL) {
+		memset(&stats, 0, sizeof (stats));
+		buffer[0] = buffer[1] = buffer[2] = 0;
+
+		this->layerCount = layerCount < MAX_LAYERS ? layerCount : MAX_LAYERS;
+		amplitude = 0;
+		for (int i = 0; i < this->layerCount; ++i) {
+			this->layers[i] = layers[i];
+			amplitude += fabs(layers[i].amplitude);
+		}
+		if (amplitude <= 0)
+			amplitude = 1;
+	}
+
+	~AnimatedSurface() {
+		delete stream;
+		delete[] samples;
+		if (!program)
+			return;
+		driver->glDeleteProgram(program);
+		driver->glDeleteBuffers(3, buffer);
+		driver->glDeleteTextures(1, &texture);
+	}
+
+	/*
+	 * Creates the GL objects, the surface can be evaluated without them
+	 */
+	void initGL() {
+		if (!hasGLExtension("GL_ARB_instanced_arrays") ||
+		    !hasGLExtension("GL_ARB_draw_instanced") ||
+		    !hasGLExtension("GL_ARB_texture_rg"))
+			return;
+
+		initProgram();
+		if (!program)
+			return;
+		initMeshes();
+
+		driver->glGenTextures(1, &texture);
+		driver->glBindTexture(GL_TEXTURE_2D, texture);
+		driver->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		driver->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		driver->glTexImage2D(GL_TEXTURE_2D, 0, GL_R16, size, size, 0, GL_RED, GL_UNSIGNED_SHORT, NULL);
+		driver->glBindTexture(GL_TEXTURE_2D, 0);
+
+		// Without pixel buffers the heights are uploaded from memory
+		if (hasGLExtension("GL_ARB_pixel_buffer_object"))
+			stream = new StreamBuffer(GL_PIXEL_UNPACK_BUFFER, STREAM_FRAMES * getFrameBytes());
+		if (!stream || !stream->isAvailable())
+			samples = new unsigned short[size * size];
+	}
+
+	bool isAvailable() const {
+		return program != 0;
+	}
+
+	int getSize() const {
+		return size;
+	}
+
+	int getLayerCount() const {
+		return layerCount;
+	}
+
+	// Bytes of one frame of heights
+	int getFrameBytes() const {
+		return size * size * sizeof (unsigned short);
+	}
+
+	// Height of the quantized value 0 and of one quantization step
+	float getMinHeight() const {
+		return -amplitude;
+	}
+
+	float getHeightStep() const {
+		return 2 * amplitude / 65535;
+	}
+
+	/*
+	 * Evaluates the surface at time t in seconds into size x size
+	 * quantized heights, split across the pool if there is one
+	 */
+	void evaluate(float t, unsigned short* out, WorkerPool* pool = NULL) {
+		EvaluateJob job = { this, t, out };
+		if (pool)
+			pool->run(evaluateRows, &job, size, GRAIN);
+		else
+			evaluateRows(&job, 0, size);
+	}
+
+	/*
+	 * Reference evaluation of one sample with the libm sine
+	 */
+	float sample(int x, int z, float t) const {
+		float h = 0;
+		for (int i = 0; i < layerCount; ++i) {
+			const WaveLayer& l = layers[i];
+			h += l.amplitude * sin(l.waveX * scale * x + l.waveZ * scale * z + l.speed * t + l.phase);
+		}
+		return h;
+	}
+
+	/*
+	 * Advances the animation by the frame time, evaluates the surface and
+	 * starts the texture update
+	 */
+	void update(float frameTime, WorkerPool* pool) {
+		if (!program)
+			return;
+		time += frameTime;
+
+		long long start = getMicroseconds();
+		int offset = 0;
+		unsigned short* out = stream ? (unsigned short*)stream->map(getFrameBytes(), offset) : NULL;
+		evaluate(time, out ? out : samples, pool);
+		if (out)
+			stream->unmap();
+		stats.evaluateTime = (int)(getMicroseconds() - start);
+
+		driver->glBindTexture(GL_TEXTURE_2D, texture);
+		driver->glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+		driver->glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, size, size, GL_RED, GL_UNSIGNED_SHORT,
+					out ? (const char*)0 + offset : (const char*)samples);
+		driver->glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		driver->glBindTexture(GL_TEXTURE_2D, 0);
+		if (out) {
+			driver->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			stream->endFrame();
+			stats.fenceWaits = stream->getFrameStats().fenceWaits;
+		}
+		stats.uploadBytes = getFrameBytes();
+	}
+
+	void draw() {
+		if (!program)
+			return;
+		driver->glUseProgram(program);
+		driver->glUniform1i(driver->glGetUniformLocation(program, "heights"), 0);
+		driver->glUniform1f(driver->glGetUniformLocation(program, "scale"), scale);
+		driver->glUniform2f(driver->glGetUniformLocation(program, "quantization"),
+				    getMinHeight(), 2 * amplitude);
+		driver->glActiveTexture(GL_TEXTURE0);
+		driver->glBindTexture(GL_TEXTURE_2D, texture);
+
+		driver->glBindBuffer(GL_ARRAY_BUFFER, buffer[0]);
+		driver->glEnableVertexAttribArray(0);
+		driver->glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+		driver->glBindBuffer(GL_ARRAY_BUFFER, buffer[2]);
+		driver->glEnableVertexAttribArray(1);
+		driver->glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+		driver->glVertexAttribDivisor(1, 1);
+		driver->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer[1]);
+		driver->glDrawElementsInstanced(GL_TRIANGLES, 6 * TILE * TILE, GL_UNSIGNED_SHORT, NULL,
+						tiles * tiles);
+		driver->glVertexAttribDivisor(1, 0);
+		driver->glDisableVertexAttribArray(1);
+		driver->glDisableVertexAttribArray(0);
+
+		driver->glBindBuffer(GL_ARRAY_BUFFER, 0);
+		driver->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+		driver->glBindTexture(GL_TEXTURE_2D, 0);
+		driver->glUseProgram(0);
+	}
+
+	// Triangles of one draw
+	int getTriangleCount() const {
+		return 2 * TILE * TILE * tiles * tiles;
+	}
+
+	const AnimatedSurfaceStats& getFrameStats() const {
+		return stats;
+	}
+
+private:
+
+	struct EvaluateJob {
+		AnimatedSurface* surface;
+		float            time;
+		unsigned short*  out;
+	};
+
+	static void evaluateRows(void* data, int begin, int end) {
+		EvaluateJob* job = (EvaluateJob*)data;
+		for (int z = begin; z < end; ++z)
+			job->surface->evaluateRow(z, job->time, job->out + z * job->surface->size);
+	}
+
+	/*
+	 * The phase of a layer is linear along the row, so everything but
+	 * the x term is folded into one offset per layer. The time term is
+	 * wrapped to keep the arguments of the polynomial small.
+	 */
+	void evaluateRow(int z, float t, unsigned short* out) const {
+		Float4 offset[MAX_LAYERS], step[MAX_LAYERS], amplitudes[MAX_LAYERS];
+		for (int i = 0; i < layerCount; ++i) {
+			const WaveLayer& l = layers[i];
+			offset[i] = l.waveZ * scale * z + fmodf(l.speed * t + l.phase, 2 * M_PI);
+			step[i] = l.waveX * scale;
+			amplitudes[i] = l.amplitude;
+		}
+
+		Float4 quantize(65535 / (2 * amplitude)), bias(amplitude), round(.5f);
+		int x = 0;
+		for (; x + 4 <= size; x += 4) {
+			Float4 px(x, x + 1, x + 2, x + 3);
+			Float4 h(0);
+			for (int i = 0; i < layerCount; ++i)
+				h = h + amplitudes[i] * sin(step[i] * px + offset[i]);
+
+			int q[4];
+			convert((h + bias) * quantize + round, q);
+			for (int j = 0; j < 4; ++j)
+				out[x + j] = (unsigned short)(q[j] < 0 ? 0 : q[j] > 65535 ? 65535 : q[j]);
+		}
+		for (; x < size; ++x) {
+			int q = (int)((sample(x, z, t) + amplitude) * (65535 / (2 * amplitude)) + .5f);
+			out[x] = (unsigned short)(q < 0 ? 0 : q > 65535 ? 65535 : q);
+		}
+	}
+
+	void initProgram() {
+		static const char* vertexSource =
+			"uniform sampler2D heights;\n"
+			"uniform float scale;\n"
+			"uniform vec2 quantization;\n"
+			"in vec2 grid;\n"
+			"in vec2 tile;\n"
+			"out vec4 color;\n"
+			"float fetch(ivec2 p) {\n"
+			"	p = clamp(p, ivec2(0), ivec2(SIZE - 1));\n"
+			"	return quantization.x + quantization.y * texelFetch(heights, p, 0).r;\n"
+			"}\n"
+			"void main() {\n"
+			"	ivec2 i = min(ivec2(tile + grid), ivec2(SIZE - 1));\n"
+			"	float h = fetch(i);\n"
+			"	vec3 n = vec3(fetch(i - ivec2(1, 0)) - fetch(i + ivec2(1, 0)), 2 * scale,\n"
+			"		      fetch(i - ivec2(0, 1)) - fetch(i + ivec2(0, 1)));\n"
+			"	vec4 position = gl_ModelViewMatrix * vec4(i.x * scale, h, i.y * scale, 1);\n"
+			"	vec3 normal = normalize(gl_NormalMatrix * n);\n"
+			"	vec3 light = normalize(gl_LightSource[1].position.xyz - position.xyz);\n"
+			"	color = gl_FrontLightModelProduct.sceneColor + gl_FrontLightProduct[1].ambient +\n"
+			"		gl_FrontLightProduct[1].diffuse * max(dot(normal, light), 0.);\n"
+			"	gl_Position = gl_ProjectionMatrix * position;\n"
+			"}\n";
+		static const char* fragmentSource =
+			"#version 130\n"
+			"in vec4 color;\n"
+			"void main() {\n"
+			"	gl_FragColor = color;\n"
+			"}\n";
+		static const char* attributes[] = { "grid", "tile", NULL };
+
+		char source[4096];
+		snprintf(source, sizeof (source), "#version 130\n#define SIZE %d\n%s", size, vertexSource);
+		program = linkProgram(source, fragmentSource, attributes);
+	}
+
+	/*
+	 * Builds the tile and the origins of its instances. Tiles that reach
+	 * past the last sample are clamped to it in the shader.
+	 */
+	void initMeshes() {
+		enum {
+			VERTICES = (TILE + 1) * (TILE + 1),
+		};
+		float vertices[2 * VERTICES];
+		GLushort indices[6 * TILE * TILE];
+		float* v = vertices;
+		GLushort* index = indices;
+		for (int z = 0; z <= TILE; ++z) {
+			for (int x = 0; x <= TILE; ++x) {
+				*v++ = x;
+				*v++ = z;
+			}
+		}
+		for (int z = 0; z < TILE; ++z) {
+			for (int x = 0; x < TILE; ++x) {
+				int a = z * (TILE + 1) + x;
+				*index++ = a;
+				*index++ = a + TILE + 1;
+				*index++ = a + 1;
+				*index++ = a + 1;
+				*index++ = a + TILE + 1;
+				*index++ = a + TILE + 2;
+			}
+		}
+
+		tiles = (size - 1 + TILE - 1) / TILE;
+		float* origins = new float[2 * tiles * tiles];
+		for (int z = 0; z < tiles; ++z) {
+			for (int x = 0; x < tiles; ++x) {
+				origins[2 * (z * tiles + x)] = x * TILE;
+				origins[2 * (z * tiles + x) + 1] = z * TILE;
+			}
+		}
+
+		driver->glGenBuffers(3, buffer);
+		driver->glBindBuffer(GL_ARRAY_BUFFER, buffer[0]);
+		driver->glBufferData(GL_ARRAY_BUFFER, sizeof (vertices), vertices, GL_STATIC_DRAW);
+		driver->glBindBuffer(GL_ARRAY_BUFFER, buffer[2]);
+		driver->glBufferData(GL_ARRAY_BUFFER, 2 * tiles * tiles * sizeof (float), origins, GL_STATIC_DRAW);
+		driver->glBindBuffer(GL_ARRAY_BUFFER, 0);
+		driver->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer[1]);
+		driver->glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof (indices), indices, GL_STATIC_DRAW);
+		driver->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+		delete[] origins;
+	}
+
+	int                  size;
+	float                scale;
+	WaveLayer            layers[MAX_LAYERS];
+	int                  layerCount;
+	float                amplitude;
+	float                time;
+	GLuint               program, texture, buffer[3];
+	int                  tiles;
+	StreamBuffer*        stream;
+	unsigned short*      samples;
+	AnimatedSurfaceStats stats;
+};
+
+#endif
@@ -0,0 +1,424 @@
+#ifndef _CLIPMAP_H
+#define _CLIPMAP_H
+
+#include <math.h>
+#include <stdio.h>
+#include "GLDriver.h"
+#include "Shader.h"
+#include "Frustum.h"
+#include "StreamBuffer.h"
+
+/*
+ * Per frame statistics of the clipmap
+ */
+struct ClipmapStats {
+	int uploadBytes;
+	int instances;
+	int culled;
+	int drawCalls;
+};
+
+/*
+ * Geometry clipmap terrain (Asirvatham & Hoppe, GPU Gems 2).
+ *
+ * LEVELS nested square grids of GRID vertices are centered on the eye,
+ * the cell size doubling from one level to the next. Each level is
+ * assembled from a handful of shared meshes (blocks, fix-ups, the L
+ * shaped interior trim) that are drawn instanced with one draw call per
+ * mesh for all levels.
+ *
+ * The heights of every level live in one layer of a texture array that
+ * is addressed toroidally, so when a level moves only the newly exposed
+ * rows and columns are uploaded. Vertices near the outer border of a
+ * level morph to the next coarser level to hide the seams.
+ *
+ * Coordinates are grid units unless noted otherwise, world coordinates
+ * are grid units times scale.
+ */
+class Clipmap {
+public:
+
+	typedef float (*HeightFunc)(int x, int z);
+
+	enum {
+		LEVELS = 6,
+		BLOCK = 16,
+		GRID = 4 * BLOCK - 1,
+		TEXTURE_SIZE = GRID + 1,
+		MORPH = 6,
+		MAX_INSTANCES = 16 * LEVELS,
+	};
+
+	Clipmap(HeightFunc height, float scale, float minHeight, float maxHeight)
+		: height(height), scale(scale), minHeight(minHeight), maxHeight(maxHeight),
+		  program(0), texture(0) {
+		memset(&stats, 0, sizeof (stats));
+		memset(&frameStats, 0, sizeof (frameStats));
+		memset(valid, 0, sizeof (valid));
+		buffer[0] = buffer[1] = 0;
+
+		if (!hasGLExtension("GL_ARB_instanced_arrays") ||
+		    !hasGLExtension("GL_ARB_draw_instanced") ||
+		    !hasGLExtension("GL_EXT_texture_array") ||
+		    !hasGLExtension("GL_ARB_texture_rg"))
+			return;
+
+		initProgram();
+		if (!program)
+			return;
+		initMeshes();
+
+		driver->glGenTextures(1, &texture);
+		driver->glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+		driver->glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		driver->glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		driver->glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R32F, TEXTURE_SIZE, TEXTURE_SIZE,
+				     LEVELS, 0, GL_RED, GL_FLOAT, NULL);
+		driver->glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+	}
+
+	~Clipmap() {
+		if (!program)
+			return;
+		driver->glDeleteProgram(program);
+		driver->glDeleteBuffers(2, buffer);
+		driver->glDeleteTextures(1, &texture);
+	}
+
+	bool isAvailable() const {
+		return program != 0;
+	}
+
+	/*
+	 * Draws the clipmap centered at the eye (world coordinates). The
+	 * instance data of the frame is written to the stream buffer.
+	 */
+	void draw(const Vector& eye, const Frustum& frustum, StreamBuffer* stream) {
+		memset(&stats, 0, sizeof (stats));
+		float eyeX = eye[0] / scale, eyeZ = eye[2] / scale;
+
+		// Origins are snapped to the next coarser grid so that the border
+		// vertices of a level coincide with vertices of the next level
+		int snapX[LEVELS], snapZ[LEVELS];
+		for (int l = 0; l < LEVELS; ++l) {
+			int s = 1 << l;
+			snapX[l] = (int)floor(eyeX / (2 * s));
+			snapZ[l] = (int)floor(eyeZ / (2 * s));
+			originX[l] = (snapX[l] - (BLOCK - 1)) * 2 * s;
+			originZ[l] = (snapZ[l] - (BLOCK - 1)) * 2 * s;
+		}
+
+		driver->glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+		for (int l = 0; l < LEVELS; ++l)
+			updateLevel(l, originX[l] >> l, originZ[l] >> l);
+
+		for (int i = 0; i < MESH_COUNT; ++i)
+			instanceCount[i] = 0;
+		for (int l = 0; l < LEVELS; ++l)
+			addLevel(l, snapX, snapZ, frustum);
+
+		int total = 0;
+		for (int i = 0; i < MESH_COUNT; ++i)
+			total += instanceCount[i];
+		stats.instances = total;
+
+		int offset;
+		float* data = total ? (float*)stream->map(total * 4 * sizeof (float), offset) : NULL;
+		if (data) {
+			for (int i = 0; i < MESH_COUNT; ++i) {
+				memcpy(data, instances[i], instanceCount[i] * 4 * sizeof (float));
+				data += 4 * instanceCount[i];
+			}
+			stream->unmap();
+			submit(eyeX, eyeZ, stream, offset);
+		}
+
+		driver->glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+		frameStats = stats;
+	}
+
+	const ClipmapStats& getFrameStats() const {
+		return frameStats;
+	}
+
+private:
+
+	enum Mesh {
+		MESH_BLOCK,
+		MESH_FIXUP_X,
+		MESH_FIXUP_Z,
+		MESH_TRIM_X,
+		MESH_TRIM_Z,
+		MESH_CENTER,
+		MESH_COUNT,
+	};
+
+	void initProgram() {
+		static const char* vertexSource =
+			"uniform sampler2DArray heights;\n"
+			"uniform vec2 eye;\n"
+			"uniform float scale;\n"
+			"in vec2 grid;\n"
+			"in vec4 instance;\n"
+			"out vec4 color;\n"
+			"float fetch(ivec2 p, int level) {\n"
+			"	return texelFetch(heights, ivec3(p & (TEXTURE_SIZE - 1), level), 0).r;\n"
+			"}\n"
+			// Past the samples of the level the texture holds those of the other side
+			"vec3 gradient(ivec2 p, int level, float s) {\n"
+			"	ivec2 window = (ivec2(floor(eye / (2 * s))) - (BLOCK - 1)) * 2;\n"
+			"	ivec2 lo = max(p - 1, window), hi = min(p + 1, window + (TEXTURE_SIZE - 1));\n"
+			"	vec2 d = 2. / vec2(hi - lo);\n"
+			"	return vec3((fetch(ivec2(lo.x, p.y), level) - fetch(ivec2(hi.x, p.y), level)) * d.x, 2 * s,\n"
+			"		    (fetch(ivec2(p.x, lo.y), level) - fetch(ivec2(p.x, hi.y), level)) * d.y);\n"
+			"}\n"
+			"void main() {\n"
+			"	float s = instance.z;\n"
+			"	int level = int(instance.w);\n"
+			"	vec2 p = instance.xy + grid * s;\n"
+			"	ivec2 i = ivec2(floor(p / s + .5));\n"
+			"	float h = fetch(i, level);\n"
+			"	vec3 n = gradient(i, level, s);\n"
+			"	vec2 d = abs(p - eye) / s;\n"
+			"	float alpha = clamp((max(d.x, d.y) - (2 * BLOCK - 2 - MORPH)) / MORPH, 0., 1.);\n"
+			"	if (level + 1 < LEVELS && alpha > 0) {\n"
+			"		ivec2 c0 = i >> 1, c1 = (i + 1) >> 1;\n"
+			"		float hc = .25 * (fetch(c0, level + 1) + fetch(ivec2(c1.x, c0.y), level + 1) +\n"
+			"				  fetch(ivec2(c0.x, c1.y), level + 1) + fetch(c1, level + 1));\n"
+			"		h = mix(h, hc, alpha);\n"
+			"		n = mix(n, gradient(c0, level + 1, 2 * s), alpha);\n"
+			"	}\n"
+			"	vec4 position = gl_ModelViewMatrix * vec4(p.x * scale, h * scale, p.y * scale, 1);\n"
+			"	vec3 normal = normalize(gl_NormalMatrix * n);\n"
+			"	vec3 light = normalize(gl_LightSource[1].position.xyz - position.xyz);\n"
+			"	color = gl_FrontLightModelProduct.sceneColor + gl_FrontLightProduct[1].ambient +\n"
+			"		gl_FrontLightProduct[1].diffuse * max(dot(normal, light), 0.);\n"
+			"	gl_Position = gl_ProjectionMatrix * position;\n"
+			"}\n";
+		static const char* fragmentSource =
+			"#version 130\n"
+			"in vec4 color;\n"
+			"void main() {\n"
+			"	gl_FragColor = color;\n"
+			"}\n";
+		static const char* attributes[] = { "grid", "instance", NULL };
+
+		char source[4096];
+		snprintf(source, sizeof (source),
+			 "#version 130\n#define LEVELS %d\n#define TEXTURE_SIZE %d\n#define BLOCK %d\n#define MORPH %d.\n%s",
+			 LEVELS, TEXTURE_SIZE, BLOCK, MORPH, vertexSource);
+		program = linkProgram(source, fragmentSource, attributes);
+	}
+
+	/*
+	 * Builds the shared meshes, all in one vertex and one index buffer
+	 */
+	void initMeshes() {
+		static const int size[MESH_COUNT][2] = {
+			{ BLOCK, BLOCK },
+			{ 3, BLOCK },
+			{ BLOCK, 3 },
+			{ 2, 2 * BLOCK + 1 },
+			{ 2 * BLOCK + 1, 2 },
+			{ 3, 3 },
+		};
+
+		int vertexCount = 0, totalIndices = 0;
+		for (int i = 0; i < MESH_COUNT; ++i) {
+			vertexCount += size[i][0] * size[i][1];
+			totalIndices += 6 * (size[i][0] - 1) * (size[i][1] - 1);
+		}
+
+		float* vertices = new float[2 * vertexCount];
+		GLushort* indices = new GLushort[totalIndices];
+		float* v = vertices;
+		GLushort* index = indices;
+		int base = 0;
+
+		for (int i = 0; i < MESH_COUNT; ++i) {
+			int w = size[i][0], h = size[i][1];
+			indexOffset[i] = (index - indices) * sizeof (GLushort);
+			indexCount[i] = 6 * (w - 1) * (h - 1);
+			for (int z = 0; z < h; ++z) {
+				for (int x = 0; x < w; ++x) {
+					*v++ = x;
+					*v++ = z;
+				}
+			}
+			for (int z = 0; z < h - 1; ++z) {
+				for (int x = 0; x < w - 1; ++x) {
+					int a = base + z * w + x;
+					*index++ = a;
+					*index++ = a + w;
+					*index++ = a + 1;
+					*index++ = a + 1;
+					*index++ = a + w;
+					*index++ = a + w + 1;
+				}
+			}
+			meshSize[i][0] = w;
+			meshSize[i][1] = h;
+			base += w * h;
+		}
+
+		driver->glGenBuffers(2, buffer);
+		driver->glBindBuffer(GL_ARRAY_BUFFER, buffer[0]);
+		driver->glBufferData(GL_ARRAY_BUFFER, 2 * vertexCount * sizeof (float), vertices, GL_STATIC_DRAW);
+		driver->glBindBuffer(GL_ARRAY_BUFFER, 0);
+		driver->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer[1]);
+		driver->glBufferData(GL_ELEMENT_ARRAY_BUFFER, totalIndices * sizeof (GLushort), indices, GL_STATIC_DRAW);
+		driver->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+		delete [] vertices;
+		delete [] indices;
+	}
+
+	/*
+	 * Moves the texture window of a level to the samples starting at x, z
+	 * and uploads the samples that became visible
+	 */
+	void updateLevel(int level, int x, int z) {
+		int dx = x - windowX[level], dz = z - windowZ[level];
+		if (!valid[level] || abs(dx) >= TEXTURE_SIZE || abs(dz) >= TEXTURE_SIZE) {
+			uploadRegion(level, x, z, TEXTURE_SIZE, TEXTURE_SIZE);
+		} else {
+			if (dx > 0)
+				uploadRegion(level, windowX[level] + TEXTURE_SIZE, z, dx, TEXTURE_SIZE);
+			else if (dx < 0)
+				uploadRegion(level, x, z, -dx, TEXTURE_SIZE);
+			if (dz > 0)
+				uploadRegion(level, x, windowZ[level] + TEXTURE_SIZE, TEXTURE_SIZE, dz);
+			else if (dz < 0)
+				uploadRegion(level, x, z, TEXTURE_SIZE, -dz);
+		}
+		windowX[level] = x;
+		windowZ[level] = z;
+		valid[level] = true;
+	}
+
+	// Uploads a rectangle of samples, split where it wraps around the texture
+	void uploadRegion(int level, int x, int z, int w, int h) {
+		int tx = x & (TEXTURE_SIZE - 1), tz = z & (TEXTURE_SIZE - 1);
+		int w0 = w < TEXTURE_SIZE - tx ? w : TEXTURE_SIZE - tx;
+		int h0 = h < TEXTURE_SIZE - tz ? h : TEXTURE_SIZE - tz;
+		uploadRect(level, x, z, w0, h0);
+		if (w > w0)
+			uploadRect(level, x + w0, z, w - w0, h0);
+		if (h > h0)
+			uploadRect(level, x, z + h0, w0, h - h0);
+		if (w > w0 && h > h0)
+			uploadRect(level, x + w0, z + h0, w - w0, h - h0);
+	}
+
+	void uploadRect(int level, int x, int z, int w, int h) {
+		int s = 1 << level;
+		float* p = upload;
+		for (int j = 0; j < h; ++j) {
+			for (int i = 0; i < w; ++i)
+				*p++ = height((x + i) * s, (z + j) * s);
+		}
+		driver->glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, x & (TEXTURE_SIZE - 1), z & (TEXTURE_SIZE - 1),
+					level, w, h, 1, GL_RED, GL_FLOAT, upload);
+		stats.uploadBytes += w * h * sizeof (float);
+	}
+
+	/*
+	 * Adds the instances of a level. Level 0 is a full grid, the other
+	 * levels are rings around the next finer level, plus the trim that
+	 * fills the gap left by the finer level's snapping.
+	 */
+	void addLevel(int level, const int* snapX, const int* snapZ, const Frustum& frustum) {
+		static const int blockOffset[4] = { 0, BLOCK - 1, 2 * BLOCK, 3 * BLOCK - 1 };
+		const int fixupOffset = 2 * BLOCK - 2;
+
+		for (int i = 0; i < 4; ++i) {
+			for (int j = 0; j < 4; ++j) {
+				bool inner = (i == 1 || i == 2) && (j == 1 || j == 2);
+				if (!inner || level == 0)
+					addInstance(MESH_BLOCK, level, blockOffset[i], blockOffset[j], frustum);
+			}
+			bool inner = i == 1 || i == 2;
+			if (!inner || level == 0) {
+				addInstance(MESH_FIXUP_X, level, fixupOffset, blockOffset[i], frustum);
+				addInstance(MESH_FIXUP_Z, level, blockOffset[i], fixupOffset, frustum);
+			}
+		}
+
+		if (level == 0) {
+			addInstance(MESH_CENTER, level, fixupOffset, fixupOffset, frustum);
+			return;
+		}
+
+		// The finer level leaves one cell free on the side it is not snapped to
+		int trimX = snapX[level - 1] & 1 ? BLOCK - 1 : 3 * BLOCK - 2;
+		int trimZ = snapZ[level - 1] & 1 ? BLOCK - 1 : 3 * BLOCK - 2;
+		addInstance(MESH_TRIM_X, level, trimX, BLOCK - 1, frustum);
+		addInstance(MESH_TRIM_Z, level, BLOCK - 1, trimZ, frustum);
+	}
+
+	// Adds a mesh instance at vertex offset x, z of the level
+	void addInstance(Mesh mesh, int level, int x, int z, const Frustum& frustum) {
+		int s = 1 << level;
+		float px = originX[level] + x * s, pz = originZ[level] + z * s;
+		Vector min(px * scale, minHeight * scale, pz * scale);
+		Vector max((px + (meshSize[mesh][0] - 1) * s) * scale, maxHeight * scale,
+			   (pz + (meshSize[mesh][1] - 1) * s) * scale);
+		if (!frustum.intersectsBox(min, max)) {
+			++stats.culled;
+			return;
+		}
+
+		float* instance = instances[mesh][instanceCount[mesh]++];
+		instance[0] = px;
+		instance[1] = pz;
+		instance[2] = s;
+		instance[3] = level;
+	}
+
+	void submit(float eyeX, float eyeZ, StreamBuffer* stream, int offset) {
+		driver->glUseProgram(program);
+		driver->glUniform1i(driver->glGetUniformLocation(program, "heights"), 0);
+		driver->glUniform2f(driver->glGetUniformLocation(program, "eye"), eyeX, eyeZ);
+		driver->glUniform1f(driver->glGetUniformLocation(program, "scale"), scale);
+
+		driver->glBindBuffer(GL_ARRAY_BUFFER, buffer[0]);
+		driver->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer[1]);
+		driver->glEnableVertexAttribArray(0);
+		driver->glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+
+		stream->bind();
+		driver->glEnableVertexAttribArray(1);
+		driver->glVertexAttribDivisor(1, 1);
+		for (int i = 0; i < MESH_COUNT; ++i) {
+			if (!instanceCount[i])
+				continue;
+			driver->glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, 0, (const char*)0 + offset);
+			driver->glDrawElementsInstanced(GL_TRIANGLES, indexCount[i], GL_UNSIGNED_SHORT,
+							(const char*)0 + indexOffset[i], instanceCount[i]);
+			offset += instanceCount[i] * 4 * sizeof (float);
+			++stats.drawCalls;
+		}
+		driver->glVertexAttribDivisor(1, 0);
+		driver->glDisableVertexAttribArray(1);
+		driver->glDisableVertexAttribArray(0);
+
+		driver->glBindBuffer(GL_ARRAY_BUFFER, 0);
+		driver->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+		driver->glUseProgram(0);
+	}
+
+	HeightFunc   height;
+	float        scale, minHeight, maxHeight;
+	GLuint       program, texture, buffer[2];
+	int          meshSize[MESH_COUNT][2];
+	int          indexOffset[MESH_COUNT], indexCount[MESH_COUNT];
+	int          originX[LEVELS], originZ[LEVELS];
+	int          windowX[LEVELS], windowZ[LEVELS];
+	bool         valid[LEVELS];
+	float        instances[MESH_COUNT][MAX_INSTANCES][4];
+	int          instanceCount[MESH_COUNT];
+	float        upload[TEXTURE_SIZE * TEXTURE_SIZE];
+	ClipmapStats stats, frameStats;
+};
+
+#endif
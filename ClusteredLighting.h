@@ -0,0 +1,359 @@
+#ifndef _CLUSTERED_LIGHTING_H
+#define _CLUSTERED_LIGHTING_H
+
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+#include "GLDriver.h"
+#include "Matrix.h"
+#include "Vector.h"
+#include "Timer.h"
+#include "WorkerPool.h"
+
+struct PointLight {
+	Vector position;
+	float  radius;
+	Vector color;
+};
+
+struct ClusterStats {
+	int lights;
+	int visibleLights;
+	int references;
+	int overflows;
+	int binTime;
+};
+
+/*
+ * Point lights binned into clusters of the view frustum.
+ *
+ * The frustum is cut into TILES_X x TILES_Y screen tiles and SLICES
+ * depth slices that grow exponentially from the near to the far plane.
+ * Every cluster keeps a count and up to CLUSTER_SIZE - 1 light indices
+ * in one row of clusters. The binning only touches CPU memory, so it
+ * can run while the render packet is prepared. ClusteredLighting
+ * uploads the result.
+ *
+ * Lights are first bounded in view space in parallel, then the slices
+ * are filled in parallel, each job writing only its own clusters.
+ */
+class LightClusters {
+public:
+
+	enum {
+		TILES_X = 16,
+		TILES_Y = 8,
+		SLICES = 24,
+		CLUSTERS = TILES_X * TILES_Y * SLICES,
+		CLUSTER_SIZE = 128,
+		MAX_LIGHTS = 1024,
+	};
+
+	LightClusters() : lightCount(0), longest(0), near(1), far(2) {
+		memset(&stats, 0, sizeof (stats));
+	}
+
+	/*
+	 * Bins the lights for a view, near and far being the planes of the
+	 * perspective projection
+	 */
+	void bin(const PointLight* lights, int count, const Matrix& modelView,
+		 const Matrix& projection, float near, float far, WorkerPool* pool = NULL) {
+		long long start = getMicroseconds();
+		lightCount = count < MAX_LIGHTS ? count : MAX_LIGHTS;
+		this->lights = lights;
+		this->modelView = modelView;
+		this->near = near;
+		this->far = far;
+		scaleX = projection(0,0);
+		scaleY = projection(1,1);
+		sliceScale = SLICES / log(far / near);
+
+		if (pool) {
+			pool->run(boundJob, this, lightCount, 64);
+			pool->run(sliceJob, this, SLICES, 1);
+		} else {
+			boundJob(this, 0, lightCount);
+			sliceJob(this, 0, SLICES);
+		}
+
+		memset(&stats, 0, sizeof (stats));
+		stats.lights = lightCount;
+		longest = 0;
+		for (int i = 0; i < lightCount; ++i)
+			stats.visibleLights += range[i].z0 <= range[i].z1;
+		for (int i = 0; i < SLICES; ++i) {
+			stats.references += sliceReferences[i];
+			stats.overflows += sliceOverflows[i];
+			if (sliceLongest[i] > longest)
+				longest = sliceLongest[i];
+		}
+		stats.binTime = (int)(getMicroseconds() - start);
+	}
+
+	const ClusterStats& getStats() const {
+		return stats;
+	}
+
+	float getNear() const {
+		return near;
+	}
+
+	float getFar() const {
+		return far;
+	}
+
+private:
+
+	friend class ClusteredLighting;
+
+	struct Range {
+		short x0, x1, y0, y1, z0, z1;
+	};
+
+	static void boundJob(void* data, int begin, int end) {
+		LightClusters* self = (LightClusters*)data;
+		for (int i = begin; i < end; ++i)
+			self->bound(i);
+	}
+
+	static void sliceJob(void* data, int begin, int end) {
+		LightClusters* self = (LightClusters*)data;
+		for (int i = begin; i < end; ++i)
+			self->fillSlice(i);
+	}
+
+	/*
+	 * Cluster range of the view space box around a light. x / depth is
+	 * extremal at the corners of the box, so the screen bounds come
+	 * from the near and far side of it. Invisible lights get an empty
+	 * depth range.
+	 */
+	void bound(int i) {
+		const PointLight& l = lights[i];
+		Range& r = range[i];
+		float* packed = lightData + 4 * i;
+		packed[0] = l.position[0];
+		packed[1] = l.position[1];
+		packed[2] = l.position[2];
+		packed[3] = l.radius;
+		packed = lightData + 4 * (MAX_LIGHTS + i);
+		packed[0] = l.color[0];
+		packed[1] = l.color[1];
+		packed[2] = l.color[2];
+		packed[3] = 0;
+
+		r.z0 = 1;
+		r.z1 = 0;
+		Vector v = modelView * l.position;
+		float d0 = -v[2] - l.radius, d1 = -v[2] + l.radius;
+		if (d1 < near || d0 > far)
+			return;
+		if (d0 < near)
+			d0 = near;
+
+		float x0 = (v[0] - l.radius) / (v[0] - l.radius < 0 ? d0 : d1) * scaleX;
+		float x1 = (v[0] + l.radius) / (v[0] + l.radius > 0 ? d0 : d1) * scaleX;
+		float y0 = (v[1] - l.radius) / (v[1] - l.radius < 0 ? d0 : d1) * scaleY;
+		float y1 = (v[1] + l.radius) / (v[1] + l.radius > 0 ? d0 : d1) * scaleY;
+		if (x1 < -1 || x0 > 1 || y1 < -1 || y0 > 1)
+			return;
+
+		r.x0 = tile(x0, TILES_X);
+		r.x1 = tile(x1, TILES_X);
+		r.y0 = tile(y0, TILES_Y);
+		r.y1 = tile(y1, TILES_Y);
+		r.z0 = slice(d0);
+		r.z1 = slice(d1);
+	}
+
+	static int tile(float ndc, int tiles) {
+		int t = (int)floor((ndc * .5f + .5f) * tiles);
+		return t < 0 ? 0 : t >= tiles ? tiles - 1 : t;
+	}
+
+	int slice(float depth) const {
+		int s = (int)floor(log(depth / near) * sliceScale);
+		return s < 0 ? 0 : s >= SLICES ? SLICES - 1 : s;
+	}
+
+	void fillSlice(int z) {
+		unsigned short (*c)[CLUSTER_SIZE] = clusters + z * TILES_X * TILES_Y;
+		for (int i = 0; i < TILES_X * TILES_Y; ++i)
+			c[i][0] = 0;
+
+		int references = 0, overflows = 0, longest = 0;
+		for (int i = 0; i < lightCount; ++i) {
+			const Range& r = range[i];
+			if (z < r.z0 || z > r.z1)
+				continue;
+			for (int y = r.y0; y <= r.y1; ++y) {
+				for (int x = r.x0; x <= r.x1; ++x) {
+					unsigned short* cluster = c[y * TILES_X + x];
+					if (cluster[0] < CLUSTER_SIZE - 1) {
+						cluster[++cluster[0]] = i;
+						++references;
+						if (cluster[0] > longest)
+							longest = cluster[0];
+					} else {
+						++overflows;
+					}
+				}
+			}
+		}
+		sliceReferences[z] = references;
+		sliceOverflows[z] = overflows;
+		sliceLongest[z] = longest;
+	}
+
+	// Position and radius of all lights, then their colors
+	float             lightData[8 * MAX_LIGHTS];
+	unsigned short    clusters[CLUSTERS][CLUSTER_SIZE];
+	int               lightCount;
+	int               longest;
+	float             near, far;
+
+	const PointLight* lights;
+	Matrix            modelView;
+	float             scaleX, scaleY, sliceScale;
+	Range             range[MAX_LIGHTS];
+	int               sliceReferences[SLICES];
+	int               sliceOverflows[SLICES];
+	int               sliceLongest[SLICES];
+	ClusterStats      stats;
+};
+
+/*
+ * GPU side of the clustered lights, the light list in a float texture
+ * and the clusters in an integer texture, one row per cluster with the
+ * count in the first texel.
+ */
+class ClusteredLighting {
+public:
+
+	/*
+	 * GLSL function summing the diffuse light of the cluster a fragment
+	 * falls into. params are the tiles per pixel in x and y, the slices
+	 * per log depth and the near plane, see getParams().
+	 */
+	static const char* shaderSource() {
+		static char source[2048];
+		if (source[0])
+			return source;
+		snprintf(source, sizeof (source),
+			 "vec3 clusteredLighting(usampler2D clusters, sampler2D lights, vec4 params,\n"
+			 "			vec3 position, vec3 normal, float depth) {\n"
+			 "	ivec3 c = ivec3(gl_FragCoord.xy * params.xy, log(max(depth / params.w, 1.)) * params.z);\n"
+			 "	c = min(c, ivec3(%d, %d, %d));\n"
+			 "	int row = (c.z * %d + c.y) * %d + c.x;\n"
+			 "	int count = int(texelFetch(clusters, ivec2(0, row), 0).r);\n"
+			 "	vec3 sum = vec3(0.);\n"
+			 "	for (int i = 1; i <= count; ++i) {\n"
+			 "		int light = int(texelFetch(clusters, ivec2(i, row), 0).r);\n"
+			 "		vec4 p = texelFetch(lights, ivec2(light, 0), 0);\n"
+			 "		vec3 d = p.xyz - position;\n"
+			 "		float distance = length(d);\n"
+			 "		float falloff = max(1. - distance / p.w, 0.);\n"
+			 "		float diffuse = max(dot(normal, d / max(distance, 1e-4)), 0.);\n"
+			 "		sum += texelFetch(lights, ivec2(light, 1), 0).rgb * falloff * falloff * diffuse;\n"
+			 "	}\n"
+			 "	return sum;\n"
+			 "}\n",
+			 LightClusters::TILES_X - 1, LightClusters::TILES_Y - 1, LightClusters::SLICES - 1,
+			 LightClusters::TILES_Y, LightClusters::TILES_X);
+		return source;
+	}
+
+	ClusteredLighting() : lightTexture(0), clusterTexture(0), uploadBytes(0) {
+		if (!hasGLExtension("GL_EXT_texture_integer") || !hasGLExtension("GL_ARB_texture_float"))
+			return;
+
+		driver->glGenTextures(1, &lightTexture);
+		driver->glBindTexture(GL_TEXTURE_2D, lightTexture);
+		driver->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		driver->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		driver->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, LightClusters::MAX_LIGHTS, 2, 0,
+				     GL_RGBA, GL_FLOAT, NULL);
+
+		driver->glGenTextures(1, &clusterTexture);
+		driver->glBindTexture(GL_TEXTURE_2D, clusterTexture);
+		driver->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		driver->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		driver->glTexImage2D(GL_TEXTURE_2D, 0, GL_R16UI, LightClusters::CLUSTER_SIZE,
+				     LightClusters::CLUSTERS, 0, GL_RED_INTEGER, GL_UNSIGNED_SHORT, NULL);
+		driver->glBindTexture(GL_TEXTURE_2D, 0);
+	}
+
+	~ClusteredLighting() {
+		if (lightTexture)
+			driver->glDeleteTextures(1, &lightTexture);
+		if (clusterTexture)
+			driver->glDeleteTextures(1, &clusterTexture);
+	}
+
+	bool isAvailable() const {
+		return lightTexture != 0;
+	}
+
+	/*
+	 * Uploads the lights and the columns of the clusters up to the
+	 * longest list
+	 */
+	void upload(const LightClusters& c) {
+		driver->glBindTexture(GL_TEXTURE_2D, lightTexture);
+		driver->glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, LightClusters::MAX_LIGHTS, 2,
+					GL_RGBA, GL_FLOAT, c.lightData);
+
+		int columns = c.longest + 1;
+		driver->glBindTexture(GL_TEXTURE_2D, clusterTexture);
+		driver->glPixelStorei(GL_UNPACK_ROW_LENGTH, LightClusters::CLUSTER_SIZE);
+		driver->glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+		driver->glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, columns, LightClusters::CLUSTERS,
+					GL_RED_INTEGER, GL_UNSIGNED_SHORT, c.clusters);
+		driver->glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		driver->glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+		driver->glBindTexture(GL_TEXTURE_2D, 0);
+		uploadBytes = sizeof (c.lightData) + columns * LightClusters::CLUSTERS * sizeof (unsigned short);
+	}
+
+	/*
+	 * Shader parameters for a viewport of width x height pixels
+	 */
+	static void getParams(const LightClusters& c, int width, int height, float* params) {
+		params[0] = (float)LightClusters::TILES_X / width;
+		params[1] = (float)LightClusters::TILES_Y / height;
+		params[2] = LightClusters::SLICES / log(c.getFar() / c.getNear());
+		params[3] = c.getNear();
+	}
+
+	/*
+	 * Binds the clusters to texture unit unit and the lights to the unit
+	 * after it
+	 */
+	void bind(int unit) const {
+		driver->glActiveTexture(GL_TEXTURE0 + unit);
+		driver->glBindTexture(GL_TEXTURE_2D, clusterTexture);
+		driver->glActiveTexture(GL_TEXTURE0 + unit + 1);
+		driver->glBindTexture(GL_TEXTURE_2D, lightTexture);
+		driver->glActiveTexture(GL_TEXTURE0);
+	}
+
+	void unbind(int unit) const {
+		driver->glActiveTexture(GL_TEXTURE0 + unit + 1);
+		driver->glBindTexture(GL_TEXTURE_2D, 0);
+		driver->glActiveTexture(GL_TEXTURE0 + unit);
+		driver->glBindTexture(GL_TEXTURE_2D, 0);
+		driver->glActiveTexture(GL_TEXTURE0);
+	}
+
+	int getUploadBytes() const {
+		return uploadBytes;
+	}
+
+private:
+
+	GLuint lightTexture, clusterTexture;
+	int    uploadBytes;
+};
+
+#endif
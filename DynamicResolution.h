@@ -0,0 +1,198 @@
+#ifndef _DYNAMIC_RESOLUTION_H
+#define _DYNAMIC_RESOLUTION_H
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "GLDriver.h"
+
+/*
+ * Resolution of the offscreen frame as a percentage of the window size,
+ * driven by the GPU time of the resolution dependent passes.
+ *
+ * The median of a window of frames is compared with the target. The
+ * cost of a fill bound pass goes with the number of pixels, so the scale
+ * per axis moves with the square root of the time over the target and
+ * aims a tenth below it. Scales are multiples of STEP and grow by at
+ * most MAX_GROWTH at a time, and nothing changes between the bands, so
+ * small variations in the measurements do not move the resolution.
+ */
+class ResolutionScale {
+public:
+
+	enum {
+		WINDOW = 8,
+		MIN_SCALE = 50,
+		MAX_SCALE = 100,
+		STEP = 5,
+		MAX_GROWTH = 10,
+		UPPER_BAND = 100,
+		LOWER_BAND = 75,
+	};
+
+	ResolutionScale(float target) : target(target) {
+		reset();
+	}
+
+	void reset() {
+		scale = MAX_SCALE;
+		frames = 0;
+		lastTime = 0;
+	}
+
+	void setTarget(float ms) {
+		target = ms;
+		frames = 0;
+	}
+
+	float getTarget() const {
+		return target;
+	}
+
+	/*
+	 * Feeds the GPU time of one frame in milliseconds, negative if not
+	 * measured. Returns true if the scale changed.
+	 */
+	bool update(float gpuTime) {
+		if (gpuTime < 0)
+			return false;
+		times[frames++ % WINDOW] = gpuTime;
+		if (frames < WINDOW)
+			return false;
+
+		float sorted[WINDOW];
+		for (int i = 0; i < WINDOW; ++i)
+			sorted[i] = times[i];
+		qsort(sorted, WINDOW, sizeof (float), compareTime);
+		lastTime = (sorted[WINDOW / 2 - 1] + sorted[WINDOW / 2]) / 2;
+
+		if (lastTime * 100 <= target * UPPER_BAND && lastTime * 100 >= target * LOWER_BAND)
+			return false;
+		int wanted = (int)(scale * sqrt(.9f * target / (lastTime > .001f ? lastTime : .001f)));
+		if (wanted > scale + MAX_GROWTH)
+			wanted = scale + MAX_GROWTH;
+		wanted = wanted / STEP * STEP;
+		wanted = wanted < MIN_SCALE ? MIN_SCALE : wanted > MAX_SCALE ? MAX_SCALE : wanted;
+		if (wanted == scale)
+			return false;
+
+		// The next decision only sees frames at the new resolution
+		scale = wanted;
+		frames = 0;
+		return true;
+	}
+
+	int getScale() const {
+		return scale;
+	}
+
+	// Median time of the last full window
+	float getTime() const {
+		return lastTime;
+	}
+
+private:
+
+	static int compareTime(const void* a, const void* b) {
+		float d = *(const float*)a - *(const float*)b;
+		return d < 0 ? -1 : d > 0;
+	}
+
+	float target;
+	float times[WINDOW];
+	int   frames;
+	int   scale;
+	float lastTime;
+};
+
+/*
+ * Framebuffer the scene is rendered into at a reduced resolution and
+ * then stretched over the window.
+ *
+ * The buffers have the size of the window, a frame only uses the lower
+ * left part of them. Changing the scale therefore never reallocates.
+ */
+class OffscreenTarget {
+public:
+
+	OffscreenTarget() : framebuffer(0), width(0), height(0) {
+		available = hasGLExtension("GL_ARB_framebuffer_object");
+		if (!available)
+			return;
+		driver->glGenFramebuffers(1, &framebuffer);
+		driver->glGenRenderbuffers(2, renderbuffer);
+	}
+
+	~OffscreenTarget() {
+		if (!framebuffer)
+			return;
+		driver->glDeleteRenderbuffers(2, renderbuffer);
+		driver->glDeleteFramebuffers(1, &framebuffer);
+	}
+
+	bool isAvailable() const {
+		return available;
+	}
+
+	/*
+	 * Allocates the buffers for a window size
+	 */
+	void resize(int w, int h) {
+		if (!available || (w == width && h == height))
+			return;
+		width = w;
+		height = h;
+
+		driver->glBindRenderbuffer(GL_RENDERBUFFER, renderbuffer[0]);
+		driver->glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, w, h);
+		driver->glBindRenderbuffer(GL_RENDERBUFFER, renderbuffer[1]);
+		driver->glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, w, h);
+		driver->glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+		driver->glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		driver->glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+						  GL_RENDERBUFFER, renderbuffer[0]);
+		driver->glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+						  GL_RENDERBUFFER, renderbuffer[1]);
+		GLenum status = driver->glCheckFramebufferStatus(GL_FRAMEBUFFER);
+		driver->glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		if (status != GL_FRAMEBUFFER_COMPLETE) {
+			fprintf(stderr, "Offscreen framebuffer is incomplete: 0x%x\n", status);
+			available = false;
+		}
+	}
+
+	/*
+	 * Directs rendering to the lower left w x h pixels. The scissor
+	 * keeps clears out of the unused part.
+	 */
+	void begin(int w, int h) {
+		driver->glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		driver->glViewport(0, 0, w, h);
+		driver->glScissor(0, 0, w, h);
+		driver->glEnable(GL_SCISSOR_TEST);
+	}
+
+	/*
+	 * Stretches the rendered pixels over the window with bilinear
+	 * filtering
+	 */
+	void end(int w, int h, int windowWidth, int windowHeight) {
+		driver->glDisable(GL_SCISSOR_TEST);
+		driver->glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+		driver->glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+		driver->glBlitFramebuffer(0, 0, w, h, 0, 0, windowWidth, windowHeight,
+					  GL_COLOR_BUFFER_BIT, GL_LINEAR);
+		driver->glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		driver->glViewport(0, 0, windowWidth, windowHeight);
+	}
+
+private:
+
+	bool   available;
+	GLuint framebuffer;
+	GLuint renderbuffer[2];
+	int    width, height;
+};
+
+#endif
@@ -0,0 +1,185 @@
+#ifndef _FRAME_BUDGET_H
+#define _FRAME_BUDGET_H
+
+#include <stdlib.h>
+
+enum BudgetAction {
+	BUDGET_HOLD,
+	BUDGET_COARSER,
+	BUDGET_FINER,
+};
+
+/*
+ * Closed loop control of the terrain detail towards a target frame time.
+ *
+ * Every frame reports its CPU and GPU time in milliseconds, the slower
+ * of the two is the cost of the frame. Once a window of frames has been
+ * measured, its median is compared with the target. Above the upper band
+ * the screen space error threshold grows, and when that is at its limit
+ * the draw distance shrinks. Below the lower band the steps are undone
+ * in reverse order. Coarser steps are as large as the frames are over
+ * the target, up to a factor of two, so a sudden load is shed within a
+ * few windows. Finer steps are always small.
+ *
+ * The gap between the bands keeps the controller from reacting to noise.
+ * After every step the window starts over, so the next decision only
+ * sees frames at the new detail. A refinement that has to be taken back
+ * right away doubles the wait before the next one, which stops the
+ * controller from oscillating around a detail level that does not fit.
+ */
+class FrameBudget {
+public:
+
+	enum {
+		WINDOW = 16,
+		MAX_REFINE_WAIT = 16 * WINDOW,
+	};
+
+	/*
+	 * Bands around the target and the smallest and largest relative
+	 * steps, all in percent
+	 */
+	enum {
+		UPPER_BAND = 100,
+		LOWER_BAND = 70,
+		MIN_STEP = 120,
+		MAX_STEP = 200,
+	};
+
+	FrameBudget(float target, float minError, float maxError, float minDistance, float maxDistance)
+		: target(target), minError(minError), maxError(maxError),
+		  minDistance(minDistance), maxDistance(maxDistance) {
+		reset();
+	}
+
+	/*
+	 * Back to the finest detail with no measurements
+	 */
+	void reset() {
+		errorThreshold = minError;
+		drawDistance = maxDistance;
+		frames = 0;
+		framesSinceChange = 0;
+		refineWait = WINDOW;
+		lastAction = BUDGET_HOLD;
+		lastCost = 0;
+	}
+
+	void setTarget(float ms) {
+		target = ms;
+		frames = 0;
+	}
+
+	float getTarget() const {
+		return target;
+	}
+
+	/*
+	 * Feeds the times of one frame, a negative GPU time is unknown.
+	 * Returns what the controller did, the new values are in the getters.
+	 */
+	BudgetAction update(float cpuTime, float gpuTime) {
+		costs[frames++ % WINDOW] = gpuTime > cpuTime ? gpuTime : cpuTime;
+		++framesSinceChange;
+		if (frames < WINDOW)
+			return BUDGET_HOLD;
+
+		float sorted[WINDOW];
+		for (int i = 0; i < WINDOW; ++i)
+			sorted[i] = costs[i];
+		qsort(sorted, WINDOW, sizeof (float), compareCost);
+		lastCost = (sorted[WINDOW / 2 - 1] + sorted[WINDOW / 2]) / 2;
+
+		BudgetAction action = BUDGET_HOLD;
+		if (lastCost * 100 > target * UPPER_BAND)
+			action = coarser(lastCost * 100 / target);
+		else if (lastCost * 100 < target * LOWER_BAND && framesSinceChange >= refineWait)
+			action = finer();
+		if (action == BUDGET_HOLD)
+			return action;
+
+		// Refinements that hold make the next one come sooner again
+		if (action == BUDGET_COARSER && lastAction == BUDGET_FINER &&
+		    framesSinceChange < 4 * WINDOW)
+			refineWait = refineWait * 2 < MAX_REFINE_WAIT ? refineWait * 2 : MAX_REFINE_WAIT;
+		else if (action == BUDGET_FINER && lastAction == BUDGET_FINER)
+			refineWait = refineWait / 2 > WINDOW ? refineWait / 2 : WINDOW;
+		lastAction = action;
+		framesSinceChange = 0;
+		frames = 0;
+		return action;
+	}
+
+	// Pixels a chunk may deviate from the full detail surface
+	float getErrorThreshold() const {
+		return errorThreshold;
+	}
+
+	// Chunks further away in world units are not drawn
+	float getDrawDistance() const {
+		return drawDistance;
+	}
+
+	// Median cost of the last full window
+	float getCost() const {
+		return lastCost;
+	}
+
+	// Frames a refinement waits for after the last step
+	int getRefineWait() const {
+		return refineWait;
+	}
+
+private:
+
+	static int compareCost(const void* a, const void* b) {
+		float d = *(const float*)a - *(const float*)b;
+		return d < 0 ? -1 : d > 0;
+	}
+
+	// Percentage of the target in, relative step out
+	BudgetAction coarser(float cost) {
+		float minStep = MIN_STEP, maxStep = MAX_STEP;
+		float step = (cost < minStep ? minStep : cost > maxStep ? maxStep : cost) / 100;
+		if (errorThreshold < maxError) {
+			float e = errorThreshold * step;
+			errorThreshold = e < maxError ? e : maxError;
+			return BUDGET_COARSER;
+		}
+		if (drawDistance > minDistance) {
+			float d = drawDistance / step;
+			drawDistance = d > minDistance ? d : minDistance;
+			return BUDGET_COARSER;
+		}
+		return BUDGET_HOLD;
+	}
+
+	BudgetAction finer() {
+		float step = MIN_STEP / 100.f;
+		if (drawDistance < maxDistance) {
+			float d = drawDistance * step;
+			drawDistance = d < maxDistance ? d : maxDistance;
+			return BUDGET_FINER;
+		}
+		if (errorThreshold > minError) {
+			float e = errorThreshold / step;
+			errorThreshold = e > minError ? e : minError;
+			return BUDGET_FINER;
+		}
+		return BUDGET_HOLD;
+	}
+
+	float        target;
+	float        minError, maxError;
+	float        minDistance, maxDistance;
+	float        errorThreshold;
+	float        drawDistance;
+	float        costs[WINDOW];
+	int          frames;
+	int          framesSinceChange;
+	int          refineWait;
+	BudgetAction lastAction;
+	float        lastCost;
+};
+
+#endif
@@ -0,0 +1,379 @@
+#ifndef _FRAME_CAPTURE_H
+#define _FRAME_CAPTURE_H
+
+#include <stdio.h>
+#include <string.h>
+#include "SDL.h"
+#include "GLDriver.h"
+#include "Shader.h"
+#include "Timer.h"
+
+enum CaptureFormat {
+	// One binary PPM per frame, the path is a printf pattern of the frame number
+	CAPTURE_IMAGES,
+	// All frames in one file of raw 8 bit RGB, top row first
+	CAPTURE_VIDEO,
+};
+
+/*
+ * Per frame statistics of a capture. The capture time is what the
+ * render thread spent reading back and handing over frames. Frames are
+ * dropped rather than waited for, when all read back buffers are still
+ * in flight or the encoder has no free frame.
+ */
+struct CaptureStats {
+	int frames;
+	int dropped;
+	int captureTime;
+	int pending;
+	int written;
+	int writeBytes;
+};
+
+/*
+ * Statistics of a whole capture, from start() on. The per frame stats
+ * are only shown now and then, these keep the drops in between.
+ */
+struct CaptureTotals {
+	int       frames;
+	int       dropped;
+	int       written;
+	long long writeBytes;
+	long long captureTime;
+};
+
+/*
+ * Frame capture to disk without stalling the render thread.
+ *
+ * capture() starts an asynchronous read of the back buffer into the
+ * next of READBACK_BUFFERS pixel buffer objects and fences it. The
+ * buffers are mapped in order a frame or more later, once their fence
+ * has passed, so the render thread never waits for the GPU. The pixels
+ * are copied into one of ENCODER_FRAMES frames and the mapping ends at
+ * once; an encoder thread flips, converts and writes the frames while
+ * the render thread goes on. stop() waits for the frames in flight.
+ *
+ * The read uses BGRA, the layout of the framebuffer on most hardware,
+ * so the driver copies it without converting.
+ */
+class FrameCapture {
+public:
+
+	enum {
+		READBACK_BUFFERS = 3,
+		ENCODER_FRAMES = 8,
+		MAX_PATH = 256,
+	};
+
+	FrameCapture() : width(0), height(0), capturing(false), row(NULL), thread(NULL), pixels(NULL) {
+		memset(&stats, 0, sizeof (stats));
+		memset(&frameStats, 0, sizeof (frameStats));
+		memset(&totals, 0, sizeof (totals));
+		memset(buffers, 0, sizeof (buffers));
+		memset(fence, 0, sizeof (fence));
+		available = hasGLExtension("GL_ARB_pixel_buffer_object") && hasGLExtension("GL_ARB_sync") &&
+			hasGLExtension("GL_ARB_map_buffer_range");
+		lock = SDL_CreateMutex();
+		framesReady = SDL_CreateSemaphore(0);
+		framesFree = SDL_CreateSemaphore(0);
+	}
+
+	~FrameCapture() {
+		stop();
+		SDL_DestroySemaphore(framesReady);
+		SDL_DestroySemaphore(framesFree);
+		SDL_DestroyMutex(lock);
+	}
+
+	bool isAvailable() const {
+		return available;
+	}
+
+	bool isCapturing() const {
+		return capturing;
+	}
+
+	/*
+	 * Starts capturing frames of width x height to path. Returns false
+	 * if capture is not supported or the encoder could not start.
+	 */
+	bool start(CaptureFormat format, const char* path, int width, int height) {
+		if (!available || capturing)
+			return false;
+		this->format = format;
+		snprintf(this->path, sizeof (this->path), "%s", path);
+		this->width = width;
+		this->height = height;
+		frameBytes = 4 * width * height;
+
+		driver->glGenBuffers(READBACK_BUFFERS, buffers);
+		for (int i = 0; i < READBACK_BUFFERS; ++i) {
+			driver->glBindBuffer(GL_PIXEL_PACK_BUFFER, buffers[i]);
+			driver->glBufferData(GL_PIXEL_PACK_BUFFER, frameBytes, NULL, GL_STREAM_READ);
+		}
+		driver->glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		readHead = readCount = 0;
+
+		pixels = new unsigned char[ENCODER_FRAMES * frameBytes];
+		row = new unsigned char[3 * width];
+		for (int i = 0; i < ENCODER_FRAMES; ++i) {
+			freeFrames[i] = i;
+			SDL_SemPost(framesFree);
+		}
+		freeCount = ENCODER_FRAMES;
+		queueHead = queueCount = 0;
+		written = writeBytes = 0;
+		memset(&stats, 0, sizeof (stats));
+		memset(&frameStats, 0, sizeof (frameStats));
+		memset(&totals, 0, sizeof (totals));
+		file = NULL;
+		failed = false;
+
+		running = true;
+		thread = SDL_CreateThread(threadMain, this);
+		if (!thread) {
+			fprintf(stderr, "Could not create capture thread: %s\n", SDL_GetError());
+			release();
+			return false;
+		}
+		capturing = true;
+		return true;
+	}
+
+	/*
+	 * Finishes the frames in flight and waits for the encoder. The
+	 * totals then hold the whole capture.
+	 */
+	void stop() {
+		if (!capturing)
+			return;
+		collect(true);
+		running = false;
+		SDL_SemPost(framesReady);
+		SDL_WaitThread(thread, NULL);
+		thread = NULL;
+		totals.dropped += stats.dropped;
+		totals.written += written;
+		totals.writeBytes += writeBytes;
+		memset(&stats, 0, sizeof (stats));
+		written = writeBytes = 0;
+		release();
+		capturing = false;
+	}
+
+	/*
+	 * Reads back the frame in the back buffer, before the swap, and
+	 * hands the earlier reads that have arrived to the encoder. Closes
+	 * the statistics of the frame.
+	 */
+	void capture() {
+		if (!capturing)
+			return;
+		long long start = getMicroseconds();
+		collect(false);
+		if (readCount == READBACK_BUFFERS) {
+			++stats.dropped;
+		} else {
+			int b = (readHead + readCount++) % READBACK_BUFFERS;
+			driver->glBindBuffer(GL_PIXEL_PACK_BUFFER, buffers[b]);
+			driver->glReadPixels(0, 0, width, height, GL_BGRA, GL_UNSIGNED_BYTE, NULL);
+			driver->glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			fence[b] = driver->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			++stats.frames;
+		}
+		stats.captureTime = (int)(getMicroseconds() - start);
+
+		SDL_mutexP(lock);
+		stats.pending = readCount + queueCount;
+		stats.written = written;
+		stats.writeBytes = writeBytes;
+		written = writeBytes = 0;
+		SDL_mutexV(lock);
+		frameStats = stats;
+		memset(&stats, 0, sizeof (stats));
+
+		totals.frames += frameStats.frames;
+		totals.dropped += frameStats.dropped;
+		totals.written += frameStats.written;
+		totals.writeBytes += frameStats.writeBytes;
+		totals.captureTime += frameStats.captureTime;
+	}
+
+	const CaptureStats& getFrameStats() const {
+		return frameStats;
+	}
+
+	/*
+	 * Statistics since start(), kept after stop() until the next start
+	 */
+	const CaptureTotals& getTotals() const {
+		return totals;
+	}
+
+private:
+
+	/*
+	 * Moves the finished reads in order to encoder frames. Without wait
+	 * it stops at the first read still in flight and drops reads the
+	 * encoder has no room for.
+	 */
+	void collect(bool wait) {
+		while (readCount) {
+			int b = readHead;
+			GLenum status = driver->glClientWaitSync(fence[b], wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0,
+								 wait ? 1000000000 : 0);
+			if (status == GL_TIMEOUT_EXPIRED && !wait)
+				break;
+			driver->glDeleteSync(fence[b]);
+			fence[b] = 0;
+			readHead = (readHead + 1) % READBACK_BUFFERS;
+			--readCount;
+
+			if (SDL_SemTryWait(framesFree) != 0) {
+				if (!wait) {
+					++stats.dropped;
+					continue;
+				}
+				SDL_SemWait(framesFree);
+			}
+			SDL_mutexP(lock);
+			int frame = freeFrames[--freeCount];
+			SDL_mutexV(lock);
+
+			driver->glBindBuffer(GL_PIXEL_PACK_BUFFER, buffers[b]);
+			const void* p = driver->glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, frameBytes, GL_MAP_READ_BIT);
+			if (p) {
+				memcpy(pixels + frame * frameBytes, p, frameBytes);
+				driver->glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+			}
+			driver->glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+			SDL_mutexP(lock);
+			if (p)
+				queue[(queueHead + queueCount++) % ENCODER_FRAMES] = frame;
+			else
+				freeFrames[freeCount++] = frame;
+			SDL_mutexV(lock);
+			if (p)
+				SDL_SemPost(framesReady);
+			else
+				SDL_SemPost(framesFree);
+		}
+	}
+
+	void release() {
+		for (int i = 0; i < READBACK_BUFFERS; ++i) {
+			if (fence[i])
+				driver->glDeleteSync(fence[i]);
+			fence[i] = 0;
+		}
+		driver->glDeleteBuffers(READBACK_BUFFERS, buffers);
+		memset(buffers, 0, sizeof (buffers));
+		// The semaphore counts the free frames of the next capture
+		while (SDL_SemTryWait(framesFree) == 0)
+			;
+		delete[] pixels;
+		delete[] row;
+		pixels = row = NULL;
+	}
+
+	static int threadMain(void* data) {
+		FrameCapture* self = (FrameCapture*)data;
+		for (int index = 0;;) {
+			SDL_SemWait(self->framesReady);
+			SDL_mutexP(self->lock);
+			if (!self->queueCount) {
+				SDL_mutexV(self->lock);
+				if (!self->running)
+					break;
+				continue;
+			}
+			int frame = self->queue[self->queueHead];
+			self->queueHead = (self->queueHead + 1) % ENCODER_FRAMES;
+			--self->queueCount;
+			SDL_mutexV(self->lock);
+
+			int bytes = self->write(self->pixels + frame * self->frameBytes, index++);
+
+			SDL_mutexP(self->lock);
+			self->freeFrames[self->freeCount++] = frame;
+			++self->written;
+			self->writeBytes += bytes;
+			SDL_mutexV(self->lock);
+			SDL_SemPost(self->framesFree);
+		}
+		if (self->file)
+			fclose(self->file);
+		return 0;
+	}
+
+	/*
+	 * Writes a frame as 8 bit RGB from the top row down, returns the
+	 * bytes written
+	 */
+	int write(const unsigned char* bgra, int index) {
+		if (failed)
+			return 0;
+		if (format == CAPTURE_IMAGES || !file) {
+			char name[MAX_PATH + 16];
+			snprintf(name, sizeof (name), path, index);
+			file = fopen(name, "wb");
+			if (!file) {
+				fprintf(stderr, "Could not open %s for the capture\n", name);
+				failed = true;
+				return 0;
+			}
+		}
+		int bytes = 0;
+		if (format == CAPTURE_IMAGES)
+			bytes += fprintf(file, "P6\n%d %d\n255\n", width, height);
+		for (int y = height - 1; y >= 0; --y) {
+			const unsigned char* in = bgra + 4 * y * width;
+			for (int x = 0; x < width; ++x) {
+				row[3 * x] = in[4 * x + 2];
+				row[3 * x + 1] = in[4 * x + 1];
+				row[3 * x + 2] = in[4 * x];
+			}
+			bytes += fwrite(row, 1, 3 * width, file);
+		}
+		if (format == CAPTURE_IMAGES) {
+			fclose(file);
+			file = NULL;
+		}
+		return bytes;
+	}
+
+	bool          available;
+	CaptureFormat format;
+	char          path[MAX_PATH];
+	int           width, height, frameBytes;
+	bool          capturing;
+
+	// Render thread only
+	GLuint buffers[READBACK_BUFFERS];
+	GLsync fence[READBACK_BUFFERS];
+	int    readHead, readCount;
+
+	// Encoder thread only
+	FILE*          file;
+	bool           failed;
+	unsigned char* row;
+
+	// Shared with the encoder thread under the lock
+	SDL_Thread*    thread;
+	SDL_mutex*     lock;
+	SDL_sem*       framesReady;
+	SDL_sem*       framesFree;
+	volatile bool  running;
+	unsigned char* pixels;
+	int            freeFrames[ENCODER_FRAMES];
+	int            freeCount;
+	int            queue[ENCODER_FRAMES];
+	int            queueHead, queueCount;
+	int            written, writeBytes;
+
+	CaptureStats  stats, frameStats;
+	CaptureTotals totals;
+};
+
+#endif
@@ -0,0 +1,138 @@
+#ifndef _FRAME_PIPELINE_H
+#define _FRAME_PIPELINE_H
+
+#include <stdio.h>
+#include "SDL.h"
+
+/*
+ * Double buffered frame packets.
+ *
+ * In serial mode the packet for a frame is prepared by the render
+ * thread right before it is submitted. In pipelined mode a separate
+ * thread prepares packet N+1 while the render thread submits packet N,
+ * which overlaps CPU preparation with GL submission at the cost of one
+ * frame of latency.
+ *
+ * A packet must not be modified after it has been prepared, the render
+ * thread only ever sees it through a const reference.
+ *
+ * Preparing reads the settings the render thread changes only through
+ * a copy. capture() makes it on the render thread, in acquire() in
+ * serial mode and in release() in pipelined mode, and the frame thread
+ * takes it under the lock before each packet, so a packet never mixes
+ * the settings of two frames.
+ */
+template<class Packet, class Settings>
+class FramePipeline {
+public:
+
+	typedef void (*PrepareFunc)(Packet&, const Settings&);
+	typedef void (*CaptureFunc)(Settings&);
+
+	FramePipeline(PrepareFunc prepare, CaptureFunc capture)
+		: prepare(prepare), capture(capture), thread(NULL), lock(NULL), freeSlots(NULL),
+		  readySlots(NULL), running(false), readSlot(0), writeSlot(0) {
+	}
+
+	~FramePipeline() {
+		setPipelined(false);
+	}
+
+	bool isPipelined() const {
+		return thread != NULL;
+	}
+
+	void setPipelined(bool pipelined) {
+		if (pipelined == isPipelined())
+			return;
+
+		if (pipelined) {
+			readSlot = writeSlot = 0;
+			capture(pending);
+			lock = SDL_CreateMutex();
+			freeSlots = SDL_CreateSemaphore(2);
+			readySlots = SDL_CreateSemaphore(0);
+			running = true;
+			thread = SDL_CreateThread(threadMain, this);
+			if (!thread) {
+				fprintf(stderr, "Could not create frame thread: %s\n", SDL_GetError());
+				running = false;
+				destroySync();
+			}
+		} else {
+			SDL_mutexP(lock);
+			running = false;
+			SDL_mutexV(lock);
+			SDL_SemPost(freeSlots);
+			SDL_WaitThread(thread, NULL);
+			thread = NULL;
+			destroySync();
+			readSlot = writeSlot = 0;
+		}
+	}
+
+	/*
+	 * Returns the packet to submit this frame. Must be paired with
+	 * release() once the render thread is done with it.
+	 */
+	const Packet& acquire() {
+		if (!isPipelined()) {
+			capture(current);
+			prepare(packet[0], current);
+			return packet[0];
+		}
+		SDL_SemWait(readySlots);
+		return packet[readSlot];
+	}
+
+	void release() {
+		if (!isPipelined())
+			return;
+		SDL_mutexP(lock);
+		capture(pending);
+		SDL_mutexV(lock);
+		readSlot ^= 1;
+		SDL_SemPost(freeSlots);
+	}
+
+private:
+
+	static int threadMain(void* data) {
+		FramePipeline* self = (FramePipeline*)data;
+		for (;;) {
+			SDL_SemWait(self->freeSlots);
+			SDL_mutexP(self->lock);
+			bool running = self->running;
+			self->current = self->pending;
+			SDL_mutexV(self->lock);
+			if (!running)
+				break;
+			self->prepare(self->packet[self->writeSlot], self->current);
+			self->writeSlot ^= 1;
+			SDL_SemPost(self->readySlots);
+		}
+		return 0;
+	}
+
+	void destroySync() {
+		SDL_DestroySemaphore(freeSlots);
+		SDL_DestroySemaphore(readySlots);
+		SDL_DestroyMutex(lock);
+		freeSlots = readySlots = NULL;
+		lock = NULL;
+	}
+
+	PrepareFunc prepare;
+	CaptureFunc capture;
+	Packet      packet[2];
+	// The copy the packet being prepared reads, and the next one
+	Settings    current, pending;
+	SDL_Thread* thread;
+	SDL_mutex*  lock;
+	SDL_sem*    freeSlots;
+	SDL_sem*    readySlots;
+	bool        running;
+	int         readSlot, writeSlot;
+};
+
+#endif
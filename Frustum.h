@@ -0,0 +1,50 @@
+#ifndef _FRUSTUM_H
+#define _FRUSTUM_H
+
+#include "Matrix.h"
+
+/*
+ * View frustum as six planes (a*x + b*y + c*z + d >= 0 is inside),
+ * extracted from a combined projection * modelview matrix.
+ */
+class Frustum {
+private:
+
+	float plane[6][4];
+
+public:
+
+	Frustum() {
+	}
+
+	Frustum(const Matrix& clip) {
+		for (int i = 0; i < 3; ++i) {
+			for (int j = 0; j < 4; ++j) {
+				plane[2*i][j]   = clip(3,j) + clip(i,j);
+				plane[2*i+1][j] = clip(3,j) - clip(i,j);
+			}
+		}
+		for (int i = 0; i < 6; ++i) {
+			float len = sqrt(plane[i][0] * plane[i][0] +
+					 plane[i][1] * plane[i][1] +
+					 plane[i][2] * plane[i][2]);
+			for (int j = 0; j < 4; ++j)
+				plane[i][j] /= len;
+		}
+	}
+
+	// Conservative test, boxes near the corners may be accepted
+	bool intersectsBox(const Vector& min, const Vector& max) const {
+		for (int i = 0; i < 6; ++i) {
+			const float* p = plane[i];
+			float x = p[0] > 0 ? max[0] : min[0];
+			float y = p[1] > 0 ? max[1] : min[1];
+			float z = p[2] > 0 ? max[2] : min[2];
+			if (p[0] * x + p[1] * y + p[2] * z + p[3] < 0)
+				return false;
+		}
+		return true;
+	}
+};
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef _GL_DRIVER_H
+#define _GL_DRIVER_H
+
+#include <string.h>
+#include "SDL.h"
+// Use the system glext.h, the one bundled with SDL predates sync objects
+#define NO_SDL_GLEXT
+#include "SDL_opengl.h"
+#include <GL/glext.h>
+
+struct GLDriver {
+#define GL_PROC(ret, name, args)\
+ret (*name)args;
+#include "GLFuncs.h"
+#undef GL_PROC
+};
+
+extern GLDriver* driver;
+
+/*
+ * Checks the extension string for a whole word match
+ */
+inline bool hasGLExtension(const char* name) {
+	const char* all = (const char*)driver->glGetString(GL_EXTENSIONS);
+	int len = strlen(name);
+	for (const char* ext = all; ext && (ext = strstr(ext, name)); ext += len) {
+		if ((ext == all || ext[-1] == ' ') && (ext[len] == ' ' || ext[len] == '\0'))
+			return true;
+	}
+	return false;
+}
+
+#endif
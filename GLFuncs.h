@@ -4,21 +4,33 @@
 */
 #define GL_PROC_UNUSED(ret,func,params)
 GL_PROC_UNUSED(void,glAccum,(GLenum,GLfloat))
+GL_PROC(void,glActiveTexture,(GLenum texture))
 GL_PROC_UNUSED(void,glAlphaFunc,(GLenum,GLclampf))
 GL_PROC_UNUSED(GLboolean,glAreTexturesResident,(GLsizei,const GLuint*,GLboolean*))
 GL_PROC_UNUSED(void,glArrayElement,(GLint))
+GL_PROC(void,glAttachShader,(GLuint program, GLuint shader))
 GL_PROC(void,glBegin,(GLenum))
+GL_PROC(void,glBeginQuery,(GLenum target, GLuint id))
+GL_PROC(void,glBindAttribLocation,(GLuint program, GLuint index, const GLchar *name))
+GL_PROC(void,glBindBuffer,(GLenum target, GLuint buffer))
+GL_PROC(void,glBindFramebuffer,(GLenum target, GLuint framebuffer))
+GL_PROC(void,glBindRenderbuffer,(GLenum target, GLuint renderbuffer))
 GL_PROC(void,glBindTexture,(GLenum,GLuint))
 GL_PROC_UNUSED(void,glBitmap,(GLsizei,GLsizei,GLfloat,GLfloat,GLfloat,GLfloat,const GLubyte*))
 GL_PROC(void,glBlendFunc,(GLenum,GLenum))
+GL_PROC(void,glBlitFramebuffer,(GLint srcX0, GLint srcY0, GLint srcX1, GLint srcY1, GLint dstX0, GLint dstY0, GLint dstX1, GLint dstY1, GLbitfield mask, GLenum filter))
+GL_PROC(void,glBufferData,(GLenum target, GLsizeiptr size, const GLvoid *data, GLenum usage))
+GL_PROC(void,glBufferStorage,(GLenum target, GLsizeiptr size, const GLvoid *data, GLbitfield flags))
 GL_PROC_UNUSED(void,glCallList,(GLuint))
 GL_PROC_UNUSED(void,glCallLists,(GLsizei,GLenum,const GLvoid*))
+GL_PROC(GLenum,glCheckFramebufferStatus,(GLenum target))
 GL_PROC(void,glClear,(GLbitfield))
 GL_PROC_UNUSED(void,glClearAccum,(GLfloat,GLfloat,GLfloat,GLfloat))
 GL_PROC(void,glClearColor,(GLclampf,GLclampf,GLclampf,GLclampf))
 GL_PROC(void,glClearDepth,(GLclampd))
 GL_PROC_UNUSED(void,glClearIndex,(GLfloat))
 GL_PROC_UNUSED(void,glClearStencil,(GLint))
+GL_PROC(GLenum,glClientWaitSync,(GLsync sync, GLbitfield flags, GLuint64 timeout))
 GL_PROC_UNUSED(void,glClipPlane,(GLenum,const GLdouble*))
 GL_PROC_UNUSED(void,glColor3b,(GLbyte,GLbyte,GLbyte))
 GL_PROC_UNUSED(void,glColor3bv,(const GLbyte*))
@@ -55,30 +67,44 @@ GL_PROC_UNUSED(void,glColor4usv,(const GLushort *v))
 GL_PROC_UNUSED(void,glColorMask,(GLboolean red, GLboolean green, GLboolean blue, GLboolean alpha))
 GL_PROC_UNUSED(void,glColorMaterial,(GLenum face, GLenum mode))
 GL_PROC_UNUSED(void,glColorPointer,(GLint size, GLenum type, GLsizei stride, const GLvoid *pointer))
+GL_PROC(void,glCompileShader,(GLuint shader))
 GL_PROC_UNUSED(void,glCopyPixels,(GLint x, GLint y, GLsizei width, GLsizei height, GLenum type))
 GL_PROC_UNUSED(void,glCopyTexImage1D,(GLenum target, GLint level, GLenum internalFormat, GLint x, GLint y, GLsizei width, GLint border))
 GL_PROC_UNUSED(void,glCopyTexImage2D,(GLenum target, GLint level, GLenum internalFormat, GLint x, GLint y, GLsizei width, GLsizei height, GLint border))
 GL_PROC_UNUSED(void,glCopyTexSubImage1D,(GLenum target, GLint level, GLint xoffset, GLint x, GLint y, GLsizei width))
 GL_PROC_UNUSED(void,glCopyTexSubImage2D,(GLenum target, GLint level, GLint xoffset, GLint yoffset, GLint x, GLint y, GLsizei width, GLsizei height))
+GL_PROC(GLuint,glCreateProgram,(void))
+GL_PROC(GLuint,glCreateShader,(GLenum type))
 GL_PROC_UNUSED(void,glCullFace,(GLenum mode))
+GL_PROC(void,glDeleteBuffers,(GLsizei n, const GLuint *buffers))
+GL_PROC(void,glDeleteFramebuffers,(GLsizei n, const GLuint *framebuffers))
 GL_PROC_UNUSED(void,glDeleteLists,(GLuint list, GLsizei range))
+GL_PROC(void,glDeleteProgram,(GLuint program))
+GL_PROC(void,glDeleteQueries,(GLsizei n, const GLuint *ids))
+GL_PROC(void,glDeleteRenderbuffers,(GLsizei n, const GLuint *renderbuffers))
+GL_PROC(void,glDeleteShader,(GLuint shader))
+GL_PROC(void,glDeleteSync,(GLsync sync))
 GL_PROC(void,glDeleteTextures,(GLsizei n, const GLuint *textures))
 GL_PROC(void,glDepthFunc,(GLenum func))
-GL_PROC_UNUSED(void,glDepthMask,(GLboolean flag))
+GL_PROC(void,glDepthMask,(GLboolean flag))
 GL_PROC_UNUSED(void,glDepthRange,(GLclampd zNear, GLclampd zFar))
 GL_PROC(void,glDisable,(GLenum cap))
-GL_PROC_UNUSED(void,glDisableClientState,(GLenum array))
-GL_PROC_UNUSED(void,glDrawArrays,(GLenum mode, GLint first, GLsizei count))
-GL_PROC_UNUSED(void,glDrawBuffer,(GLenum mode))
-GL_PROC_UNUSED(void,glDrawElements,(GLenum mode, GLsizei count, GLenum type, const GLvoid *indices))
+GL_PROC(void,glDisableClientState,(GLenum array))
+GL_PROC(void,glDisableVertexAttribArray,(GLuint index))
+GL_PROC(void,glDrawArrays,(GLenum mode, GLint first, GLsizei count))
+GL_PROC(void,glDrawBuffer,(GLenum mode))
+GL_PROC(void,glDrawElements,(GLenum mode, GLsizei count, GLenum type, const GLvoid *indices))
+GL_PROC(void,glDrawElementsInstanced,(GLenum mode, GLsizei count, GLenum type, const GLvoid *indices, GLsizei primcount))
 GL_PROC_UNUSED(void,glDrawPixels,(GLsizei width, GLsizei height, GLenum format, GLenum type, const GLvoid *pixels))
 GL_PROC_UNUSED(void,glEdgeFlag,(GLboolean flag))
 GL_PROC_UNUSED(void,glEdgeFlagPointer,(GLsizei stride, const GLvoid *pointer))
 GL_PROC_UNUSED(void,glEdgeFlagv,(const GLboolean *flag))
 GL_PROC(void,glEnable,(GLenum cap))
-GL_PROC_UNUSED(void,glEnableClientState,(GLenum array))
+GL_PROC(void,glEnableClientState,(GLenum array))
+GL_PROC(void,glEnableVertexAttribArray,(GLuint index))
 GL_PROC(void,glEnd,(void))
 GL_PROC_UNUSED(void,glEndList,(void))
+GL_PROC(void,glEndQuery,(GLenum target))
 GL_PROC_UNUSED(void,glEvalCoord1d,(GLdouble u))
 GL_PROC_UNUSED(void,glEvalCoord1dv,(const GLdouble *u))
 GL_PROC_UNUSED(void,glEvalCoord1f,(GLfloat u))
@@ -92,22 +118,31 @@ GL_PROC_UNUSED(void,glEvalMesh2,(GLenum mode, GLint i1, GLint i2, GLint j1, GLin
 GL_PROC_UNUSED(void,glEvalPoint1,(GLint i))
 GL_PROC_UNUSED(void,glEvalPoint2,(GLint i, GLint j))
 GL_PROC_UNUSED(void,glFeedbackBuffer,(GLsizei size, GLenum type, GLfloat *buffer))
+GL_PROC(GLsync,glFenceSync,(GLenum condition, GLbitfield flags))
 GL_PROC_UNUSED(void,glFinish,(void))
-GL_PROC_UNUSED(void,glFlush,(void))
+GL_PROC(void,glFlush,(void))
 GL_PROC_UNUSED(void,glFogf,(GLenum pname, GLfloat param))
 GL_PROC_UNUSED(void,glFogfv,(GLenum pname, const GLfloat *params))
 GL_PROC_UNUSED(void,glFogi,(GLenum pname, GLint param))
 GL_PROC_UNUSED(void,glFogiv,(GLenum pname, const GLint *params))
+GL_PROC(void,glFramebufferRenderbuffer,(GLenum target, GLenum attachment, GLenum renderbuffertarget, GLuint renderbuffer))
+GL_PROC(void,glFramebufferTexture2D,(GLenum target, GLenum attachment, GLenum textarget, GLuint texture, GLint level))
+GL_PROC(void,glFramebufferTextureLayer,(GLenum target, GLenum attachment, GLuint texture, GLint level, GLint layer))
 GL_PROC_UNUSED(void,glFrontFace,(GLenum mode))
 GL_PROC_UNUSED(void,glFrustum,(GLdouble left, GLdouble right, GLdouble bottom, GLdouble top, GLdouble zNear, GLdouble zFar))
+GL_PROC(void,glGenBuffers,(GLsizei n, GLuint *buffers))
+GL_PROC(void,glGenerateMipmap,(GLenum target))
+GL_PROC(void,glGenFramebuffers,(GLsizei n, GLuint *framebuffers))
 GL_PROC_UNUSED(GLuint,glGenLists,(GLsizei range))
+GL_PROC(void,glGenQueries,(GLsizei n, GLuint *ids))
+GL_PROC(void,glGenRenderbuffers,(GLsizei n, GLuint *renderbuffers))
 GL_PROC(void,glGenTextures,(GLsizei n, GLuint *textures))
 GL_PROC_UNUSED(void,glGetBooleanv,(GLenum pname, GLboolean *params))
 GL_PROC_UNUSED(void,glGetClipPlane,(GLenum plane, GLdouble *equation))
 GL_PROC_UNUSED(void,glGetDoublev,(GLenum pname, GLdouble *params))
 GL_PROC_UNUSED(GLenum,glGetError,(void))
 GL_PROC_UNUSED(void,glGetFloatv,(GLenum pname, GLfloat *params))
-GL_PROC_UNUSED(void,glGetIntegerv,(GLenum pname, GLint *params))
+GL_PROC(void,glGetIntegerv,(GLenum pname, GLint *params))
 GL_PROC_UNUSED(void,glGetLightfv,(GLenum light, GLenum pname, GLfloat *params))
 GL_PROC_UNUSED(void,glGetLightiv,(GLenum light, GLenum pname, GLint *params))
 GL_PROC_UNUSED(void,glGetMapdv,(GLenum target, GLenum query, GLdouble *v))
@@ -120,7 +155,13 @@ GL_PROC_UNUSED(void,glGetPixelMapuiv,(GLenum map, GLuint *values))
 GL_PROC_UNUSED(void,glGetPixelMapusv,(GLenum map, GLushort *values))
 GL_PROC_UNUSED(void,glGetPointerv,(GLenum pname, GLvoid* *params))
 GL_PROC_UNUSED(void,glGetPolygonStipple,(GLubyte *mask))
-GL_PROC_UNUSED(const GLubyte *,glGetString,(GLenum name))
+GL_PROC(void,glGetProgramInfoLog,(GLuint program, GLsizei bufSize, GLsizei *length, GLchar *infoLog))
+GL_PROC(void,glGetProgramiv,(GLuint program, GLenum pname, GLint *params))
+GL_PROC(void,glGetQueryObjectiv,(GLuint id, GLenum pname, GLint *params))
+GL_PROC(void,glGetQueryObjectuiv,(GLuint id, GLenum pname, GLuint *params))
+GL_PROC(void,glGetShaderInfoLog,(GLuint shader, GLsizei bufSize, GLsizei *length, GLchar *infoLog))
+GL_PROC(void,glGetShaderiv,(GLuint shader, GLenum pname, GLint *params))
+GL_PROC(const GLubyte *,glGetString,(GLenum name))
 GL_PROC_UNUSED(void,glGetTexEnvfv,(GLenum target, GLenum pname, GLfloat *params))
 GL_PROC_UNUSED(void,glGetTexEnviv,(GLenum target, GLenum pname, GLint *params))
 GL_PROC_UNUSED(void,glGetTexGendv,(GLenum coord, GLenum pname, GLdouble *params))
@@ -131,6 +172,7 @@ GL_PROC_UNUSED(void,glGetTexLevelParameterfv,(GLenum target, GLint level, GLenum
 GL_PROC_UNUSED(void,glGetTexLevelParameteriv,(GLenum target, GLint level, GLenum pname, GLint *params))
 GL_PROC_UNUSED(void,glGetTexParameterfv,(GLenum target, GLenum pname, GLfloat *params))
 GL_PROC_UNUSED(void,glGetTexParameteriv,(GLenum target, GLenum pname, GLint *params))
+GL_PROC(GLint,glGetUniformLocation,(GLuint program, const GLchar *name))
 GL_PROC(void,glHint,(GLenum target, GLenum mode))
 GL_PROC_UNUSED(void,glIndexMask,(GLuint mask))
 GL_PROC_UNUSED(void,glIndexPointer,(GLenum type, GLsizei stride, const GLvoid *pointer))
@@ -146,7 +188,7 @@ GL_PROC_UNUSED(void,glIndexub,(GLubyte c))
 GL_PROC_UNUSED(void,glIndexubv,(const GLubyte *c))
 GL_PROC_UNUSED(void,glInitNames,(void))
 GL_PROC_UNUSED(void,glInterleavedArrays,(GLenum format, GLsizei stride, const GLvoid *pointer))
-GL_PROC_UNUSED(GLboolean,glIsEnabled,(GLenum cap))
+GL_PROC(GLboolean,glIsEnabled,(GLenum cap))
 GL_PROC_UNUSED(GLboolean,glIsList,(GLuint list))
 GL_PROC_UNUSED(GLboolean,glIsTexture,(GLuint texture))
 GL_PROC_UNUSED(void,glLightModelf,(GLenum pname, GLfloat param))
@@ -159,6 +201,7 @@ GL_PROC_UNUSED(void,glLighti,(GLenum light, GLenum pname, GLint param))
 GL_PROC_UNUSED(void,glLightiv,(GLenum light, GLenum pname, const GLint *params))
 GL_PROC_UNUSED(void,glLineStipple,(GLint factor, GLushort pattern))
 GL_PROC_UNUSED(void,glLineWidth,(GLfloat width))
+GL_PROC(void,glLinkProgram,(GLuint program))
 GL_PROC_UNUSED(void,glListBase,(GLuint base))
 GL_PROC(void,glLoadIdentity,(void))
 GL_PROC_UNUSED(void,glLoadMatrixd,(const GLdouble *m))
@@ -169,6 +212,7 @@ GL_PROC_UNUSED(void,glMap1d,(GLenum target, GLdouble u1, GLdouble u2, GLint stri
 GL_PROC_UNUSED(void,glMap1f,(GLenum target, GLfloat u1, GLfloat u2, GLint stride, GLint order, const GLfloat *points))
 GL_PROC_UNUSED(void,glMap2d,(GLenum target, GLdouble u1, GLdouble u2, GLint ustride, GLint uorder, GLdouble v1, GLdouble v2, GLint vstride, GLint vorder, const GLdouble *points))
 GL_PROC_UNUSED(void,glMap2f,(GLenum target, GLfloat u1, GLfloat u2, GLint ustride, GLint uorder, GLfloat v1, GLfloat v2, GLint vstride, GLint vorder, const GLfloat *points))
+GL_PROC(void *,glMapBufferRange,(GLenum target, GLintptr offset, GLsizeiptr length, GLbitfield access))
 GL_PROC_UNUSED(void,glMapGrid1d,(GLint un, GLdouble u1, GLdouble u2))
 GL_PROC_UNUSED(void,glMapGrid1f,(GLint un, GLfloat u1, GLfloat u2))
 GL_PROC_UNUSED(void,glMapGrid2d,(GLint un, GLdouble u1, GLdouble u2, GLint vn, GLdouble v1, GLdouble v2))
@@ -178,6 +222,7 @@ GL_PROC_UNUSED(void,glMaterialfv,(GLenum face, GLenum pname, const GLfloat *para
 GL_PROC_UNUSED(void,glMateriali,(GLenum face, GLenum pname, GLint param))
 GL_PROC_UNUSED(void,glMaterialiv,(GLenum face, GLenum pname, const GLint *params))
 GL_PROC(void,glMatrixMode,(GLenum mode))
+GL_PROC(void,glMultiDrawArrays,(GLenum mode, const GLint *first, const GLsizei *count, GLsizei drawcount))
 GL_PROC_UNUSED(void,glMultMatrixd,(const GLdouble *m))
 GL_PROC_UNUSED(void,glMultMatrixf,(const GLfloat *m))
 GL_PROC_UNUSED(void,glNewList,(GLuint list, GLenum mode))
@@ -191,20 +236,20 @@ GL_PROC_UNUSED(void,glNormal3i,(GLint nx, GLint ny, GLint nz))
 GL_PROC_UNUSED(void,glNormal3iv,(const GLint *v))
 GL_PROC_UNUSED(void,glNormal3s,(GLshort nx, GLshort ny, GLshort nz))
 GL_PROC_UNUSED(void,glNormal3sv,(const GLshort *v))
-GL_PROC_UNUSED(void,glNormalPointer,(GLenum type, GLsizei stride, const GLvoid *pointer))
+GL_PROC(void,glNormalPointer,(GLenum type, GLsizei stride, const GLvoid *pointer))
 GL_PROC_UNUSED(void,glOrtho,(GLdouble left, GLdouble right, GLdouble bottom, GLdouble top, GLdouble zNear, GLdouble zFar))
 GL_PROC_UNUSED(void,glPassThrough,(GLfloat token))
 GL_PROC_UNUSED(void,glPixelMapfv,(GLenum map, GLsizei mapsize, const GLfloat *values))
 GL_PROC_UNUSED(void,glPixelMapuiv,(GLenum map, GLsizei mapsize, const GLuint *values))
 GL_PROC_UNUSED(void,glPixelMapusv,(GLenum map, GLsizei mapsize, const GLushort *values))
 GL_PROC_UNUSED(void,glPixelStoref,(GLenum pname, GLfloat param))
-GL_PROC_UNUSED(void,glPixelStorei,(GLenum pname, GLint param))
+GL_PROC(void,glPixelStorei,(GLenum pname, GLint param))
 GL_PROC_UNUSED(void,glPixelTransferf,(GLenum pname, GLfloat param))
 GL_PROC_UNUSED(void,glPixelTransferi,(GLenum pname, GLint param))
 GL_PROC_UNUSED(void,glPixelZoom,(GLfloat xfactor, GLfloat yfactor))
 GL_PROC_UNUSED(void,glPointSize,(GLfloat size))
 GL_PROC_UNUSED(void,glPolygonMode,(GLenum face, GLenum mode))
-GL_PROC_UNUSED(void,glPolygonOffset,(GLfloat factor, GLfloat units))
+GL_PROC(void,glPolygonOffset,(GLfloat factor, GLfloat units))
 GL_PROC_UNUSED(void,glPolygonStipple,(const GLubyte *mask))
 GL_PROC_UNUSED(void,glPopAttrib,(void))
 GL_PROC_UNUSED(void,glPopClientAttrib,(void))
@@ -239,8 +284,8 @@ GL_PROC_UNUSED(void,glRasterPos4i,(GLint x, GLint y, GLint z, GLint w))
 GL_PROC_UNUSED(void,glRasterPos4iv,(const GLint *v))
 GL_PROC_UNUSED(void,glRasterPos4s,(GLshort x, GLshort y, GLshort z, GLshort w))
 GL_PROC_UNUSED(void,glRasterPos4sv,(const GLshort *v))
-GL_PROC_UNUSED(void,glReadBuffer,(GLenum mode))
-GL_PROC_UNUSED(void,glReadPixels,(GLint x, GLint y, GLsizei width, GLsizei height, GLenum format, GLenum type, GLvoid *pixels))
+GL_PROC(void,glReadBuffer,(GLenum mode))
+GL_PROC(void,glReadPixels,(GLint x, GLint y, GLsizei width, GLsizei height, GLenum format, GLenum type, GLvoid *pixels))
 GL_PROC_UNUSED(void,glRectd,(GLdouble x1, GLdouble y1, GLdouble x2, GLdouble y2))
 GL_PROC_UNUSED(void,glRectdv,(const GLdouble *v1, const GLdouble *v2))
 GL_PROC_UNUSED(void,glRectf,(GLfloat x1, GLfloat y1, GLfloat x2, GLfloat y2))
@@ -249,14 +294,16 @@ GL_PROC_UNUSED(void,glRecti,(GLint x1, GLint y1, GLint x2, GLint y2))
 GL_PROC_UNUSED(void,glRectiv,(const GLint *v1, const GLint *v2))
 GL_PROC_UNUSED(void,glRects,(GLshort x1, GLshort y1, GLshort x2, GLshort y2))
 GL_PROC_UNUSED(void,glRectsv,(const GLshort *v1, const GLshort *v2))
+GL_PROC(void,glRenderbufferStorage,(GLenum target, GLenum internalformat, GLsizei width, GLsizei height))
 GL_PROC_UNUSED(GLint,glRenderMode,(GLenum mode))
 GL_PROC_UNUSED(void,glRotated,(GLdouble angle, GLdouble x, GLdouble y, GLdouble z))
 GL_PROC_UNUSED(void,glRotatef,(GLfloat angle, GLfloat x, GLfloat y, GLfloat z))
 GL_PROC_UNUSED(void,glScaled,(GLdouble x, GLdouble y, GLdouble z))
 GL_PROC_UNUSED(void,glScalef,(GLfloat x, GLfloat y, GLfloat z))
-GL_PROC_UNUSED(void,glScissor,(GLint x, GLint y, GLsizei width, GLsizei height))
+GL_PROC(void,glScissor,(GLint x, GLint y, GLsizei width, GLsizei height))
 GL_PROC_UNUSED(void,glSelectBuffer,(GLsizei size, GLuint *buffer))
 GL_PROC(void,glShadeModel,(GLenum mode))
+GL_PROC(void,glShaderSource,(GLuint shader, GLsizei count, const GLchar* const *string, const GLint *length))
 GL_PROC_UNUSED(void,glStencilFunc,(GLenum func, GLint ref, GLuint mask))
 GL_PROC_UNUSED(void,glStencilMask,(GLuint mask))
 GL_PROC_UNUSED(void,glStencilOp,(GLenum fail, GLenum zfail, GLenum zpass))
@@ -305,14 +352,24 @@ GL_PROC_UNUSED(void,glTexGeni,(GLenum coord, GLenum pname, GLint param))
 GL_PROC_UNUSED(void,glTexGeniv,(GLenum coord, GLenum pname, const GLint *params))
 GL_PROC_UNUSED(void,glTexImage1D,(GLenum target, GLint level, GLint internalformat, GLsizei width, GLint border, GLenum format, GLenum type, const GLvoid *pixels))
 GL_PROC(void,glTexImage2D,(GLenum target, GLint level, GLint internalformat, GLsizei width, GLsizei height, GLint border, GLenum format, GLenum type, const GLvoid *pixels))
+GL_PROC(void,glTexImage3D,(GLenum target, GLint level, GLint internalformat, GLsizei width, GLsizei height, GLsizei depth, GLint border, GLenum format, GLenum type, const GLvoid *pixels))
 GL_PROC_UNUSED(void,glTexParameterf,(GLenum target, GLenum pname, GLfloat param))
 GL_PROC_UNUSED(void,glTexParameterfv,(GLenum target, GLenum pname, const GLfloat *params))
 GL_PROC(void,glTexParameteri,(GLenum target, GLenum pname, GLint param))
 GL_PROC_UNUSED(void,glTexParameteriv,(GLenum target, GLenum pname, const GLint *params))
 GL_PROC_UNUSED(void,glTexSubImage1D,(GLenum target, GLint level, GLint xoffset, GLsizei width, GLenum format, GLenum type, const GLvoid *pixels))
-GL_PROC_UNUSED(void,glTexSubImage2D,(GLenum target, GLint level, GLint xoffset, GLint yoffset, GLsizei width, GLsizei height, GLenum format, GLenum type, const GLvoid *pixels))
+GL_PROC(void,glTexSubImage2D,(GLenum target, GLint level, GLint xoffset, GLint yoffset, GLsizei width, GLsizei height, GLenum format, GLenum type, const GLvoid *pixels))
+GL_PROC(void,glTexSubImage3D,(GLenum target, GLint level, GLint xoffset, GLint yoffset, GLint zoffset, GLsizei width, GLsizei height, GLsizei depth, GLenum format, GLenum type, const GLvoid *pixels))
 GL_PROC_UNUSED(void,glTranslated,(GLdouble x, GLdouble y, GLdouble z))
 GL_PROC_UNUSED(void,glTranslatef,(GLfloat x, GLfloat y, GLfloat z))
+GL_PROC(void,glUniform1f,(GLint location, GLfloat v0))
+GL_PROC(void,glUniform1i,(GLint location, GLint v0))
+GL_PROC(void,glUniform2f,(GLint location, GLfloat v0, GLfloat v1))
+GL_PROC(void,glUniform3f,(GLint location, GLfloat v0, GLfloat v1, GLfloat v2))
+GL_PROC(void,glUniform4f,(GLint location, GLfloat v0, GLfloat v1, GLfloat v2, GLfloat v3))
+GL_PROC(void,glUniformMatrix4fv,(GLint location, GLsizei count, GLboolean transpose, const GLfloat* value))
+GL_PROC(GLboolean,glUnmapBuffer,(GLenum target))
+GL_PROC(void,glUseProgram,(GLuint program))
 GL_PROC_UNUSED(void,glVertex2d,(GLdouble x, GLdouble y))
 GL_PROC_UNUSED(void,glVertex2dv,(const GLdouble *v))
 GL_PROC_UNUSED(void,glVertex2f,(GLfloat x, GLfloat y))
@@ -337,5 +394,8 @@ GL_PROC_UNUSED(void,glVertex4i,(GLint x, GLint y, GLint z, GLint w))
 GL_PROC_UNUSED(void,glVertex4iv,(const GLint *v))
 GL_PROC_UNUSED(void,glVertex4s,(GLshort x, GLshort y, GLshort z, GLshort w))
 GL_PROC_UNUSED(void,glVertex4sv,(const GLshort *v))
-GL_PROC_UNUSED(void,glVertexPointer,(GLint size, GLenum type, GLsizei stride, const GLvoid *pointer))
+GL_PROC(void,glVertexAttrib4f,(GLuint index, GLfloat x, GLfloat y, GLfloat z, GLfloat w))
+GL_PROC(void,glVertexAttribDivisor,(GLuint index, GLuint divisor))
+GL_PROC(void,glVertexAttribPointer,(GLuint index, GLint size, GLenum type, GLboolean normalized, GLsizei stride, const GLvoid *pointer))
+GL_PROC(void,glVertexPointer,(GLint size, GLenum type, GLsizei stride, const GLvoid *pointer))
 GL_PROC(void,glViewport,(GLint x, GLint y, GLsizei width, GLsizei height))
@@ -0,0 +1,87 @@
+#ifndef _GPU_TIMER_H
+#define _GPU_TIMER_H
+
+#include "GLDriver.h"
+
+/*
+ * GPU time of a section of the frame.
+ *
+ * The elapsed time queries are kept in a small ring and read back a few
+ * frames later once they are available, so measuring never stalls the
+ * pipeline. Frames whose query slot is still busy are not measured.
+ */
+class GpuTimer {
+public:
+
+	enum {
+		QUERIES = 4,
+	};
+
+	GpuTimer() : slot(0), active(false), lastTime(-1) {
+		available = hasGLExtension("GL_ARB_timer_query") || hasGLExtension("GL_EXT_timer_query");
+		if (available)
+			driver->glGenQueries(QUERIES, query);
+		for (int i = 0; i < QUERIES; ++i)
+			pending[i] = false;
+	}
+
+	~GpuTimer() {
+		if (available)
+			driver->glDeleteQueries(QUERIES, query);
+	}
+
+	bool isAvailable() const {
+		return available;
+	}
+
+	void begin() {
+		if (!available)
+			return;
+		collect();
+		active = !pending[slot];
+		if (active)
+			driver->glBeginQuery(GL_TIME_ELAPSED, query[slot]);
+	}
+
+	void end() {
+		if (!active)
+			return;
+		driver->glEndQuery(GL_TIME_ELAPSED);
+		pending[slot] = true;
+		slot = (slot + 1) % QUERIES;
+		active = false;
+	}
+
+	// Latest measurement in microseconds, -1 before the first one
+	int getTime() const {
+		return lastTime;
+	}
+
+private:
+
+	// Reads back the finished queries, oldest first
+	void collect() {
+		for (int i = 1; i <= QUERIES; ++i) {
+			int s = (slot + i) % QUERIES;
+			if (!pending[s])
+				continue;
+			GLint done = 0;
+			driver->glGetQueryObjectiv(query[s], GL_QUERY_RESULT_AVAILABLE, &done);
+			if (!done)
+				break;
+			GLuint ns;
+			driver->glGetQueryObjectuiv(query[s], GL_QUERY_RESULT, &ns);
+			lastTime = ns / 1000;
+			pending[s] = false;
+		}
+	}
+
+	bool   available;
+	GLuint query[QUERIES];
+	bool   pending[QUERIES];
+	int    slot;
+	bool   active;
+	int    lastTime;
+};
+
+#endif
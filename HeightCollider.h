@@ -0,0 +1,508 @@
+#ifndef _HEIGHT_COLLIDER_H
+#define _HEIGHT_COLLIDER_H
+
+#include <math.h>
+#include "Vector.h"
+#include "WorkerPool.h"
+
+enum ShapeType {
+	SHAPE_SPHERE,
+	SHAPE_CAPSULE,
+	SHAPE_BOX,
+};
+
+/*
+ * A sphere is center and radius, a capsule the segment from center to
+ * end with radius, a box the center and its three half axes, which
+ * may be rotated but must be perpendicular.
+ */
+struct Shape {
+	ShapeType type;
+	Vector    center;
+	Vector    end;
+	float     radius;
+	Vector    axis[3];
+};
+
+/*
+ * Point on the terrain, normal pointing out of it towards the shape and
+ * the distance the shape has to move along the normal to separate
+ */
+struct Contact {
+	Vector point;
+	Vector normal;
+	float  depth;
+};
+
+struct ShapeContacts {
+	enum {
+		MAX_CONTACTS = 4,
+	};
+
+	int     count;
+	Contact contact[MAX_CONTACTS];
+};
+
+/*
+ * Contacts between shapes and the triangles of a height grid.
+ *
+ * The grid is size x size heights indexed as height[x * size + z] and
+ * scaled by scale on all axes, with cells split like in RayCaster.
+ * Tiles of TILE x TILE cells keep their height range, which rejects
+ * shapes above the terrain before any triangle is looked at. Each
+ * shape keeps its deepest contacts. Nothing is allocated per query.
+ */
+class HeightCollider {
+public:
+
+	enum {
+		TILE = 8,
+	};
+
+	HeightCollider(const short* height, int size, float scale)
+		: height(height), size(size), scale(scale) {
+		tiles = (size - 2) / TILE + 1;
+		tileMin = new short[tiles * tiles];
+		tileMax = new short[tiles * tiles];
+		update(0, 0, size - 1, size - 1);
+	}
+
+	~HeightCollider() {
+		delete[] tileMin;
+		delete[] tileMax;
+	}
+
+	/*
+	 * Recomputes the tile bounds over the cells in [x0, x1) x [z0, z1)
+	 */
+	void update(int x0, int z0, int x1, int z1) {
+		for (int tx = x0 / TILE; tx <= (x1 - 1) / TILE; ++tx) {
+			for (int tz = z0 / TILE; tz <= (z1 - 1) / TILE; ++tz) {
+				int cx1 = tx * TILE + TILE < size - 1 ? tx * TILE + TILE : size - 1;
+				int cz1 = tz * TILE + TILE < size - 1 ? tz * TILE + TILE : size - 1;
+				short lo = 32767, hi = -32768;
+				for (int x = tx * TILE; x <= cx1; ++x) {
+					for (int z = tz * TILE; z <= cz1; ++z) {
+						short h = height[x * size + z];
+						if (h < lo) lo = h;
+						if (h > hi) hi = h;
+					}
+				}
+				tileMin[tx * tiles + tz] = lo;
+				tileMax[tx * tiles + tz] = hi;
+			}
+		}
+	}
+
+	/*
+	 * Returns the number of contacts
+	 */
+	int collide(const Shape& shape, ShapeContacts& contacts) const {
+		for (int i = 0; i < ShapeContacts::MAX_CONTACTS; ++i)
+			contacts.contact[i].depth = -1;
+
+		// Everything in grid units from here on, buried centers first.
+		// Spheres get one contact, capsules one per half.
+		float r = shape.radius / scale;
+		if (shape.type == SHAPE_SPHERE && collideBuried(shape.center / scale, r, contacts, 0, 1))
+			return finish(contacts);
+		if (shape.type == SHAPE_CAPSULE) {
+			collideBuried(shape.center / scale, r, contacts, 0, 1);
+			collideBuried(shape.end / scale, r, contacts, 1, 2);
+		}
+
+		Vector lo, hi;
+		bounds(shape, lo, hi);
+		int x0 = cellIndex(lo[0]), x1 = cellIndex(hi[0]);
+		int z0 = cellIndex(lo[2]), z1 = cellIndex(hi[2]);
+		if (hi[0] < 0 || hi[2] < 0 || lo[0] > size - 1 || lo[2] > size - 1)
+			return finish(contacts);
+
+		for (int tx = x0 / TILE; tx <= x1 / TILE; ++tx) {
+			for (int tz = z0 / TILE; tz <= z1 / TILE; ++tz) {
+				if (lo[1] > tileMax[tx * tiles + tz])
+					continue;
+				int cx0 = tx * TILE > x0 ? tx * TILE : x0;
+				int cz0 = tz * TILE > z0 ? tz * TILE : z0;
+				int cx1 = tx * TILE + TILE - 1 < x1 ? tx * TILE + TILE - 1 : x1;
+				int cz1 = tz * TILE + TILE - 1 < z1 ? tz * TILE + TILE - 1 : z1;
+				for (int x = cx0; x <= cx1; ++x) {
+					for (int z = cz0; z <= cz1; ++z)
+						collideCell(shape, x, z, lo[1], contacts);
+				}
+			}
+		}
+
+		if (shape.type == SHAPE_BOX)
+			collideBoxCorners(shape, contacts);
+		return finish(contacts);
+	}
+
+	/*
+	 * Collides a batch of shapes, split across the pool if there is one
+	 */
+	void collide(const Shape* shapes, ShapeContacts* contacts, int count, WorkerPool* pool = NULL) const {
+		Batch batch = { this, shapes, contacts };
+		if (pool)
+			pool->run(batchJob, &batch, count, 256);
+		else
+			batchJob(&batch, 0, count);
+	}
+
+private:
+
+	struct Batch {
+		const HeightCollider* collider;
+		const Shape*          shapes;
+		ShapeContacts*        contacts;
+	};
+
+	static void batchJob(void* data, int begin, int end) {
+		Batch* batch = (Batch*)data;
+		for (int i = begin; i < end; ++i)
+			batch->collider->collide(batch->shapes[i], batch->contacts[i]);
+	}
+
+	// Packs the used slots in world units
+	int finish(ShapeContacts& contacts) const {
+		contacts.count = 0;
+		for (int i = 0; i < ShapeContacts::MAX_CONTACTS; ++i) {
+			if (contacts.contact[i].depth < 0)
+				continue;
+			Contact& c = contacts.contact[contacts.count++];
+			c = contacts.contact[i];
+			c.point *= scale;
+			c.depth *= scale;
+		}
+		return contacts.count;
+	}
+
+	int cellIndex(float g) const {
+		return g < 0 ? 0 : g >= size - 2 ? size - 2 : (int)g;
+	}
+
+	void bounds(const Shape& shape, Vector& lo, Vector& hi) const {
+		Vector c = shape.center / scale;
+		Vector r;
+		switch (shape.type) {
+		case SHAPE_SPHERE:
+			r = Vector(shape.radius, shape.radius, shape.radius) / scale;
+			lo = c - r;
+			hi = c + r;
+			break;
+
+		case SHAPE_CAPSULE: {
+			Vector e = shape.end / scale;
+			r = Vector(shape.radius, shape.radius, shape.radius) / scale;
+			for (int i = 0; i < 3; ++i) {
+				lo[i] = (c[i] < e[i] ? c[i] : e[i]) - r[i];
+				hi[i] = (c[i] > e[i] ? c[i] : e[i]) + r[i];
+			}
+			break;
+		}
+
+		case SHAPE_BOX:
+			for (int i = 0; i < 3; ++i) {
+				r[i] = (fabs(shape.axis[0][i]) + fabs(shape.axis[1][i]) +
+					fabs(shape.axis[2][i])) / scale;
+			}
+			lo = c - r;
+			hi = c + r;
+			break;
+		}
+	}
+
+	void collideCell(const Shape& shape, int x, int z, float bottom, ShapeContacts& contacts) const {
+		const short* h = height + x * size + z;
+		short top = h[0];
+		if (h[1] > top) top = h[1];
+		if (h[size] > top) top = h[size];
+		if (h[size + 1] > top) top = h[size + 1];
+		if (bottom > top)
+			return;
+
+		short low = h[0];
+		if (h[1] < low) low = h[1];
+		if (h[size] < low) low = h[size];
+		if (h[size + 1] < low) low = h[size + 1];
+		Vector boxMin(x, low, z), boxMax(x + 1, top, z + 1);
+
+		Vector v00(x, h[0], z), v01(x, h[1], z + 1);
+		Vector v10(x + 1, h[size], z), v11(x + 1, h[size + 1], z + 1);
+		Vector tri[2][3] = {
+			{ v10, v00, v01 },
+			{ v10, v01, v11 },
+		};
+
+		Vector a = shape.center / scale, b = shape.end / scale;
+		float r = shape.radius / scale;
+		if (shape.type == SHAPE_SPHERE && !segmentNearBox(a, a, r, boxMin, boxMax))
+			return;
+		if (shape.type == SHAPE_CAPSULE && !segmentNearBox(a, b, r, boxMin, boxMax))
+			return;
+
+		for (int t = 0; t < 2; ++t) {
+			const Vector* p = tri[t];
+			switch (shape.type) {
+			case SHAPE_SPHERE:
+				collideSphere(a, r, p, contacts, 0, 1);
+				break;
+
+			case SHAPE_CAPSULE:
+				collideCapsule(a, b, r, p, contacts);
+				break;
+
+			case SHAPE_BOX:
+				// Terrain vertices inside the box, the corners are tested separately
+				if (t == 0)
+					collideBoxVertex(shape, v00, contacts);
+				break;
+			}
+		}
+	}
+
+	static void collideCapsule(const Vector& a, const Vector& b, float r, const Vector* tri,
+				   ShapeContacts& contacts) {
+		Vector n = cross(tri[1] - tri[0], tri[2] - tri[0]);
+		n /= n.length();
+		float sa = dot(a - tri[0], n), sb = dot(b - tri[0], n);
+		if (sa >= r && sb >= r)
+			return;
+
+		// Both ends, and the segment where it passes closest to an edge
+		if (sa < r)
+			collideSphere(a, r, tri, contacts, 0, 1);
+		if (sb < r)
+			collideSphere(b, r, tri, contacts, 1, 2);
+
+		// A segment through the surface has its buried end handled already
+		if (sa * sb <= 0)
+			return;
+		for (int i = 0; i < 3; ++i) {
+			Vector p, q;
+			closestPointsOnSegments(a, b, tri[i], tri[(i + 1) % 3], p, q);
+			Vector d = p - q;
+			float dist = d.length();
+			if (dist < r && dist > 1e-6 && (closestPointOnTriangle(p, tri) - q).squareLength() < 1e-8) {
+				int half = (p - a).squareLength() < (p - b).squareLength() ? 0 : 1;
+				addContact(contacts, q, d / dist, r - dist, half, half + 1);
+			}
+		}
+	}
+
+	static void collideSphere(const Vector& c, float r, const Vector* tri, ShapeContacts& contacts,
+				  int first, int last) {
+		Vector q = closestPointOnTriangle(c, tri);
+		Vector d = c - q;
+		float dist = d.length();
+		if (dist < r && dist > 1e-6)
+			addContact(contacts, q, d / dist, r - dist, first, last);
+	}
+
+	/*
+	 * Height and normal of the terrain at a point in grid units
+	 */
+	bool surface(const Vector& p, float& y, Vector& n) const {
+		if (p[0] < 0 || p[2] < 0 || p[0] > size - 1 || p[2] > size - 1)
+			return false;
+
+		int x = cellIndex(p[0]), z = cellIndex(p[2]);
+		float fx = p[0] - x, fz = p[2] - z;
+		const short* h = height + x * size + z;
+		float h00 = h[0], h01 = h[1], h10 = h[size], h11 = h[size + 1];
+		if (fx + fz <= 1) {
+			y = h00 + fx * (h10 - h00) + fz * (h01 - h00);
+			n = Vector(h00 - h10, 1, h00 - h01);
+		} else {
+			y = h11 + (1 - fx) * (h01 - h11) + (1 - fz) * (h10 - h11);
+			n = Vector(h01 - h11, 1, h10 - h11);
+		}
+		n.normalize();
+		return true;
+	}
+
+	/*
+	 * A point under the terrain is pushed out along the surface normal.
+	 * Returns false if the point is above.
+	 */
+	bool collideBuried(const Vector& p, float r, ShapeContacts& contacts, int first, int last) const {
+		float y;
+		Vector n;
+		if (!surface(p, y, n) || p[1] >= y)
+			return false;
+		addContact(contacts, Vector(p[0], y, p[2]), n, (y - p[1]) * n[1] + r, first, last);
+		return true;
+	}
+
+	/*
+	 * Box corners under the terrain
+	 */
+	void collideBoxCorners(const Shape& shape, ShapeContacts& contacts) const {
+		for (int i = 0; i < 8; ++i) {
+			Vector p = shape.center;
+			for (int j = 0; j < 3; ++j)
+				p += (i >> j & 1 ? 1 : -1) * shape.axis[j];
+			collideBuried(p / scale, 0, contacts, 0, ShapeContacts::MAX_CONTACTS);
+		}
+	}
+
+	/*
+	 * A terrain vertex inside the box pushes it out through the nearest face
+	 */
+	void collideBoxVertex(const Shape& shape, const Vector& v, ShapeContacts& contacts) const {
+		Vector d = v * scale - shape.center;
+		float depth = 1e30;
+		Vector n;
+		for (int i = 0; i < 3; ++i) {
+			float length = shape.axis[i].length();
+			float t = dot(d, shape.axis[i]) / (length * length);
+			if (t < -1 || t > 1)
+				return;
+			float exit = (1 - fabs(t)) * length;
+			if (exit < depth) {
+				depth = exit;
+				n = (t > 0 ? -1 : 1) / length * shape.axis[i];
+			}
+		}
+		addContact(contacts, v, n, depth / scale, 0, ShapeContacts::MAX_CONTACTS);
+	}
+
+	/*
+	 * Keeps the deepest contacts in the slots [first, last), one per
+	 * point. Unused slots have a negative depth until finish().
+	 */
+	static void addContact(ShapeContacts& contacts, const Vector& point, const Vector& normal,
+			       float depth, int first, int last) {
+		int slot = -1;
+		for (int i = first; i < last; ++i) {
+			Contact& c = contacts.contact[i];
+			if (c.depth >= 0 && (c.point - point).squareLength() < 1e-4) {
+				slot = i;
+				break;
+			}
+			if (slot < 0 || c.depth < contacts.contact[slot].depth)
+				slot = i;
+		}
+		Contact& c = contacts.contact[slot];
+		if (depth <= c.depth)
+			return;
+		c.point = point;
+		c.normal = normal;
+		c.depth = depth;
+	}
+
+	/*
+	 * From Ericson, Real-Time Collision Detection, 5.1.5
+	 */
+	static Vector closestPointOnTriangle(const Vector& p, const Vector* tri) {
+		const Vector& a = tri[0];
+		const Vector& b = tri[1];
+		const Vector& c = tri[2];
+		Vector ab = b - a, ac = c - a, ap = p - a;
+		float d1 = dot(ab, ap), d2 = dot(ac, ap);
+		if (d1 <= 0 && d2 <= 0)
+			return a;
+
+		Vector bp = p - b;
+		float d3 = dot(ab, bp), d4 = dot(ac, bp);
+		if (d3 >= 0 && d4 <= d3)
+			return b;
+
+		float vc = d1 * d4 - d3 * d2;
+		if (vc <= 0 && d1 >= 0 && d3 <= 0)
+			return a + d1 / (d1 - d3) * ab;
+
+		Vector cp = p - c;
+		float d5 = dot(ab, cp), d6 = dot(ac, cp);
+		if (d6 >= 0 && d5 <= d6)
+			return c;
+
+		float vb = d5 * d2 - d1 * d6;
+		if (vb <= 0 && d2 >= 0 && d6 <= 0)
+			return a + d2 / (d2 - d6) * ac;
+
+		float va = d3 * d6 - d5 * d4;
+		if (va <= 0 && d4 - d3 >= 0 && d5 - d6 >= 0)
+			return b + (d4 - d3) / ((d4 - d3) + (d5 - d6)) * (c - b);
+
+		float denom = 1 / (va + vb + vc);
+		return a + vb * denom * ab + vc * denom * ac;
+	}
+
+	/*
+	 * From Ericson, Real-Time Collision Detection, 5.1.9
+	 */
+	static void closestPointsOnSegments(const Vector& p1, const Vector& q1, const Vector& p2,
+					    const Vector& q2, Vector& c1, Vector& c2) {
+		Vector d1 = q1 - p1, d2 = q2 - p2, r = p1 - p2;
+		float a = dot(d1, d1), e = dot(d2, d2), f = dot(d2, r);
+		float s, t;
+		if (a < 1e-12) {
+			s = 0;
+			t = clamp(f / e);
+		} else {
+			float c = dot(d1, r);
+			float b = dot(d1, d2);
+			float denom = a * e - b * b;
+			s = denom > 1e-12 ? clamp((b * f - c * e) / denom) : 0;
+			t = (b * s + f) / e;
+			if (t < 0) {
+				t = 0;
+				s = clamp(-c / a);
+			} else if (t > 1) {
+				t = 1;
+				s = clamp((b - c) / a);
+			}
+		}
+		c1 = p1 + s * d1;
+		c2 = p2 + t * d2;
+	}
+
+	/*
+	 * Whether the segment passes within r of the box, conservatively
+	 * as a slab test against the box grown by r
+	 */
+	static bool segmentNearBox(const Vector& a, const Vector& b, float r, const Vector& lo, const Vector& hi) {
+		float t0 = 0, t1 = 1;
+		for (int i = 0; i < 3; ++i) {
+			float d = b[i] - a[i];
+			float l = lo[i] - r, h = hi[i] + r;
+			if (fabs(d) < 1e-9) {
+				if (a[i] < l || a[i] > h)
+					return false;
+				continue;
+			}
+			float u0 = (l - a[i]) / d, u1 = (h - a[i]) / d;
+			if (u0 > u1) {
+				float u = u0; u0 = u1; u1 = u;
+			}
+			if (u0 > t0) t0 = u0;
+			if (u1 < t1) t1 = u1;
+			if (t0 > t1)
+				return false;
+		}
+		return true;
+	}
+
+	static float clamp(float t) {
+		return t < 0 ? 0 : t > 1 ? 1 : t;
+	}
+
+	static float dot(const Vector& a, const Vector& b) {
+		return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+	}
+
+	static Vector cross(const Vector& a, const Vector& b) {
+		return Vector(a[1] * b[2] - a[2] * b[1], a[2] * b[0] - a[0] * b[2],
+			      a[0] * b[1] - a[1] * b[0]);
+	}
+
+	const short* height;
+	int          size;
+	float        scale;
+	int          tiles;
+	short*       tileMin;
+	short*       tileMax;
+};
+
+#endif
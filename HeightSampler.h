@@ -0,0 +1,171 @@
+#ifndef _HEIGHT_SAMPLER_H
+#define _HEIGHT_SAMPLER_H
+
+#include <math.h>
+#include "Vector.h"
+#include "Simd.h"
+#include "WorkerPool.h"
+
+/*
+ * Bilinear height queries at world positions.
+ *
+ * The grid is size x size heights indexed as height[x * size + z] and
+ * scaled by scale on all axes, like RayCaster. The sampler keeps its
+ * own float copy of the heights for the vector path, which update()
+ * refreshes after edits. Positions outside the grid are clamped to
+ * its border.
+ *
+ * Slopes are the derivatives of the height along world x and z, the
+ * normal is the normalized (-slopeX, 1, -slopeZ).
+ */
+class HeightSampler {
+public:
+
+	HeightSampler(const short* height, int size, float scale)
+		: height(height), size(size), scale(scale) {
+		samples = new float[size * size];
+		update(0, 0, size, size);
+	}
+
+	~HeightSampler() {
+		delete[] samples;
+	}
+
+	/*
+	 * Copies the heights in [x0, x1) x [z0, z1)
+	 */
+	void update(int x0, int z0, int x1, int z1) {
+		for (int x = x0; x < x1; ++x) {
+			for (int z = z0; z < z1; ++z)
+				samples[x * size + z] = height[x * size + z];
+		}
+	}
+
+	/*
+	 * Single query, also the reference for the batched path
+	 */
+	float sample(float x, float z, float* slopeX = NULL, float* slopeZ = NULL) const {
+		float gx = clamp(x * (1 / scale)), gz = clamp(z * (1 / scale));
+		int ix = (int)gx < size - 2 ? (int)gx : size - 2;
+		int iz = (int)gz < size - 2 ? (int)gz : size - 2;
+		float fx = gx - ix, fz = gz - iz;
+
+		const short* h = height + ix * size + iz;
+		float h00 = h[0], h01 = h[1], h10 = h[size], h11 = h[size + 1];
+		if (slopeX)
+			*slopeX = (h10 - h00) + fz * (h11 - h10 - h01 + h00);
+		if (slopeZ)
+			*slopeZ = (h01 - h00) + fx * (h11 - h10 - h01 + h00);
+		return scale * (h00 + fx * (h10 - h00) + fz * (h01 - h00) + fx * fz * (h11 - h10 - h01 + h00));
+	}
+
+	/*
+	 * Just the heights of four positions, for kernels that keep their
+	 * own data in vectors
+	 */
+	Float4 sample(Float4 x, Float4 z) const {
+		Float4 zero(0), limit(size - 1), last(size - 2);
+		Float4 gx = min(max(x * Float4(1 / scale), zero), limit);
+		Float4 gz = min(max(z * Float4(1 / scale), zero), limit);
+		Float4 ix = min(truncate(gx), last), iz = min(truncate(gz), last);
+		Float4 fx = gx - ix, fz = gz - iz;
+
+		int index[4];
+		convert(ix * Float4(size) + iz, index);
+		Float4 h00 = gather(samples, index);
+		Float4 h01 = gather(samples + 1, index);
+		Float4 h10 = gather(samples + size, index);
+		Float4 h11 = gather(samples + size + 1, index);
+		Float4 h0 = h00 + fz * (h01 - h00), h1 = h10 + fz * (h11 - h10);
+		return Float4(scale) * (h0 + fx * (h1 - h0));
+	}
+
+	/*
+	 * Batched queries, four at a time. slopeX, slopeZ and normal may be
+	 * NULL if they are not needed. Large batches are split across the pool.
+	 */
+	void sample(const float* x, const float* z, int count, float* heights,
+		    float* slopeX, float* slopeZ, Vector* normal, WorkerPool* pool = NULL) const {
+		Batch batch = { this, x, z, heights, slopeX, slopeZ, normal };
+		if (pool)
+			pool->run(batchJob, &batch, count, 4096);
+		else
+			batchJob(&batch, 0, count);
+	}
+
+private:
+
+	struct Batch {
+		const HeightSampler* sampler;
+		const float* x;
+		const float* z;
+		float*       heights;
+		float*       slopeX;
+		float*       slopeZ;
+		Vector*      normal;
+	};
+
+	static void batchJob(void* data, int begin, int end) {
+		const Batch& b = *(Batch*)data;
+		const HeightSampler& s = *b.sampler;
+
+		Float4 invScale(1 / s.scale), scale(s.scale), zero(0), one(1);
+		Float4 limit(s.size - 1), last(s.size - 2);
+		int i = begin;
+		for (; i + 4 <= end; i += 4) {
+			Float4 gx = min(max(Float4::loadUnaligned(b.x + i) * invScale, zero), limit);
+			Float4 gz = min(max(Float4::loadUnaligned(b.z + i) * invScale, zero), limit);
+			Float4 ix = min(truncate(gx), last), iz = min(truncate(gz), last);
+			Float4 fx = gx - ix, fz = gz - iz;
+
+			int index[4];
+			convert(ix * Float4(s.size) + iz, index);
+			Float4 h00 = gather(s.samples, index);
+			Float4 h01 = gather(s.samples + 1, index);
+			Float4 h10 = gather(s.samples + s.size, index);
+			Float4 h11 = gather(s.samples + s.size + 1, index);
+
+			Float4 dx = h10 - h00, dz = h01 - h00, twist = h11 - h10 - h01 + h00;
+			(scale * (h00 + fx * dx + fz * dz + fx * fz * twist)).storeUnaligned(b.heights + i);
+
+			Float4 sx = dx + fz * twist, sz = dz + fx * twist;
+			if (b.slopeX)
+				sx.storeUnaligned(b.slopeX + i);
+			if (b.slopeZ)
+				sz.storeUnaligned(b.slopeZ + i);
+			if (b.normal) {
+				Float4 len = one / sqrt(sx * sx + sz * sz + one);
+				float nx[4], ny[4], nz[4];
+				(zero - sx * len).storeUnaligned(nx);
+				len.storeUnaligned(ny);
+				(zero - sz * len).storeUnaligned(nz);
+				for (int j = 0; j < 4; ++j)
+					b.normal[i + j] = Vector(nx[j], ny[j], nz[j]);
+			}
+		}
+
+		for (; i < end; ++i) {
+			float sx, sz;
+			b.heights[i] = s.sample(b.x[i], b.z[i], &sx, &sz);
+			if (b.slopeX)
+				b.slopeX[i] = sx;
+			if (b.slopeZ)
+				b.slopeZ[i] = sz;
+			if (b.normal) {
+				b.normal[i] = Vector(-sx, 1, -sz);
+				b.normal[i].normalize();
+			}
+		}
+	}
+
+	float clamp(float g) const {
+		return g < 0 ? 0 : g > size - 1 ? size - 1 : g;
+	}
+
+	const short* height;
+	int          size;
+	float        scale;
+	float*       samples;
+};
+
+#endif
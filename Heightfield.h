@@ -0,0 +1,211 @@
+#ifndef _HEIGHTFIELD_H
+#define _HEIGHTFIELD_H
+
+#include <math.h>
+#include <string.h>
+
+/*
+ * Row major order with z innermost, the order of height[x][z]. A step
+ * along z is the next sample, a step along x a whole row away.
+ *
+ * Layouts split the index of (x, z) into indexX(x) + indexZ(z), so a
+ * row or a neighbourhood computes each part once.
+ */
+class RowLayout {
+public:
+
+	RowLayout(int sizeX, int sizeZ) : sizeZ(sizeZ), count(sizeX * sizeZ) {
+	}
+
+	// Samples to allocate
+	int getCount() const {
+		return count;
+	}
+
+	int indexX(int x) const {
+		return x * sizeZ;
+	}
+
+	int indexZ(int z) const {
+		return z;
+	}
+
+private:
+
+	int sizeZ, count;
+};
+
+/*
+ * Square tiles of TILE x TILE samples one after the other, x major, in
+ * Z order inside each tile.
+ *
+ * A tile of shorts is 2 KB, so a neighbourhood in any direction stays
+ * within a few cache lines and one page, where row major order touches
+ * a line and soon a page per step along x. Inside its tile the index
+ * interleaves the bits of z, in the even positions, with those of x, in
+ * the odd ones. The bits of x and z never overlap, so the index is
+ * still a sum of an x and a z part, each a table lookup and a shift.
+ */
+class TiledLayout {
+public:
+
+	enum {
+		TILE_BITS = 5,
+		TILE = 1 << TILE_BITS,
+		TILE_MASK = TILE - 1,
+		TILE_SAMPLES = TILE * TILE,
+	};
+
+	TiledLayout(int sizeX, int sizeZ) {
+		// Partial tiles at the far edges are padded
+		int tilesZ = (sizeZ + TILE_MASK) >> TILE_BITS;
+		tileRow = tilesZ * TILE_SAMPLES;
+		count = ((sizeX + TILE_MASK) >> TILE_BITS) * tileRow;
+		for (int i = 0; i < TILE; ++i) {
+			int spread = 0;
+			for (int b = 0; b < TILE_BITS; ++b)
+				spread |= (i >> b & 1) << 2 * b;
+			spreadZ[i] = spread;
+			spreadX[i] = spread << 1;
+		}
+	}
+
+	int getCount() const {
+		return count;
+	}
+
+	int indexX(int x) const {
+		return (x >> TILE_BITS) * tileRow + spreadX[x & TILE_MASK];
+	}
+
+	int indexZ(int z) const {
+		return (z >> TILE_BITS) * TILE_SAMPLES + spreadZ[z & TILE_MASK];
+	}
+
+private:
+
+	int tileRow, count;
+	int spreadX[TILE], spreadZ[TILE];
+};
+
+/*
+ * Grid of sizeX x sizeZ height samples of any arithmetic type, short,
+ * unsigned short or float, addressed as (x, z) like height[x][z]. The
+ * layout is a template parameter so the accessors inline without a
+ * branch on it.
+ *
+ * Single samples, neighbours and bilinear samples go through the
+ * layout. Bulk work reads whole rows along z or blocks into plain
+ * arrays, computes on those and writes the results back.
+ */
+template<class Sample, class Layout = TiledLayout>
+class Heightfield {
+public:
+
+	Heightfield(int sizeX, int sizeZ) : sizeX(sizeX), sizeZ(sizeZ), layout(sizeX, sizeZ) {
+		samples = new Sample[layout.getCount()];
+		memset(samples, 0, layout.getCount() * sizeof (Sample));
+	}
+
+	~Heightfield() {
+		delete[] samples;
+	}
+
+	int getSizeX() const {
+		return sizeX;
+	}
+
+	int getSizeZ() const {
+		return sizeZ;
+	}
+
+	// Bytes of samples, with the padding of the layout
+	size_t getMemory() const {
+		return (size_t)layout.getCount() * sizeof (Sample);
+	}
+
+	Sample get(int x, int z) const {
+		return samples[layout.indexX(x) + layout.indexZ(z)];
+	}
+
+	void set(int x, int z, Sample s) {
+		samples[layout.indexX(x) + layout.indexZ(z)] = s;
+	}
+
+	/*
+	 * The neighbours along x and z, repeating the border
+	 */
+	void getNeighbours(int x, int z, Sample& x0, Sample& x1, Sample& z0, Sample& z1) const {
+		int ix = layout.indexX(x), iz = layout.indexZ(z);
+		x0 = samples[layout.indexX(x > 0 ? x - 1 : x) + iz];
+		x1 = samples[layout.indexX(x < sizeX - 1 ? x + 1 : x) + iz];
+		z0 = samples[ix + layout.indexZ(z > 0 ? z - 1 : z)];
+		z1 = samples[ix + layout.indexZ(z < sizeZ - 1 ? z + 1 : z)];
+	}
+
+	/*
+	 * Bilinear interpolation in grid units, clamped to the grid
+	 */
+	float sample(float x, float z) const {
+		x = x < 0 ? 0 : x > sizeX - 1 ? sizeX - 1 : x;
+		z = z < 0 ? 0 : z > sizeZ - 1 ? sizeZ - 1 : z;
+		int ix = (int)x < sizeX - 2 ? (int)x : sizeX - 2;
+		int iz = (int)z < sizeZ - 2 ? (int)z : sizeZ - 2;
+		float fx = x - ix, fz = z - iz;
+
+		int x0 = layout.indexX(ix), x1 = layout.indexX(ix + 1);
+		int z0 = layout.indexZ(iz), z1 = layout.indexZ(iz + 1);
+		float h00 = samples[x0 + z0], h01 = samples[x0 + z1];
+		float h10 = samples[x1 + z0], h11 = samples[x1 + z1];
+		float h0 = h00 + fz * (h01 - h00), h1 = h10 + fz * (h11 - h10);
+		return h0 + fx * (h1 - h0);
+	}
+
+	/*
+	 * count samples along z from (x, z0), inside the grid
+	 */
+	void readRow(int x, int z0, int count, Sample* out) const {
+		const Sample* row = samples + layout.indexX(x);
+		for (int k = 0; k < count; ++k)
+			out[k] = row[layout.indexZ(z0 + k)];
+	}
+
+	void writeRow(int x, int z0, int count, const Sample* in) {
+		Sample* row = samples + layout.indexX(x);
+		for (int k = 0; k < count; ++k)
+			row[layout.indexZ(z0 + k)] = in[k];
+	}
+
+	/*
+	 * Copies [x0, x0 + w) x [z0, z0 + h) to out[(x - x0) * h + z - z0].
+	 * The block may reach beyond the grid, which repeats its border, so
+	 * a tile and an apron around it are one read.
+	 */
+	void readBlock(int x0, int z0, int w, int h, Sample* out) const {
+		int zb = z0 < 0 ? 0 : z0, ze = z0 + h < sizeZ ? z0 + h : sizeZ;
+		for (int x = x0; x < x0 + w; ++x, out += h) {
+			int cx = x < 0 ? 0 : x < sizeX ? x : sizeX - 1;
+			readRow(cx, zb, ze - zb, out + zb - z0);
+			for (int z = z0; z < zb; ++z)
+				out[z - z0] = out[zb - z0];
+			for (int z = ze; z < z0 + h; ++z)
+				out[z - z0] = out[ze - 1 - z0];
+		}
+	}
+
+	/*
+	 * Copies a block back, which has to lie inside the grid
+	 */
+	void writeBlock(int x0, int z0, int w, int h, const Sample* in) {
+		for (int x = x0; x < x0 + w; ++x, in += h)
+			writeRow(x, z0, h, in);
+	}
+
+private:
+
+	int     sizeX, sizeZ;
+	Layout  layout;
+	Sample* samples;
+};
+
+#endif
@@ -0,0 +1,136 @@
+#ifndef _HORIZON_H
+#define _HORIZON_H
+
+#include "Matrix.h"
+
+/*
+ * One dimensional occlusion horizon for terrain.
+ *
+ * For every screen column the horizon holds the screen height (NDC)
+ * below which everything already drawn hides what lies behind it.
+ * Chunks are processed front to back: a chunk whose bounding box lies
+ * below the horizon in all its columns is occluded, otherwise its
+ * bounding box at minimum height, which is certainly covered by the
+ * terrain, raises the horizon.
+ *
+ * The test assumes the space below the terrain is solid, which breaks
+ * down when the camera looks steeply down, so the horizon disables
+ * itself when the nadir is on screen.
+ */
+class Horizon {
+public:
+
+	enum {
+		COLUMNS = 256,
+	};
+
+	Horizon() : enabled(false) {
+	}
+
+	void clear(const Matrix& clip) {
+		for (int i = 0; i < COLUMNS; ++i)
+			height[i] = -1;
+
+		float x, y, w = -clip(3,1);
+		x = -clip(0,1) / w;
+		y = -clip(1,1) / w;
+		enabled = !(w > 0 && x >= -1 && x <= 1 && y >= -1 && y <= 1);
+	}
+
+	bool isOccluded(const Matrix& clip, const Vector& min, const Vector& max) const {
+		if (!enabled)
+			return false;
+
+		float x0 = 1, x1 = -1, top = -1;
+		for (int i = 0; i < 8; ++i) {
+			float x, y;
+			if (!project(clip, i & 1 ? max[0] : min[0], i & 2 ? max[1] : min[1],
+				     i & 4 ? max[2] : min[2], x, y))
+				return false;
+			if (x < x0)
+				x0 = x;
+			if (x > x1)
+				x1 = x;
+			if (y > top)
+				top = y;
+		}
+
+		int c0 = column(x0), c1 = column(x1);
+		if (c0 < 0)
+			c0 = 0;
+		if (c1 >= COLUMNS)
+			c1 = COLUMNS - 1;
+		if (c0 > c1)
+			return false;
+		for (int c = c0; c <= c1; ++c) {
+			if (top >= height[c])
+				return false;
+		}
+		return true;
+	}
+
+	void addOccluder(const Matrix& clip, const Vector& min, const Vector& max) {
+		if (!enabled)
+			return;
+
+		float x[4], y[4];
+		for (int i = 0; i < 4; ++i) {
+			// Corners in order around the top face
+			bool right = i == 1 || i == 2;
+			if (!project(clip, right ? max[0] : min[0], min[1], i & 2 ? max[2] : min[2], x[i], y[i]))
+				return;
+			x[i] = (x[i] + 1) / 2 * COLUMNS;
+		}
+
+		// Upper edge of the projected face at the column boundaries
+		float edge[COLUMNS + 1];
+		bool inside[COLUMNS + 1];
+		for (int i = 0; i <= COLUMNS; ++i)
+			inside[i] = false;
+		for (int i = 0; i < 4; ++i) {
+			int j = (i + 1) & 3;
+			int a = x[i] < x[j] ? i : j, b = a == i ? j : i;
+			int k0 = (int)ceil(x[a]), k1 = (int)floor(x[b]);
+			if (k0 < 0)
+				k0 = 0;
+			if (k1 > COLUMNS)
+				k1 = COLUMNS;
+			for (int k = k0; k <= k1; ++k) {
+				float t = x[b] > x[a] ? (k - x[a]) / (x[b] - x[a]) : 0;
+				float e = y[a] + t * (y[b] - y[a]);
+				if (!inside[k] || e > edge[k])
+					edge[k] = e;
+				inside[k] = true;
+			}
+		}
+
+		// The upper edge is concave, so its minimum over a column is at a boundary
+		for (int c = 0; c < COLUMNS; ++c) {
+			if (!inside[c] || !inside[c + 1])
+				continue;
+			float e = edge[c] < edge[c + 1] ? edge[c] : edge[c + 1];
+			if (e > height[c])
+				height[c] = e;
+		}
+	}
+
+private:
+
+	static int column(float x) {
+		return (int)floor((x + 1) / 2 * COLUMNS);
+	}
+
+	static bool project(const Matrix& m, float x, float y, float z, float& sx, float& sy) {
+		float w = m(3,0) * x + m(3,1) * y + m(3,2) * z + m(3,3);
+		if (w < 1e-3)
+			return false;
+		sx = (m(0,0) * x + m(0,1) * y + m(0,2) * z + m(0,3)) / w;
+		sy = (m(1,0) * x + m(1,1) * y + m(1,2) * z + m(1,3)) / w;
+		return true;
+	}
+
+	bool  enabled;
+	float height[COLUMNS];
+};
+
+#endif
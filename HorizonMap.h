@@ -0,0 +1,266 @@
+#ifndef _HORIZON_MAP_H
+#define _HORIZON_MAP_H
+
+#include <math.h>
+#include <string.h>
+#include "GLDriver.h"
+#include "Simd.h"
+#include "Timer.h"
+#include "WorkerPool.h"
+
+/*
+ * Precomputed horizon elevation around every grid point.
+ *
+ * For DIRECTIONS evenly spaced azimuths the bake marches away from
+ * each sample up to MAX_DISTANCE cells and keeps the steepest rise. The
+ * sine of the horizon elevation is stored in a byte, four directions
+ * per RGBA texel, in a texture array with DIRECTIONS / 4 layers.
+ *
+ * With that the shader gets self shadowing for any sun direction by
+ * comparing the sun elevation with the horizon interpolated at the sun
+ * azimuth, and ambient occlusion from the average over all directions.
+ * Direction k points along (cos, sin) of 2 pi k / DIRECTIONS in x and z.
+ */
+class HorizonMap {
+public:
+
+	enum {
+		DIRECTIONS = 8,
+		LAYERS = DIRECTIONS / 4,
+		MAX_DISTANCE = 64,
+		MAX_STEPS = 64,
+	};
+
+	/*
+	 * GLSL helpers for the fragment shader. uv addresses the texture,
+	 * sun is the normalized direction towards the sun.
+	 */
+	static const char* shaderSource() {
+		return
+			"float horizonAt(sampler2DArray horizon, vec2 uv, float azimuth) {\n"
+			"	vec4 a = texture(horizon, vec3(uv, 0.)), b = texture(horizon, vec3(uv, 1.));\n"
+			"	float h[8] = float[8](a.x, a.y, a.z, a.w, b.x, b.y, b.z, b.w);\n"
+			"	float f = mod(azimuth / 6.2831853 * 8., 8.);\n"
+			"	int k = int(f);\n"
+			"	return mix(h[k], h[(k + 1) & 7], f - float(k));\n"
+			"}\n"
+			"float horizonShadow(sampler2DArray horizon, vec2 uv, vec3 sun) {\n"
+			"	float h = horizonAt(horizon, uv, atan(sun.z, sun.x));\n"
+			"	return smoothstep(h - .05, h + .05, sun.y);\n"
+			"}\n"
+			"float horizonOcclusion(sampler2DArray horizon, vec2 uv) {\n"
+			"	vec4 a = texture(horizon, vec3(uv, 0.)), b = texture(horizon, vec3(uv, 1.));\n"
+			"	return 1. - (dot(a, a) + dot(b, b)) / 8.;\n"
+			"}\n";
+	}
+
+	HorizonMap(const short* height, int size)
+		: height(height), size(size), texture(0), bakeTime(0), uploadBytes(0) {
+		dirtyX0 = dirtyZ0 = dirtyX1 = dirtyZ1 = 0;
+		data = new unsigned char[LAYERS * size * size * 4];
+		memset(data, 0, LAYERS * size * size * 4);
+
+		stride = size + 2 * MAX_DISTANCE + 8;
+		padded = new float[stride * stride];
+
+		// Step lengths grow with the distance, horizons far away need less detail
+		steps = 0;
+		for (float t = 1; t <= MAX_DISTANCE && steps < MAX_STEPS; t += t < 8 ? 1 : t / 8)
+			step[steps++] = t;
+	}
+
+	~HorizonMap() {
+		if (texture)
+			driver->glDeleteTextures(1, &texture);
+		delete[] data;
+		delete[] padded;
+	}
+
+	/*
+	 * Bakes all samples, rows split across the pool
+	 */
+	void bake(WorkerPool* pool = NULL) {
+		update(0, 0, size, size, pool);
+	}
+
+	/*
+	 * Rebakes after the heights in [x0, x1) x [z0, z1) changed. Every
+	 * sample whose steps reach into the rectangle is affected, so the
+	 * work grows with the rectangle and the step distance but not with
+	 * the size of the map.
+	 */
+	void update(int x0, int z0, int x1, int z1, WorkerPool* pool = NULL) {
+		long long start = getMicroseconds();
+
+		// Beyond the border the edge heights continue
+		int px0 = x0 > 0 ? x0 + MAX_DISTANCE + 1 : 0, px1 = x1 < size ? x1 + MAX_DISTANCE + 1 : stride;
+		int pz0 = z0 > 0 ? z0 + MAX_DISTANCE + 1 : 0, pz1 = z1 < size ? z1 + MAX_DISTANCE + 1 : stride;
+		for (int x = px0; x < px1; ++x) {
+			int hx = clamp(x - MAX_DISTANCE - 1);
+			for (int z = pz0; z < pz1; ++z)
+				padded[x * stride + z] = height[hx * size + clamp(z - MAX_DISTANCE - 1)];
+		}
+
+		bakeX0 = x0 - MAX_DISTANCE - 1 > 0 ? x0 - MAX_DISTANCE - 1 : 0;
+		bakeZ0 = z0 - MAX_DISTANCE - 1 > 0 ? z0 - MAX_DISTANCE - 1 : 0;
+		bakeX1 = x1 + MAX_DISTANCE + 1 < size ? x1 + MAX_DISTANCE + 1 : size;
+		bakeZ1 = z1 + MAX_DISTANCE + 1 < size ? z1 + MAX_DISTANCE + 1 : size;
+		if (pool)
+			pool->run(bakeJob, this, bakeX1 - bakeX0, 4);
+		else
+			bakeJob(this, 0, bakeX1 - bakeX0);
+
+		if (dirtyX0 >= dirtyX1) {
+			dirtyX0 = bakeX0;
+			dirtyZ0 = bakeZ0;
+			dirtyX1 = bakeX1;
+			dirtyZ1 = bakeZ1;
+		} else {
+			dirtyX0 = bakeX0 < dirtyX0 ? bakeX0 : dirtyX0;
+			dirtyZ0 = bakeZ0 < dirtyZ0 ? bakeZ0 : dirtyZ0;
+			dirtyX1 = bakeX1 > dirtyX1 ? bakeX1 : dirtyX1;
+			dirtyZ1 = bakeZ1 > dirtyZ1 ? bakeZ1 : dirtyZ1;
+		}
+		bakeTime = getMicroseconds() - start;
+	}
+
+	/*
+	 * Takes the baked samples from a cache instead of baking them, the
+	 * whole map is uploaded next
+	 */
+	void restore(const unsigned char* baked) {
+		memcpy(data, baked, getMemory());
+		dirtyX0 = dirtyZ0 = 0;
+		dirtyX1 = dirtyZ1 = size;
+	}
+
+	// The baked samples, layer by layer
+	const unsigned char* getData() const {
+		return data;
+	}
+
+	long long getBakeTime() const {
+		return bakeTime;
+	}
+
+	// Bytes of baked data, the same on the GPU
+	int getMemory() const {
+		return LAYERS * size * size * 4;
+	}
+
+	/*
+	 * Sine of the horizon elevation at a grid point in direction k, 0 to 1
+	 */
+	float getHorizon(int x, int z, int k) const {
+		return data[((k / 4 * size + z) * size + x) * 4 + k % 4] / 255.f;
+	}
+
+	/*
+	 * Uploads the baked data, false if texture arrays are missing. Once
+	 * the texture exists only what was rebaked since is uploaded.
+	 */
+	bool upload() {
+		if (!hasGLExtension("GL_EXT_texture_array"))
+			return false;
+		uploadBytes = 0;
+		if (!texture) {
+			driver->glGenTextures(1, &texture);
+			driver->glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+			driver->glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			driver->glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			driver->glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			driver->glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			driver->glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, size, size, LAYERS, 0,
+					     GL_RGBA, GL_UNSIGNED_BYTE, data);
+			uploadBytes = getMemory();
+		} else if (dirtyX0 < dirtyX1) {
+			// Texture x is grid x, rows are grid z
+			int w = dirtyX1 - dirtyX0, h = dirtyZ1 - dirtyZ0;
+			driver->glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+			driver->glPixelStorei(GL_UNPACK_ROW_LENGTH, size);
+			driver->glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, size);
+			driver->glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, dirtyX0, dirtyZ0, 0, w, h, LAYERS,
+						GL_RGBA, GL_UNSIGNED_BYTE, data + (dirtyZ0 * size + dirtyX0) * 4);
+			driver->glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, 0);
+			driver->glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+			uploadBytes = LAYERS * w * h * 4;
+		}
+		driver->glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+		dirtyX0 = dirtyX1 = 0;
+		return true;
+	}
+
+	// Bytes the last upload() sent
+	int getUploadBytes() const {
+		return uploadBytes;
+	}
+
+	GLuint getTexture() const {
+		return texture;
+	}
+
+private:
+
+	static void bakeJob(void* data, int begin, int end) {
+		HorizonMap* self = (HorizonMap*)data;
+		for (int x = begin; x < end; ++x)
+			self->bakeRow(self->bakeX0 + x, self->bakeZ0, self->bakeZ1);
+	}
+
+	/*
+	 * Four samples along z at once. They share the fractional offsets
+	 * of every step, so the bilinear corners are plain unaligned loads.
+	 */
+	void bakeRow(int x, int z0, int z1) {
+		const float* base = padded + (x + MAX_DISTANCE + 1) * stride + MAX_DISTANCE + 1;
+		for (int k = 0; k < DIRECTIONS; ++k) {
+			float a = 2 * M_PI * k / DIRECTIONS;
+			float dx = cos(a), dz = sin(a);
+			unsigned char* out = data + (k / 4 * size * size + x) * 4 + k % 4;
+
+			for (int z = z0 & ~3; z < z1; z += 4) {
+				Float4 h0 = Float4::loadUnaligned(base + z);
+				Float4 rise(0);
+				for (int s = 0; s < steps; ++s) {
+					float ox = step[s] * dx, oz = step[s] * dz;
+					int ix = (int)floor(ox), iz = (int)floor(oz);
+					Float4 fx(ox - ix), fz(oz - iz);
+					const float* p = base + ix * stride + z + iz;
+					Float4 h00 = Float4::loadUnaligned(p);
+					Float4 h01 = Float4::loadUnaligned(p + 1);
+					Float4 h10 = Float4::loadUnaligned(p + stride);
+					Float4 h11 = Float4::loadUnaligned(p + stride + 1);
+					Float4 h0z = h00 + fz * (h01 - h00);
+					Float4 h1z = h10 + fz * (h11 - h10);
+					Float4 h = h0z + fx * (h1z - h0z);
+					rise = max(rise, (h - h0) * Float4(1 / step[s]));
+				}
+
+				// Sine of the elevation, rise / sqrt(1 + rise²)
+				float sine[4];
+				(rise / sqrt(rise * rise + Float4(1))).storeUnaligned(sine);
+				for (int i = 0; i < 4 && z + i < size; ++i)
+					out[(z + i) * size * 4] = (unsigned char)(sine[i] * 255 + .5f);
+			}
+		}
+	}
+
+	int clamp(int i) const {
+		return i < 0 ? 0 : i >= size ? size - 1 : i;
+	}
+
+	const short*   height;
+	int            size;
+	int            stride;
+	float*         padded;
+	float          step[MAX_STEPS];
+	int            steps;
+	unsigned char* data;
+	GLuint         texture;
+	long long      bakeTime;
+	int            uploadBytes;
+	int            bakeX0, bakeZ0, bakeX1, bakeZ1;
+	int            dirtyX0, dirtyZ0, dirtyX1, dirtyZ1;
+};
+
+#endif
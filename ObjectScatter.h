@@ -0,0 +1,746 @@
+#ifndef _OBJECT_SCATTER_H
+#define _OBJECT_SCATTER_H
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include "GLDriver.h"
+#include "Shader.h"
+#include "Matrix.h"
+#include "Vector.h"
+#include "Frustum.h"
+#include "HeightSampler.h"
+#include "Timer.h"
+#include "WorkerPool.h"
+
+/*
+ * Ring of a surface of revolution in units of the object height. The
+ * segment from a ring to the next has the color of the lower ring.
+ */
+struct LatheRing {
+	float         y, radius;
+	unsigned char color[3];
+};
+
+/*
+ * One kind of object and where it stands. Objects are placed where the
+ * ground lies between minHeight and maxHeight in world units and its
+ * slope, rise over run, between minSlope and maxSlope. share is their
+ * part of all instances. The shape is a surface of revolution with
+ * sides[0] sides in the detail mesh and sides[1] in the coarse one.
+ */
+struct ScatterKind {
+	float            share;
+	float            minHeight, maxHeight;
+	float            minSlope, maxSlope;
+	float            minScale, maxScale;
+	const LatheRing* rings;
+	int              ringCount;
+	int              sides[2];
+};
+
+/*
+ * Statistics of the last select() and draw()
+ */
+struct ScatterStats {
+	int instances;
+	int chunks;
+	int culledChunks;
+	int hiddenChunks;
+	int lodInstances[3];
+	int drawCalls;
+	int triangles;
+	int selectTime;
+};
+
+/*
+ * Objects scattered over the terrain chunks and drawn instanced.
+ *
+ * Placement is deterministic: candidate i of a kind in a chunk takes
+ * its position and size from a hash of the chunk, the kind and i, and
+ * stands if the ground there passes the rules of the kind. The number
+ * of candidates is scaled by the fraction of the ground that passes,
+ * so the total comes out near the count asked for, and placing again
+ * after an edit only moves the objects the edit touched. Chunks are
+ * placed in parallel and their instances, position and scale, go to a
+ * static buffer per chunk ordered by kind.
+ *
+ * Every frame the chunks are culled against the frustum, the draw
+ * distance and what the caller found hidden behind the terrain, and each kind of a chunk takes a LOD from the projected
+ * size of its largest object at the nearest point of the chunk: the
+ * detail mesh, the coarse mesh or a billboard impostor. The impostors
+ * are the detail meshes rendered from the side into a texture once.
+ * The draws are grouped by LOD and kind, one instanced draw per chunk,
+ * so the state changes once per group.
+ */
+class ObjectScatter {
+public:
+
+	enum {
+		MAX_KINDS = 4,
+		MESH_LODS = 2,
+		IMPOSTOR = MESH_LODS,
+		LODS,
+		IMPOSTOR_SIZE = 128,
+		// Projected height in pixels down to which the meshes are drawn
+		DETAIL_PIXELS = 64,
+		COARSE_PIXELS = 24,
+	};
+
+	/*
+	 * The chunks are chunkSize cells of a grid of size x size points
+	 * scale apart, like the terrain chunks
+	 */
+	ObjectScatter(const HeightSampler* ground, int size, int chunkSize, float scale,
+		      const ScatterKind* kinds, int kindCount)
+		: ground(ground), size(size), chunkSize(chunkSize), scale(scale), target(0),
+		  placeTime(0), meshProgram(0), impostorProgram(0), vertexBuffer(0), indexBuffer(0),
+		  quadBuffer(0), impostorTexture(0) {
+		memset(&stats, 0, sizeof (stats));
+		this->kindCount = kindCount < MAX_KINDS ? kindCount : MAX_KINDS;
+		for (int k = 0; k < this->kindCount; ++k) {
+			const ScatterKind& kind = this->kinds[k] = kinds[k];
+			radius[k] = 0;
+			bottom[k] = top[k] = kind.rings[0].y;
+			for (int i = 0; i < kind.ringCount; ++i) {
+				radius[k] = kind.rings[i].radius > radius[k] ? kind.rings[i].radius : radius[k];
+				bottom[k] = kind.rings[i].y < bottom[k] ? kind.rings[i].y : bottom[k];
+				top[k] = kind.rings[i].y > top[k] ? kind.rings[i].y : top[k];
+			}
+			for (int lod = 0; lod < MESH_LODS; ++lod)
+				triangles[lod][k] = 2 * kind.sides[lod] * (kind.ringCount - 1);
+		}
+		chunksPerSide = (size - 1 + chunkSize - 1) / chunkSize;
+		chunkCount = chunksPerSide * chunksPerSide;
+		chunks = new ScatterChunk[chunkCount];
+		for (int i = 0; i < chunkCount; ++i) {
+			chunks[i].buffer = 0;
+			chunks[i].total = 0;
+			chunks[i].instances = NULL;
+		}
+		for (int i = 0; i < LODS; ++i) {
+			draws[i] = new Draw[chunkCount * MAX_KINDS];
+			drawCount[i] = 0;
+		}
+	}
+
+	~ObjectScatter() {
+		for (int i = 0; i < LODS; ++i)
+			delete[] draws[i];
+		for (int i = 0; i < chunkCount; ++i) {
+			delete[] chunks[i].instances;
+			if (chunks[i].buffer)
+				driver->glDeleteBuffers(1, &chunks[i].buffer);
+		}
+		if (meshProgram) {
+			driver->glDeleteProgram(meshProgram);
+			driver->glDeleteProgram(impostorProgram);
+			driver->glDeleteBuffers(1, &vertexBuffer);
+			driver->glDeleteBuffers(1, &indexBuffer);
+			driver->glDeleteBuffers(1, &quadBuffer);
+			driver->glDeleteTextures(1, &impostorTexture);
+		}
+		delete[] chunks;
+	}
+
+	/*
+	 * Creates the meshes, the programs and the impostors. Placement
+	 * works without them.
+	 */
+	void initGL() {
+		if (!hasGLExtension("GL_ARB_instanced_arrays") || !hasGLExtension("GL_ARB_draw_instanced") ||
+		    !hasGLExtension("GL_ARB_framebuffer_object"))
+			return;
+		initPrograms();
+		if (!meshProgram || !impostorProgram) {
+			meshProgram = 0;
+			return;
+		}
+		initMeshes();
+		bakeImpostors();
+	}
+
+	bool isAvailable() const {
+		return meshProgram != 0;
+	}
+
+	int getInstanceCount() const {
+		return stats.instances;
+	}
+
+	int getChunkCount() const {
+		return chunkCount;
+	}
+
+	// Chunk of the cell at x, z
+	int getChunk(int x, int z) const {
+		return x / chunkSize * chunksPerSide + z / chunkSize;
+	}
+
+	/*
+	 * Bounds of the objects of a chunk in world units, false if it has
+	 * none
+	 */
+	bool getChunkBounds(int i, Vector& min, Vector& max) const {
+		const ScatterChunk& c = chunks[i];
+		min = c.min;
+		max = c.max;
+		return c.total != 0;
+	}
+
+	// Microseconds the last place() took
+	long long getPlaceTime() const {
+		return placeTime;
+	}
+
+	/*
+	 * Places about count instances over all chunks, split across the
+	 * pool if there is one
+	 */
+	void place(int count, WorkerPool* pool = NULL) {
+		long long start = getMicroseconds();
+		target = count;
+
+		// Fraction of the grid points each kind may stand on
+		for (int k = 0; k < kindCount; ++k) {
+			int passed = 0;
+			for (int x = 0; x < size; ++x) {
+				for (int z = 0; z < size; ++z) {
+					float slopeX, slopeZ;
+					float h = ground->sample(x * scale, z * scale, &slopeX, &slopeZ);
+					passed += accepts(kinds[k], h, slopeX, slopeZ);
+				}
+			}
+			float cells = (float)(size - 1) * (size - 1);
+			density[k] = passed ? target * kinds[k].share * size * size / ((float)passed * cells) : 0;
+		}
+
+		if (pool)
+			pool->run(placeChunks, this, chunkCount, 1);
+		else
+			placeChunks(this, 0, chunkCount);
+		stats.instances = 0;
+		for (int i = 0; i < chunkCount; ++i)
+			stats.instances += upload(chunks[i]);
+		placeTime = getMicroseconds() - start;
+	}
+
+	/*
+	 * Places the chunks again that have points in [x0, x1) x [z0, z1)
+	 */
+	void update(int x0, int z0, int x1, int z1) {
+		if (!target)
+			return;
+		int cx0 = (x0 > 0 ? x0 - 1 : 0) / chunkSize, cz0 = (z0 > 0 ? z0 - 1 : 0) / chunkSize;
+		int cx1 = (x1 - 1) / chunkSize < chunksPerSide ? (x1 - 1) / chunkSize : chunksPerSide - 1;
+		int cz1 = (z1 - 1) / chunkSize < chunksPerSide ? (z1 - 1) / chunkSize : chunksPerSide - 1;
+		for (int cx = cx0; cx <= cx1; ++cx) {
+			for (int cz = cz0; cz <= cz1; ++cz) {
+				ScatterChunk& c = chunks[cx * chunksPerSide + cz];
+				stats.instances -= c.total;
+				placeChunk(cx * chunksPerSide + cz);
+				stats.instances += upload(c);
+			}
+		}
+	}
+
+	/*
+	 * Culls the chunks and picks the LODs for the next draw(). pixelScale
+	 * is the projected size of one world unit at distance one. hidden,
+	 * if given, is non-zero for the chunks out of sight.
+	 */
+	void select(const Frustum& frustum, const Vector& eye, float pixelScale, float distance,
+		    const unsigned char* hidden = NULL) {
+		long long start = getMicroseconds();
+		this->eye = eye;
+		stats.chunks = stats.culledChunks = stats.hiddenChunks = stats.triangles = 0;
+		for (int i = 0; i < LODS; ++i)
+			drawCount[i] = stats.lodInstances[i] = 0;
+
+		for (int i = 0; i < chunkCount; ++i) {
+			const ScatterChunk& c = chunks[i];
+			if (!c.total)
+				continue;
+			// Nearest point of the chunk
+			float d[3];
+			for (int j = 0; j < 3; ++j)
+				d[j] = eye[j] < c.min[j] ? c.min[j] - eye[j] : eye[j] > c.max[j] ? eye[j] - c.max[j] : 0;
+			float dist = sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+			if (dist > distance || !frustum.intersectsBox(c.min, c.max)) {
+				++stats.culledChunks;
+				continue;
+			}
+			if (hidden && hidden[i]) {
+				++stats.hiddenChunks;
+				continue;
+			}
+			++stats.chunks;
+			dist = dist > 1e-3f ? dist : 1e-3f;
+
+			for (int k = 0; k < kindCount; ++k) {
+				if (!c.count[k])
+					continue;
+				float pixels = kinds[k].maxScale * pixelScale / dist;
+				int lod = pixels > DETAIL_PIXELS ? 0 : pixels > COARSE_PIXELS ? 1 : IMPOSTOR;
+				Draw& draw = draws[lod][drawCount[lod]++];
+				draw.chunk = i;
+				draw.kind = k;
+				stats.lodInstances[lod] += c.count[k];
+				stats.triangles += c.count[k] * (lod == IMPOSTOR ? 2 : triangles[lod][k]);
+			}
+		}
+		stats.selectTime = (int)(getMicroseconds() - start);
+	}
+
+	/*
+	 * Draws what select() picked, lit by the sun
+	 */
+	void draw(const Vector& sun, float sunIntensity) {
+		stats.drawCalls = 0;
+		if (!meshProgram)
+			return;
+
+		driver->glUseProgram(meshProgram);
+		driver->glUniform3f(driver->glGetUniformLocation(meshProgram, "sun"), sun[0], sun[1], sun[2]);
+		driver->glUniform1f(driver->glGetUniformLocation(meshProgram, "sunIntensity"), sunIntensity);
+		driver->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+		for (int i = 0; i < 4; ++i)
+			driver->glEnableVertexAttribArray(i);
+		driver->glVertexAttribDivisor(3, 1);
+		for (int lod = 0; lod < MESH_LODS; ++lod) {
+			for (int k = 0; k < kindCount; ++k) {
+				const Mesh& m = meshes[lod][k];
+				bool bound = false;
+				for (int i = 0; i < drawCount[lod]; ++i) {
+					const Draw& d = draws[lod][i];
+					if (d.kind != k)
+						continue;
+					if (!bound) {
+						bindMesh(m);
+						bound = true;
+					}
+					drawInstances(chunks[d.chunk], k, 3, m.indexCount, m.indexOffset);
+				}
+			}
+		}
+		driver->glVertexAttribDivisor(3, 0);
+		for (int i = 0; i < 4; ++i)
+			driver->glDisableVertexAttribArray(i);
+
+		if (drawCount[IMPOSTOR]) {
+			driver->glUseProgram(impostorProgram);
+			driver->glUniform3f(driver->glGetUniformLocation(impostorProgram, "eye"), eye[0], eye[1], eye[2]);
+			// The bake has half the ambient light only, the sides of a
+			// round shape catch on average 1 / pi of the sun across them
+			float horizontal = sqrt(sun[0] * sun[0] + sun[2] * sun[2]);
+			driver->glUniform1f(driver->glGetUniformLocation(impostorProgram, "brightness"),
+					    2 * sunIntensity * (.5f + horizontal / M_PI));
+			driver->glUniform1i(driver->glGetUniformLocation(impostorProgram, "impostors"), 0);
+			GLint bounds = driver->glGetUniformLocation(impostorProgram, "bounds");
+			driver->glActiveTexture(GL_TEXTURE0);
+			driver->glBindTexture(GL_TEXTURE_2D, impostorTexture);
+			driver->glBindBuffer(GL_ARRAY_BUFFER, quadBuffer);
+			driver->glEnableVertexAttribArray(0);
+			driver->glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+			driver->glEnableVertexAttribArray(1);
+			driver->glVertexAttribDivisor(1, 1);
+			for (int k = 0; k < kindCount; ++k) {
+				driver->glUniform4f(bounds, radius[k], bottom[k], top[k] - bottom[k], (float)k / kindCount);
+				for (int i = 0; i < drawCount[IMPOSTOR]; ++i) {
+					const Draw& d = draws[IMPOSTOR][i];
+					if (d.kind == k)
+						drawInstances(chunks[d.chunk], k, 1, 6, quadIndexOffset);
+				}
+			}
+			driver->glVertexAttribDivisor(1, 0);
+			driver->glDisableVertexAttribArray(1);
+			driver->glDisableVertexAttribArray(0);
+			driver->glBindTexture(GL_TEXTURE_2D, 0);
+		}
+
+		driver->glBindBuffer(GL_ARRAY_BUFFER, 0);
+		driver->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+		driver->glUseProgram(0);
+	}
+
+	const ScatterStats& getFrameStats() const {
+		return stats;
+	}
+
+private:
+
+	struct ScatterChunk {
+		GLuint buffer;
+		int    offset[MAX_KINDS], count[MAX_KINDS];
+		int    total;
+		Vector min, max;
+		// x, y, z and scale of each instance, until the upload
+		float* instances;
+	};
+
+	struct Mesh {
+		int vertexOffset;
+		int indexOffset;
+		int indexCount;
+	};
+
+	struct MeshVertex {
+		float         position[3];
+		float         normal[3];
+		unsigned char color[4];
+	};
+
+	struct Draw {
+		int chunk;
+		int kind;
+	};
+
+	static unsigned hash(unsigned h) {
+		h ^= h >> 16;
+		h *= 0x7feb352d;
+		h ^= h >> 15;
+		h *= 0x846ca68b;
+		h ^= h >> 16;
+		return h;
+	}
+
+	static float unit(unsigned h) {
+		return (h >> 8) * (1.f / 16777216);
+	}
+
+	static bool accepts(const ScatterKind& kind, float h, float slopeX, float slopeZ) {
+		float slope = sqrt(slopeX * slopeX + slopeZ * slopeZ);
+		return h >= kind.minHeight && h <= kind.maxHeight && slope >= kind.minSlope && slope <= kind.maxSlope;
+	}
+
+	static void placeChunks(void* data, int begin, int end) {
+		ObjectScatter* self = (ObjectScatter*)data;
+		for (int i = begin; i < end; ++i)
+			self->placeChunk(i);
+	}
+
+	void placeChunk(int index) {
+		ScatterChunk& c = chunks[index];
+		int x0 = index / chunksPerSide * chunkSize, z0 = index % chunksPerSide * chunkSize;
+		int w = x0 + chunkSize < size - 1 ? chunkSize : size - 1 - x0;
+		int d = z0 + chunkSize < size - 1 ? chunkSize : size - 1 - z0;
+
+		int candidates[MAX_KINDS], total = 0;
+		for (int k = 0; k < kindCount; ++k) {
+			candidates[k] = (int)(density[k] * w * d + .5f);
+			total += candidates[k];
+		}
+		delete[] c.instances;
+		c.instances = new float[4 * total];
+		c.min = Vector(1e30, 1e30, 1e30);
+		c.max = Vector(-1e30, -1e30, -1e30);
+
+		float* out = c.instances;
+		int placed = 0;
+		for (int k = 0; k < kindCount; ++k) {
+			const ScatterKind& kind = kinds[k];
+			c.offset[k] = placed;
+			unsigned seed = hash(hash(index) + k);
+			for (int i = 0; i < candidates[k]; ++i) {
+				unsigned h0 = hash(seed + i), h1 = hash(h0), h2 = hash(h1);
+				float x = (x0 + unit(h0) * w) * scale, z = (z0 + unit(h1) * d) * scale;
+				float slopeX, slopeZ;
+				float y = ground->sample(x, z, &slopeX, &slopeZ);
+				if (!accepts(kind, y, slopeX, slopeZ))
+					continue;
+				float s = kind.minScale + unit(h2) * (kind.maxScale - kind.minScale);
+				// Sunk so the base does not float on the slope
+				y -= kind.rings[0].radius * s * (fabs(slopeX) + fabs(slopeZ));
+				*out++ = x;
+				*out++ = y;
+				*out++ = z;
+				*out++ = s;
+				Vector lo(x - radius[k] * s, y + bottom[k] * s, z - radius[k] * s);
+				Vector hi(x + radius[k] * s, y + top[k] * s, z + radius[k] * s);
+				for (int j = 0; j < 3; ++j) {
+					c.min[j] = lo[j] < c.min[j] ? lo[j] : c.min[j];
+					c.max[j] = hi[j] > c.max[j] ? hi[j] : c.max[j];
+				}
+				++placed;
+			}
+			c.count[k] = placed - c.offset[k];
+		}
+		c.total = placed;
+	}
+
+	/*
+	 * Moves the instances of a chunk to its buffer, returns their number
+	 */
+	int upload(ScatterChunk& c) {
+		if (meshProgram) {
+			if (!c.buffer)
+				driver->glGenBuffers(1, &c.buffer);
+			driver->glBindBuffer(GL_ARRAY_BUFFER, c.buffer);
+			driver->glBufferData(GL_ARRAY_BUFFER, 4 * c.total * sizeof (float), c.instances, GL_STATIC_DRAW);
+			driver->glBindBuffer(GL_ARRAY_BUFFER, 0);
+		}
+		delete[] c.instances;
+		c.instances = NULL;
+		return c.total;
+	}
+
+	void bindMesh(const Mesh& m) {
+		const char* base = (const char*)0 + m.vertexOffset;
+		driver->glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+		driver->glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof (MeshVertex), base);
+		driver->glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof (MeshVertex),
+					      base + offsetof(MeshVertex, normal));
+		driver->glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof (MeshVertex),
+					      base + offsetof(MeshVertex, color));
+	}
+
+	void drawInstances(const ScatterChunk& c, int kind, int attribute, int indexCount, int indexOffset) {
+		driver->glBindBuffer(GL_ARRAY_BUFFER, c.buffer);
+		driver->glVertexAttribPointer(attribute, 4, GL_FLOAT, GL_FALSE, 0,
+					      (const char*)0 + c.offset[kind] * 4 * sizeof (float));
+		driver->glDrawElementsInstanced(GL_TRIANGLES, indexCount, GL_UNSIGNED_SHORT,
+						(const char*)0 + indexOffset, c.count[kind]);
+		++stats.drawCalls;
+	}
+
+	void initPrograms() {
+		static const char* meshVertexSource =
+			"#version 130\n"
+			"uniform vec3 sun;\n"
+			"uniform float sunIntensity;\n"
+			"in vec3 meshPosition;\n"
+			"in vec3 meshNormal;\n"
+			"in vec4 meshColor;\n"
+			"in vec4 instance;\n"
+			"out vec3 color;\n"
+			"void main() {\n"
+			"	float yaw = fract(sin(dot(instance.xz, vec2(12.9898, 78.233))) * 43758.547) * 6.2831853;\n"
+			"	mat2 r = mat2(cos(yaw), sin(yaw), -sin(yaw), cos(yaw));\n"
+			"	vec3 p = vec3(r * meshPosition.xz, meshPosition.y).xzy;\n"
+			"	vec3 n = vec3(r * meshNormal.xz, meshNormal.y).xzy;\n"
+			"	color = meshColor.rgb * (.5 + max(dot(n, sun), 0.)) * sunIntensity;\n"
+			"	gl_Position = gl_ModelViewProjectionMatrix * vec4(instance.xyz + p * instance.w, 1.);\n"
+			"}\n";
+		static const char* meshFragmentSource =
+			"#version 130\n"
+			"in vec3 color;\n"
+			"void main() {\n"
+			"	gl_FragColor = vec4(color, 1.);\n"
+			"}\n";
+		// Turns around y to face the eye
+		static const char* impostorVertexSource =
+			"#version 130\n"
+			"uniform vec3 eye;\n"
+			"uniform vec4 bounds;\n"
+			"in vec2 corner;\n"
+			"in vec4 instance;\n"
+			"out vec2 uv;\n"
+			"void main() {\n"
+			"	vec2 d = normalize(eye.xz - instance.xz);\n"
+			"	vec3 right = vec3(d.y, 0., -d.x);\n"
+			"	vec3 p = right * corner.x * bounds.x + vec3(0., bounds.y + corner.y * bounds.z, 0.);\n"
+			"	uv = vec2(bounds.w + (corner.x * .5 + .5) / KINDS, corner.y);\n"
+			"	gl_Position = gl_ModelViewProjectionMatrix * vec4(instance.xyz + p * instance.w, 1.);\n"
+			"}\n";
+		static const char* impostorFragmentSource =
+			"#version 130\n"
+			"uniform sampler2D impostors;\n"
+			"uniform float brightness;\n"
+			"in vec2 uv;\n"
+			"void main() {\n"
+			"	vec4 c = texture(impostors, uv);\n"
+			"	if (c.a < .5)\n"
+			"		discard;\n"
+			"	gl_FragColor = vec4(c.rgb * brightness, 1.);\n"
+			"}\n";
+		static const char* meshAttributes[] = { "meshPosition", "meshNormal", "meshColor", "instance", NULL };
+		static const char* impostorAttributes[] = { "corner", "instance", NULL };
+
+		meshProgram = linkProgram(meshVertexSource, meshFragmentSource, meshAttributes);
+		char source[2048];
+		snprintf(source, sizeof (source), "#version 130\n#define KINDS %d.\n%s", kindCount,
+			 impostorVertexSource + strlen("#version 130\n"));
+		impostorProgram = linkProgram(source, impostorFragmentSource, impostorAttributes);
+	}
+
+	/*
+	 * Lathes the rings of every kind at both LODs into one vertex and
+	 * one index buffer, followed by the impostor quad
+	 */
+	void initMeshes() {
+		int vertexCount = 0, indexCount = 0;
+		for (int lod = 0; lod < MESH_LODS; ++lod) {
+			for (int k = 0; k < kindCount; ++k) {
+				vertexCount += 2 * kinds[k].sides[lod] * (kinds[k].ringCount - 1);
+				indexCount += 6 * kinds[k].sides[lod] * (kinds[k].ringCount - 1);
+			}
+		}
+		MeshVertex* vertices = new MeshVertex[vertexCount];
+		GLushort* indices = new GLushort[indexCount + 6];
+		MeshVertex* v = vertices;
+		GLushort* index = indices;
+
+		for (int lod = 0; lod < MESH_LODS; ++lod) {
+			for (int k = 0; k < kindCount; ++k) {
+				const ScatterKind& kind = kinds[k];
+				int sides = kind.sides[lod];
+				Mesh& m = meshes[lod][k];
+				m.vertexOffset = (v - vertices) * sizeof (MeshVertex);
+				m.indexOffset = (index - indices) * sizeof (GLushort);
+				MeshVertex* first = v;
+				for (int s = 0; s + 1 < kind.ringCount; ++s) {
+					const LatheRing& a = kind.rings[s];
+					const LatheRing& b = kind.rings[s + 1];
+					// Outward normal of the profile of the segment
+					float dy = b.y - a.y, dr = b.radius - a.radius;
+					float length = sqrt(dy * dy + dr * dr);
+					float ny = -dr / length, nr = dy / length;
+					int base = v - first;
+					for (int j = 0; j < sides; ++j) {
+						float angle = 2 * M_PI * j / sides;
+						float c = cos(angle), sn = sin(angle);
+						for (int e = 0; e < 2; ++e) {
+							const LatheRing& r = e ? b : a;
+							v->position[0] = r.radius * c;
+							v->position[1] = r.y;
+							v->position[2] = r.radius * sn;
+							v->normal[0] = nr * c;
+							v->normal[1] = ny;
+							v->normal[2] = nr * sn;
+							memcpy(v->color, a.color, 3);
+							v->color[3] = 255;
+							++v;
+						}
+						int i0 = base + 2 * j, k0 = base + 2 * ((j + 1) % sides);
+						*index++ = i0;
+						*index++ = i0 + 1;
+						*index++ = k0;
+						*index++ = k0;
+						*index++ = i0 + 1;
+						*index++ = k0 + 1;
+					}
+				}
+				m.indexCount = index - indices - m.indexOffset / (int)sizeof (GLushort);
+			}
+		}
+		quadIndexOffset = (index - indices) * sizeof (GLushort);
+		static const GLushort quad[] = { 0, 1, 2, 0, 2, 3 };
+		memcpy(index, quad, sizeof (quad));
+
+		driver->glGenBuffers(1, &vertexBuffer);
+		driver->glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+		driver->glBufferData(GL_ARRAY_BUFFER, vertexCount * sizeof (MeshVertex), vertices, GL_STATIC_DRAW);
+		static const float corners[] = { -1, 0, 1, 0, 1, 1, -1, 1 };
+		driver->glGenBuffers(1, &quadBuffer);
+		driver->glBindBuffer(GL_ARRAY_BUFFER, quadBuffer);
+		driver->glBufferData(GL_ARRAY_BUFFER, sizeof (corners), corners, GL_STATIC_DRAW);
+		driver->glBindBuffer(GL_ARRAY_BUFFER, 0);
+		driver->glGenBuffers(1, &indexBuffer);
+		driver->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+		driver->glBufferData(GL_ELEMENT_ARRAY_BUFFER, (indexCount + 6) * sizeof (GLushort), indices,
+				     GL_STATIC_DRAW);
+		driver->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+		delete[] vertices;
+		delete[] indices;
+	}
+
+	/*
+	 * Renders the detail mesh of every kind from the side into its part
+	 * of the impostor texture, with the ambient light only. The shapes
+	 * are round, one view serves all directions.
+	 */
+	void bakeImpostors() {
+		driver->glGenTextures(1, &impostorTexture);
+		driver->glBindTexture(GL_TEXTURE_2D, impostorTexture);
+		driver->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		driver->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		driver->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		driver->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		driver->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, IMPOSTOR_SIZE * kindCount, IMPOSTOR_SIZE, 0,
+				     GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+		GLuint framebuffer, depth;
+		driver->glGenRenderbuffers(1, &depth);
+		driver->glBindRenderbuffer(GL_RENDERBUFFER, depth);
+		driver->glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, IMPOSTOR_SIZE * kindCount,
+					      IMPOSTOR_SIZE);
+		driver->glBindRenderbuffer(GL_RENDERBUFFER, 0);
+		driver->glGenFramebuffers(1, &framebuffer);
+		driver->glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		driver->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, impostorTexture, 0);
+		driver->glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+		if (driver->glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE) {
+			GLint viewport[4];
+			driver->glGetIntegerv(GL_VIEWPORT, viewport);
+			// The lathe meshes overlap themselves, baking may run before the depth test is on
+			GLboolean depthTest = driver->glIsEnabled(GL_DEPTH_TEST);
+			driver->glEnable(GL_DEPTH_TEST);
+			driver->glClearColor(0, 0, 0, 0);
+			driver->glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			driver->glUseProgram(meshProgram);
+			driver->glUniform3f(driver->glGetUniformLocation(meshProgram, "sun"), 0, 0, 0);
+			driver->glUniform1f(driver->glGetUniformLocation(meshProgram, "sunIntensity"), 1);
+			driver->glVertexAttrib4f(3, 0, 0, 0, 1);
+			driver->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+			for (int i = 0; i < 3; ++i)
+				driver->glEnableVertexAttribArray(i);
+			driver->glMatrixMode(GL_MODELVIEW);
+			driver->glLoadIdentity();
+			driver->glMatrixMode(GL_PROJECTION);
+			for (int k = 0; k < kindCount; ++k) {
+				float r = radius[k], b = bottom[k], t = top[k];
+				Matrix ortho(1 / r, 0,           0,      0,
+					     0,     2 / (t - b), 0,      -(t + b) / (t - b),
+					     0,     0,           -1 / r, 0,
+					     0,     0,           0,      1);
+				driver->glLoadMatrixf(ortho);
+				driver->glViewport(k * IMPOSTOR_SIZE, 0, IMPOSTOR_SIZE, IMPOSTOR_SIZE);
+				const Mesh& m = meshes[0][k];
+				bindMesh(m);
+				driver->glDrawElements(GL_TRIANGLES, m.indexCount, GL_UNSIGNED_SHORT,
+						       (const char*)0 + m.indexOffset);
+			}
+			for (int i = 0; i < 3; ++i)
+				driver->glDisableVertexAttribArray(i);
+			driver->glBindBuffer(GL_ARRAY_BUFFER, 0);
+			driver->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+			driver->glUseProgram(0);
+			driver->glMatrixMode(GL_MODELVIEW);
+			driver->glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+			if (!depthTest)
+				driver->glDisable(GL_DEPTH_TEST);
+		} else {
+			fprintf(stderr, "Impostor framebuffer is incomplete\n");
+		}
+		driver->glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		driver->glDeleteFramebuffers(1, &framebuffer);
+		driver->glDeleteRenderbuffers(1, &depth);
+		driver->glGenerateMipmap(GL_TEXTURE_2D);
+		driver->glBindTexture(GL_TEXTURE_2D, 0);
+	}
+
+	const HeightSampler* ground;
+	int                  size, chunkSize, chunksPerSide, chunkCount;
+	float                scale;
+	ScatterKind          kinds[MAX_KINDS];
+	int                  kindCount;
+	// Candidates per grid cell
+	float                density[MAX_KINDS];
+	// Extents of the shapes in units of the object height
+	float                radius[MAX_KINDS], bottom[MAX_KINDS], top[MAX_KINDS];
+	int                  triangles[MESH_LODS][MAX_KINDS];
+	int                  target;
+	long long            placeTime;
+	ScatterChunk*        chunks;
+	Draw*                draws[LODS];
+	int                  drawCount[LODS];
+	Vector               eye;
+	GLuint               meshProgram, impostorProgram;
+	GLuint               vertexBuffer, indexBuffer, quadBuffer, impostorTexture;
+	Mesh                 meshes[MESH_LODS][MAX_KINDS];
+	int                  quadIndexOffset;
+	ScatterStats         stats;
+};
+
+#endif
@@ -0,0 +1,250 @@
+#ifndef _OCCLUSION_BUFFER_H
+#define _OCCLUSION_BUFFER_H
+
+#include <math.h>
+#include "Matrix.h"
+#include "Simd.h"
+
+/*
+ * Low resolution software depth buffer for occlusion culling.
+ *
+ * Occluder meshes are transformed and rasterized on the CPU, four
+ * pixels at a time, keeping the nearest depth per pixel. finish() builds
+ * a pyramid where every texel holds the farthest depth of the four texels
+ * below it, so a box can be tested against a handful of texels at the
+ * level that matches its screen size.
+ *
+ * Occluders have to lie inside opaque geometry, e.g. terrain below the
+ * actual surface. Depth is window depth in [0, 1].
+ */
+class OcclusionBuffer {
+public:
+
+	enum {
+		WIDTH = 256,
+		HEIGHT = 128,
+		LEVELS = 8,
+		MAX_VERTICES = 1024,
+	};
+
+	OcclusionBuffer() : triangles(0) {
+		int offset = 0;
+		for (int l = 0; l < LEVELS; ++l) {
+			level[l] = pyramid + offset;
+			offset += (WIDTH >> l) * (HEIGHT >> l);
+		}
+	}
+
+	void begin(const Matrix& clip) {
+		this->clip = clip;
+		triangles = 0;
+		Float4 far(1);
+		for (int i = 0; i < WIDTH * HEIGHT; i += 4)
+			far.storeUnaligned(pyramid + i);
+	}
+
+	/*
+	 * Draws an indexed triangle mesh given as separate coordinate arrays.
+	 * The arrays are read in groups of four, so they must be padded to a
+	 * multiple of four.
+	 */
+	void drawMesh(const float* x, const float* y, const float* z, int vertexCount,
+		      const unsigned short* indices, int triangleCount) {
+		Float4 m[16];
+		for (int i = 0; i < 16; ++i)
+			m[i] = Float4(clip(i & 3, i >> 2));
+
+		for (int i = 0; i < vertexCount; i += 4) {
+			Float4 px = Float4::loadUnaligned(x + i);
+			Float4 py = Float4::loadUnaligned(y + i);
+			Float4 pz = Float4::loadUnaligned(z + i);
+			(m[0] * px + m[4] * py + m[8]  * pz + m[12]).storeUnaligned(cx + i);
+			(m[1] * px + m[5] * py + m[9]  * pz + m[13]).storeUnaligned(cy + i);
+			(m[2] * px + m[6] * py + m[10] * pz + m[14]).storeUnaligned(cz + i);
+			(m[3] * px + m[7] * py + m[11] * pz + m[15]).storeUnaligned(cw + i);
+		}
+
+		for (int i = 0; i < triangleCount; ++i, indices += 3)
+			clipTriangle(indices[0], indices[1], indices[2]);
+	}
+
+	void finish() {
+		for (int l = 1; l < LEVELS; ++l) {
+			int w = WIDTH >> l, h = HEIGHT >> l;
+			const float* src = level[l - 1];
+			float* dst = level[l];
+			for (int y = 0; y < h; ++y) {
+				const float* a = src + 2 * y * 2 * w;
+				const float* b = a + 2 * w;
+				for (int x = 0; x < w; ++x) {
+					float m0 = a[2*x] > a[2*x+1] ? a[2*x] : a[2*x+1];
+					float m1 = b[2*x] > b[2*x+1] ? b[2*x] : b[2*x+1];
+					dst[y * w + x] = m0 > m1 ? m0 : m1;
+				}
+			}
+		}
+	}
+
+	/*
+	 * True if the box is behind the occluders everywhere on screen
+	 */
+	bool isOccluded(const Vector& min, const Vector& max) const {
+		float x0 = WIDTH, x1 = 0, y0 = HEIGHT, y1 = 0, depth = 1;
+		for (int i = 0; i < 8; ++i) {
+			float px = i & 1 ? max[0] : min[0];
+			float py = i & 2 ? max[1] : min[1];
+			float pz = i & 4 ? max[2] : min[2];
+			float x = clip(0,0) * px + clip(0,1) * py + clip(0,2) * pz + clip(0,3);
+			float y = clip(1,0) * px + clip(1,1) * py + clip(1,2) * pz + clip(1,3);
+			float z = clip(2,0) * px + clip(2,1) * py + clip(2,2) * pz + clip(2,3);
+			float w = clip(3,0) * px + clip(3,1) * py + clip(3,2) * pz + clip(3,3);
+			// Crossing the near plane
+			if (z < -w)
+				return false;
+			x = (x / w + 1) * WIDTH / 2;
+			y = (y / w + 1) * HEIGHT / 2;
+			z = (z / w + 1) / 2;
+			if (x < x0) x0 = x;
+			if (x > x1) x1 = x;
+			if (y < y0) y0 = y;
+			if (y > y1) y1 = y;
+			if (z < depth) depth = z;
+		}
+
+		int ix0 = x0 < 0 ? 0 : (int)x0;
+		int iy0 = y0 < 0 ? 0 : (int)y0;
+		int ix1 = x1 >= WIDTH ? WIDTH - 1 : (int)x1;
+		int iy1 = y1 >= HEIGHT ? HEIGHT - 1 : (int)y1;
+		if (ix0 > ix1 || iy0 > iy1)
+			return false;
+
+		// Coarsest level where the box covers at most two texels per axis
+		int l = 0;
+		while (l < LEVELS - 1 && ((ix1 >> l) - (ix0 >> l) > 1 || (iy1 >> l) - (iy0 >> l) > 1))
+			++l;
+
+		int w = WIDTH >> l;
+		for (int y = iy0 >> l; y <= iy1 >> l; ++y) {
+			for (int x = ix0 >> l; x <= ix1 >> l; ++x) {
+				if (level[l][y * w + x] >= depth)
+					return false;
+			}
+		}
+		return true;
+	}
+
+	int getTriangleCount() const {
+		return triangles;
+	}
+
+	// Depth of a pixel at level 0
+	float getDepth(int x, int y) const {
+		return pyramid[y * WIDTH + x];
+	}
+
+private:
+
+	/*
+	 * Clips a triangle in clip space against the near plane z = -w,
+	 * which yields up to two triangles
+	 */
+	void clipTriangle(int i0, int i1, int i2) {
+		int index[3] = { i0, i1, i2 };
+		float d[3];
+		int inside = 0;
+		for (int i = 0; i < 3; ++i) {
+			d[i] = cz[index[i]] + cw[index[i]];
+			if (d[i] >= 0)
+				++inside;
+		}
+		if (inside == 0)
+			return;
+
+		float v[4][4];
+		int n = 0;
+		for (int i = 0; i < 3; ++i) {
+			int a = index[i], b = index[(i + 1) % 3];
+			float da = d[i], db = d[(i + 1) % 3];
+			if (da >= 0)
+				toScreen(v[n++], cx[a], cy[a], cz[a], cw[a]);
+			if ((da >= 0) != (db >= 0)) {
+				float t = da / (da - db);
+				toScreen(v[n++], cx[a] + t * (cx[b] - cx[a]), cy[a] + t * (cy[b] - cy[a]),
+					 cz[a] + t * (cz[b] - cz[a]), cw[a] + t * (cw[b] - cw[a]));
+			}
+		}
+
+		rasterize(v[0], v[1], v[2]);
+		if (n == 4)
+			rasterize(v[0], v[2], v[3]);
+	}
+
+	static void toScreen(float* v, float x, float y, float z, float w) {
+		v[0] = (x / w + 1) * WIDTH / 2;
+		v[1] = (y / w + 1) * HEIGHT / 2;
+		v[2] = (z / w + 1) / 2;
+	}
+
+	void rasterize(const float* v0, const float* v1, const float* v2) {
+		float area = (v1[0] - v0[0]) * (v2[1] - v0[1]) - (v2[0] - v0[0]) * (v1[1] - v0[1]);
+		if (fabs(area) < 1e-6)
+			return;
+		if (area < 0) {
+			const float* t = v1;
+			v1 = v2;
+			v2 = t;
+			area = -area;
+		}
+
+		float fx0 = v0[0] < v1[0] ? (v0[0] < v2[0] ? v0[0] : v2[0]) : (v1[0] < v2[0] ? v1[0] : v2[0]);
+		float fx1 = v0[0] > v1[0] ? (v0[0] > v2[0] ? v0[0] : v2[0]) : (v1[0] > v2[0] ? v1[0] : v2[0]);
+		float fy0 = v0[1] < v1[1] ? (v0[1] < v2[1] ? v0[1] : v2[1]) : (v1[1] < v2[1] ? v1[1] : v2[1]);
+		float fy1 = v0[1] > v1[1] ? (v0[1] > v2[1] ? v0[1] : v2[1]) : (v1[1] > v2[1] ? v1[1] : v2[1]);
+		int x0 = fx0 < 0 ? 0 : (int)fx0 & ~3;
+		int x1 = fx1 >= WIDTH ? WIDTH - 1 : (int)fx1;
+		int y0 = fy0 < 0 ? 0 : (int)fy0;
+		int y1 = fy1 >= HEIGHT ? HEIGHT - 1 : (int)fy1;
+		if (x0 > x1 || y0 > y1)
+			return;
+		++triangles;
+
+		// Edge functions, positive inside, as a + b * x + c * y
+		float a0 = v1[0] * v2[1] - v2[0] * v1[1], b0 = v1[1] - v2[1], c0 = v2[0] - v1[0];
+		float a1 = v2[0] * v0[1] - v0[0] * v2[1], b1 = v2[1] - v0[1], c1 = v0[0] - v2[0];
+		float a2 = v0[0] * v1[1] - v1[0] * v0[1], b2 = v0[1] - v1[1], c2 = v1[0] - v0[0];
+
+		// Depth as a plane over the barycentric coordinates of v1 and v2
+		float dz1 = (v1[2] - v0[2]) / area, dz2 = (v2[2] - v0[2]) / area;
+
+		Float4 px = Float4(x0 + .5f, x0 + 1.5f, x0 + 2.5f, x0 + 3.5f);
+		Float4 zero(0);
+		for (int y = y0; y <= y1; ++y) {
+			float py = y + .5f;
+			Float4 e0 = Float4(a0 + c0 * py) + Float4(b0) * px;
+			Float4 e1 = Float4(a1 + c1 * py) + Float4(b1) * px;
+			Float4 e2 = Float4(a2 + c2 * py) + Float4(b2) * px;
+			Float4 step0(4 * b0), step1(4 * b1), step2(4 * b2);
+			float* row = pyramid + y * WIDTH;
+
+			for (int x = x0; x <= x1; x += 4) {
+				Float4 inside = (e0 >= zero) & (e1 >= zero) & (e2 >= zero);
+				if (mask(inside)) {
+					Float4 depth = Float4(v0[2]) + e1 * Float4(dz1) + e2 * Float4(dz2);
+					Float4 old = Float4::loadUnaligned(row + x);
+					select(inside, min(depth, old), old).storeUnaligned(row + x);
+				}
+				e0 = e0 + step0;
+				e1 = e1 + step1;
+				e2 = e2 + step2;
+			}
+		}
+	}
+
+	Matrix clip;
+	int    triangles;
+	float  cx[MAX_VERTICES], cy[MAX_VERTICES], cz[MAX_VERTICES], cw[MAX_VERTICES];
+	float  pyramid[WIDTH * HEIGHT * 4 / 3];
+	float* level[LEVELS];
+};
+
+#endif
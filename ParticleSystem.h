@@ -0,0 +1,443 @@
+#ifndef _PARTICLE_SYSTEM_H
+#define _PARTICLE_SYSTEM_H
+
+#include <math.h>
+#include <string.h>
+#include <stddef.h>
+#include "GLDriver.h"
+#include "Shader.h"
+#include "Simd.h"
+#include "StreamBuffer.h"
+#include "HeightSampler.h"
+#include "Timer.h"
+#include "Vector.h"
+#include "WorkerPool.h"
+
+/*
+ * How the particles of one system move and look. Velocities relax
+ * towards the wind by drag per second and gravity accelerates along y.
+ * A particle that falls below the ground is put back on it, its speed
+ * along y reflected and scaled by restitution and its speed along the
+ * ground by friction. With a negative restitution it dies instead.
+ */
+struct ParticleKind {
+	float gravity;
+	float drag;
+	float restitution;
+	float friction;
+	// Seconds a particle lives, and its size in world units
+	float life;
+	float size;
+	float color[4];
+};
+
+/*
+ * Box new particles appear in, with y above the ground if grounded,
+ * and their velocity with a random part of up to spread on each axis
+ */
+struct ParticleEmitter {
+	Vector min, max;
+	bool   grounded;
+	Vector velocity;
+	float  spread;
+};
+
+/*
+ * Per frame statistics of a particle system
+ */
+struct ParticleStats {
+	int particles;
+	int spawned;
+	int died;
+	int groundHits;
+	int updateTime;
+	int streamBytes;
+};
+
+/*
+ * Particles of one kind, stored as one array per component so the
+ * update works on four particles at once.
+ *
+ * The particles are split into blocks of BLOCK that the worker pool
+ * updates in parallel. A block integrates its particles, collides them
+ * with the heights of the sampler and ages them, then swap-removes the
+ * dead ones within itself and writes the survivors' vertices at its
+ * own place in the mapped stream buffer. Afterwards the holes at the
+ * block ends are filled with particles from the last blocks, which
+ * moves about as many particles as died. The frame draws the blocks'
+ * vertex ranges as point sprites with one multi-draw.
+ *
+ * The particles are not sorted, they are faint and blended so the
+ * order hardly shows.
+ */
+class ParticleSystem {
+public:
+
+	enum {
+		BLOCK = 4096,
+		STREAM_FRAMES = 3,
+	};
+
+	ParticleSystem(const ParticleKind& kind, int capacity, const HeightSampler* ground)
+		: kind(kind), ground(ground), count(0), seed(1), program(0), stream(NULL), vertexOffset(0) {
+		memset(&stats, 0, sizeof (stats));
+		memset(&frameStats, 0, sizeof (frameStats));
+		// Vectors may run past the last particle
+		this->capacity = (capacity + 3) & ~3;
+		for (int i = 0; i < COMPONENTS; ++i) {
+			component[i] = new float[this->capacity];
+			memset(component[i], 0, this->capacity * sizeof (float));
+		}
+		blocks = (this->capacity + BLOCK - 1) / BLOCK;
+		live = new int[blocks];
+		hits = new int[blocks];
+		firsts = new GLint[blocks];
+		counts = new GLsizei[blocks];
+		drawCount = 0;
+	}
+
+	~ParticleSystem() {
+		for (int i = 0; i < COMPONENTS; ++i)
+			delete[] component[i];
+		delete[] live;
+		delete[] hits;
+		delete[] firsts;
+		delete[] counts;
+		delete stream;
+		if (program)
+			driver->glDeleteProgram(program);
+	}
+
+	/*
+	 * Creates the GL objects, the particles can be updated without them
+	 */
+	void initGL() {
+		static const char* vertexSource =
+			"#version 130\n"
+			"uniform float pointScale;\n"
+			"in vec3 particlePosition;\n"
+			"in vec4 particleColor;\n"
+			"out vec4 color;\n"
+			"void main() {\n"
+			"	vec4 position = gl_ModelViewMatrix * vec4(particlePosition, 1.);\n"
+			"	color = particleColor;\n"
+			"	gl_PointSize = max(pointScale / -position.z, 1.);\n"
+			"	gl_Position = gl_ProjectionMatrix * position;\n"
+			"}\n";
+		static const char* fragmentSource =
+			"#version 130\n"
+			"uniform float brightness;\n"
+			"in vec4 color;\n"
+			"void main() {\n"
+			"	vec2 p = gl_PointCoord * 2. - 1.;\n"
+			"	float a = 1. - dot(p, p);\n"
+			"	if (a <= 0.)\n"
+			"		discard;\n"
+			"	gl_FragColor = vec4(color.rgb * brightness, color.a * a);\n"
+			"}\n";
+		static const char* attributes[] = { "particlePosition", "particleColor", NULL };
+
+		if (!hasGLExtension("GL_ARB_point_sprite"))
+			return;
+		stream = new StreamBuffer(GL_ARRAY_BUFFER, STREAM_FRAMES * capacity * sizeof (Vertex));
+		if (!stream->isAvailable())
+			return;
+		program = linkProgram(vertexSource, fragmentSource, attributes);
+	}
+
+	bool isAvailable() const {
+		return program != 0;
+	}
+
+	int getCount() const {
+		return count;
+	}
+
+	int getCapacity() const {
+		return capacity;
+	}
+
+	const ParticleKind& getKind() const {
+		return kind;
+	}
+
+	void clear() {
+		count = 0;
+		drawCount = 0;
+	}
+
+	/*
+	 * Adds up to n particles, returns how many fit
+	 */
+	int emit(const ParticleEmitter& e, int n) {
+		if (n > capacity - count)
+			n = capacity - count;
+		float* x = component[X];
+		float* y = component[Y];
+		float* z = component[Z];
+		for (int i = count; i < count + n; ++i) {
+			x[i] = e.min[0] + uniform() * (e.max[0] - e.min[0]);
+			y[i] = e.min[1] + uniform() * (e.max[1] - e.min[1]);
+			z[i] = e.min[2] + uniform() * (e.max[2] - e.min[2]);
+			if (e.grounded)
+				y[i] += ground->sample(x[i], z[i]);
+			component[VX][i] = e.velocity[0] + (2 * uniform() - 1) * e.spread;
+			component[VY][i] = e.velocity[1] + (2 * uniform() - 1) * e.spread;
+			component[VZ][i] = e.velocity[2] + (2 * uniform() - 1) * e.spread;
+			// Spread out so a burst does not die all at once
+			component[LIFE][i] = kind.life * (.5f + uniform());
+		}
+		count += n;
+		stats.spawned += n;
+		return n;
+	}
+
+	/*
+	 * Advances the particles by dt seconds, split across the pool if
+	 * there is one. With render the vertices of the survivors are
+	 * streamed for the next draw().
+	 */
+	void update(float dt, const Vector& wind, WorkerPool* pool, bool render = false) {
+		long long start = getMicroseconds();
+		int previous = count;
+		int blockCount = (count + BLOCK - 1) / BLOCK;
+
+		UpdateJob job = { this, dt, wind, NULL };
+		int offset = 0;
+		if (render && program && count) {
+			job.vertices = (Vertex*)stream->map(count * sizeof (Vertex), offset);
+			vertexOffset = offset;
+		}
+		if (pool)
+			pool->run(updateBlocks, &job, blockCount, 1);
+		else
+			updateBlocks(&job, 0, blockCount);
+		if (job.vertices)
+			stream->unmap();
+
+		drawCount = 0;
+		stats.groundHits = 0;
+		for (int b = 0; b < blockCount; ++b) {
+			stats.groundHits += hits[b];
+			if (job.vertices && live[b]) {
+				firsts[drawCount] = b * BLOCK;
+				counts[drawCount++] = live[b];
+			}
+		}
+		compact(blockCount);
+
+		stats.died = previous - count;
+		stats.particles = count;
+		stats.streamBytes = job.vertices ? previous * sizeof (Vertex) : 0;
+		stats.updateTime = (int)(getMicroseconds() - start);
+	}
+
+	/*
+	 * Draws the vertices of the last update. pixelScale is the projected
+	 * size of one world unit at distance one.
+	 */
+	void draw(float pixelScale, float brightness) {
+		if (!program || !drawCount)
+			return;
+		driver->glUseProgram(program);
+		driver->glUniform1f(driver->glGetUniformLocation(program, "pointScale"), kind.size * pixelScale);
+		driver->glUniform1f(driver->glGetUniformLocation(program, "brightness"), brightness);
+		driver->glEnable(GL_VERTEX_PROGRAM_POINT_SIZE);
+		driver->glEnable(GL_POINT_SPRITE);
+		driver->glEnable(GL_BLEND);
+		driver->glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		driver->glDepthMask(GL_FALSE);
+
+		stream->bind();
+		const char* base = (const char*)0 + vertexOffset;
+		driver->glEnableVertexAttribArray(0);
+		driver->glEnableVertexAttribArray(1);
+		driver->glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof (Vertex), base);
+		driver->glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof (Vertex),
+					      base + offsetof(Vertex, color));
+		driver->glMultiDrawArrays(GL_POINTS, firsts, counts, drawCount);
+		driver->glDisableVertexAttribArray(1);
+		driver->glDisableVertexAttribArray(0);
+		driver->glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+		driver->glDepthMask(GL_TRUE);
+		driver->glDisable(GL_BLEND);
+		driver->glDisable(GL_POINT_SPRITE);
+		driver->glDisable(GL_VERTEX_PROGRAM_POINT_SIZE);
+		driver->glUseProgram(0);
+	}
+
+	/*
+	 * Closes the statistics of the frame
+	 */
+	void endFrame() {
+		frameStats = stats;
+		memset(&stats, 0, sizeof (stats));
+		if (stream && stream->isAvailable())
+			stream->endFrame();
+	}
+
+	const ParticleStats& getFrameStats() const {
+		return frameStats;
+	}
+
+private:
+
+	enum Component {
+		X, Y, Z,
+		VX, VY, VZ,
+		LIFE,
+		COMPONENTS,
+	};
+
+	struct Vertex {
+		float         position[3];
+		unsigned char color[4];
+	};
+
+	struct UpdateJob {
+		ParticleSystem* system;
+		float           dt;
+		Vector          wind;
+		Vertex*         vertices;
+	};
+
+	static void updateBlocks(void* data, int begin, int end) {
+		UpdateJob* job = (UpdateJob*)data;
+		for (int b = begin; b < end; ++b)
+			job->system->updateBlock(b, *job);
+	}
+
+	/*
+	 * The vector part runs over whole vectors, also past the last
+	 * particle, the swap-remove only over the particles of the block
+	 */
+	void updateBlock(int b, const UpdateJob& job) {
+		int begin = b * BLOCK, end = begin + BLOCK < count ? begin + BLOCK : count;
+		float* x = component[X];
+		float* y = component[Y];
+		float* z = component[Z];
+		float* vx = component[VX];
+		float* vy = component[VY];
+		float* vz = component[VZ];
+		float* life = component[LIFE];
+
+		float relax = kind.drag * job.dt < 1 ? kind.drag * job.dt : 1;
+		Float4 dt(job.dt), k(relax), fall(kind.gravity * job.dt);
+		Float4 windX(job.wind[0]), windY(job.wind[1]), windZ(job.wind[2]);
+		Float4 bounce(kind.restitution < 0 ? 0 : -kind.restitution), friction(kind.friction);
+		Float4 zero(0);
+		bool lethal = kind.restitution < 0;
+		int hitCount = 0;
+		for (int i = begin; i < end; i += 4) {
+			Float4 px = Float4::loadUnaligned(x + i), py = Float4::loadUnaligned(y + i);
+			Float4 pz = Float4::loadUnaligned(z + i);
+			Float4 wx = Float4::loadUnaligned(vx + i), wy = Float4::loadUnaligned(vy + i);
+			Float4 wz = Float4::loadUnaligned(vz + i);
+
+			wx = wx + (windX - wx) * k;
+			wy = wy + (windY - wy) * k + fall;
+			wz = wz + (windZ - wz) * k;
+			px = px + wx * dt;
+			py = py + wy * dt;
+			pz = pz + wz * dt;
+
+			Float4 h = ground->sample(px, pz);
+			Float4 hit = py < h;
+			py = select(hit, h, py);
+			wx = select(hit, wx * friction, wx);
+			wy = select(hit, wy * bounce, wy);
+			wz = select(hit, wz * friction, wz);
+			Float4 left = Float4::loadUnaligned(life + i) - dt;
+			if (lethal)
+				left = select(hit, zero, left);
+
+			px.storeUnaligned(x + i);
+			py.storeUnaligned(y + i);
+			pz.storeUnaligned(z + i);
+			wx.storeUnaligned(vx + i);
+			wy.storeUnaligned(vy + i);
+			wz.storeUnaligned(vz + i);
+			left.storeUnaligned(life + i);
+			int m = mask(hit);
+			hitCount += (m & 1) + (m >> 1 & 1) + (m >> 2 & 1) + (m >> 3 & 1);
+		}
+		hits[b] = hitCount;
+
+		// Fades out over the last half second
+		unsigned char r = (unsigned char)(255 * kind.color[0]);
+		unsigned char g = (unsigned char)(255 * kind.color[1]);
+		unsigned char bl = (unsigned char)(255 * kind.color[2]);
+		float alpha = 255 * kind.color[3];
+		Vertex* v = job.vertices ? job.vertices + begin : NULL;
+		int i = begin;
+		while (i < end) {
+			if (life[i] <= 0) {
+				--end;
+				for (int c = 0; c < COMPONENTS; ++c)
+					component[c][i] = component[c][end];
+				continue;
+			}
+			if (v) {
+				v->position[0] = x[i];
+				v->position[1] = y[i];
+				v->position[2] = z[i];
+				v->color[0] = r;
+				v->color[1] = g;
+				v->color[2] = bl;
+				v->color[3] = (unsigned char)(alpha * (life[i] < .5f ? 2 * life[i] : 1));
+				++v;
+			}
+			++i;
+		}
+		live[b] = end - begin;
+	}
+
+	/*
+	 * Fills the holes at the ends of the blocks with the particles at
+	 * the end of the last ones, so the survivors are contiguous again
+	 */
+	void compact(int blockCount) {
+		int t = blockCount - 1;
+		for (int h = 0; h < t; ++h) {
+			while (live[h] < BLOCK && h < t) {
+				if (!live[t]) {
+					--t;
+					continue;
+				}
+				int from = t * BLOCK + --live[t], to = h * BLOCK + live[h]++;
+				for (int c = 0; c < COMPONENTS; ++c)
+					component[c][to] = component[c][from];
+			}
+		}
+		count = 0;
+		for (int b = 0; b <= t && b < blockCount; ++b)
+			count += live[b];
+	}
+
+	// Uniform in [0, 1), xorshift
+	float uniform() {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		return (seed >> 8) * (1.f / 16777216);
+	}
+
+	ParticleKind          kind;
+	const HeightSampler*  ground;
+	float*                component[COMPONENTS];
+	int                   capacity, count;
+	int                   blocks;
+	int*                  live;
+	int*                  hits;
+	unsigned              seed;
+	GLuint                program;
+	StreamBuffer*         stream;
+	int                   vertexOffset;
+	GLint*                firsts;
+	GLsizei*              counts;
+	int                   drawCount;
+	ParticleStats         stats, frameStats;
+};
+
+#endif
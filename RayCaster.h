@@ -0,0 +1,304 @@
+#ifndef _RAY_CASTER_H
+#define _RAY_CASTER_H
+
+#include <math.h>
+#include <string.h>
+#include "Vector.h"
+#include "WorkerPool.h"
+
+struct Ray {
+	Vector origin;
+	Vector direction;
+	float  maxDistance;
+};
+
+struct RayHit {
+	bool   hit;
+	float  distance;
+	Vector point;
+	Vector normal;
+};
+
+/*
+ * Ray intersection with the triangles of a height grid.
+ *
+ * The grid is size x size heights indexed as height[x * size + z], in
+ * world units scaled by scale on all axes. Cell (x, z) is split along
+ * the diagonal from (x + 1, z) to (x, z + 1) like the rendered quads.
+ *
+ * A quadtree of maximum cell heights lets the traversal skip every
+ * node the ray passes above. Children are visited front to back, so
+ * the first triangle hit is the closest one.
+ */
+class RayCaster {
+public:
+
+	enum {
+		MAX_LEVELS = 16,
+	};
+
+	/*
+	 * Builds the quadtree, or copies it from a cached one of the same
+	 * heights
+	 */
+	RayCaster(const short* height, int size, float scale, const short* cached = NULL)
+		: height(height), size(size), scale(scale) {
+		cells = 1;
+		levels = 1;
+		while (cells < size - 1) {
+			cells <<= 1;
+			++levels;
+		}
+
+		pyramid = new short[getPyramidBytes(size) / sizeof (short)];
+		level[0] = pyramid;
+		for (int l = 1; l < levels; ++l)
+			level[l] = level[l - 1] + (cells >> (l - 1)) * (cells >> (l - 1));
+		if (cached) {
+			memcpy(pyramid, cached, getPyramidBytes(size));
+			return;
+		}
+
+		// Padding cells beyond the grid are never hit
+		for (int x = 0; x < cells; ++x) {
+			for (int z = x < size - 1 ? size - 1 : 0; z < cells; ++z)
+				level[0][x * cells + z] = -32768;
+		}
+		update(0, 0, size - 1, size - 1);
+	}
+
+	~RayCaster() {
+		delete[] pyramid;
+	}
+
+	// Every level of the quadtree, to cache
+	const short* getPyramid() const {
+		return pyramid;
+	}
+
+	// Bytes of the quadtree over a grid of a size
+	static int getPyramidBytes(int size) {
+		int bytes = 0;
+		for (int cells = 1; ; cells <<= 1) {
+			bytes += cells * cells * sizeof (short);
+			if (cells >= size - 1)
+				return bytes;
+		}
+	}
+
+	/*
+	 * Rebuilds the pyramid over the cells in [x0, x1) x [z0, z1) after
+	 * the heights changed
+	 */
+	void update(int x0, int z0, int x1, int z1) {
+		for (int x = x0; x < x1; ++x) {
+			for (int z = z0; z < z1; ++z) {
+				const short* h = height + x * size + z;
+				short m = h[0];
+				if (h[1] > m) m = h[1];
+				if (h[size] > m) m = h[size];
+				if (h[size + 1] > m) m = h[size + 1];
+				level[0][x * cells + z] = m;
+			}
+		}
+		for (int l = 1; l < levels; ++l) {
+			x0 >>= 1;
+			z0 >>= 1;
+			x1 = (x1 + 1) >> 1;
+			z1 = (z1 + 1) >> 1;
+			int n = cells >> l;
+			const short* src = level[l - 1];
+			short* dst = level[l];
+			for (int x = x0; x < x1; ++x) {
+				for (int z = z0; z < z1; ++z) {
+					const short* s = src + 2 * x * 2 * n + 2 * z;
+					short m = s[0];
+					if (s[1] > m) m = s[1];
+					if (s[2 * n] > m) m = s[2 * n];
+					if (s[2 * n + 1] > m) m = s[2 * n + 1];
+					dst[x * n + z] = m;
+				}
+			}
+		}
+	}
+
+	bool intersect(const Ray& ray, RayHit& hit) const {
+		float length = ray.direction.length();
+		Vector o = ray.origin / scale;
+		Vector d = ray.direction / length;
+		float tMax = ray.maxDistance / scale;
+
+		float inv[3];
+		for (int i = 0; i < 3; i += 2)
+			inv[i] = fabs(d[i]) > 1e-12 ? 1 / d[i] : 1e30;
+
+		Node stack[3 * MAX_LEVELS + 1];
+		int top = 0;
+
+		Node root = { (short)(levels - 1), 0, 0, 0, 0 };
+		if (!clipNode(o, inv, root, tMax))
+			return miss(hit);
+		stack[top++] = root;
+
+		while (top) {
+			Node n = stack[--top];
+			// The ray is lowest at one end of the node
+			float y = o[1] + d[1] * (d[1] < 0 ? n.t1 : n.t0);
+			if (y > level[n.l][n.x * (cells >> n.l) + n.z])
+				continue;
+
+			if (n.l == 0) {
+				float t;
+				Vector normal;
+				if (intersectCell(o, d, n.x, n.z, tMax, t, normal)) {
+					hit.hit = true;
+					hit.distance = t * scale;
+					hit.point = ray.origin + d * hit.distance;
+					hit.normal = normal;
+					return true;
+				}
+				continue;
+			}
+
+			Node child[4];
+			int count = 0;
+			for (int i = 0; i < 4; ++i) {
+				Node& c = child[count];
+				c.l = n.l - 1;
+				c.x = 2 * n.x + (i >> 1);
+				c.z = 2 * n.z + (i & 1);
+				if (clipNode(o, inv, c, tMax))
+					++count;
+			}
+			// Farthest first, so the nearest is popped next
+			for (int i = 1; i < count; ++i) {
+				for (int j = i; j > 0 && child[j].t0 > child[j - 1].t0; --j) {
+					Node t = child[j];
+					child[j] = child[j - 1];
+					child[j - 1] = t;
+				}
+			}
+			for (int i = 0; i < count; ++i)
+				stack[top++] = child[i];
+		}
+		return miss(hit);
+	}
+
+	/*
+	 * Intersects a batch of rays, split across the pool if there is one
+	 */
+	void intersect(const Ray* rays, RayHit* hits, int count, WorkerPool* pool = NULL) const {
+		Batch batch = { this, rays, hits };
+		if (pool)
+			pool->run(batchJob, &batch, count, 64);
+		else
+			batchJob(&batch, 0, count);
+	}
+
+private:
+
+	// Quadtree node at level l and the ray interval over its footprint
+	struct Node {
+		short l, x, z;
+		float t0, t1;
+	};
+
+	struct Batch {
+		const RayCaster* caster;
+		const Ray*       rays;
+		RayHit*          hits;
+	};
+
+	static void batchJob(void* data, int begin, int end) {
+		Batch* batch = (Batch*)data;
+		for (int i = begin; i < end; ++i)
+			batch->caster->intersect(batch->rays[i], batch->hits[i]);
+	}
+
+	static bool miss(RayHit& hit) {
+		hit.hit = false;
+		hit.distance = 0;
+		return false;
+	}
+
+	/*
+	 * Clips the ray against the node footprint in grid units
+	 */
+	bool clipNode(const Vector& o, const float* inv, Node& n, float tMax) const {
+		int extent = 1 << n.l;
+		float x0 = (n.x * extent - o[0]) * inv[0], x1 = ((n.x + 1) * extent - o[0]) * inv[0];
+		float z0 = (n.z * extent - o[2]) * inv[2], z1 = ((n.z + 1) * extent - o[2]) * inv[2];
+		if (x0 > x1) {
+			float t = x0; x0 = x1; x1 = t;
+		}
+		if (z0 > z1) {
+			float t = z0; z0 = z1; z1 = t;
+		}
+		n.t0 = x0 > z0 ? x0 : z0;
+		n.t1 = x1 < z1 ? x1 : z1;
+		if (n.t0 < 0)
+			n.t0 = 0;
+		if (n.t1 > tMax)
+			n.t1 = tMax;
+		return n.t0 <= n.t1;
+	}
+
+	bool intersectCell(const Vector& o, const Vector& d, int x, int z, float tMax,
+			   float& t, Vector& normal) const {
+		const short* h = height + x * size + z;
+		float h00 = h[0], h10 = h[size], h01 = h[1], h11 = h[size + 1];
+
+		// Both triangles share the diagonal from (x + 1, z) to (x, z + 1)
+		bool found = false;
+		t = tMax;
+		found |= intersectTriangle(o, d, Vector(x + 1, h10, z), Vector(x, h00, z),
+					   Vector(x, h01, z + 1), t, normal);
+		found |= intersectTriangle(o, d, Vector(x + 1, h10, z), Vector(x, h01, z + 1),
+					   Vector(x + 1, h11, z + 1), t, normal);
+		return found;
+	}
+
+	static bool intersectTriangle(const Vector& o, const Vector& d, const Vector& a,
+				      const Vector& b, const Vector& c, float& t, Vector& normal) {
+		Vector e1 = b - a, e2 = c - a;
+		Vector p = cross(d, e2);
+		float det = dot(e1, p);
+		if (fabs(det) < 1e-9)
+			return false;
+		float invDet = 1 / det;
+		Vector s = o - a;
+		float u = dot(s, p) * invDet;
+		if (u < 0 || u > 1)
+			return false;
+		Vector q = cross(s, e1);
+		float v = dot(d, q) * invDet;
+		if (v < 0 || u + v > 1)
+			return false;
+		float tHit = dot(e2, q) * invDet;
+		if (tHit < 0 || tHit > t)
+			return false;
+
+		t = tHit;
+		normal = cross(e1, e2);
+		normal.normalize();
+		return true;
+	}
+
+	static float dot(const Vector& a, const Vector& b) {
+		return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+	}
+
+	static Vector cross(const Vector& a, const Vector& b) {
+		return Vector(a[1] * b[2] - a[2] * b[1], a[2] * b[0] - a[0] * b[2],
+			      a[0] * b[1] - a[1] * b[0]);
+	}
+
+	const short* height;
+	int          size;
+	float        scale;
+	int          cells, levels;
+	short*       pyramid;
+	short*       level[MAX_LEVELS];
+};
+
+#endif
@@ -0,0 +1,353 @@
+#ifndef _RESOURCE_LOADER_H
+#define _RESOURCE_LOADER_H
+
+#include <stdio.h>
+#include <string.h>
+#include "SDL.h"
+#include "SDL_syswm.h"
+#include "GLDriver.h"
+#include "Timer.h"
+
+#ifdef SDL_VIDEO_DRIVER_X11
+#include <GL/glx.h>
+#endif
+
+/*
+ * Second GL context sharing its objects with the one of the SDL window,
+ * for a thread that creates resources.
+ *
+ * It has to be created on the main thread right after the window, while
+ * the window's context is current. The context lives on a display
+ * connection of its own, so the two threads never share Xlib state, and
+ * is made current on the window without ever drawing to it. Direct
+ * contexts of one process may share objects across connections. There is
+ * no other window system support, elsewhere isAvailable() is false.
+ */
+class SharedContext {
+public:
+
+	SharedContext() {
+#ifdef SDL_VIDEO_DRIVER_X11
+		display = NULL;
+		context = NULL;
+
+		SDL_SysWMinfo info;
+		SDL_VERSION(&info.version);
+		GLXContext shared = glXGetCurrentContext();
+		if (SDL_GetWMInfo(&info) != 1 || info.subsystem != SDL_SYSWM_X11 || !shared)
+			return;
+		display = XOpenDisplay(DisplayString(info.info.x11.gfxdisplay));
+		if (!display)
+			return;
+		window = info.info.x11.window;
+
+		XWindowAttributes attributes;
+		XGetWindowAttributes(display, window, &attributes);
+		XVisualInfo pattern;
+		pattern.visualid = XVisualIDFromVisual(attributes.visual);
+		int count;
+		XVisualInfo* visual = XGetVisualInfo(display, VisualIDMask, &pattern, &count);
+		if (visual) {
+			context = glXCreateContext(display, visual, shared, True);
+			XFree(visual);
+		}
+		if (!context) {
+			fprintf(stderr, "Could not create a shared GL context\n");
+			XCloseDisplay(display);
+			display = NULL;
+		}
+#endif
+	}
+
+	~SharedContext() {
+#ifdef SDL_VIDEO_DRIVER_X11
+		if (!display)
+			return;
+		glXDestroyContext(display, context);
+		XCloseDisplay(display);
+#endif
+	}
+
+	bool isAvailable() const {
+#ifdef SDL_VIDEO_DRIVER_X11
+		return display != NULL;
+#else
+		return false;
+#endif
+	}
+
+	/*
+	 * Binds the context to the calling thread, or unbinds it
+	 */
+	bool makeCurrent(bool current = true) {
+#ifdef SDL_VIDEO_DRIVER_X11
+		if (!display)
+			return false;
+		return current ? glXMakeCurrent(display, window, context) : glXMakeCurrent(display, None, NULL);
+#else
+		(void)current;
+		return false;
+#endif
+	}
+
+private:
+
+#ifdef SDL_VIDEO_DRIVER_X11
+	Display*   display;
+	Window     window;
+	GLXContext context;
+#endif
+};
+
+enum ResourceType {
+	RESOURCE_BUFFER,
+	RESOURCE_TEXTURE,
+};
+
+/*
+ * Per frame statistics of the resource loader. The load time is spent
+ * on the loader thread.
+ */
+struct LoaderStats {
+	int loads;
+	int bytes;
+	int loadTime;
+	int pending;
+};
+
+/*
+ * Thread with a shared context that creates and fills GL objects.
+ *
+ * load() queues a function that creates one object on the loader thread
+ * and returns it. A fence follows every object, and collect() only
+ * hands an object to the renderer once its fence has signaled, so the
+ * data is complete on the GPU and using it never waits. Objects the
+ * renderer no longer needs go back through destroy(), so neither
+ * creation nor deletion happens on the render thread.
+ */
+class ResourceLoader {
+public:
+
+	typedef GLuint (*LoadFunc)(int tag, int& bytes);
+
+	/*
+	 * A finished object and the tag it was requested with
+	 */
+	struct Resource {
+		int    tag;
+		GLuint object;
+	};
+
+	enum {
+		MAX_REQUESTS = 256,
+		MAX_DONE = 256,
+	};
+
+	ResourceLoader(SharedContext* context) : context(context), thread(NULL), running(true) {
+		memset(&stats, 0, sizeof (stats));
+		memset(&frameStats, 0, sizeof (frameStats));
+		requestHead = requestCount = doneCount = 0;
+		if (!context->isAvailable() || !hasGLExtension("GL_ARB_sync"))
+			return;
+
+		lock = SDL_CreateMutex();
+		loadLock = SDL_CreateMutex();
+		requestsReady = SDL_CreateSemaphore(0);
+		thread = SDL_CreateThread(threadMain, this);
+		if (!thread) {
+			fprintf(stderr, "Could not create loader thread: %s\n", SDL_GetError());
+			SDL_DestroySemaphore(requestsReady);
+			SDL_DestroyMutex(loadLock);
+			SDL_DestroyMutex(lock);
+		}
+	}
+
+	~ResourceLoader() {
+		if (!thread)
+			return;
+		running = false;
+		SDL_SemPost(requestsReady);
+		SDL_WaitThread(thread, NULL);
+		SDL_DestroySemaphore(requestsReady);
+		SDL_DestroyMutex(loadLock);
+		SDL_DestroyMutex(lock);
+		for (int i = 0; i < doneCount; ++i)
+			driver->glDeleteSync(done[i].fence);
+	}
+
+	bool isAvailable() const {
+		return thread != NULL;
+	}
+
+	/*
+	 * Queues the creation of an object of a type. Returns false if the
+	 * queue is full.
+	 */
+	bool load(ResourceType type, LoadFunc func, int tag) {
+		return enqueue(type, func, tag, 0);
+	}
+
+	/*
+	 * Deletes an object on the loader thread
+	 */
+	void destroy(ResourceType type, GLuint object) {
+		// Deleting can not wait for a free place
+		while (!enqueue(type, NULL, 0, object) && running)
+			SDL_Delay(1);
+	}
+
+	/*
+	 * Waits for the load in progress and holds off the next ones until
+	 * resume(), while the render thread changes the data they read
+	 */
+	void pause() {
+		if (thread)
+			SDL_mutexP(loadLock);
+	}
+
+	void resume() {
+		if (thread)
+			SDL_mutexV(loadLock);
+	}
+
+	/*
+	 * Takes up to max objects whose data has arrived on the GPU, in the
+	 * order they were requested
+	 */
+	int collect(Resource* resources, int max) {
+		if (!thread)
+			return 0;
+		SDL_mutexP(lock);
+		int count = 0;
+		while (count < max && count < doneCount) {
+			Done& d = done[count];
+			GLenum status = driver->glClientWaitSync(d.fence, 0, 0);
+			if (status == GL_TIMEOUT_EXPIRED || status == GL_WAIT_FAILED)
+				break;
+			driver->glDeleteSync(d.fence);
+			resources[count].tag = d.tag;
+			resources[count].object = d.object;
+			++count;
+		}
+		memmove(done, done + count, (doneCount - count) * sizeof (Done));
+		doneCount -= count;
+		SDL_mutexV(lock);
+		return count;
+	}
+
+	/*
+	 * Closes the statistics of the frame
+	 */
+	void endFrame() {
+		if (!thread)
+			return;
+		SDL_mutexP(lock);
+		stats.pending = requestCount + doneCount;
+		frameStats = stats;
+		memset(&stats, 0, sizeof (stats));
+		SDL_mutexV(lock);
+	}
+
+	const LoaderStats& getFrameStats() const {
+		return frameStats;
+	}
+
+private:
+
+	struct Request {
+		ResourceType type;
+		LoadFunc     func;
+		int          tag;
+		GLuint       object;
+	};
+
+	struct Done {
+		int    tag;
+		GLuint object;
+		GLsync fence;
+	};
+
+	bool enqueue(ResourceType type, LoadFunc func, int tag, GLuint object) {
+		if (!thread || !running)
+			return false;
+		SDL_mutexP(lock);
+		bool queued = requestCount < MAX_REQUESTS && requestCount + doneCount < MAX_DONE;
+		if (queued) {
+			Request& r = requests[(requestHead + requestCount++) % MAX_REQUESTS];
+			r.type = type;
+			r.func = func;
+			r.tag = tag;
+			r.object = object;
+		}
+		SDL_mutexV(lock);
+		if (queued)
+			SDL_SemPost(requestsReady);
+		return queued;
+	}
+
+	static int threadMain(void* data) {
+		ResourceLoader* self = (ResourceLoader*)data;
+		if (!self->context->makeCurrent()) {
+			fprintf(stderr, "Could not make the loader context current\n");
+			self->running = false;
+			return 1;
+		}
+
+		for (;;) {
+			SDL_SemWait(self->requestsReady);
+			if (!self->running)
+				break;
+			SDL_mutexP(self->lock);
+			Request r = self->requests[self->requestHead];
+			self->requestHead = (self->requestHead + 1) % MAX_REQUESTS;
+			--self->requestCount;
+			SDL_mutexV(self->lock);
+
+			if (!r.func) {
+				if (r.type == RESOURCE_BUFFER)
+					driver->glDeleteBuffers(1, &r.object);
+				else
+					driver->glDeleteTextures(1, &r.object);
+				continue;
+			}
+
+			long long start = getMicroseconds();
+			int bytes = 0;
+			SDL_mutexP(self->loadLock);
+			GLuint object = r.func(r.tag, bytes);
+			SDL_mutexV(self->loadLock);
+			// Flushed, or the fence might never signal for the renderer
+			GLsync fence = driver->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			driver->glFlush();
+
+			SDL_mutexP(self->lock);
+			Done& d = self->done[self->doneCount++];
+			d.tag = r.tag;
+			d.object = object;
+			d.fence = fence;
+			++self->stats.loads;
+			self->stats.bytes += bytes;
+			self->stats.loadTime += (int)(getMicroseconds() - start);
+			SDL_mutexV(self->lock);
+		}
+
+		self->context->makeCurrent(false);
+		return 0;
+	}
+
+	SharedContext* context;
+
+	// Shared with the loader thread under the lock
+	SDL_Thread*   thread;
+	SDL_mutex*    lock;
+	SDL_mutex*    loadLock;
+	SDL_sem*      requestsReady;
+	volatile bool running;
+	Request       requests[MAX_REQUESTS];
+	int           requestHead, requestCount;
+	Done          done[MAX_DONE];
+	int           doneCount;
+	LoaderStats   stats, frameStats;
+};
+
+#endif
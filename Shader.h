@@ -0,0 +1,67 @@
+#ifndef _SHADER_H
+#define _SHADER_H
+
+#include <stdio.h>
+#include "GLDriver.h"
+
+/*
+ * Compiles a shader, prints the info log and returns 0 on failure
+ */
+inline GLuint compileShader(GLenum type, const char* source) {
+	GLuint shader = driver->glCreateShader(type);
+	driver->glShaderSource(shader, 1, &source, NULL);
+	driver->glCompileShader(shader);
+
+	GLint status;
+	driver->glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+	if (!status) {
+		char log[4096];
+		driver->glGetShaderInfoLog(shader, sizeof (log), NULL, log);
+		fprintf(stderr, "Shader compilation failed:\n%s\n", log);
+		driver->glDeleteShader(shader);
+		return 0;
+	}
+	return shader;
+}
+
+/*
+ * Links a program from vertex and fragment shader source.
+ * The NULL terminated attribute names are bound to the locations
+ * matching their index.
+ */
+inline GLuint linkProgram(const char* vertexSource, const char* fragmentSource,
+			  const char* const* attributes) {
+	GLuint vertex = compileShader(GL_VERTEX_SHADER, vertexSource);
+	GLuint fragment = compileShader(GL_FRAGMENT_SHADER, fragmentSource);
+	if (!vertex || !fragment) {
+		if (vertex)
+			driver->glDeleteShader(vertex);
+		if (fragment)
+			driver->glDeleteShader(fragment);
+		return 0;
+	}
+
+	GLuint program = driver->glCreateProgram();
+	driver->glAttachShader(program, vertex);
+	driver->glAttachShader(program, fragment);
+	for (int i = 0; attributes && attributes[i]; ++i)
+		driver->glBindAttribLocation(program, i, attributes[i]);
+	driver->glLinkProgram(program);
+
+	// The program keeps the shaders alive
+	driver->glDeleteShader(vertex);
+	driver->glDeleteShader(fragment);
+
+	GLint status;
+	driver->glGetProgramiv(program, GL_LINK_STATUS, &status);
+	if (!status) {
+		char log[4096];
+		driver->glGetProgramInfoLog(program, sizeof (log), NULL, log);
+		fprintf(stderr, "Program linking failed:\n%s\n", log);
+		driver->glDeleteProgram(program);
+		return 0;
+	}
+	return program;
+}
+
+#endif
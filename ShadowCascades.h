@@ -0,0 +1,247 @@
+#ifndef _SHADOW_CASCADES_H
+#define _SHADOW_CASCADES_H
+
+#include <math.h>
+#include <stdio.h>
+#include "GLDriver.h"
+#include "Matrix.h"
+#include "Vector.h"
+#include "Frustum.h"
+#include "Shader.h"
+
+/*
+ * One slice of the view frustum and the sun's view of it
+ */
+struct ShadowCascade {
+	// World to shadow map clip space, and the planes of that box
+	Matrix  viewProjection;
+	Frustum frustum;
+	// Far end of the slice in view space depth
+	float   split;
+	// World units per shadow map texel
+	float   texelSize;
+};
+
+/*
+ * Cascaded shadow maps for the sun.
+ *
+ * The view frustum up to the shadow distance is split into CASCADES
+ * slices, closer to logarithmic than even so that a texel covers about
+ * as many pixels near the camera as far away. Each slice is enclosed in
+ * a sphere and the sun looks at the sphere through an orthographic box
+ * of its size. The sphere only depends on the projection, so turning
+ * the camera changes neither the box size nor the texel size, and the
+ * box moves in whole texels. Together that keeps the shadow edges from
+ * shimmering while the camera moves. The box reaches towards the sun
+ * up to the top of the scene, so casters outside the slice still land
+ * in the map.
+ *
+ * fit() only computes, so it can run with the rest of the frame
+ * preparation. The maps are the layers of one depth texture array that
+ * the fragment shader reads with hardware comparison.
+ */
+class ShadowCascades {
+public:
+
+	enum {
+		CASCADES = 4,
+		MAP_SIZE = 1024,
+	};
+
+	/*
+	 * GLSL helper for the fragment shader, the lit fraction of a world
+	 * position at a view depth. Beyond the last cascade it is lit.
+	 */
+	static const char* shaderSource() {
+		return
+			"uniform sampler2DArrayShadow shadowMap;\n"
+			"uniform mat4 shadowMatrices[4];\n"
+			"uniform vec4 shadowSplits;\n"
+			"float cascadeShadow(vec3 position, float depth) {\n"
+			"	if (depth >= shadowSplits.w)\n"
+			"		return 1.;\n"
+			"	int c = depth < shadowSplits.x ? 0 : depth < shadowSplits.y ? 1 : depth < shadowSplits.z ? 2 : 3;\n"
+			"	vec4 p = shadowMatrices[c] * vec4(position, 1.);\n"
+			"	return texture(shadowMap, vec4(p.xy, float(c), p.z));\n"
+			"}\n";
+	}
+
+	/*
+	 * Splits the view up to distance and fits a cascade to every slice.
+	 * sun points towards the sun, the scene lies within sceneMin and
+	 * sceneMax.
+	 */
+	static void fit(const Matrix& projection, const Matrix& modelView, const Vector& sun,
+			float nearPlane, float distance, const Vector& sceneMin, const Vector& sceneMax,
+			ShadowCascade* cascades) {
+		// The sun's axes, it looks down its -z
+		Vector forward = -sun;
+		forward.normalize();
+		Vector up = fabs(forward[1]) < .99f ? Vector(0, 1, 0) : Vector(1, 0, 0);
+		Vector right = crossProduct(up, forward);
+		right.normalize();
+		up = crossProduct(forward, right);
+		Matrix light(right[0],    right[1],    right[2],    0,
+			     up[0],       up[1],       up[2],       0,
+			     -forward[0], -forward[1], -forward[2], 0,
+			     0,           0,           0,           1);
+
+		// Highest point of the scene along the sun direction
+		float top = -1e30;
+		for (int i = 0; i < 8; ++i) {
+			Vector corner(i & 1 ? sceneMax[0] : sceneMin[0], i & 2 ? sceneMax[1] : sceneMin[1],
+				      i & 4 ? sceneMax[2] : sceneMin[2]);
+			float z = (light * corner)[2];
+			top = z > top ? z : top;
+		}
+
+		// Weight of the logarithmic split against the even one
+		const float logarithmic = .75f;
+		// Half extents of the view per unit of depth
+		float sx = 1 / projection(0, 0), sy = 1 / projection(1, 1);
+		float diagonal = sqrt(sx * sx + sy * sy);
+		float d0 = nearPlane;
+		for (int i = 0; i < CASCADES; ++i) {
+			float f = (float)(i + 1) / CASCADES;
+			float d1 = logarithmic * nearPlane * pow(distance / nearPlane, f) +
+				(1 - logarithmic) * (nearPlane + (distance - nearPlane) * f);
+
+			// Smallest sphere through the corners of the slice, on the view axis
+			float a = d0 * diagonal, b = d1 * diagonal;
+			float c = (d1 * d1 - d0 * d0 + b * b - a * a) / (2 * (d1 - d0));
+			c = c < d1 ? c : d1;
+			float radius = sqrt((d1 - c) * (d1 - c) + b * b);
+			// Rounded up, so it does not change with the float error of the view
+			radius = ceil(radius * 16) / 16;
+			Vector center = viewToWorld(modelView, Vector(0, 0, -c));
+
+			float texel = 2 * radius / MAP_SIZE;
+			Vector l = light * center;
+			float x = floor(l[0] / texel) * texel, y = floor(l[1] / texel) * texel;
+			float n = -(top > l[2] + radius ? top : l[2] + radius), far = -(l[2] - radius);
+
+			ShadowCascade& cascade = cascades[i];
+			cascade.viewProjection = orthographic(x - radius, x + radius, y - radius, y + radius, n, far) * light;
+			cascade.frustum = Frustum(cascade.viewProjection);
+			cascade.split = d1;
+			cascade.texelSize = texel;
+			d0 = d1;
+		}
+	}
+
+	ShadowCascades() : texture(0), framebuffer(0) {
+		available = hasGLExtension("GL_EXT_texture_array") && hasGLExtension("GL_ARB_framebuffer_object");
+		if (!available)
+			return;
+
+		driver->glGenTextures(1, &texture);
+		driver->glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+		driver->glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		driver->glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		driver->glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		driver->glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		// Filtered comparison, four taps blended for free
+		driver->glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+		driver->glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+		driver->glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT24, MAP_SIZE, MAP_SIZE, CASCADES, 0,
+				     GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+		driver->glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+		driver->glGenFramebuffers(1, &framebuffer);
+		driver->glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		driver->glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, texture, 0, 0);
+		driver->glDrawBuffer(GL_NONE);
+		driver->glReadBuffer(GL_NONE);
+		GLenum status = driver->glCheckFramebufferStatus(GL_FRAMEBUFFER);
+		driver->glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		if (status != GL_FRAMEBUFFER_COMPLETE) {
+			fprintf(stderr, "Shadow map framebuffer is incomplete: 0x%x\n", status);
+			available = false;
+		}
+	}
+
+	~ShadowCascades() {
+		if (framebuffer)
+			driver->glDeleteFramebuffers(1, &framebuffer);
+		if (texture)
+			driver->glDeleteTextures(1, &texture);
+	}
+
+	bool isAvailable() const {
+		return available;
+	}
+
+	/*
+	 * Directs depth rendering to the map of a cascade. The slope scaled
+	 * offset keeps surfaces from shadowing themselves.
+	 */
+	void begin(int cascade) {
+		driver->glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		driver->glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, texture, 0, cascade);
+		driver->glViewport(0, 0, MAP_SIZE, MAP_SIZE);
+		driver->glClear(GL_DEPTH_BUFFER_BIT);
+		driver->glPolygonOffset(2, 4);
+		driver->glEnable(GL_POLYGON_OFFSET_FILL);
+	}
+
+	void end() {
+		driver->glDisable(GL_POLYGON_OFFSET_FILL);
+		driver->glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+
+	/*
+	 * Binds the maps to a texture unit and sets the uniforms of
+	 * shaderSource() in the current program
+	 */
+	void bind(GLuint program, int unit, const ShadowCascade* cascades) {
+		float matrices[16 * CASCADES];
+		// Clip space to texture coordinates and depth
+		Matrix bias(.5, 0,  0,  .5,
+			    0,  .5, 0,  .5,
+			    0,  0,  .5, .5,
+			    0,  0,  0,  1);
+		for (int i = 0; i < CASCADES; ++i) {
+			Matrix m = bias * cascades[i].viewProjection;
+			for (int j = 0; j < 16; ++j)
+				matrices[16 * i + j] = ((const float*)m)[j];
+		}
+		driver->glUniformMatrix4fv(driver->glGetUniformLocation(program, "shadowMatrices"),
+					   CASCADES, GL_FALSE, matrices);
+		driver->glUniform4f(driver->glGetUniformLocation(program, "shadowSplits"),
+				    cascades[0].split, cascades[1].split, cascades[2].split, cascades[3].split);
+		driver->glActiveTexture(GL_TEXTURE0 + unit);
+		driver->glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+		driver->glActiveTexture(GL_TEXTURE0);
+	}
+
+	void unbind(int unit) {
+		driver->glActiveTexture(GL_TEXTURE0 + unit);
+		driver->glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+		driver->glActiveTexture(GL_TEXTURE0);
+	}
+
+private:
+
+	/*
+	 * Inverse of a rigid view transform applied to a point
+	 */
+	static Vector viewToWorld(const Matrix& modelView, const Vector& v) {
+		Vector u(v[0] - modelView(0, 3), v[1] - modelView(1, 3), v[2] - modelView(2, 3));
+		return Vector(modelView(0, 0) * u[0] + modelView(1, 0) * u[1] + modelView(2, 0) * u[2],
+			      modelView(0, 1) * u[0] + modelView(1, 1) * u[1] + modelView(2, 1) * u[2],
+			      modelView(0, 2) * u[0] + modelView(1, 2) * u[1] + modelView(2, 2) * u[2]);
+	}
+
+	static Matrix orthographic(float l, float r, float b, float t, float n, float f) {
+		return Matrix(2 / (r - l), 0,           0,            -(r + l) / (r - l),
+			      0,           2 / (t - b), 0,            -(t + b) / (t - b),
+			      0,           0,           -2 / (f - n), -(f + n) / (f - n),
+			      0,           0,           0,            1);
+	}
+
+	bool   available;
+	GLuint texture;
+	GLuint framebuffer;
+};
+
+#endif
@@ -0,0 +1,215 @@
+#ifndef _SIMD_H
+#define _SIMD_H
+
+#include <math.h>
+
+/*
+ * Four floats processed at once. Maps to SSE where the compiler
+ * enables it and falls back to plain loops otherwise.
+ *
+ * Comparisons return masks with all bits set in the true lanes, which
+ * select() and mask() consume.
+ */
+
+#ifdef __SSE2__
+
+#include <emmintrin.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+class Float4 {
+public:
+
+	__m128 v;
+
+	Float4() {
+	}
+
+	Float4(__m128 v) : v(v) {
+	}
+
+	Float4(float f) : v(_mm_set1_ps(f)) {
+	}
+
+	Float4(float a, float b, float c, float d) : v(_mm_setr_ps(a, b, c, d)) {
+	}
+
+	// p must be 16 byte aligned
+	static Float4 load(const float* p) {
+		return _mm_load_ps(p);
+	}
+
+	static Float4 loadUnaligned(const float* p) {
+		return _mm_loadu_ps(p);
+	}
+
+	void store(float* p) const {
+		_mm_store_ps(p, v);
+	}
+
+	void storeUnaligned(float* p) const {
+		_mm_storeu_ps(p, v);
+	}
+};
+
+inline Float4 operator+(Float4 a, Float4 b) { return _mm_add_ps(a.v, b.v); }
+inline Float4 operator-(Float4 a, Float4 b) { return _mm_sub_ps(a.v, b.v); }
+inline Float4 operator*(Float4 a, Float4 b) { return _mm_mul_ps(a.v, b.v); }
+inline Float4 operator/(Float4 a, Float4 b) { return _mm_div_ps(a.v, b.v); }
+inline Float4 operator&(Float4 a, Float4 b) { return _mm_and_ps(a.v, b.v); }
+inline Float4 operator|(Float4 a, Float4 b) { return _mm_or_ps(a.v, b.v); }
+inline Float4 min(Float4 a, Float4 b) { return _mm_min_ps(a.v, b.v); }
+inline Float4 max(Float4 a, Float4 b) { return _mm_max_ps(a.v, b.v); }
+inline Float4 sqrt(Float4 a) { return _mm_sqrt_ps(a.v); }
+inline Float4 operator<(Float4 a, Float4 b) { return _mm_cmplt_ps(a.v, b.v); }
+inline Float4 operator<=(Float4 a, Float4 b) { return _mm_cmple_ps(a.v, b.v); }
+inline Float4 operator>(Float4 a, Float4 b) { return _mm_cmpgt_ps(a.v, b.v); }
+inline Float4 operator>=(Float4 a, Float4 b) { return _mm_cmpge_ps(a.v, b.v); }
+
+// Lanes of a where the mask is set, b elsewhere
+inline Float4 select(Float4 mask, Float4 a, Float4 b) {
+	return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v));
+}
+
+// One bit per lane
+inline int mask(Float4 m) {
+	return _mm_movemask_ps(m.v);
+}
+
+// Rounds towards zero
+inline Float4 truncate(Float4 a) {
+	return _mm_cvtepi32_ps(_mm_cvttps_epi32(a.v));
+}
+
+// Rounds towards zero and stores the lanes as integers
+inline void convert(Float4 a, int* i) {
+	_mm_storeu_si128((__m128i*)i, _mm_cvttps_epi32(a.v));
+}
+
+// Loads base[index[0]], ..., base[index[3]]
+inline Float4 gather(const float* base, const int* index) {
+#ifdef __AVX2__
+	return _mm_i32gather_ps(base, _mm_loadu_si128((const __m128i*)index), 4);
+#else
+	return Float4(base[index[0]], base[index[1]], base[index[2]], base[index[3]]);
+#endif
+}
+
+#else
+
+class Float4 {
+public:
+
+	union {
+		float f[4];
+		unsigned int u[4];
+	};
+
+	Float4() {
+	}
+
+	Float4(float x) {
+		f[0] = f[1] = f[2] = f[3] = x;
+	}
+
+	Float4(float a, float b, float c, float d) {
+		f[0] = a; f[1] = b; f[2] = c; f[3] = d;
+	}
+
+	static Float4 load(const float* p) {
+		return Float4(p[0], p[1], p[2], p[3]);
+	}
+
+	static Float4 loadUnaligned(const float* p) {
+		return load(p);
+	}
+
+	void store(float* p) const {
+		p[0] = f[0]; p[1] = f[1]; p[2] = f[2]; p[3] = f[3];
+	}
+
+	void storeUnaligned(float* p) const {
+		store(p);
+	}
+};
+
+#define FLOAT4_OP(op, expr)\
+inline Float4 op(Float4 a, Float4 b) {\
+	Float4 r;\
+	for (int i = 0; i < 4; ++i)\
+		expr;\
+	return r;\
+}
+FLOAT4_OP(operator+, r.f[i] = a.f[i] + b.f[i])
+FLOAT4_OP(operator-, r.f[i] = a.f[i] - b.f[i])
+FLOAT4_OP(operator*, r.f[i] = a.f[i] * b.f[i])
+FLOAT4_OP(operator/, r.f[i] = a.f[i] / b.f[i])
+FLOAT4_OP(operator&, r.u[i] = a.u[i] & b.u[i])
+FLOAT4_OP(operator|, r.u[i] = a.u[i] | b.u[i])
+FLOAT4_OP(min, r.f[i] = a.f[i] < b.f[i] ? a.f[i] : b.f[i])
+FLOAT4_OP(max, r.f[i] = a.f[i] > b.f[i] ? a.f[i] : b.f[i])
+FLOAT4_OP(operator<, r.u[i] = a.f[i] < b.f[i] ? ~0u : 0)
+FLOAT4_OP(operator<=, r.u[i] = a.f[i] <= b.f[i] ? ~0u : 0)
+FLOAT4_OP(operator>, r.u[i] = a.f[i] > b.f[i] ? ~0u : 0)
+FLOAT4_OP(operator>=, r.u[i] = a.f[i] >= b.f[i] ? ~0u : 0)
+#undef FLOAT4_OP
+
+inline Float4 select(Float4 mask, Float4 a, Float4 b) {
+	Float4 r;
+	for (int i = 0; i < 4; ++i)
+		r.u[i] = (mask.u[i] & a.u[i]) | (~mask.u[i] & b.u[i]);
+	return r;
+}
+
+inline int mask(Float4 m) {
+	return (m.u[0] >> 31) | (m.u[1] >> 31) << 1 | (m.u[2] >> 31) << 2 | (m.u[3] >> 31) << 3;
+}
+
+inline Float4 sqrt(Float4 a) {
+	return Float4(sqrtf(a.f[0]), sqrtf(a.f[1]), sqrtf(a.f[2]), sqrtf(a.f[3]));
+}
+
+inline Float4 truncate(Float4 a) {
+	return Float4((int)a.f[0], (int)a.f[1], (int)a.f[2], (int)a.f[3]);
+}
+
+inline void convert(Float4 a, int* i) {
+	for (int j = 0; j < 4; ++j)
+		i[j] = (int)a.f[j];
+}
+
+inline Float4 gather(const float* base, const int* index) {
+	return Float4(base[index[0]], base[index[1]], base[index[2]], base[index[3]]);
+}
+
+#endif
+
+/*
+ * Polynomial sine and cosine, within about 2e-7 of the libm results for
+ * arguments up to a few thousand radians. The argument is reduced to
+ * [-pi, pi] with 2 pi split in two parts so the reduction stays exact,
+ * the outer quarters are folded in with sin(x) = sin(pi - x), and the
+ * Taylor polynomial of degree 11 is evaluated on [-pi/2, pi/2].
+ */
+inline Float4 sin(Float4 x) {
+	Float4 half = select(x < Float4(0), Float4(-.5f), Float4(.5f));
+	Float4 k = truncate(x * Float4(.15915494f) + half);
+	x = x - k * Float4(6.28125f) - k * Float4(1.9353072e-3f);
+
+	x = select(x > Float4(1.5707964f), Float4(3.1415927f) - x, x);
+	x = select(x < Float4(-1.5707964f), Float4(-3.1415927f) - x, x);
+
+	Float4 x2 = x * x;
+	Float4 p = Float4(-2.5052108e-8f) * x2 + Float4(2.7557319e-6f);
+	p = p * x2 - Float4(1.9841270e-4f);
+	p = p * x2 + Float4(8.3333333e-3f);
+	p = p * x2 - Float4(.16666667f);
+	return x + x * x2 * p;
+}
+
+inline Float4 cos(Float4 x) {
+	return sin(x + Float4(1.5707964f));
+}
+
+#endif
@@ -0,0 +1,203 @@
+#ifndef _STREAM_BUFFER_H
+#define _STREAM_BUFFER_H
+
+#include "GLDriver.h"
+
+/*
+ * Per frame statistics of a stream buffer
+ */
+struct StreamStats {
+	int bytes;
+	int fenceWaits;
+	int orphans;
+};
+
+/*
+ * Ring buffer for data that is written by the CPU every frame.
+ *
+ * The buffer is split into REGION_COUNT regions. A fence is inserted
+ * when the write position leaves a region and waited for when it enters
+ * the region again one lap later, so as long as the ring holds more than
+ * the frames in flight the CPU never waits for the GPU.
+ *
+ * With GL_ARB_buffer_storage the whole ring stays persistently mapped and
+ * map() is just pointer arithmetic. Without it every allocation maps its
+ * range unsynchronized, and without GL_ARB_sync the buffer is orphaned
+ * whenever it wraps.
+ *
+ * The data returned by map() must be submitted before the next call to
+ * map(), since leaving a region fences everything issued so far.
+ */
+class StreamBuffer {
+public:
+
+	enum Mode {
+		PERSISTENT,
+		UNSYNCHRONIZED,
+		ORPHAN,
+		UNAVAILABLE,
+	};
+
+	enum {
+		REGION_COUNT = 4,
+		ALIGNMENT = 64,
+	};
+
+	StreamBuffer(GLenum target, int size)
+		: target(target), buffer(0), size(size), head(0),
+		  current(-1), unfenced(0), base(NULL) {
+		regionSize = (size + REGION_COUNT - 1) / REGION_COUNT;
+		memset(fence, 0, sizeof (fence));
+		memset(&stats, 0, sizeof (stats));
+		memset(&frameStats, 0, sizeof (frameStats));
+
+		bool sync = hasGLExtension("GL_ARB_sync");
+		if (sync && hasGLExtension("GL_ARB_buffer_storage"))
+			mode = PERSISTENT;
+		else if (hasGLExtension("GL_ARB_map_buffer_range"))
+			mode = sync ? UNSYNCHRONIZED : ORPHAN;
+		else {
+			mode = UNAVAILABLE;
+			return;
+		}
+
+		driver->glGenBuffers(1, &buffer);
+		driver->glBindBuffer(target, buffer);
+		if (mode == PERSISTENT) {
+			GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			driver->glBufferStorage(target, size, NULL, flags);
+			base = (char*)driver->glMapBufferRange(target, 0, size, flags);
+		} else {
+			driver->glBufferData(target, size, NULL, GL_STREAM_DRAW);
+		}
+		driver->glBindBuffer(target, 0);
+	}
+
+	~StreamBuffer() {
+		if (mode == UNAVAILABLE)
+			return;
+		for (int i = 0; i < REGION_COUNT; ++i) {
+			if (fence[i])
+				driver->glDeleteSync(fence[i]);
+		}
+		if (base) {
+			driver->glBindBuffer(target, buffer);
+			driver->glUnmapBuffer(target);
+			driver->glBindBuffer(target, 0);
+		}
+		driver->glDeleteBuffers(1, &buffer);
+	}
+
+	Mode getMode() const {
+		return mode;
+	}
+
+	bool isAvailable() const {
+		return mode != UNAVAILABLE;
+	}
+
+	void bind() const {
+		driver->glBindBuffer(target, buffer);
+	}
+
+	/*
+	 * Reserves bytes in the ring and returns a pointer to write them to.
+	 * The offset of the data in the buffer object is stored in offset.
+	 * Leaves the buffer bound.
+	 */
+	void* map(int bytes, int& offset) {
+		if (mode == UNAVAILABLE || bytes > size)
+			return NULL;
+
+		bind();
+		if (head + bytes > size) {
+			fenceRegions(current + 1);
+			head = 0;
+			current = -1;
+			unfenced = 0;
+			if (mode == ORPHAN) {
+				driver->glBufferData(target, size, NULL, GL_STREAM_DRAW);
+				++stats.orphans;
+			}
+		}
+
+		int first = head / regionSize, last = (head + bytes - 1) / regionSize;
+		fenceRegions(first);
+		for (int i = first; i <= last; ++i) {
+			if (i != current)
+				waitRegion(i);
+		}
+		current = last;
+
+		offset = head;
+		head += (bytes + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+		stats.bytes += bytes;
+
+		if (base)
+			return base + offset;
+		return driver->glMapBufferRange(target, offset, bytes,
+						GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT |
+						GL_MAP_INVALIDATE_RANGE_BIT);
+	}
+
+	/*
+	 * Finishes writing the last mapped range, must be called before
+	 * the data is used for drawing.
+	 */
+	void unmap() {
+		if (!base && mode != UNAVAILABLE)
+			driver->glUnmapBuffer(target);
+	}
+
+	/*
+	 * Closes the statistics of the current frame
+	 */
+	void endFrame() {
+		frameStats = stats;
+		memset(&stats, 0, sizeof (stats));
+	}
+
+	const StreamStats& getFrameStats() const {
+		return frameStats;
+	}
+
+private:
+
+	// Fences all regions written since the last fence up to, but not including, end
+	void fenceRegions(int end) {
+		if (mode == ORPHAN || current < 0)
+			return;
+		for (int i = unfenced; i < end; ++i) {
+			if (fence[i])
+				driver->glDeleteSync(fence[i]);
+			fence[i] = driver->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		}
+		if (end > unfenced)
+			unfenced = end;
+	}
+
+	void waitRegion(int i) {
+		if (!fence[i])
+			return;
+		GLenum status = driver->glClientWaitSync(fence[i], 0, 0);
+		if (status == GL_TIMEOUT_EXPIRED) {
+			++stats.fenceWaits;
+			do {
+				status = driver->glClientWaitSync(fence[i], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+			} while (status == GL_TIMEOUT_EXPIRED);
+		}
+		driver->glDeleteSync(fence[i]);
+		fence[i] = 0;
+	}
+
+	GLenum      target;
+	GLuint      buffer;
+	Mode        mode;
+	int         size, regionSize;
+	int         head, current, unfenced;
+	char*       base;
+	GLsync      fence[REGION_COUNT];
+	StreamStats stats, frameStats;
+};
+
+#endif
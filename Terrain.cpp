@@ -1,157 +1,3145 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
 #include "SDL.h"
-#include "SDL_opengl.h"
+#include "GLDriver.h"
 #include "Matrix.h"
 #include "Vector.h"
+#include "Frustum.h"
+#include "FramePipeline.h"
+#include "StreamBuffer.h"
+#include "Clipmap.h"
+#include "Horizon.h"
+#include "OcclusionBuffer.h"
+#include "Timer.h"
+#include "WorkerPool.h"
+#include "RayCaster.h"
+#include "HeightSampler.h"
+#include "HeightCollider.h"
+#include "Viewshed.h"
+#include "HorizonMap.h"
+#include "VirtualTexture.h"
+#include "ClusteredLighting.h"
+#include "GpuTimer.h"
+#include "FrameBudget.h"
+#include "DynamicResolution.h"
+#include "TerrainEditor.h"
+#include "AnimatedSurface.h"
+#include "ResourceLoader.h"
+#include "TerrainCache.h"
+#include "Heightfield.h"
+#include "ShadowCascades.h"
+#include "ParticleSystem.h"
+#include "ObjectScatter.h"
+#include "FrameCapture.h"
+#include "Shader.h"
 
-struct GLDriver {
+enum {
+	SCREEN_WIDTH = 640,
+	SCREEN_HEIGHT = 480,
+	SCREEN_BPP = 32,
+	AREA_SIZE = 256,
+	CHUNK_SIZE = 32,
+	CHUNK_COUNT = AREA_SIZE / CHUNK_SIZE,
+	MAX_LOD = 3,
+	STREAM_BUFFER_SIZE = 16 << 20,
+	FEEDBACK_SCALE = 8,
+	OCCLUDER_STEP = 8,
+	OCCLUDER_SIZE = CHUNK_SIZE / OCCLUDER_STEP + 1,
+	OCCLUDER_VERTICES = (OCCLUDER_SIZE * OCCLUDER_SIZE + 3) & ~3,
+	OCCLUDER_TRIANGLES = 2 * (OCCLUDER_SIZE - 1) * (OCCLUDER_SIZE - 1),
+	ANIMATED_SIZE = 1024,
+	LARGE_FIELD_SIZE = 8192,
+	// Most vertices of a chunk, the full detail quads and the skirts
+	CHUNK_VERTICES = 4 * CHUNK_SIZE * (CHUNK_SIZE + 4),
+	// Finer than the terrain chunks, so the LOD of the objects follows the distance closer
+	SCATTER_CHUNK_SIZE = 8,
+	SCATTER_CHUNKS_PER_SIDE = (AREA_SIZE - 1 + SCATTER_CHUNK_SIZE - 1) / SCATTER_CHUNK_SIZE,
+	SCATTER_CHUNKS = SCATTER_CHUNKS_PER_SIDE * SCATTER_CHUNKS_PER_SIDE,
+};
+
+/* Clip planes of the perspective projection */
+const float NEAR_PLANE = .1;
+const float FAR_PLANE = 200;
+
+const float WORLD_SCALE = .1;
+
+/* Pixels a chunk may deviate from the full detail surface on screen */
+const float LOD_ERROR = 1;
+
+/*
+ * Frame time in milliseconds the budget controller holds by raising the
+ * LOD error up to its limit and then pulling in the draw distance. At
+ * the longest distance the whole area is visible from anywhere near it.
+ */
+const float FRAME_BUDGET = 16.6;
+const float MAX_LOD_ERROR = 16;
+const float MIN_DRAW_DISTANCE = 8;
+const float MAX_DRAW_DISTANCE = 2 * WORLD_SCALE * AREA_SIZE;
+
+/*
+ * The sun's shadows reach as far as the terrain is drawn. Shadow casters
+ * may deviate this many shadow map texels from the full detail surface.
+ */
+const float SHADOW_DISTANCE = MAX_DRAW_DISTANCE;
+const float SHADOW_LOD_TEXELS = 4;
+
+/* Flythrough path, a circle around the center of the area (grid units) */
+const float FLYTHROUGH_PERIOD = 20;
+const float FLYTHROUGH_RADIUS = 90;
+const float FLYTHROUGH_ALTITUDE = 6;
+const float FLYTHROUGH_PITCH = .1;
+
+/* Sun circling the area, azimuth period in seconds and elevation in radians */
+const float SUN_PERIOD = 30;
+const float SUN_ELEVATION = .35;
+
+/* Terrain brush under the mouse, radius in grid units */
+const char* const BRUSH_NAMES[] = { "raise", "lower", "flatten", "smooth" };
+const float BRUSH_RADIUS = 8;
+const float BRUSH_STRENGTH[] = { 4, 4, .3, .5 };
+
+/*
+ * Layers of the animated surface in world units, the height function of
+ * the area standing still with swell and ripples running across it
+ */
+const WaveLayer WAVE_LAYERS[] = {
+	{ 10 * WORLD_SCALE, 1 / (24 * WORLD_SCALE), 0, 0, 0 },
+	{ 7 * WORLD_SCALE, 0, 1 / (18 * WORLD_SCALE), 0, M_PI / 2 - 50 / 18. },
+	{ .2, .8, .3, 1.2, 0 },
+	{ .1, -.5, 1.4, 1.9, 1 },
+	{ .05, 2.1, -1.3, 3.1, 2 },
+	{ .02, -3.7, -4.1, 5.3, 3 },
+};
+
+/* Data derived from the heights, in the working directory */
+const char* const CACHE_PATH = "Terrain.cache";
+
+/* Frame capture, C steps through images, raw video and off */
+const char* const CAPTURE_IMAGE_PATH = "capture%05d.ppm";
+const char* const CAPTURE_VIDEO_PATH = "capture.rgb";
+
+/* Number of point lights F10 steps through, with lights on it is night */
+const int LIGHT_COUNTS[] = { 0, 64, 256, 1024 };
+const float NIGHT_SUN = .1;
+
+/*
+ * Particles over the terrain. P steps through the total counts, which
+ * are shared by rain around the camera, dust blown up from the ground
+ * and smoke rising from the fires.
+ */
+enum ParticleSource {
+	PARTICLE_RAIN,
+	PARTICLE_DUST,
+	PARTICLE_SMOKE,
+	PARTICLE_SOURCES,
+};
+
+const char* const PARTICLE_NAMES[] = { "rain", "dust", "smoke" };
+const int PARTICLE_COUNTS[] = { 0, 100000, 1000000, 2000000 };
+const float PARTICLE_SHARES[] = { .5, .3, .2 };
+const ParticleKind PARTICLE_KINDS[] = {
+	// gravity, drag, restitution, friction, life, size, color
+	{ -9.8, .5, -1, 0, 1.5, .015, { .6, .65, .8, .4 } },
+	{ -1.5, 1.5, .3, .6, 5, .04, { .55, .45, .3, .3 } },
+	{ .5, .7, .2, .8, 8, .25, { .45, .45, .45, .1 } },
+};
+const float PARTICLE_WIND[] = { .8, 0, .3 };
+/* Fires the smoke rises from, the same spots that burn at night */
+const int SMOKE_SOURCES = 16;
+
+/*
+ * Trees on the gentle slopes below the tops and rocks on the steep
+ * ones, scattered over the terrain. V steps through the counts.
+ */
+const int SCATTER_COUNTS[] = { 0, 100000, 1000000, 5000000 };
+const LatheRing TREE_RINGS[] = {
+	{ 0, .06, { 90, 60, 35 } },
+	{ .2, .05, { 90, 60, 35 } },
+	{ .2, .3, { 30, 90, 40 } },
+	{ 1, 0, { 30, 90, 40 } },
+};
+const LatheRing ROCK_RINGS[] = {
+	{ 0, .5, { 120, 115, 105 } },
+	{ .4, .55, { 120, 115, 105 } },
+	{ .8, .3, { 120, 115, 105 } },
+	{ 1, 0, { 120, 115, 105 } },
+};
+const ScatterKind SCATTER_KINDS[] = {
+	// share, heights, slopes, scales, rings, sides
+	{ .7, -1.2, 1.3, 0, .6, .15, .45, TREE_RINGS, 4, { 12, 5 } },
+	{ .3, -1.7, 1.7, .3, 10, .03, .1, ROCK_RINGS, 4, { 9, 4 } },
+};
+
+struct Chunk {
+	short x, z;
+	short sizeX, sizeZ;
+	Vector min, max;
+	// Largest height difference to the full detail in world units per LOD
+	float error[MAX_LOD + 1];
+};
+
+/*
+ * Coarse mesh that lies below the chunk surface everywhere, rasterized
+ * into the occlusion buffer. Coordinates are padded to a multiple of four.
+ */
+struct Occluder {
+	float x[OCCLUDER_VERTICES];
+	float y[OCCLUDER_VERTICES];
+	float z[OCCLUDER_VERTICES];
+};
+
+/*
+ * What F3 steps through
+ */
+enum TerrainRenderer {
+	RENDERER_CHUNKS,
+	RENDERER_CLIPMAP,
+	RENDERER_ANIMATED,
+	RENDERERS,
+};
+
+const char* const RENDERER_NAMES[] = { "chunks", "clipmap", "animated surface" };
+
+/*
+ * Sections of the cache file
+ */
+enum CacheSection {
+	CACHE_NORMALS,
+	CACHE_PACKED_NORMALS,
+	CACHE_CHUNKS,
+	CACHE_OCCLUDERS,
+	CACHE_OCCLUDER_INDICES,
+	CACHE_RAY_PYRAMID,
+	CACHE_HORIZON_MAP,
+};
+
+/*
+ * Chunk vertices are either full floats or chunk local shorts with an
+ * octahedral normal, decoded in the vertex shader
+ */
+enum VertexFormat {
+	VERTEX_FLOAT,
+	VERTEX_PACKED,
+	VERTEX_FORMATS,
+};
+
+/*
+ * Shaders of the chunk renderer for one vertex format
+ */
+struct ChunkPrograms {
+	GLuint terrain, feedback, shadow;
+	GLint  sun, horizonLighting, virtualTexturing;
+	GLint  clusteredLights, clusterParams, sunIntensity, shadows;
+};
+
+struct ChunkDraw {
+	short x, z;
+	short lod;
+};
+
+/*
+ * Static vertex buffer of a chunk with every LOD in the packed format,
+ * created on the loader thread the first time the chunk is drawn. Edits
+ * bump the version, and a buffer of an older version is not drawn.
+ */
+struct ChunkBuffer {
+	GLuint buffer;
+	int    bufferVersion;
+	int    version;
+	bool   loading;
+};
+
+/*
+ * Everything the render thread needs to submit one frame
+ */
+struct RenderPacket {
+	int       frame;
+	float     frameTime;
+	Matrix    projection;
+	Matrix    modelView;
+	Vector    eye;
+	Frustum   frustum;
+	int       chunkCount;
+	ChunkDraw chunks[CHUNK_COUNT * CHUNK_COUNT];
+	int       occludedChunks;
+	int       triangles;
+	int       occludedTriangles;
+	int       bufferOccludedChunks;
+	int       occluderTriangles;
+	int       occlusionTime;
+	float     lodError;
+	float     drawDistance;
+	int       prepareTime;
+	Vector    sun;
+	LightClusters lights;
+	// Shadow casters per cascade, at their shadow LOD
+	bool      shadows;
+	ShadowCascade shadowCascades[ShadowCascades::CASCADES];
+	int       shadowChunkCount[ShadowCascades::CASCADES];
+	ChunkDraw shadowChunks[ShadowCascades::CASCADES][CHUNK_COUNT * CHUNK_COUNT];
+	int       shadowTriangles;
+	// Scatter chunks behind the terrain, if there are objects
+	bool      scatterCulled;
+	unsigned char hiddenScatter[SCATTER_CHUNKS];
+};
+
+/*
+ * The settings the render thread changes that preparing a packet reads,
+ * copied once per packet by the frame pipeline
+ */
+struct FrameSettings {
+	int   viewWidth, viewHeight;
+	TerrainRenderer renderer;
+	int   lightLevel;
+	int   scatterLevel;
+	bool  flythrough;
+	bool  useHorizon;
+	bool  useOcclusionBuffer;
+	bool  useShadows;
+	// From the frame budget if it is on
+	float lodError;
+	float drawDistance;
+};
+
+SDL_Surface *surface;
+GLDriver glDriver;
+GLDriver* driver = &glDriver;
+
+/* Ambient Light Values */
+GLfloat LightAmbient[]  = { 0.5f, 0.5f, 0.5f, 1.0f };
+/* Diffuse Light Values */
+GLfloat LightDiffuse[]  = { 1.0f, 1.0f, 1.0f, 1.0f };
+/* Light Position */
+GLfloat LightPosition[] = { 0.0f, 0.0f, 2.0f, 1.0f };
+
+short height[AREA_SIZE][AREA_SIZE];
+float normals[AREA_SIZE][AREA_SIZE][3];
+signed char packedNormals[AREA_SIZE][AREA_SIZE][2];
+Chunk chunks[CHUNK_COUNT][CHUNK_COUNT];
+ChunkBuffer chunkBuffers[CHUNK_COUNT][CHUNK_COUNT];
+Occluder occluders[CHUNK_COUNT][CHUNK_COUNT];
+unsigned short occluderIndices[3 * OCCLUDER_TRIANGLES];
+// The terrain as an occluder in the frame being prepared. prepareFrame()
+// builds both, culling on the same thread may test boxes against them.
+Horizon terrainHorizon;
+OcclusionBuffer occlusionBuffer;
+StreamBuffer* vertexStream;
+Clipmap* clipmap;
+AnimatedSurface* animatedSurface;
+SharedContext* sharedContext;
+ResourceLoader* resourceLoader;
+WorkerPool* workers;
+RayCaster* rayCaster;
+HeightSampler* heightSampler;
+HeightCollider* heightCollider;
+HorizonMap* horizonMap;
+VirtualTexture* virtualTexture;
+ChunkPrograms chunkPrograms[VERTEX_FORMATS];
+VertexFormat vertexFormat = VERTEX_FLOAT;
+ClusteredLighting* clusteredLighting;
+ShadowCascades* shadowCascades;
+ParticleSystem* particles[PARTICLE_SOURCES];
+ObjectScatter* scatter;
+FrameCapture* frameCapture;
+GpuTimer* terrainTimer;
+GpuTimer* upscaleTimer;
+GpuTimer* shadowTimer;
+GpuTimer* scatterTimer;
+OffscreenTarget* offscreen;
+int lightLevel = 0;
+int particleLevel = 0;
+int scatterLevel = 0;
+CaptureFormat captureFormat = CAPTURE_IMAGES;
+FrameBudget frameBudget(FRAME_BUDGET, LOD_ERROR, MAX_LOD_ERROR, MIN_DRAW_DISTANCE, MAX_DRAW_DISTANCE);
+bool useFrameBudget = false;
+int submitTime;
+ResolutionScale resolutionScale(FRAME_BUDGET);
+bool useDynamicResolution = false;
+int renderWidth = SCREEN_WIDTH, renderHeight = SCREEN_HEIGHT;
+TerrainRenderer renderer = RENDERER_CHUNKS;
+bool flythrough = false;
+// Set when the window regains focus, read by prepareFrame on the frame thread
+volatile bool resumed = false;
+bool useHorizon = true;
+bool useOcclusionBuffer = true;
+bool useHorizonLighting = true;
+bool useVirtualTexture = true;
+bool useShadows = true;
+bool derivedFromCache = false;
+int viewWidth = SCREEN_WIDTH, viewHeight = SCREEN_HEIGHT;
+int pickX = -1, pickY = -1;
+TerrainEditor* terrainEditor;
+BrushType brushType = BRUSH_RAISE;
+int editX = -1, editY = -1;
+
+void prepareFrame (RenderPacket& packet, const FrameSettings& settings);
+void captureSettings (FrameSettings& settings);
+FramePipeline<RenderPacket, FrameSettings> pipeline(prepareFrame, captureSettings);
+// Pipelined mode is off for the edit stroke in progress
+bool pipelineAfterStroke;
+
+/*
+ * Stops the capture and prints what it wrote and dropped in all
+ */
+void
+stopCapture ()
+{
+	frameCapture->stop();
+	const CaptureTotals& t = frameCapture->getTotals();
+	printf("Capture: %d frames captured, %d dropped, %d written (%lld KB), %lld us on the render thread\n",
+	       t.frames, t.dropped, t.written, t.writeBytes >> 10, t.captureTime);
+}
+
+void
+quit (int exitCode)
+{
+	pipeline.setPipelined(false);
+	if (frameCapture && frameCapture->isCapturing())
+		stopCapture();
+	delete clipmap;
+	delete animatedSurface;
+	delete vertexStream;
+	delete rayCaster;
+	delete heightSampler;
+	delete heightCollider;
+	delete horizonMap;
+	delete terrainEditor;
+	delete virtualTexture;
+	delete clusteredLighting;
+	delete shadowCascades;
+	for (int i = 0; i < PARTICLE_SOURCES; ++i)
+		delete particles[i];
+	delete scatter;
+	delete frameCapture;
+	delete terrainTimer;
+	delete upscaleTimer;
+	delete shadowTimer;
+	delete scatterTimer;
+	delete offscreen;
+	delete resourceLoader;
+	delete sharedContext;
+	delete workers;
+	SDL_Quit ();
+	exit (exitCode);
+}
+
+void
+resizeWindow (int width, int height)
+{
+	if (height == 0)
+		height = 1;
+	driver->glViewport (0, 0, width, height);
+
+	/* The projection is part of the render packet */
+	viewWidth = width;
+	viewHeight = height;
+
+	/* Scaled frames render into a part of a window sized framebuffer */
+	offscreen->resize(width, height);
+
+	/* The frames of a capture keep their size */
+	if (frameCapture->isCapturing()) {
+		stopCapture();
+		printf("Capture: stopped by the resize\n");
+	}
+}
+
+void
+handleKeyPress (SDL_keysym * keysym)
+{
+	bool pipelined;
+	switch (keysym->sym) {
+	case SDLK_ESCAPE:
+		quit (0);
+		break;
+
+	case SDLK_F1:
+		SDL_WM_ToggleFullScreen (surface);
+		break;
+
+	case SDLK_F2:
+		// A stroke in progress turns it off again until it ends
+		pipeline.setPipelined(!(pipeline.isPipelined() || pipelineAfterStroke));
+		pipelineAfterStroke = false;
+		printf("Frame pipeline: %s\n", pipeline.isPipelined() ? "pipelined" : "serial");
+		break;
+
+	case SDLK_F3:
+		do
+			renderer = (TerrainRenderer)((renderer + 1) % RENDERERS);
+		while ((renderer == RENDERER_CLIPMAP && !clipmap->isAvailable()) ||
+		       (renderer == RENDERER_ANIMATED && !animatedSurface->isAvailable()));
+		printf("Terrain renderer: %s\n", RENDERER_NAMES[renderer]);
+		break;
+
+	case SDLK_F4:
+		flythrough = !flythrough;
+		printf("Flythrough: %s\n", flythrough ? "on" : "off");
+		break;
+
+	case SDLK_F5:
+		useHorizon = !useHorizon;
+		printf("Horizon culling: %s\n", useHorizon ? "on" : "off");
+		break;
+
+	case SDLK_F6:
+		useOcclusionBuffer = !useOcclusionBuffer;
+		printf("Occlusion buffer: %s\n", useOcclusionBuffer ? "on" : "off");
+		break;
+
+	case SDLK_F7:
+		if (!chunkPrograms[vertexFormat].terrain || !horizonMap->getTexture()) {
+			printf("Horizon map lighting is not supported\n");
+			break;
+		}
+		useHorizonLighting = !useHorizonLighting;
+		printf("Horizon map lighting: %s\n", useHorizonLighting ? "on" : "off");
+		break;
+
+	case SDLK_F8:
+		if (!chunkPrograms[vertexFormat].feedback) {
+			printf("Virtual texturing is not supported\n");
+			break;
+		}
+		useVirtualTexture = !useVirtualTexture;
+		printf("Virtual texturing: %s\n", useVirtualTexture ? "on" : "off");
+		break;
+
+	case SDLK_F9:
+		if (!chunkPrograms[VERTEX_PACKED].terrain || !vertexStream->isAvailable()) {
+			printf("Packed vertices are not supported\n");
+			break;
+		}
+		vertexFormat = vertexFormat == VERTEX_PACKED ? VERTEX_FLOAT : VERTEX_PACKED;
+		printf("Vertex format: %s\n", vertexFormat == VERTEX_PACKED ? "packed" : "float");
+		break;
+
+	case SDLK_F10:
+		if (!clusteredLighting->isAvailable() || !chunkPrograms[vertexFormat].terrain) {
+			printf("Clustered lighting is not supported\n");
+			break;
+		}
+		lightLevel = (lightLevel + 1) % (sizeof (LIGHT_COUNTS) / sizeof (LIGHT_COUNTS[0]));
+		printf("Point lights: %d\n", LIGHT_COUNTS[lightLevel]);
+		break;
+
+	case SDLK_F11:
+		useFrameBudget = !useFrameBudget;
+		frameBudget.reset();
+		printf("Frame budget: %s, %.1f ms\n", useFrameBudget ? "on" : "off", frameBudget.getTarget());
+		break;
+
+	case SDLK_s:
+		if (!shadowCascades->isAvailable() || !chunkPrograms[vertexFormat].shadow) {
+			printf("Shadow maps are not supported\n");
+			break;
+		}
+		useShadows = !useShadows;
+		printf("Shadow maps: %s\n", useShadows ? "on" : "off");
+		break;
+
+	case SDLK_p:
+		particleLevel = (particleLevel + 1) % (sizeof (PARTICLE_COUNTS) / sizeof (PARTICLE_COUNTS[0]));
+		for (int i = 0; i < PARTICLE_SOURCES; ++i)
+			particles[i]->clear();
+		printf("Particles: %d\n", PARTICLE_COUNTS[particleLevel]);
+		break;
+
+	case SDLK_v:
+		if (!scatter->isAvailable()) {
+			printf("Object scattering is not supported\n");
+			break;
+		}
+		// The frame thread culls the chunks by their bounds
+		pipelined = pipeline.isPipelined();
+		pipeline.setPipelined(false);
+		scatterLevel = (scatterLevel + 1) % (sizeof (SCATTER_COUNTS) / sizeof (SCATTER_COUNTS[0]));
+		scatter->place(SCATTER_COUNTS[scatterLevel], workers);
+		pipeline.setPipelined(pipelined);
+		printf("Scatter: %d objects placed in %.1f ms\n", scatter->getInstanceCount(),
+		       scatter->getPlaceTime() * .001f);
+		break;
+
+	case SDLK_c:
+		if (!frameCapture->isAvailable()) {
+			printf("Frame capture is not supported\n");
+			break;
+		}
+		if (frameCapture->isCapturing()) {
+			stopCapture();
+			captureFormat = (CaptureFormat)(captureFormat + 1);
+			if (captureFormat > CAPTURE_VIDEO) {
+				captureFormat = CAPTURE_IMAGES;
+				printf("Capture: off\n");
+				break;
+			}
+		}
+		if (!frameCapture->start(captureFormat, captureFormat == CAPTURE_IMAGES ? CAPTURE_IMAGE_PATH :
+					 CAPTURE_VIDEO_PATH, viewWidth, viewHeight))
+			break;
+		if (captureFormat == CAPTURE_IMAGES)
+			printf("Capture: images to %s\n", CAPTURE_IMAGE_PATH);
+		else
+			printf("Capture: raw video to %s, %dx%d rgb24\n", CAPTURE_VIDEO_PATH, viewWidth, viewHeight);
+		break;
+
+	case SDLK_b:
+		brushType = (BrushType)((brushType + 1) % BRUSH_TYPES);
+		printf("Brush: %s\n", BRUSH_NAMES[brushType]);
+		break;
+
+	case SDLK_F12:
+		if (!offscreen->isAvailable() || !terrainTimer->isAvailable()) {
+			printf("Dynamic resolution is not supported\n");
+			break;
+		}
+		useDynamicResolution = !useDynamicResolution;
+		resolutionScale.reset();
+		printf("Dynamic resolution: %s, %.1f ms\n", useDynamicResolution ? "on" : "off",
+		       resolutionScale.getTarget());
+		break;
+	}
+}
+
+bool initGLDriver() {
 #define GL_PROC(ret, name, args)\
-ret (*name)args;
+	driver->name = (ret (*)args)SDL_GL_GetProcAddress(#name);
 #include "GLFuncs.h"
 #undef GL_PROC
-};
+	return true;
+}
+
+/*
+ * The height function is defined everywhere, the clipmap samples it
+ * beyond the area
+ */
+float terrainHeight(int x, int z) {
+	return 10.0 * sin(x/24.0) + 7.0 * cos((z-50.0)/18.0);
+}
+
+void initHeights() {
+    float h;
+    for (int x = 0; x < AREA_SIZE; ++x) {
+        for(int y = 0; y < AREA_SIZE; ++y) {
+            height[x][y] = (short)terrainHeight(x, y);
+        }
+    }
+}
+
+/*
+ * Octahedral encoding around the y axis. The lower hemisphere is folded
+ * over the diagonals, terrain normals never need it.
+ */
+void packNormal(const Vector& n, signed char* packed) {
+	float l = fabs(n[0]) + fabs(n[1]) + fabs(n[2]);
+	float x = n[0] / l, z = n[2] / l;
+	if (n[1] < 0) {
+		float fx = (1 - fabs(z)) * (x < 0 ? -1 : 1);
+		z = (1 - fabs(x)) * (z < 0 ? -1 : 1);
+		x = fx;
+	}
+	packed[0] = (signed char)floor(x * 127 + .5f);
+	packed[1] = (signed char)floor(z * 127 + .5f);
+}
+
+/*
+ * Central differences over [x0, x1) x [z0, z1), clamped at the border
+ */
+void updateNormals(int fromX, int fromZ, int toX, int toZ) {
+	for (int x = fromX; x < toX; ++x) {
+		int x0 = x > 0 ? x - 1 : x, x1 = x < AREA_SIZE - 1 ? x + 1 : x;
+		for (int z = fromZ; z < toZ; ++z) {
+			int z0 = z > 0 ? z - 1 : z, z1 = z < AREA_SIZE - 1 ? z + 1 : z;
+			Vector n((height[x0][z] - height[x1][z]) / (float)(x1 - x0), 1,
+				 (height[x][z0] - height[x][z1]) / (float)(z1 - z0));
+			n.normalize();
+			for (int i = 0; i < 3; ++i)
+				normals[x][z][i] = n[i];
+			packNormal(n, packedNormals[x][z]);
+		}
+	}
+}
+
+void initNormals() {
+	updateNormals(0, 0, AREA_SIZE, AREA_SIZE);
+}
+
+/*
+ * Compares every height with the bilinear interpolation of the quad
+ * that covers it at each LOD. Coarser LODs never get a smaller error,
+ * so the selection can stop at the first one above the threshold.
+ */
+void initChunkErrors(Chunk& c) {
+	c.error[0] = 0;
+	for (int lod = 1; lod <= MAX_LOD; ++lod) {
+		int step = 1 << lod;
+		float error = c.error[lod - 1];
+		for (int x0 = c.x; x0 < c.x + c.sizeX; x0 += step) {
+			int x1 = x0 + step < c.x + c.sizeX ? x0 + step : c.x + c.sizeX;
+			for (int z0 = c.z; z0 < c.z + c.sizeZ; z0 += step) {
+				int z1 = z0 + step < c.z + c.sizeZ ? z0 + step : c.z + c.sizeZ;
+				for (int x = x0; x <= x1; ++x) {
+					float fx = (float)(x - x0) / (x1 - x0);
+					for (int z = z0; z <= z1; ++z) {
+						float fz = (float)(z - z0) / (z1 - z0);
+						float h0 = height[x0][z0] + fz * (height[x0][z1] - height[x0][z0]);
+						float h1 = height[x1][z0] + fz * (height[x1][z1] - height[x1][z0]);
+						float e = fabs(h0 + fx * (h1 - h0) - height[x][z]) * WORLD_SCALE;
+						if (e > error)
+							error = e;
+					}
+				}
+			}
+		}
+		c.error[lod] = error;
+	}
+}
+
+/*
+ * Bounds and LOD errors of a chunk from its heights
+ */
+void updateChunk(int cx, int cz) {
+	Chunk& c = chunks[cx][cz];
+	short minHeight = height[c.x][c.z], maxHeight = minHeight;
+	for (int x = c.x; x <= c.x + c.sizeX; ++x) {
+		for (int z = c.z; z <= c.z + c.sizeZ; ++z) {
+			if (height[x][z] < minHeight)
+				minHeight = height[x][z];
+			if (height[x][z] > maxHeight)
+				maxHeight = height[x][z];
+		}
+	}
+	c.min = WORLD_SCALE * Vector(c.x, minHeight, c.z);
+	c.max = WORLD_SCALE * Vector(c.x + c.sizeX, maxHeight, c.z + c.sizeZ);
+	initChunkErrors(c);
+}
+
+void initChunks() {
+	for (int cx = 0; cx < CHUNK_COUNT; ++cx) {
+		for (int cz = 0; cz < CHUNK_COUNT; ++cz) {
+			Chunk& c = chunks[cx][cz];
+			c.x = cx * CHUNK_SIZE;
+			c.z = cz * CHUNK_SIZE;
+			// The last row and column of vertices have no cells
+			c.sizeX = c.x + CHUNK_SIZE < AREA_SIZE ? CHUNK_SIZE : AREA_SIZE - 1 - c.x;
+			c.sizeZ = c.z + CHUNK_SIZE < AREA_SIZE ? CHUNK_SIZE : AREA_SIZE - 1 - c.z;
+			updateChunk(cx, cz);
+		}
+	}
+}
+
+/*
+ * Triangles of a chunk at a LOD, with the skirts
+ */
+int chunkTriangles(const Chunk& c, int lod) {
+	int step = 1 << lod;
+	int quadsX = (c.sizeX + step - 1) >> lod, quadsZ = (c.sizeZ + step - 1) >> lod;
+	return 2 * quadsX * quadsZ + 4 * (quadsX + quadsZ);
+}
+
+/*
+ * Depth in height units the skirts of a chunk hang below its edges.
+ * Neighbours sample their shared edge at the same points, so along it
+ * either LOD lies within the error of that LOD on both chunks. The gap
+ * between them is at most twice the coarsest error of either one.
+ */
+int chunkSkirt(const Chunk& c) {
+	return (int)ceil(2 * c.error[MAX_LOD] / WORLD_SCALE);
+}
+
+/*
+ * Every occluder vertex takes the lowest height of the cells around it,
+ * so the interpolated mesh never rises above the terrain
+ */
+void updateOccluder(int cx, int cz) {
+	const Chunk& c = chunks[cx][cz];
+	Occluder& o = occluders[cx][cz];
+	for (int i = 0; i < OCCLUDER_VERTICES; ++i) {
+		int u = i / OCCLUDER_SIZE, v = i % OCCLUDER_SIZE;
+		if (u >= OCCLUDER_SIZE)
+			u = v = 0;
+		int x = c.x + (u * OCCLUDER_STEP < c.sizeX ? u * OCCLUDER_STEP : c.sizeX);
+		int z = c.z + (v * OCCLUDER_STEP < c.sizeZ ? v * OCCLUDER_STEP : c.sizeZ);
+
+		int x0 = x - OCCLUDER_STEP > c.x ? x - OCCLUDER_STEP : c.x;
+		int x1 = x + OCCLUDER_STEP < c.x + c.sizeX ? x + OCCLUDER_STEP : c.x + c.sizeX;
+		int z0 = z - OCCLUDER_STEP > c.z ? z - OCCLUDER_STEP : c.z;
+		int z1 = z + OCCLUDER_STEP < c.z + c.sizeZ ? z + OCCLUDER_STEP : c.z + c.sizeZ;
+		short h = height[x][z];
+		for (int hx = x0; hx <= x1; ++hx) {
+			for (int hz = z0; hz <= z1; ++hz) {
+				if (height[hx][hz] < h)
+					h = height[hx][hz];
+			}
+		}
+
+		o.x[i] = WORLD_SCALE * x;
+		o.y[i] = WORLD_SCALE * h;
+		o.z[i] = WORLD_SCALE * z;
+	}
+}
+
+void initOccluders() {
+	for (int i = 0; i < OCCLUDER_SIZE - 1; ++i) {
+		for (int j = 0; j < OCCLUDER_SIZE - 1; ++j) {
+			unsigned short* t = occluderIndices + 6 * (i * (OCCLUDER_SIZE - 1) + j);
+			int v = i * OCCLUDER_SIZE + j;
+			t[0] = v;
+			t[1] = v + OCCLUDER_SIZE;
+			t[2] = v + 1;
+			t[3] = v + 1;
+			t[4] = v + OCCLUDER_SIZE;
+			t[5] = v + OCCLUDER_SIZE + 1;
+		}
+	}
+
+	for (int cx = 0; cx < CHUNK_COUNT; ++cx) {
+		for (int cz = 0; cz < CHUNK_COUNT; ++cz)
+			updateOccluder(cx, cz);
+	}
+}
+
+/*
+ * Hash of the heights and of every parameter the derived data depends
+ * on. The struct sizes stand for their layout.
+ */
+unsigned long long
+cacheKey ()
+{
+	int parameters[] = {
+		AREA_SIZE, CHUNK_SIZE, MAX_LOD, OCCLUDER_STEP, (int)sizeof (Chunk), (int)sizeof (Occluder),
+		HorizonMap::DIRECTIONS, HorizonMap::MAX_DISTANCE, HorizonMap::MAX_STEPS,
+	};
+	unsigned long long key = hashBytes(height, sizeof (height));
+	key = hashBytes(parameters, sizeof (parameters), key);
+	return hashBytes(&WORLD_SCALE, sizeof (WORLD_SCALE), key);
+}
+
+/*
+ * Normals, chunks, occluders, the ray quadtree and the horizon map from
+ * the heights
+ */
+void
+deriveData ()
+{
+	initNormals();
+	initChunks();
+	initOccluders();
+	rayCaster = new RayCaster(&height[0][0], AREA_SIZE, WORLD_SCALE);
+	horizonMap = new HorizonMap(&height[0][0], AREA_SIZE);
+	horizonMap->bake(workers);
+}
+
+/*
+ * The same from a loaded cache, false if a section is missing
+ */
+bool
+restoreDerivedData (const TerrainCache& cache)
+{
+	const void* normalData = cache.find(CACHE_NORMALS, sizeof (normals));
+	const void* packedNormalData = cache.find(CACHE_PACKED_NORMALS, sizeof (packedNormals));
+	const void* chunkData = cache.find(CACHE_CHUNKS, sizeof (chunks));
+	const void* occluderData = cache.find(CACHE_OCCLUDERS, sizeof (occluders));
+	const void* indexData = cache.find(CACHE_OCCLUDER_INDICES, sizeof (occluderIndices));
+	const void* pyramid = cache.find(CACHE_RAY_PYRAMID, RayCaster::getPyramidBytes(AREA_SIZE));
+	const void* horizons = cache.find(CACHE_HORIZON_MAP, HorizonMap::LAYERS * AREA_SIZE * AREA_SIZE * 4);
+	if (!normalData || !packedNormalData || !chunkData || !occluderData || !indexData ||
+	    !pyramid || !horizons)
+		return false;
+
+	memcpy(normals, normalData, sizeof (normals));
+	memcpy(packedNormals, packedNormalData, sizeof (packedNormals));
+	memcpy(chunks, chunkData, sizeof (chunks));
+	memcpy(occluders, occluderData, sizeof (occluders));
+	memcpy(occluderIndices, indexData, sizeof (occluderIndices));
+	rayCaster = new RayCaster(&height[0][0], AREA_SIZE, WORLD_SCALE, (const short*)pyramid);
+	horizonMap = new HorizonMap(&height[0][0], AREA_SIZE);
+	horizonMap->restore((const unsigned char*)horizons);
+	return true;
+}
+
+bool
+saveDerivedData (TerrainCache& cache)
+{
+	cache.add(CACHE_NORMALS, normals, sizeof (normals));
+	cache.add(CACHE_PACKED_NORMALS, packedNormals, sizeof (packedNormals));
+	cache.add(CACHE_CHUNKS, chunks, sizeof (chunks));
+	cache.add(CACHE_OCCLUDERS, occluders, sizeof (occluders));
+	cache.add(CACHE_OCCLUDER_INDICES, occluderIndices, sizeof (occluderIndices));
+	cache.add(CACHE_RAY_PYRAMID, rayCaster->getPyramid(), RayCaster::getPyramidBytes(AREA_SIZE));
+	cache.add(CACHE_HORIZON_MAP, horizonMap->getData(), horizonMap->getMemory());
+	return cache.save();
+}
+
+/*
+ * Loads the derived data if the cache was built from the same heights,
+ * otherwise derives it and writes the cache for the next start. Returns
+ * true if it came from the cache.
+ */
+bool
+initDerivedData (const char* path)
+{
+	long long start = getMicroseconds();
+	TerrainCache cache(path, cacheKey());
+	if (cache.load() && restoreDerivedData(cache)) {
+		printf("Derived data: loaded %d KB from %s in %.2f ms\n", (int)(cache.getSize() >> 10),
+		       path, (getMicroseconds() - start) * .001f);
+		return true;
+	}
+
+	deriveData();
+	long long derived = getMicroseconds();
+	printf("Horizon map: %d samples x %d directions baked in %.2f ms, %d KB\n",
+	       AREA_SIZE * AREA_SIZE, HorizonMap::DIRECTIONS,
+	       horizonMap->getBakeTime() * .001f, horizonMap->getMemory() >> 10);
+	bool saved = saveDerivedData(cache);
+	printf("Derived data: built in %.2f ms, %s %s in %.2f ms\n", (derived - start) * .001f,
+	       saved ? "saved to" : "could not save", path, (getMicroseconds() - derived) * .001f);
+	return false;
+}
+
+unsigned
+hashTexel (int x, int y)
+{
+	unsigned h = x * 374761393u + y * 668265263u;
+	h = (h ^ (h >> 13)) * 1274126177u;
+	return h ^ (h >> 16);
+}
+
+/*
+ * Value noise on a lattice of cell texels, 0 to 1
+ */
+float
+valueNoise (float x, float y, int cell)
+{
+	x /= cell;
+	y /= cell;
+	int ix = (int)floor(x), iy = (int)floor(y);
+	float fx = x - ix, fy = y - iy;
+	fx = fx * fx * (3 - 2 * fx);
+	fy = fy * fy * (3 - 2 * fy);
+	float n00 = hashTexel(ix, iy) / 4294967295.f, n10 = hashTexel(ix + 1, iy) / 4294967295.f;
+	float n01 = hashTexel(ix, iy + 1) / 4294967295.f, n11 = hashTexel(ix + 1, iy + 1) / 4294967295.f;
+	float n0 = n00 + fx * (n10 - n00), n1 = n01 + fx * (n11 - n01);
+	return n0 + fy * (n1 - n0);
+}
+
+/*
+ * Fills a virtual texture page with grass, rock on the steep slopes and
+ * noise. Octaves finer than the texels of the level are replaced by
+ * their mean, so coarse levels look like the filtered fine ones.
+ * Runs on the page producer thread.
+ */
+void
+produceSurfacePage (int level, int x, int y, int size, unsigned char* rgba)
+{
+	static const int cells[] = { 2, 8, 32, 128 };
+	int texels = VirtualTexture::TEXELS >> level, footprint = 1 << level;
+	for (int j = 0; j < size; ++j) {
+		int ty = y + j < 0 ? 0 : y + j >= texels ? texels - 1 : y + j;
+		for (int i = 0; i < size; ++i, rgba += 4) {
+			int tx = x + i < 0 ? 0 : x + i >= texels ? texels - 1 : x + i;
+
+			// Texel center in finest level texels, then grid units
+			float fx = (tx + .5f) * footprint, fy = (ty + .5f) * footprint;
+			int gx = (int)(fx * AREA_SIZE / VirtualTexture::TEXELS);
+			int gz = (int)(fy * AREA_SIZE / VirtualTexture::TEXELS);
+			float rock = (1 - normals[gx][gz][1] - .1f) * 8;
+			rock = rock < 0 ? 0 : rock > 1 ? 1 : rock;
+
+			float detail = 0, amplitude = .5;
+			for (int o = 0; o < 4; ++o, amplitude *= .5)
+				detail += amplitude * (cells[o] > footprint ? valueNoise(fx, fy, cells[o]) : .5f);
+			float shade = .6f + .8f * detail;
+
+			rgba[0] = (unsigned char)(shade * (60 + rock * 50));
+			rgba[1] = (unsigned char)(shade * (110 - rock * 10));
+			rgba[2] = (unsigned char)(shade * (30 + rock * 60));
+			rgba[3] = 255;
+		}
+	}
+}
+
+/*
+ * Chunk shading with sun shadows and ambient occlusion from the
+ * horizon map and surface detail from the virtual texture, the fixed
+ * function lighting is the fallback. The feedback program writes the
+ * virtual texture pages the chunks need.
+ *
+ * Packed vertices hold the grid position, the world scale comes in as
+ * a constant attribute.
+ */
+void
+initChunkPrograms (VertexFormat format)
+{
+	static const char* vertexSource =
+		"#ifdef PACKED_VERTICES\n"
+		"in vec3 packedPosition;\n"
+		"in vec2 packedNormal;\n"
+		"in float gridScale;\n"
+		"vec3 octahedralDecode(vec2 e) {\n"
+		"	vec3 n = vec3(e.x, 1. - abs(e.x) - abs(e.y), e.y);\n"
+		"	if (n.y < 0.)\n"
+		"		n.xz = (1. - abs(n.zx)) * sign(n.xz);\n"
+		"	return normalize(n);\n"
+		"}\n"
+		"#endif\n"
+		"out vec3 position;\n"
+		"out vec3 normal;\n"
+		"out float depth;\n"
+		"void main() {\n"
+		"#ifdef PACKED_VERTICES\n"
+		"	vec4 vertex = vec4(packedPosition.xzy * gridScale, 1.);\n"
+		"	normal = octahedralDecode(packedNormal);\n"
+		"#else\n"
+		"	vec4 vertex = gl_Vertex;\n"
+		"	normal = gl_Normal;\n"
+		"#endif\n"
+		"	position = vertex.xyz;\n"
+		"	depth = -(gl_ModelViewMatrix * vertex).z;\n"
+		"	gl_FrontColor = gl_Color;\n"
+		"	gl_Position = gl_ModelViewProjectionMatrix * vertex;\n"
+		"}\n";
+	static const char* fragmentSource =
+		"uniform sampler2DArray horizon;\n"
+		"uniform sampler2D virtualIndirection;\n"
+		"uniform sampler2D virtualAtlas;\n"
+		"uniform usampler2D lightClusters;\n"
+		"uniform sampler2D lightData;\n"
+		"uniform bool horizonLighting;\n"
+		"uniform bool virtualTexturing;\n"
+		"uniform bool clusteredLights;\n"
+		"uniform bool shadows;\n"
+		"uniform vec4 clusterParams;\n"
+		"uniform vec3 sun;\n"
+		"uniform float sunIntensity;\n"
+		"uniform vec2 areaScale;\n"
+		"in vec3 position;\n"
+		"in vec3 normal;\n"
+		"in float depth;\n"
+		"void main() {\n"
+		"	vec2 uv = position.xz * areaScale.x;\n"
+		"	vec3 color = gl_Color.rgb;\n"
+		"	if (virtualTexturing) {\n"
+		"		vec4 detail = virtualTexture(virtualIndirection, virtualAtlas, uv);\n"
+		"		color = mix(color, detail.rgb, detail.a);\n"
+		"	}\n"
+		"	vec3 n = normalize(normal);\n"
+		"	float ambient = .5, light = max(dot(n, sun), 0.);\n"
+		"	if (horizonLighting) {\n"
+		"		ambient *= horizonOcclusion(horizon, uv + areaScale.y);\n"
+		"		light *= horizonShadow(horizon, uv + areaScale.y, sun);\n"
+		"	}\n"
+		"	if (shadows)\n"
+		"		light *= cascadeShadow(position, depth);\n"
+		"	vec3 lit = vec3((ambient + light) * sunIntensity);\n"
+		"	if (clusteredLights)\n"
+		"		lit += clusteredLighting(lightClusters, lightData, clusterParams, position, n, depth);\n"
+		"	gl_FragColor = vec4(color * lit, 1.);\n"
+		"}\n";
+	static const char* feedbackSource =
+		"uniform vec2 areaScale;\n"
+		"uniform float feedbackBias;\n"
+		"in vec3 position;\n"
+		"void main() {\n"
+		"	gl_FragColor = virtualFeedback(position.xz * areaScale.x, feedbackBias);\n"
+		"}\n";
+	static const char* shadowSource =
+		"#version 130\n"
+		"void main() {\n"
+		"}\n";
+	static const char* attributes[] = { "packedPosition", "packedNormal", "gridScale", NULL };
+
+	ChunkPrograms& p = chunkPrograms[format];
+	const char* const* bound = format == VERTEX_PACKED ? attributes : NULL;
+	char vertex[2048], source[8192];
+	snprintf(vertex, sizeof (vertex), "#version 130\n%s%s",
+		 format == VERTEX_PACKED ? "#define PACKED_VERTICES\n" : "", vertexSource);
+	snprintf(source, sizeof (source), "#version 130\n%s%s%s%s%s", HorizonMap::shaderSource(),
+		 VirtualTexture::shaderSource(), ClusteredLighting::shaderSource(),
+		 ShadowCascades::shaderSource(), fragmentSource);
+	p.terrain = linkProgram(vertex, source, bound);
+	if (!p.terrain)
+		return;
+	p.shadow = linkProgram(vertex, shadowSource, bound);
+
+	driver->glUseProgram(p.terrain);
+	driver->glUniform1i(driver->glGetUniformLocation(p.terrain, "horizon"), 0);
+	driver->glUniform1i(driver->glGetUniformLocation(p.terrain, "virtualIndirection"), 1);
+	driver->glUniform1i(driver->glGetUniformLocation(p.terrain, "virtualAtlas"), 2);
+	driver->glUniform1i(driver->glGetUniformLocation(p.terrain, "lightClusters"), 3);
+	driver->glUniform1i(driver->glGetUniformLocation(p.terrain, "lightData"), 4);
+	driver->glUniform1i(driver->glGetUniformLocation(p.terrain, "shadowMap"), 5);
+	driver->glUniform2f(driver->glGetUniformLocation(p.terrain, "areaScale"),
+			    1 / (WORLD_SCALE * AREA_SIZE), .5f / AREA_SIZE);
+	p.sun = driver->glGetUniformLocation(p.terrain, "sun");
+	p.horizonLighting = driver->glGetUniformLocation(p.terrain, "horizonLighting");
+	p.virtualTexturing = driver->glGetUniformLocation(p.terrain, "virtualTexturing");
+	p.clusteredLights = driver->glGetUniformLocation(p.terrain, "clusteredLights");
+	p.clusterParams = driver->glGetUniformLocation(p.terrain, "clusterParams");
+	p.sunIntensity = driver->glGetUniformLocation(p.terrain, "sunIntensity");
+	p.shadows = driver->glGetUniformLocation(p.terrain, "shadows");
+	driver->glUseProgram(0);
+
+	if (!virtualTexture->isAvailable())
+		return;
+	snprintf(source, sizeof (source), "#version 130\n%s%s",
+		 VirtualTexture::shaderSource(), feedbackSource);
+	p.feedback = linkProgram(vertex, source, bound);
+	if (!p.feedback)
+		return;
+
+	driver->glUseProgram(p.feedback);
+	driver->glUniform2f(driver->glGetUniformLocation(p.feedback, "areaScale"),
+			    1 / (WORLD_SCALE * AREA_SIZE), .5f / AREA_SIZE);
+	driver->glUniform1f(driver->glGetUniformLocation(p.feedback, "feedbackBias"),
+			    -log2f(FEEDBACK_SCALE));
+	driver->glUseProgram(0);
+}
+
+bool
+initGL ()
+{
+	if (!initGLDriver())
+		return false;
+
+	initHeights();
+	derivedFromCache = initDerivedData(CACHE_PATH);
+	heightSampler = new HeightSampler(&height[0][0], AREA_SIZE, WORLD_SCALE);
+	heightCollider = new HeightCollider(&height[0][0], AREA_SIZE, WORLD_SCALE);
+	terrainEditor = new TerrainEditor(&height[0][0], AREA_SIZE);
+
+	vertexStream = new StreamBuffer(GL_ARRAY_BUFFER, STREAM_BUFFER_SIZE);
+	clipmap = new Clipmap(terrainHeight, WORLD_SCALE, -17, 17);
+	animatedSurface = new AnimatedSurface(ANIMATED_SIZE, WORLD_SCALE * (AREA_SIZE - 1) / (ANIMATED_SIZE - 1),
+					      WAVE_LAYERS, sizeof (WAVE_LAYERS) / sizeof (WAVE_LAYERS[0]));
+	animatedSurface->initGL();
+
+	horizonMap->upload();
+
+	virtualTexture = new VirtualTexture(produceSurfacePage);
+	printf("Virtual texture: %dx%d texels, %d KB cache\n", VirtualTexture::TEXELS,
+	       VirtualTexture::TEXELS, virtualTexture->getMemory() >> 10);
+	clusteredLighting = new ClusteredLighting();
+	shadowCascades = new ShadowCascades();
+	int maxParticles = PARTICLE_COUNTS[sizeof (PARTICLE_COUNTS) / sizeof (PARTICLE_COUNTS[0]) - 1];
+	for (int i = 0; i < PARTICLE_SOURCES; ++i) {
+		// Room for the spread of the lifetimes
+		particles[i] = new ParticleSystem(PARTICLE_KINDS[i], 3 * PARTICLE_SHARES[i] * maxParticles / 2,
+						  heightSampler);
+		particles[i]->initGL();
+	}
+	scatter = new ObjectScatter(heightSampler, AREA_SIZE, SCATTER_CHUNK_SIZE, WORLD_SCALE, SCATTER_KINDS,
+				    sizeof (SCATTER_KINDS) / sizeof (SCATTER_KINDS[0]));
+	scatter->initGL();
+	frameCapture = new FrameCapture();
+	terrainTimer = new GpuTimer();
+	upscaleTimer = new GpuTimer();
+	shadowTimer = new GpuTimer();
+	scatterTimer = new GpuTimer();
+	offscreen = new OffscreenTarget();
+	initChunkPrograms(VERTEX_FLOAT);
+	initChunkPrograms(VERTEX_PACKED);
+	if (chunkPrograms[VERTEX_PACKED].terrain && vertexStream->isAvailable())
+		vertexFormat = VERTEX_PACKED;
+	resourceLoader = new ResourceLoader(sharedContext);
+	printf("Resource loader: %s\n", resourceLoader->isAvailable() ? "shared context" : "not supported");
+
+	driver->glShadeModel (GL_SMOOTH);
+	driver->glClearColor (0, 0, 0, 0);
+	driver->glClearDepth (1);
+	driver->glEnable (GL_DEPTH_TEST);
+	//driver->glEnable (GL_BLEND);
+	//driver->glBlendFunc (GL_SRC_ALPHA, GL_ONE);
+	//driver->glHint (GL_PERSPECTIVE_CORRECTION_HINT, GL_NICEST);
+	//driver->glHint (GL_POINT_SMOOTH_HINT, GL_NICEST);
+
+    /* Setup The Ambient Light */
+    driver->glLightfv( GL_LIGHT1, GL_AMBIENT, LightAmbient );
+
+    /* Setup The Diffuse Light */
+    driver->glLightfv( GL_LIGHT1, GL_DIFFUSE, LightDiffuse );
+
+    /* Position The Light */
+    driver->glLightfv( GL_LIGHT1, GL_POSITION, LightPosition );
+
+    /* Enable Light One */
+    driver->glEnable( GL_LIGHT1 );
+driver->glEnable( GL_LIGHTING );
+
+	return true;
+}
+
+void
+flythroughCamera (float time, Matrix& modelView, Vector& eye)
+{
+	float a = 2 * M_PI * time / FLYTHROUGH_PERIOD;
+	float x = AREA_SIZE / 2 + FLYTHROUGH_RADIUS * cos(a);
+	float z = AREA_SIZE / 2 + FLYTHROUGH_RADIUS * sin(a);
+	eye = WORLD_SCALE * Vector(x, terrainHeight((int)x, (int)z) + FLYTHROUGH_ALTITUDE, z);
+
+	// Looking along the tangent, counter clockwise
+	float yaw = atan2(-sin(a), -cos(a));
+	modelView = rotateX(Matrix::IDENTITY, FLYTHROUGH_PITCH) *
+		rotateY(Matrix::IDENTITY, yaw) * translationMatrix(-eye);
+}
+
+void
+fixedCamera (Matrix& modelView, Vector& eye)
+{
+	Matrix rotation = rotateX(Matrix::IDENTITY, .35);
+	modelView = translationMatrix(-13, 0, -42) * rotation;
+	eye = transpose(rotation) * Vector(13, 0, 42);
+}
+
+/*
+ * Night scene, fires burning at fixed spots and vehicles driving in
+ * circles around the center, all just above the ground
+ */
+void
+placeLights (PointLight* lights, int count, float time)
+{
+	float extent = WORLD_SCALE * (AREA_SIZE - 1);
+	for (int i = 0; i < count; ++i) {
+		PointLight& l = lights[i];
+		unsigned h = hashTexel(i, 0);
+		float u = (h & 0xffff) / 65535.f, v = (h >> 16) / 65535.f;
+		float x, z;
+		if (i % 2) {
+			float flicker = .8f + .2f * sin(13 * time + i);
+			x = u * extent;
+			z = v * extent;
+			l.radius = .8f * flicker;
+			l.color = Vector(1, .45, .1) * flicker;
+		} else {
+			float r = (.1f + .85f * u) * extent / 2;
+			float a = 2 * M_PI * v + (i % 4 ? .3f : -.3f) * time;
+			x = extent / 2 + r * cos(a);
+			z = extent / 2 + r * sin(a);
+			l.radius = 1.2;
+			l.color = Vector(.8, .8, .9);
+		}
+		l.position = Vector(x, heightSampler->sample(x, z) + .3f, z);
+	}
+}
+
+/*
+ * Sums up the culling over one round of the flythrough
+ */
+void
+flythroughStats (const RenderPacket& packet, float time)
+{
+	static int round = 0, frames = 0, chunks = 0, occludedChunks = 0;
+	static long triangles = 0, occludedTriangles = 0;
+
+	if ((int)(time / FLYTHROUGH_PERIOD) != round) {
+		if (frames) {
+			printf("Flythrough: %d frames, %.1f%% chunks and %.1f%% triangles occluded\n",
+			       frames, 100.f * occludedChunks / chunks,
+			       100.f * occludedTriangles / triangles);
+		}
+		round = (int)(time / FLYTHROUGH_PERIOD);
+		frames = chunks = occludedChunks = 0;
+		triangles = occludedTriangles = 0;
+	}
+
+	++frames;
+	chunks += packet.chunkCount + packet.occludedChunks;
+	occludedChunks += packet.occludedChunks;
+	triangles += packet.triangles + packet.occludedTriangles;
+	occludedTriangles += packet.occludedTriangles;
+}
+
+struct ChunkOrder {
+	float dist;
+	short x, z;
+};
+
+int
+compareChunkOrder (const void* a, const void* b)
+{
+	float d = ((const ChunkOrder*)a)->dist - ((const ChunkOrder*)b)->dist;
+	return d < 0 ? -1 : d > 0;
+}
+
+/*
+ * Coarsest LOD whose error projects to at most the threshold in pixels.
+ * pixelScale is the projected size of one world unit at distance one.
+ */
+int
+chunkLod (const Chunk& c, float dist, float pixelScale, float threshold)
+{
+	int lod = 0;
+	while (lod < MAX_LOD && c.error[lod + 1] * pixelScale <= threshold * dist)
+		++lod;
+	return lod;
+}
+
+/*
+ * Fits the shadow cascades to the view and picks the chunks that cast
+ * into each. Shadows need much less detail than the view, so casters
+ * take the coarsest LOD within SHADOW_LOD_TEXELS texels of the cascade.
+ */
+void
+prepareShadows (RenderPacket& packet)
+{
+	Vector sceneMin = chunks[0][0].min, sceneMax = chunks[0][0].max;
+	for (int cx = 0; cx < CHUNK_COUNT; ++cx) {
+		for (int cz = 0; cz < CHUNK_COUNT; ++cz) {
+			const Chunk& c = chunks[cx][cz];
+			for (int i = 0; i < 3; ++i) {
+				sceneMin[i] = c.min[i] < sceneMin[i] ? c.min[i] : sceneMin[i];
+				sceneMax[i] = c.max[i] > sceneMax[i] ? c.max[i] : sceneMax[i];
+			}
+		}
+	}
+	ShadowCascades::fit(packet.projection, packet.modelView, packet.sun, NEAR_PLANE, SHADOW_DISTANCE,
+			    sceneMin, sceneMax, packet.shadowCascades);
+
+	packet.shadowTriangles = 0;
+	for (int i = 0; i < ShadowCascades::CASCADES; ++i) {
+		const ShadowCascade& cascade = packet.shadowCascades[i];
+		float threshold = SHADOW_LOD_TEXELS * cascade.texelSize;
+		int& count = packet.shadowChunkCount[i];
+		count = 0;
+		for (int cx = 0; cx < CHUNK_COUNT; ++cx) {
+			for (int cz = 0; cz < CHUNK_COUNT; ++cz) {
+				const Chunk& c = chunks[cx][cz];
+				if (!cascade.frustum.intersectsBox(c.min, c.max))
+					continue;
+				int lod = 0;
+				while (lod < MAX_LOD && c.error[lod + 1] <= threshold)
+					++lod;
+				ChunkDraw& draw = packet.shadowChunks[i][count++];
+				draw.x = cx;
+				draw.z = cz;
+				draw.lod = lod;
+				packet.shadowTriangles += chunkTriangles(c, lod);
+			}
+		}
+	}
+}
+
+/*
+ * True if the objects of scatter chunk i are behind the horizon or in
+ * the occlusion buffer, whichever is given
+ */
+bool
+isScatterHidden (const ObjectScatter& objects, int i, const Matrix& clip, const Horizon* horizon,
+		 const OcclusionBuffer* buffer)
+{
+	Vector min, max;
+	if (!objects.getChunkBounds(i, min, max))
+		return false;
+	return (horizon && horizon->isOccluded(clip, min, max)) || (buffer && buffer->isOccluded(min, max));
+}
+
+/*
+ * Marks the scatter chunks on a terrain chunk that the terrain hides
+ */
+void
+hideScatter (RenderPacket& packet, const Matrix& clip, const Chunk& c, const Horizon* horizon,
+	     const OcclusionBuffer* buffer)
+{
+	for (int x = c.x; x < c.x + c.sizeX; x += SCATTER_CHUNK_SIZE) {
+		for (int z = c.z; z < c.z + c.sizeZ; z += SCATTER_CHUNK_SIZE) {
+			int i = scatter->getChunk(x, z);
+			if (!packet.hiddenScatter[i])
+				packet.hiddenScatter[i] = isScatterHidden(*scatter, i, clip, horizon, buffer);
+		}
+	}
+}
+
+/*
+ * Copies the settings for the next packet, on the render thread
+ */
+void
+captureSettings (FrameSettings& settings)
+{
+	settings.viewWidth = viewWidth;
+	settings.viewHeight = viewHeight;
+	settings.renderer = renderer;
+	settings.lightLevel = lightLevel;
+	settings.scatterLevel = scatterLevel;
+	settings.flythrough = flythrough;
+	settings.useHorizon = useHorizon;
+	settings.useOcclusionBuffer = useOcclusionBuffer;
+	settings.useShadows = useShadows;
+	settings.lodError = useFrameBudget ? frameBudget.getErrorThreshold() : LOD_ERROR;
+	settings.drawDistance = useFrameBudget ? frameBudget.getDrawDistance() : MAX_DRAW_DISTANCE;
+}
+
+/*
+ * Builds the packet for the next frame. Runs on the render thread in
+ * serial mode and on the frame thread in pipelined mode, so it must not
+ * touch GL or read the settings but through their copy.
+ */
+void
+prepareFrame (RenderPacket& packet, const FrameSettings& settings)
+{
+	static int frame = 0, lastTicks = SDL_GetTicks();
+	static float flythroughTime = 0, sunTime = 0;
+	int ticks = SDL_GetTicks();
+	long long start = getMicroseconds();
+
+	// The time the window was in the background does not count
+	if (resumed) {
+		lastTicks = ticks;
+		resumed = false;
+	}
+	packet.frame = frame++;
+	packet.frameTime = (ticks - lastTicks) * .001f;
+	lastTicks = ticks;
+
+	packet.projection = perspectiveMatrix(45.0f, (float) settings.viewWidth / settings.viewHeight, NEAR_PLANE, FAR_PLANE);
+	if (settings.flythrough) {
+		flythroughTime += packet.frameTime;
+		flythroughCamera(flythroughTime, packet.modelView, packet.eye);
+	} else {
+		fixedCamera(packet.modelView, packet.eye);
+	}
+
+	sunTime += packet.frameTime;
+	float azimuth = 2 * M_PI * sunTime / SUN_PERIOD;
+	packet.sun = Vector(cos(azimuth) * cos(SUN_ELEVATION), sin(SUN_ELEVATION),
+			    sin(azimuth) * cos(SUN_ELEVATION));
+
+	static PointLight lights[LightClusters::MAX_LIGHTS];
+	int lightCount = LIGHT_COUNTS[settings.lightLevel];
+	placeLights(lights, lightCount, sunTime);
+	packet.lights.bin(lights, lightCount, packet.modelView, packet.projection,
+			  NEAR_PLANE, FAR_PLANE, workers);
+
+	Matrix clip = packet.projection * packet.modelView;
+	packet.frustum = Frustum(clip);
+
+	packet.lodError = settings.lodError;
+	packet.drawDistance = settings.drawDistance;
+	float pixelScale = packet.projection(1, 1) * settings.viewHeight / 2;
+
+	// Front to back, so nearer chunks raise the horizon first
+	ChunkOrder order[CHUNK_COUNT * CHUNK_COUNT];
+	int count = 0;
+	for (int cx = 0; cx < CHUNK_COUNT; ++cx) {
+		for (int cz = 0; cz < CHUNK_COUNT; ++cz) {
+			const Chunk& c = chunks[cx][cz];
+			if (!packet.frustum.intersectsBox(c.min, c.max))
+				continue;
+			order[count].dist = ((c.min + c.max) / 2 - packet.eye).length();
+			if (order[count].dist > packet.drawDistance)
+				continue;
+			order[count].x = cx;
+			order[count].z = cz;
+			++count;
+		}
+	}
+	qsort(order, count, sizeof (ChunkOrder), compareChunkOrder);
+
+	packet.scatterCulled = settings.scatterLevel != 0;
+	if (packet.scatterCulled)
+		memset(packet.hiddenScatter, 0, sizeof (packet.hiddenScatter));
+
+	terrainHorizon.clear(clip);
+	packet.chunkCount = packet.occludedChunks = 0;
+	packet.triangles = packet.occludedTriangles = 0;
+	for (int i = 0; i < count; ++i) {
+		const Chunk& c = chunks[order[i].x][order[i].z];
+
+		int lod = chunkLod(c, order[i].dist, pixelScale, packet.lodError);
+		int triangles = chunkTriangles(c, lod);
+
+		// Before the chunk raises the horizon, the objects stand on it
+		if (settings.useHorizon && packet.scatterCulled)
+			hideScatter(packet, clip, c, &terrainHorizon, NULL);
+
+		if (settings.useHorizon && terrainHorizon.isOccluded(clip, c.min, c.max)) {
+			++packet.occludedChunks;
+			packet.occludedTriangles += triangles;
+			continue;
+		}
+		terrainHorizon.addOccluder(clip, c.min, c.max);
+
+		ChunkDraw& draw = packet.chunks[packet.chunkCount++];
+		draw.x = order[i].x;
+		draw.z = order[i].z;
+		draw.lod = lod;
+		packet.triangles += triangles;
+	}
+
+	// The survivors of the horizon occlude each other in the depth buffer
+	packet.bufferOccludedChunks = packet.occluderTriangles = packet.occlusionTime = 0;
+	if (settings.useOcclusionBuffer) {
+		long long start = getMicroseconds();
+		occlusionBuffer.begin(clip);
+		for (int i = 0; i < packet.chunkCount; ++i) {
+			const Occluder& o = occluders[packet.chunks[i].x][packet.chunks[i].z];
+			occlusionBuffer.drawMesh(o.x, o.y, o.z, OCCLUDER_VERTICES, occluderIndices, OCCLUDER_TRIANGLES);
+		}
+		occlusionBuffer.finish();
+		if (packet.scatterCulled) {
+			for (int cx = 0; cx < CHUNK_COUNT; ++cx) {
+				for (int cz = 0; cz < CHUNK_COUNT; ++cz)
+					hideScatter(packet, clip, chunks[cx][cz], NULL, &occlusionBuffer);
+			}
+		}
+
+		int visible = 0;
+		for (int i = 0; i < packet.chunkCount; ++i) {
+			const ChunkDraw& draw = packet.chunks[i];
+			const Chunk& c = chunks[draw.x][draw.z];
+			if (occlusionBuffer.isOccluded(c.min, c.max)) {
+				int triangles = chunkTriangles(c, draw.lod);
+				++packet.occludedChunks;
+				++packet.bufferOccludedChunks;
+				packet.occludedTriangles += triangles;
+				packet.triangles -= triangles;
+				continue;
+			}
+			packet.chunks[visible++] = draw;
+		}
+		packet.chunkCount = visible;
+		packet.occluderTriangles = occlusionBuffer.getTriangleCount();
+		packet.occlusionTime = (int)(getMicroseconds() - start);
+	}
+
+	packet.shadows = settings.useShadows && settings.renderer == RENDERER_CHUNKS;
+	if (packet.shadows)
+		prepareShadows(packet);
+
+	if (settings.flythrough)
+		flythroughStats(packet, flythroughTime);
+	packet.prepareTime = (int)(getMicroseconds() - start);
+}
+
+/*
+ * Interleaved layout matching GL_N3F_V3F
+ */
+struct TerrainVertex {
+	float normal[3];
+	float position[3];
+};
+
+/*
+ * Vertex at a grid position, drop height units below the surface
+ */
+inline void
+setVertex (TerrainVertex* v, int x, int z, int drop = 0)
+{
+	v->normal[0] = normals[x][z][0];
+	v->normal[1] = normals[x][z][1];
+	v->normal[2] = normals[x][z][2];
+	v->position[0] = WORLD_SCALE * x;
+	v->position[1] = WORLD_SCALE * (height[x][z] - drop);
+	v->position[2] = WORLD_SCALE * z;
+}
+
+/*
+ * 8 bytes against 24, grid position and the octahedral normal in
+ * signed bytes
+ */
+struct PackedVertex {
+	short x, z, height;
+	signed char normal[2];
+};
+
+inline void
+setVertex (PackedVertex* v, int x, int z, int drop = 0)
+{
+	v->x = x;
+	v->z = z;
+	v->height = height[x][z] - drop;
+	v->normal[0] = packedNormals[x][z][0];
+	v->normal[1] = packedNormals[x][z][1];
+}
+
+int
+chunkVertexCount (const ChunkDraw& draw)
+{
+	int step = 1 << draw.lod;
+	const Chunk& c = chunks[draw.x][draw.z];
+	int quadsX = (c.sizeX + step - 1) / step, quadsZ = (c.sizeZ + step - 1) / step;
+	return 4 * quadsX * quadsZ + 8 * (quadsX + quadsZ);
+}
+
+/*
+ * Writes the quads of a chunk and the skirts hanging from its edges,
+ * which close the cracks to neighbours at other LODs. Returns the
+ * number of vertices.
+ */
+template<class Vertex>
+int
+writeChunk (const ChunkDraw& draw, Vertex* v)
+{
+	const Chunk& c = chunks[draw.x][draw.z];
+	int step = 1 << draw.lod;
+	Vertex* start = v;
+
+	for (int x = c.x; x < c.x + c.sizeX; x += step)
+	{
+		int x1 = x + step < c.x + c.sizeX ? x + step : c.x + c.sizeX;
+		for (int z = c.z; z < c.z + c.sizeZ; z += step)
+		{
+			int z1 = z + step < c.z + c.sizeZ ? z + step : c.z + c.sizeZ;
+			setVertex(v++, x1, z);
+			setVertex(v++, x,  z);
+			setVertex(v++, x,  z1);
+			setVertex(v++, x1, z1);
+		}
+	}
+
+	int drop = chunkSkirt(c);
+	for (int x = c.x; x < c.x + c.sizeX; x += step) {
+		int x1 = x + step < c.x + c.sizeX ? x + step : c.x + c.sizeX;
+		for (int i = 0; i < 2; ++i) {
+			int z = i ? c.z + c.sizeZ : c.z;
+			setVertex(v++, x,  z);
+			setVertex(v++, x1, z);
+			setVertex(v++, x1, z, drop);
+			setVertex(v++, x,  z, drop);
+		}
+	}
+	for (int z = c.z; z < c.z + c.sizeZ; z += step) {
+		int z1 = z + step < c.z + c.sizeZ ? z + step : c.z + c.sizeZ;
+		for (int i = 0; i < 2; ++i) {
+			int x = i ? c.x + c.sizeX : c.x;
+			setVertex(v++, x, z);
+			setVertex(v++, x, z1);
+			setVertex(v++, x, z1, drop);
+			setVertex(v++, x, z,  drop);
+		}
+	}
+	return v - start;
+}
+
+/*
+ * Immediate mode fallback if there are no buffer objects
+ */
+void
+drawChunk (const ChunkDraw& draw)
+{
+	static TerrainVertex v[CHUNK_VERTICES];
+	int count = writeChunk(draw, v);
+
+	driver->glBegin(GL_QUADS);
+	for (int i = 0; i < count; ++i) {
+		driver->glNormal3f(v[i].normal[0], v[i].normal[1], v[i].normal[2]);
+		driver->glVertex3f(v[i].position[0], v[i].position[1], v[i].position[2]);
+	}
+	driver->glEnd();
+}
+
+/*
+ * Runs on the loader thread, which an edit pauses while it changes the
+ * heights, normals and chunks. A buffer made before the edit comes back
+ * with an old version and is never drawn.
+ */
+GLuint
+loadChunkBuffer (int tag, int& bytes)
+{
+	short cx = tag / CHUNK_COUNT % CHUNK_COUNT, cz = tag % CHUNK_COUNT;
+	int count = 0;
+	for (short lod = 0; lod <= MAX_LOD; ++lod) {
+		ChunkDraw draw = { cx, cz, lod };
+		count += chunkVertexCount(draw);
+	}
+	PackedVertex* vertices = new PackedVertex[count];
+	PackedVertex* v = vertices;
+	for (short lod = 0; lod <= MAX_LOD; ++lod) {
+		ChunkDraw draw = { cx, cz, lod };
+		v += writeChunk(draw, v);
+	}
+
+	GLuint buffer;
+	bytes = count * sizeof (PackedVertex);
+	driver->glGenBuffers(1, &buffer);
+	driver->glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	driver->glBufferData(GL_ARRAY_BUFFER, bytes, vertices, GL_STATIC_DRAW);
+	driver->glBindBuffer(GL_ARRAY_BUFFER, 0);
+	delete[] vertices;
+	return buffer;
+}
+
+/*
+ * Takes over the chunk buffers the loader finished, those of chunks
+ * edited in the meantime go straight back
+ */
+void
+collectChunkBuffers ()
+{
+	ResourceLoader::Resource loaded[CHUNK_COUNT * CHUNK_COUNT];
+	int count = resourceLoader->collect(loaded, CHUNK_COUNT * CHUNK_COUNT);
+	for (int i = 0; i < count; ++i) {
+		int tag = loaded[i].tag;
+		ChunkBuffer& b = chunkBuffers[tag / CHUNK_COUNT % CHUNK_COUNT][tag % CHUNK_COUNT];
+		b.loading = false;
+		if (tag / (CHUNK_COUNT * CHUNK_COUNT) != b.version) {
+			resourceLoader->destroy(RESOURCE_BUFFER, loaded[i].object);
+			continue;
+		}
+		if (b.buffer)
+			resourceLoader->destroy(RESOURCE_BUFFER, b.buffer);
+		b.buffer = loaded[i].object;
+		b.bufferVersion = b.version;
+	}
+	resourceLoader->endFrame();
+}
+
+/*
+ * Streams the chunk vertices through the ring buffer. Packed chunks come
+ * from their static buffer once the loader has made it.
+ */
+void
+streamChunk (const ChunkDraw& draw)
+{
+	int offset;
+	if (vertexFormat == VERTEX_PACKED) {
+		ChunkBuffer& b = chunkBuffers[draw.x][draw.z];
+		int count = chunkVertexCount(draw);
+		if (b.buffer && b.bufferVersion == b.version) {
+			offset = 0;
+			for (short lod = 0; lod < draw.lod; ++lod) {
+				ChunkDraw finer = { draw.x, draw.z, lod };
+				offset += chunkVertexCount(finer) * sizeof (PackedVertex);
+			}
+			driver->glBindBuffer(GL_ARRAY_BUFFER, b.buffer);
+		} else {
+			if (!b.loading && resourceLoader->isAvailable()) {
+				int tag = (b.version * CHUNK_COUNT + draw.x) * CHUNK_COUNT + draw.z;
+				b.loading = resourceLoader->load(RESOURCE_BUFFER, loadChunkBuffer, tag);
+			}
+			PackedVertex* v = (PackedVertex*)vertexStream->map(count * sizeof (PackedVertex), offset);
+			if (!v)
+				return;
+			writeChunk(draw, v);
+			vertexStream->unmap();
+		}
+
+		const char* base = (const char*)0 + offset;
+		driver->glVertexAttribPointer(0, 3, GL_SHORT, GL_FALSE, sizeof (PackedVertex), base);
+		driver->glVertexAttribPointer(1, 2, GL_BYTE, GL_TRUE, sizeof (PackedVertex),
+					      base + offsetof(PackedVertex, normal));
+		driver->glDrawArrays(GL_QUADS, 0, count);
+		return;
+	}
+
+	TerrainVertex* v = (TerrainVertex*)vertexStream->map(chunkVertexCount(draw) * sizeof (TerrainVertex), offset);
+	if (!v) {
+		drawChunk(draw);
+		return;
+	}
+	int count = writeChunk(draw, v);
+	vertexStream->unmap();
+
+	const char* base = (const char*)0 + offset;
+	driver->glNormalPointer(GL_FLOAT, sizeof (TerrainVertex), base + offsetof(TerrainVertex, normal));
+	driver->glVertexPointer(3, GL_FLOAT, sizeof (TerrainVertex), base + offsetof(TerrainVertex, position));
+	driver->glDrawArrays(GL_QUADS, 0, count);
+}
+
+/*
+ * Lowers a coarse chunk by its error, so it lies below the full detail
+ * surface and can not shadow it
+ */
+void
+sinkChunk (const ChunkDraw& draw)
+{
+	driver->glLoadMatrixf(translationMatrix(0, -chunks[draw.x][draw.z].error[draw.lod], 0));
+}
+
+/*
+ * Draws a list of chunks. Sunk chunks replace the modelview matrix.
+ */
+void
+drawChunks (const ChunkDraw* draws, int count, bool sunk)
+{
+	if (vertexFormat == VERTEX_PACKED) {
+		driver->glVertexAttrib4f(2, WORLD_SCALE, 0, 0, 1);
+		driver->glEnableVertexAttribArray(0);
+		driver->glEnableVertexAttribArray(1);
+		for (int i = 0; i < count; ++i) {
+			if (sunk)
+				sinkChunk(draws[i]);
+			streamChunk(draws[i]);
+		}
+		driver->glDisableVertexAttribArray(1);
+		driver->glDisableVertexAttribArray(0);
+		driver->glBindBuffer(GL_ARRAY_BUFFER, 0);
+	} else if (vertexStream->isAvailable()) {
+		driver->glEnableClientState(GL_NORMAL_ARRAY);
+		driver->glEnableClientState(GL_VERTEX_ARRAY);
+		for (int i = 0; i < count; ++i) {
+			if (sunk)
+				sinkChunk(draws[i]);
+			streamChunk(draws[i]);
+		}
+		driver->glDisableClientState(GL_VERTEX_ARRAY);
+		driver->glDisableClientState(GL_NORMAL_ARRAY);
+		driver->glBindBuffer(GL_ARRAY_BUFFER, 0);
+	} else {
+		for (int i = 0; i < count; ++i) {
+			if (sunk)
+				sinkChunk(draws[i]);
+			drawChunk(draws[i]);
+		}
+	}
+}
+
+/*
+ * Renders the casters of every cascade into its shadow map, only depth
+ * and with the shadow LOD of the chunks
+ */
+void
+renderShadows (const RenderPacket& packet)
+{
+	shadowTimer->begin();
+	driver->glUseProgram(chunkPrograms[vertexFormat].shadow);
+	for (int i = 0; i < ShadowCascades::CASCADES; ++i) {
+		shadowCascades->begin(i);
+		driver->glMatrixMode(GL_PROJECTION);
+		driver->glLoadMatrixf(packet.shadowCascades[i].viewProjection);
+		driver->glMatrixMode(GL_MODELVIEW);
+		drawChunks(packet.shadowChunks[i], packet.shadowChunkCount[i], true);
+		shadowCascades->end();
+	}
+	driver->glUseProgram(0);
+	shadowTimer->end();
+	driver->glViewport(0, 0, viewWidth, viewHeight);
+}
+
+/*
+ * Renders the virtual texture pages the chunks need at a fraction of
+ * the resolution, reads them back and uploads the pages that arrived
+ */
+void
+renderFeedback (const RenderPacket& packet)
+{
+	int width = renderWidth / FEEDBACK_SCALE > 0 ? renderWidth / FEEDBACK_SCALE : 1;
+	int height = renderHeight / FEEDBACK_SCALE > 0 ? renderHeight / FEEDBACK_SCALE : 1;
+	driver->glViewport(0, 0, width, height);
+	driver->glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+	driver->glUseProgram(chunkPrograms[vertexFormat].feedback);
+	drawChunks(packet.chunks, packet.chunkCount, false);
+	driver->glUseProgram(0);
+
+	virtualTexture->processFeedback(width, height);
+	virtualTexture->update();
+	driver->glViewport(0, 0, renderWidth, renderHeight);
+}
+
+/*
+ * Emits the particles of a source at the rate that keeps its share of
+ * the current count alive
+ */
+void
+emitParticles (ParticleSource source, const Vector& eye, float frameTime)
+{
+	static float carry[PARTICLE_SOURCES];
+	ParticleSystem* system = particles[source];
+	float rate = PARTICLE_SHARES[source] * PARTICLE_COUNTS[particleLevel] / PARTICLE_KINDS[source].life;
+	carry[source] += rate * frameTime;
+	int count = (int)carry[source];
+	carry[source] -= count;
+
+	float extent = WORLD_SCALE * (AREA_SIZE - 1);
+	ParticleEmitter e;
+	switch (source) {
+	case PARTICLE_RAIN:
+		e.min = Vector(eye[0] - 8, eye[1] + 2, eye[2] - 8);
+		e.max = Vector(eye[0] + 8, eye[1] + 8, eye[2] + 8);
+		e.grounded = false;
+		e.velocity = Vector(0, -6, 0);
+		e.spread = .3;
+		system->emit(e, count);
+		break;
+
+	case PARTICLE_DUST:
+		e.min = Vector(0, 0, 0);
+		e.max = Vector(extent, .2, extent);
+		e.grounded = true;
+		e.velocity = Vector(0, .8, 0);
+		e.spread = .6;
+		system->emit(e, count);
+		break;
+
+	default:
+		e.grounded = true;
+		e.velocity = Vector(0, .3, 0);
+		e.spread = .15;
+		for (int i = 0; i < SMOKE_SOURCES; ++i) {
+			// The odd lights of placeLights() are the fires
+			unsigned h = hashTexel(2 * i + 1, 0);
+			float x = (h & 0xffff) / 65535.f * extent, z = (h >> 16) / 65535.f * extent;
+			e.min = Vector(x - .1, 0, z - .1);
+			e.max = Vector(x + .1, .1, z + .1);
+			int n = (count + i) / SMOKE_SOURCES;
+			system->emit(e, n);
+		}
+		break;
+	}
+}
+
+void
+updateParticles (const RenderPacket& packet)
+{
+	Vector wind(PARTICLE_WIND[0], PARTICLE_WIND[1], PARTICLE_WIND[2]);
+	for (int i = 0; i < PARTICLE_SOURCES; ++i) {
+		ParticleSystem* system = particles[i];
+		if (particleLevel)
+			emitParticles((ParticleSource)i, packet.eye, packet.frameTime);
+		system->update(packet.frameTime, wind, workers, true);
+		system->endFrame();
+	}
+}
+
+void
+drawScene (const RenderPacket& packet)
+{
+	long long start = getMicroseconds();
+
+	const ChunkPrograms& programs = chunkPrograms[vertexFormat];
+	bool chunked = renderer == RENDERER_CHUNKS;
+	bool shadows = chunked && packet.shadows && programs.shadow && shadowCascades->isAvailable();
+	if (shadows)
+		renderShadows(packet);
+
+	// A smaller frame keeps the aspect ratio, the projection stays the same
+	bool scaled = useDynamicResolution && offscreen->isAvailable();
+	renderWidth = viewWidth;
+	renderHeight = viewHeight;
+	if (scaled) {
+		renderWidth = viewWidth * resolutionScale.getScale() / 100 > 0 ? viewWidth * resolutionScale.getScale() / 100 : 1;
+		renderHeight = viewHeight * resolutionScale.getScale() / 100 > 0 ? viewHeight * resolutionScale.getScale() / 100 : 1;
+		offscreen->begin(renderWidth, renderHeight);
+	}
+
+	driver->glMatrixMode(GL_PROJECTION);
+	driver->glLoadMatrixf(packet.projection);
+	driver->glMatrixMode(GL_MODELVIEW);
+	driver->glLoadMatrixf(packet.modelView);
+
+	collectChunkBuffers();
+
+	bool virtualTexturing = chunked && useVirtualTexture && programs.feedback;
+	if (virtualTexturing)
+		renderFeedback(packet);
+
+	// The heights are on their way to the texture by the time it is drawn
+	if (renderer == RENDERER_ANIMATED)
+		animatedSurface->update(packet.frameTime, workers);
+	if (particleLevel)
+		updateParticles(packet);
+
+	driver->glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+	driver->glColor3f(0, 0.5, 0.1);
+	bool horizonLighting = useHorizonLighting && horizonMap->getTexture();
+	bool lights = chunked && packet.lights.getStats().lights && clusteredLighting->isAvailable();
+	// Packed vertices can only be decoded by the shader
+	bool shaded = chunked && programs.terrain &&
+		(horizonLighting || virtualTexturing || lights || shadows || vertexFormat == VERTEX_PACKED);
+	if (shaded) {
+		driver->glUseProgram(programs.terrain);
+		driver->glUniform3f(programs.sun, packet.sun[0], packet.sun[1], packet.sun[2]);
+		driver->glUniform1f(programs.sunIntensity, lights ? NIGHT_SUN : 1);
+		driver->glUniform1i(programs.horizonLighting, horizonLighting);
+		driver->glUniform1i(programs.virtualTexturing, virtualTexturing);
+		driver->glUniform1i(programs.clusteredLights, lights);
+		driver->glUniform1i(programs.shadows, shadows);
+		driver->glActiveTexture(GL_TEXTURE0);
+		driver->glBindTexture(GL_TEXTURE_2D_ARRAY, horizonMap->getTexture());
+		if (virtualTexturing)
+			virtualTexture->bind(1);
+		if (lights) {
+			float params[4];
+			ClusteredLighting::getParams(packet.lights, renderWidth, renderHeight, params);
+			driver->glUniform4f(programs.clusterParams, params[0], params[1], params[2], params[3]);
+			clusteredLighting->upload(packet.lights);
+			clusteredLighting->bind(3);
+		}
+		if (shadows)
+			shadowCascades->bind(programs.terrain, 5, packet.shadowCascades);
+	}
+
+	terrainTimer->begin();
+	if (renderer == RENDERER_CLIPMAP)
+		clipmap->draw(packet.eye, packet.frustum, vertexStream);
+	else if (renderer == RENDERER_ANIMATED)
+		animatedSurface->draw();
+	else
+		drawChunks(packet.chunks, packet.chunkCount, false);
+	terrainTimer->end();
+
+	if (shaded) {
+		if (shadows)
+			shadowCascades->unbind(5);
+		if (lights)
+			clusteredLighting->unbind(3);
+		if (virtualTexturing)
+			virtualTexture->unbind(1);
+		driver->glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+		driver->glUseProgram(0);
+	}
+	vertexStream->endFrame();
+
+	float pixelScale = packet.projection(1, 1) * renderHeight / 2;
+	if (scatterLevel) {
+		scatter->select(packet.frustum, packet.eye, pixelScale, packet.drawDistance,
+				packet.scatterCulled ? packet.hiddenScatter : NULL);
+		scatterTimer->begin();
+		scatter->draw(packet.sun, lights ? NIGHT_SUN : 1);
+		scatterTimer->end();
+	}
+	for (int i = 0; i < PARTICLE_SOURCES; ++i)
+		particles[i]->draw(pixelScale, lights ? NIGHT_SUN : 1);
+
+	if (scaled) {
+		upscaleTimer->begin();
+		offscreen->end(renderWidth, renderHeight, viewWidth, viewHeight);
+		upscaleTimer->end();
+	}
+	frameCapture->capture();
+	submitTime = (int)(getMicroseconds() - start);
+
+	SDL_GL_SwapBuffers ();
+}
+
+/*
+ * Feeds the frame times to the budget controller and logs its steps.
+ * In pipelined mode preparing and submitting overlap.
+ */
+void
+updateFrameBudget (const RenderPacket& packet)
+{
+	int cpu = pipeline.isPipelined() ?
+		(packet.prepareTime > submitTime ? packet.prepareTime : submitTime) :
+		packet.prepareTime + submitTime;
+	int gpu = terrainTimer->getTime();
+	BudgetAction action = frameBudget.update(cpu * .001f, gpu >= 0 ? gpu * .001f : -1);
+	if (action != BUDGET_HOLD) {
+		printf("Frame budget: %.2f ms %s %.1f ms, LOD error %.2f pixels, draw distance %.1f\n",
+		       frameBudget.getCost(), action == BUDGET_COARSER ? "over" : "under",
+		       frameBudget.getTarget(), frameBudget.getErrorThreshold(), frameBudget.getDrawDistance());
+	}
+}
+
+/*
+ * Scales the offscreen frame with the GPU time of the terrain pass, the
+ * part of the frame that is bound by fill rate
+ */
+void
+updateDynamicResolution ()
+{
+	int gpu = terrainTimer->getTime();
+	if (resolutionScale.update(gpu >= 0 ? gpu * .001f : -1)) {
+		int scale = resolutionScale.getScale();
+		printf("Dynamic resolution: %.2f ms GPU for %.1f ms, %d%% (%dx%d)\n",
+		       resolutionScale.getTime(), resolutionScale.getTarget(), scale,
+		       viewWidth * scale / 100, viewHeight * scale / 100);
+	}
+}
+
+/*
+ * Casts the ray through a window position into the terrain
+ */
+bool
+castPickRay (const RenderPacket& packet, int x, int y, RayHit& hit)
+{
+	const Matrix& p = packet.projection;
+	const Matrix& m = packet.modelView;
+	Vector e((2.f * x / viewWidth - 1) / p(0,0), (1 - 2.f * y / viewHeight) / p(1,1), -1);
+
+	Ray ray;
+	ray.origin = packet.eye;
+	ray.direction = Vector(m(0,0) * e[0] + m(1,0) * e[1] + m(2,0) * e[2],
+			       m(0,1) * e[0] + m(1,1) * e[1] + m(2,1) * e[2],
+			       m(0,2) * e[0] + m(1,2) * e[1] + m(2,2) * e[2]);
+	ray.maxDistance = 200;
+	return rayCaster->intersect(ray, hit);
+}
+
+void
+pickTerrain (const RenderPacket& packet, int x, int y)
+{
+	RayHit hit;
+	if (castPickRay(packet, x, y, hit)) {
+		printf("Pick: (%.2f, %.2f, %.2f) at distance %.2f, normal (%.2f, %.2f, %.2f)\n",
+		       hit.point[0], hit.point[1], hit.point[2], hit.distance,
+		       hit.normal[0], hit.normal[1], hit.normal[2]);
+	} else {
+		printf("Pick: no terrain\n");
+	}
+}
+
+/*
+ * Rebuilds what is derived from the heights after the points in r
+ * changed, each part over just the points, cells, chunks or tiles that
+ * depend on them. The horizon map reaches HorizonMap::MAX_DISTANCE
+ * beyond r and is left to the caller, like everything on the GPU.
+ */
+void
+updateTerrain (const DirtyRect& r)
+{
+	DirtyRect n = r.grow(1, AREA_SIZE);
+	updateNormals(n.x0, n.z0, n.x1, n.z1);
+
+	// Points on chunk edges belong to the chunks on both sides
+	int cx0 = (r.x0 > 0 ? r.x0 - 1 : 0) / CHUNK_SIZE, cz0 = (r.z0 > 0 ? r.z0 - 1 : 0) / CHUNK_SIZE;
+	int cx1 = (r.x1 - 1) / CHUNK_SIZE < CHUNK_COUNT ? (r.x1 - 1) / CHUNK_SIZE : CHUNK_COUNT - 1;
+	int cz1 = (r.z1 - 1) / CHUNK_SIZE < CHUNK_COUNT ? (r.z1 - 1) / CHUNK_SIZE : CHUNK_COUNT - 1;
+	for (int cx = cx0; cx <= cx1; ++cx) {
+		for (int cz = cz0; cz <= cz1; ++cz) {
+			updateChunk(cx, cz);
+			updateOccluder(cx, cz);
+		}
+	}
+
+	// Static vertex buffers also hold the normals, which reach a point further
+	cx0 = (n.x0 > 0 ? n.x0 - 1 : 0) / CHUNK_SIZE, cz0 = (n.z0 > 0 ? n.z0 - 1 : 0) / CHUNK_SIZE;
+	cx1 = (n.x1 - 1) / CHUNK_SIZE < CHUNK_COUNT ? (n.x1 - 1) / CHUNK_SIZE : CHUNK_COUNT - 1;
+	cz1 = (n.z1 - 1) / CHUNK_SIZE < CHUNK_COUNT ? (n.z1 - 1) / CHUNK_SIZE : CHUNK_COUNT - 1;
+	for (int cx = cx0; cx <= cx1; ++cx) {
+		for (int cz = cz0; cz <= cz1; ++cz)
+			++chunkBuffers[cx][cz].version;
+	}
+
+	// Cells have a point on each corner
+	int x0 = r.x0 > 0 ? r.x0 - 1 : 0, z0 = r.z0 > 0 ? r.z0 - 1 : 0;
+	int x1 = r.x1 < AREA_SIZE - 1 ? r.x1 : AREA_SIZE - 1, z1 = r.z1 < AREA_SIZE - 1 ? r.z1 : AREA_SIZE - 1;
+	rayCaster->update(x0, z0, x1, z1);
+	heightCollider->update(x0, z0, x1, z1);
+	heightSampler->update(r.x0, r.z0, r.x1, r.z1);
+}
+
+/* Points changed by the brush stroke in progress */
+DirtyRect stroke;
+int strokeFrames, strokeTime;
+float flattenHeight;
+
+/*
+ * Applies the brush under the mouse once per frame while the right
+ * button is held. The surface follows right away, the horizon map and
+ * the virtual texture pages once the stroke ends.
+ *
+ * The frame thread prepares packets from the chunks, the occluders and
+ * the height sampler, so a stroke runs in serial mode. The page
+ * producer and the chunk buffer loader read the heights and normals and
+ * wait while they change.
+ */
+void
+editTerrain (const RenderPacket& packet, int x, int y)
+{
+	RayHit hit;
+	if (!castPickRay(packet, x, y, hit))
+		return;
+	if (!strokeFrames++)
+		flattenHeight = hit.point[1] / WORLD_SCALE;
+
+	long long start = getMicroseconds();
+	Brush brush = { brushType, hit.point[0] / WORLD_SCALE, hit.point[2] / WORLD_SCALE,
+			BRUSH_RADIUS, BRUSH_STRENGTH[brushType], flattenHeight };
+	if (pipeline.isPipelined()) {
+		pipeline.setPipelined(false);
+		pipelineAfterStroke = true;
+	}
+	virtualTexture->pause();
+	resourceLoader->pause();
+	DirtyRect dirty = terrainEditor->apply(brush);
+	if (!dirty.isEmpty())
+		updateTerrain(dirty);
+	resourceLoader->resume();
+	virtualTexture->resume();
+	stroke.add(dirty);
+	strokeTime += (int)(getMicroseconds() - start);
+}
+
+void
+finishStroke ()
+{
+	if (!strokeFrames)
+		return;
+	if (!stroke.isEmpty()) {
+		horizonMap->update(stroke.x0, stroke.z0, stroke.x1, stroke.z1, workers);
+		horizonMap->upload();
+		scatter->update(stroke.x0, stroke.z0, stroke.x1, stroke.z1);
+
+		// Page colors follow the slope
+		DirtyRect n = stroke.grow(1, AREA_SIZE);
+		virtualTexture->invalidate((float)n.x0 / AREA_SIZE, (float)n.z0 / AREA_SIZE,
+					   (float)n.x1 / AREA_SIZE, (float)n.z1 / AREA_SIZE);
 
-enum {
-	SCREEN_WIDTH = 640,
-	SCREEN_HEIGHT = 480,
-	SCREEN_BPP = 32,
-	AREA_SIZE = 256,
-};
+		printf("Edit: %s stroke of %d frames over %dx%d points, %d us per frame, "
+		       "horizon map rebaked in %.1f ms and %d KB uploaded\n",
+		       BRUSH_NAMES[brushType], strokeFrames, stroke.x1 - stroke.x0, stroke.z1 - stroke.z0,
+		       strokeTime / strokeFrames, horizonMap->getBakeTime() * .001f,
+		       horizonMap->getUploadBytes() >> 10);
+	}
+	stroke.x0 = stroke.x1 = 0;
+	strokeFrames = strokeTime = 0;
+}
 
-SDL_Surface *surface;
-GLDriver glDriver;
-GLDriver* driver = &glDriver;
+float
+randomFloat (float min, float max)
+{
+	return min + (max - min) * rand() / RAND_MAX;
+}
 
-/* Ambient Light Values */
-GLfloat LightAmbient[]  = { 0.5f, 0.5f, 0.5f, 1.0f };
-/* Diffuse Light Values */
-GLfloat LightDiffuse[]  = { 1.0f, 1.0f, 1.0f, 1.0f };
-/* Light Position */
-GLfloat LightPosition[] = { 0.0f, 0.0f, 2.0f, 1.0f };
+/*
+ * Short rays like projectiles and picking near the ground, long ones
+ * like line of fire across the whole area
+ */
+void
+benchmarkRays ()
+{
+	enum {
+		RAY_COUNT = 200000,
+	};
+	static Ray rays[RAY_COUNT];
+	static RayHit hits[RAY_COUNT];
+	float extent = WORLD_SCALE * (AREA_SIZE - 1);
 
-short height[AREA_SIZE][AREA_SIZE];
+	for (int pass = 0; pass < 2; ++pass) {
+		bool shortRays = pass == 0;
+		srand(1);
+		for (int i = 0; i < RAY_COUNT; ++i) {
+			Ray& r = rays[i];
+			if (shortRays) {
+				r.origin = Vector(randomFloat(0, extent), randomFloat(1, 3), randomFloat(0, extent));
+				r.direction = Vector(randomFloat(-1, 1), randomFloat(-1, 0), randomFloat(-1, 1));
+				r.maxDistance = 2;
+			} else {
+				r.origin = Vector(0, randomFloat(0, 2), randomFloat(0, extent));
+				r.direction = Vector(1, randomFloat(-.1, .05), randomFloat(-.5, .5));
+				r.maxDistance = 2 * extent;
+			}
+		}
 
+		long long start = getMicroseconds();
+		rayCaster->intersect(rays, hits, RAY_COUNT);
+		long long serial = getMicroseconds() - start;
+
+		start = getMicroseconds();
+		rayCaster->intersect(rays, hits, RAY_COUNT, workers);
+		long long parallel = getMicroseconds() - start;
+
+		int hitCount = 0;
+		for (int i = 0; i < RAY_COUNT; ++i)
+			hitCount += hits[i].hit;
+		printf("Rays (%s): %.2f M/s on 1 thread, %.2f M/s on %d threads, %.1f%% hit\n",
+		       shortRays ? "short" : "long", (float)RAY_COUNT / serial,
+		       (float)RAY_COUNT / parallel, workers->getThreadCount(),
+		       100.f * hitCount / RAY_COUNT);
+	}
+}
+
+/*
+ * Height, slope and normal queries at random positions, one by one
+ * and batched
+ */
 void
-quit (int exitCode)
+benchmarkSampling ()
 {
-	SDL_Quit ();
-	exit (exitCode);
+	enum {
+		QUERY_COUNT = 1 << 20,
+	};
+	static float x[QUERY_COUNT], z[QUERY_COUNT];
+	static float heights[QUERY_COUNT], slopeX[QUERY_COUNT], slopeZ[QUERY_COUNT];
+	static Vector normal[QUERY_COUNT];
+	float extent = WORLD_SCALE * (AREA_SIZE - 1);
+
+	srand(1);
+	for (int i = 0; i < QUERY_COUNT; ++i) {
+		x[i] = randomFloat(0, extent);
+		z[i] = randomFloat(0, extent);
+	}
+
+	long long start = getMicroseconds();
+	for (int i = 0; i < QUERY_COUNT; ++i) {
+		heights[i] = heightSampler->sample(x[i], z[i], &slopeX[i], &slopeZ[i]);
+		normal[i] = Vector(-slopeX[i], 1, -slopeZ[i]);
+		normal[i].normalize();
+	}
+	long long naive = getMicroseconds() - start;
+
+	start = getMicroseconds();
+	heightSampler->sample(x, z, QUERY_COUNT, heights, slopeX, slopeZ, normal);
+	long long batched = getMicroseconds() - start;
+
+	start = getMicroseconds();
+	heightSampler->sample(x, z, QUERY_COUNT, heights, slopeX, slopeZ, normal, workers);
+	long long parallel = getMicroseconds() - start;
+
+	printf("Height queries: %.1f M/s one by one, %.1f M/s batched, %.1f M/s batched on %d threads\n",
+	       (float)QUERY_COUNT / naive, (float)QUERY_COUNT / batched,
+	       (float)QUERY_COUNT / parallel, workers->getThreadCount());
 }
 
+/*
+ * One physics step of spheres, capsules and boxes scattered around the
+ * surface, about half of them touching it
+ */
 void
-resizeWindow (int width, int height)
+benchmarkCollision ()
 {
-	if (height == 0)
-		height = 1;
-	driver->glViewport (0, 0, width, height);
-	driver->glMatrixMode(GL_PROJECTION);
+	enum {
+		MAX_SHAPES = 100000,
+	};
+	static Shape shapes[MAX_SHAPES];
+	static ShapeContacts contacts[MAX_SHAPES];
+	float extent = WORLD_SCALE * (AREA_SIZE - 1);
 
-	driver->glLoadMatrixf(perspectiveMatrix
-			      (45.0f, (float) width / height, 0.1f,
-			       200.0f));
+	srand(1);
+	for (int i = 0; i < MAX_SHAPES; ++i) {
+		Shape& s = shapes[i];
+		float x = randomFloat(0, extent), z = randomFloat(0, extent);
+		float size = randomFloat(.05, .3);
+		s.type = (ShapeType)(i % 3);
+		s.center = Vector(x, heightSampler->sample(x, z) + randomFloat(-.5, 1.5) * size, z);
+		s.radius = size;
+		s.end = s.center + Vector(randomFloat(-1, 1), randomFloat(-.5, .5), randomFloat(-1, 1)) * size;
+		float a = randomFloat(0, M_PI);
+		s.axis[0] = Vector(cos(a), 0, sin(a)) * size;
+		s.axis[1] = Vector(0, size, 0);
+		s.axis[2] = Vector(-sin(a), 0, cos(a)) * size;
+	}
 
-	driver->glMatrixMode(GL_MODELVIEW);
-	driver->glLoadIdentity();
+	for (int count = 10000; count <= MAX_SHAPES; count *= 10) {
+		long long start = getMicroseconds();
+		heightCollider->collide(shapes, contacts, count);
+		long long serial = getMicroseconds() - start;
+
+		start = getMicroseconds();
+		heightCollider->collide(shapes, contacts, count, workers);
+		long long parallel = getMicroseconds() - start;
+
+		int touching = 0;
+		for (int i = 0; i < count; ++i)
+			touching += contacts[i].count > 0;
+		printf("Collision (%d shapes): %.2f ms on 1 thread, %.2f ms on %d threads, %.1f%% touching\n",
+		       count, serial * .001f, parallel * .001f, workers->getThreadCount(),
+		       100.f * touching / count);
+	}
+}
+
+/*
+ * Heights of a size x size map from the same height function as the
+ * area, x major. The caller deletes it.
+ */
+short*
+generateMap (int size)
+{
+	short* map = new short[size * size];
+	for (int x = 0; x < size; ++x) {
+		for (int z = 0; z < size; ++z)
+			map[x * size + z] = (short)terrainHeight(x, z);
+	}
+	return map;
 }
 
+/*
+ * Viewsheds of observers scattered over a large map generated from
+ * the same height function as the area
+ */
 void
-handleKeyPress (SDL_keysym * keysym)
+benchmarkViewshed ()
 {
-	switch (keysym->sym) {
-	case SDLK_ESCAPE:
-		quit (0);
-		break;
+	enum {
+		MAP_SIZE = 4096,
+		OBSERVER_COUNT = 100,
+		OBSERVER_RADIUS = 1024,
+	};
+	short* map = generateMap(MAP_SIZE);
 
-	case SDLK_F1:
-		SDL_WM_ToggleFullScreen (surface);
-		break;
+	Viewshed viewshed(map, MAP_SIZE, WORLD_SCALE);
+	Observer observers[OBSERVER_COUNT];
+	VisibilityMap* maps = new VisibilityMap[OBSERVER_COUNT];
+	srand(1);
+	for (int i = 0; i < OBSERVER_COUNT; ++i) {
+		observers[i].x = rand() % MAP_SIZE;
+		observers[i].z = rand() % MAP_SIZE;
+		observers[i].eyeHeight = .2;
+		observers[i].targetHeight = 0;
+		observers[i].radius = OBSERVER_RADIUS;
+	}
+
+	long long start = getMicroseconds();
+	viewshed.compute(observers, maps, 1);
+	long long single = getMicroseconds() - start;
+
+	start = getMicroseconds();
+	viewshed.compute(observers, maps, 1, workers);
+	long long sectors = getMicroseconds() - start;
+
+	start = getMicroseconds();
+	viewshed.compute(observers, maps, OBSERVER_COUNT, workers);
+	long long all = getMicroseconds() - start;
+
+	long visible = 0;
+	for (int i = 0; i < OBSERVER_COUNT; ++i)
+		visible += maps[i].getVisibleCount();
+	printf("Viewshed (%dx%d, radius %d): one observer %.1f ms, %.1f ms over sectors, "
+	       "%d observers %.1f ms on %d threads, %.1f%% visible, %d KB per map\n",
+	       MAP_SIZE, MAP_SIZE, OBSERVER_RADIUS, single * .001f, sectors * .001f,
+	       OBSERVER_COUNT, all * .001f, workers->getThreadCount(),
+	       100.f * visible / (OBSERVER_COUNT * M_PI * OBSERVER_RADIUS * OBSERVER_RADIUS),
+	       maps[0].getMemory() >> 10);
+
+	delete[] maps;
+	delete[] map;
+}
+
+/*
+ * Horizon map bake of a large map, serial and across the pool
+ */
+void
+benchmarkHorizonBake ()
+{
+	enum {
+		MAP_SIZE = 1024,
+	};
+	short* map = generateMap(MAP_SIZE);
+
+	HorizonMap horizon(map, MAP_SIZE);
+	horizon.bake();
+	long long serial = horizon.getBakeTime();
+	horizon.bake(workers);
+	long long parallel = horizon.getBakeTime();
+
+	float directions = (float)MAP_SIZE * MAP_SIZE * HorizonMap::DIRECTIONS;
+	printf("Horizon bake (%dx%d, %d directions): %.1f ms on 1 thread, %.1f ms on %d threads, "
+	       "%.1f M directions/s, %d KB\n",
+	       MAP_SIZE, MAP_SIZE, HorizonMap::DIRECTIONS, serial * .001f, parallel * .001f,
+	       workers->getThreadCount(), directions / parallel, horizon.getMemory() >> 10);
+
+	delete[] map;
+}
+
+/*
+ * Binning of growing numbers of lights for the fixed camera
+ */
+void
+benchmarkLightBinning ()
+{
+	enum {
+		PASSES = 20,
+	};
+	static PointLight lights[LightClusters::MAX_LIGHTS];
+	static LightClusters clusters;
+	Matrix projection = perspectiveMatrix(45.0f, (float)SCREEN_WIDTH / SCREEN_HEIGHT, NEAR_PLANE, FAR_PLANE);
+	Matrix modelView;
+	Vector eye;
+	fixedCamera(modelView, eye);
+
+	for (int count = 64; count <= LightClusters::MAX_LIGHTS; count *= 4) {
+		placeLights(lights, count, 0);
+		long long start = getMicroseconds();
+		for (int i = 0; i < PASSES; ++i)
+			clusters.bin(lights, count, modelView, projection, NEAR_PLANE, FAR_PLANE);
+		long long serial = (getMicroseconds() - start) / PASSES;
+
+		start = getMicroseconds();
+		for (int i = 0; i < PASSES; ++i)
+			clusters.bin(lights, count, modelView, projection, NEAR_PLANE, FAR_PLANE, workers);
+		long long parallel = (getMicroseconds() - start) / PASSES;
+
+		const ClusterStats& stats = clusters.getStats();
+		printf("Light binning (%d lights): %d us on 1 thread, %d us on %d threads, "
+		       "%d visible, %d cluster references, %d overflows\n",
+		       count, (int)serial, (int)parallel, workers->getThreadCount(),
+		       stats.visibleLights, stats.references, stats.overflows);
 	}
 }
 
-bool initGLDriver() {
-#define GL_PROC(ret, name, args)\
-	driver->name = (ret (*)args)SDL_GL_GetProcAddress(#name);
-#include "GLFuncs.h"
-#undef GL_PROC
-	return true;
+/*
+ * Writes every chunk at full detail in both vertex formats, the CPU
+ * side of streaming the terrain
+ */
+template<class Vertex>
+void
+benchmarkVertexFormat (const char* name)
+{
+	enum {
+		PASSES = 20,
+	};
+	Vertex* vertices = new Vertex[CHUNK_VERTICES * CHUNK_COUNT * CHUNK_COUNT];
+	int bytes = 0;
+	long long start = getMicroseconds();
+	for (int pass = 0; pass < PASSES; ++pass) {
+		Vertex* v = vertices;
+		for (int cx = 0; cx < CHUNK_COUNT; ++cx) {
+			for (int cz = 0; cz < CHUNK_COUNT; ++cz) {
+				ChunkDraw draw = { (short)cx, (short)cz, 0 };
+				v += writeChunk(draw, v);
+			}
+		}
+		bytes = (v - vertices) * sizeof (Vertex);
+	}
+	long long time = (getMicroseconds() - start) / PASSES;
+	delete[] vertices;
+	printf("Vertex format (%s): %d bytes per vertex, %d KB per frame written in %.2f ms, %.0f MB/s\n",
+	       name, (int)sizeof (Vertex), bytes >> 10, time * .001f, (float)bytes / time);
 }
 
-void initHeights() {
-    float h;
-    for (int x = 0; x < AREA_SIZE; ++x) {
-        for(int y = 0; y < AREA_SIZE; ++y) {
-            height[x][y] = (short)(10.0 * sin(x/24.0) + 7.0 * cos((y-50.0)/18.0));
-        }
-    }
+/*
+ * Triangles and chunks of the chunk renderer for a camera, without
+ * occlusion culling
+ */
+int
+countTriangles (const Matrix& projection, const Matrix& modelView, const Vector& eye,
+		float pixelScale, float lodError, float drawDistance, int& chunkCount)
+{
+	Frustum frustum(projection * modelView);
+	int triangles = 0;
+	chunkCount = 0;
+	for (int cx = 0; cx < CHUNK_COUNT; ++cx) {
+		for (int cz = 0; cz < CHUNK_COUNT; ++cz) {
+			const Chunk& c = chunks[cx][cz];
+			if (!frustum.intersectsBox(c.min, c.max))
+				continue;
+			float dist = ((c.min + c.max) / 2 - eye).length();
+			if (dist > drawDistance)
+				continue;
+			int lod = chunkLod(c, dist, pixelScale, lodError);
+			triangles += chunkTriangles(c, lod);
+			++chunkCount;
+		}
+	}
+	return triangles;
 }
 
+/*
+ * Runs the budget controller along the flythrough against a simulated
+ * cost model, so the result is the same on every machine. The GPU cost
+ * grows with the triangles and reaches the controller a few frames
+ * late like the timer queries. In the middle phase it is three times as
+ * expensive, as on a much slower GPU.
+ *
+ * Returns false if a phase spent too many frames over the budget or the
+ * controller went back and forth, as it does when it overshoots.
+ */
 bool
-initGL ()
+benchmarkFrameBudget ()
 {
-	if (!initGLDriver())
-		return false;
+	enum {
+		PHASES = 3,
+		PHASE_FRAMES = 900,
+		GPU_LATENCY = 3,
+		MAX_REVERSALS = 12,
+	};
+	const float MAX_OVER = .2f;
+	const float LOADS[PHASES] = { 1, 3, 1 };
+	const float GPU_BASE = 1, GPU_PER_TRIANGLE = .0003;
+	const float CPU_BASE = 2, CPU_PER_CHUNK = .05;
 
-	initHeights();
+	FrameBudget budget(FRAME_BUDGET, LOD_ERROR, MAX_LOD_ERROR, MIN_DRAW_DISTANCE, MAX_DRAW_DISTANCE);
+	Matrix projection = perspectiveMatrix(45.0f, (float)SCREEN_WIDTH / SCREEN_HEIGHT, NEAR_PLANE, FAR_PLANE);
+	float pixelScale = projection(1, 1) * SCREEN_HEIGHT / 2;
+	float gpuTimes[GPU_LATENCY] = { 0 };
+	int frame = 0, reversals = 0;
+	BudgetAction lastAction = BUDGET_HOLD;
+	bool passed = true;
 
-	driver->glShadeModel (GL_SMOOTH);
-	driver->glClearColor (0, 0, 0, 0);
-	driver->glClearDepth (1);
-	driver->glEnable (GL_DEPTH_TEST);
-	//driver->glEnable (GL_BLEND);
-	//driver->glBlendFunc (GL_SRC_ALPHA, GL_ONE);
-	//driver->glHint (GL_PERSPECTIVE_CORRECTION_HINT, GL_NICEST);
-	//driver->glHint (GL_POINT_SMOOTH_HINT, GL_NICEST);
+	srand(1);
+	for (int phase = 0; phase < PHASES; ++phase) {
+		int over = 0, coarser = 0, finer = 0;
+		float total = 0;
+		for (int i = 0; i < PHASE_FRAMES; ++i, ++frame) {
+			Matrix modelView;
+			Vector eye;
+			flythroughCamera(frame / 60.f, modelView, eye);
+			int chunkCount;
+			int triangles = countTriangles(projection, modelView, eye, pixelScale,
+						       budget.getErrorThreshold(), budget.getDrawDistance(), chunkCount);
 
-    /* Setup The Ambient Light */
-    driver->glLightfv( GL_LIGHT1, GL_AMBIENT, LightAmbient );
+			// A tenth of noise on both
+			float cpu = (CPU_BASE + CPU_PER_CHUNK * chunkCount) * randomFloat(.95, 1.05);
+			float gpu = (GPU_BASE + GPU_PER_TRIANGLE * triangles) * LOADS[phase] * randomFloat(.95, 1.05);
+			float cost = gpu > cpu ? gpu : cpu;
+			total += cost;
+			over += cost > FRAME_BUDGET;
 
-    /* Setup The Diffuse Light */
-    driver->glLightfv( GL_LIGHT1, GL_DIFFUSE, LightDiffuse );
+			BudgetAction action = budget.update(cpu, frame >= GPU_LATENCY ? gpuTimes[frame % GPU_LATENCY] : -1);
+			gpuTimes[frame % GPU_LATENCY] = gpu;
+			if (action == BUDGET_HOLD)
+				continue;
+			coarser += action == BUDGET_COARSER;
+			finer += action == BUDGET_FINER;
+			reversals += lastAction != BUDGET_HOLD && action != lastAction;
+			lastAction = action;
+		}
+		printf("Frame budget (load x%.0f): %.2f ms mean of %.1f ms, %.1f%% frames over, "
+		       "%d coarser and %d finer steps, LOD error %.2f pixels, draw distance %.1f\n",
+		       LOADS[phase], total / PHASE_FRAMES, FRAME_BUDGET, 100.f * over / PHASE_FRAMES,
+		       coarser, finer, budget.getErrorThreshold(), budget.getDrawDistance());
+		if (over > MAX_OVER * PHASE_FRAMES) {
+			fprintf(stderr, "Frame budget: more than %.0f%% frames over\n", 100 * MAX_OVER);
+			passed = false;
+		}
+	}
+	printf("Frame budget: %d direction changes in %d frames\n", reversals, frame);
+	if (reversals > MAX_REVERSALS) {
+		fprintf(stderr, "Frame budget: more than %d direction changes\n", MAX_REVERSALS);
+		passed = false;
+	}
+	return passed;
+}
 
-    /* Position The Light */
-    driver->glLightfv( GL_LIGHT1, GL_POSITION, LightPosition );
+/*
+ * Brush edits of growing radius and the rebuild after each, against
+ * rebuilding everything. The horizon map is measured on a larger map,
+ * the brush only changes a part of it either way.
+ */
+void
+benchmarkEditing ()
+{
+	enum {
+		EDITS = 100,
+		MAP_SIZE = 1024,
+	};
+	const float RADII[] = { 2, 4, 8, 16, 32 };
 
-    /* Enable Light One */
-    driver->glEnable( GL_LIGHT1 );
-driver->glEnable( GL_LIGHTING );
+	srand(1);
+	for (int r = 0; r < (int)(sizeof (RADII) / sizeof (RADII[0])); ++r) {
+		long long brushTime = 0, rebuildTime = 0, points = 0;
+		for (int i = 0; i < EDITS; ++i) {
+			Brush brush = { (BrushType)(i % BRUSH_TYPES), randomFloat(0, AREA_SIZE - 1),
+					randomFloat(0, AREA_SIZE - 1), RADII[r], 1, 0 };
+			brush.strength = brush.type < BRUSH_FLATTEN ? 20 : .5f;
+			long long start = getMicroseconds();
+			DirtyRect dirty = terrainEditor->apply(brush);
+			long long applied = getMicroseconds();
+			if (!dirty.isEmpty())
+				updateTerrain(dirty);
+			brushTime += applied - start;
+			rebuildTime += getMicroseconds() - applied;
+			points += (dirty.x1 - dirty.x0) * (dirty.z1 - dirty.z0);
+		}
+		printf("Edit (radius %.0f): %d points, brush %.1f us, rebuild %.1f us\n",
+		       RADII[r], (int)(points / EDITS), (float)brushTime / EDITS, (float)rebuildTime / EDITS);
+	}
 
-	return true;
+	long long start = getMicroseconds();
+	DirtyRect all = { 0, 0, AREA_SIZE, AREA_SIZE };
+	updateTerrain(all);
+	printf("Full rebuild (%dx%d): %.1f us\n", AREA_SIZE, AREA_SIZE, (float)(getMicroseconds() - start));
+
+	short* map = generateMap(MAP_SIZE);
+	HorizonMap horizon(map, MAP_SIZE);
+	TerrainEditor editor(map, MAP_SIZE);
+	horizon.bake(workers);
+	long long bakeTime = horizon.getBakeTime();
+	for (int r = 0; r < (int)(sizeof (RADII) / sizeof (RADII[0])); r += 2) {
+		long long time = 0;
+		for (int i = 0; i < EDITS / 10; ++i) {
+			Brush brush = { BRUSH_RAISE, randomFloat(0, MAP_SIZE - 1), randomFloat(0, MAP_SIZE - 1),
+					RADII[r], 20, 0 };
+			DirtyRect dirty = editor.apply(brush);
+			horizon.update(dirty.x0, dirty.z0, dirty.x1, dirty.z1, workers);
+			time += horizon.getBakeTime();
+		}
+		printf("Horizon map update (%dx%d, radius %.0f): %.2f ms, full bake %.1f ms\n",
+		       MAP_SIZE, MAP_SIZE, RADII[r], time * .001f / (EDITS / 10), bakeTime * .001f);
+	}
+	delete[] map;
 }
 
+/*
+ * Accuracy and speed of the polynomial sine against libm, then one frame
+ * of the animated surface with both
+ */
 void
-drawScene (float frameTime)
+benchmarkAnimatedSurface ()
 {
-	driver->glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	//driver->glLoadIdentity();
-	driver->glLoadMatrixf(translationMatrix(-13, 0, -42).rotateX(.35));
+	enum {
+		ARGUMENTS = 1 << 20,
+		PASSES = 10,
+	};
+	static float args[ARGUMENTS], values[ARGUMENTS], exact[ARGUMENTS];
+	srand(1);
+	for (int i = 0; i < ARGUMENTS; ++i)
+		args[i] = randomFloat(-1000, 1000);
 
-	float scale = .1;
+	long long start = getMicroseconds();
+	for (int i = 0; i < ARGUMENTS; i += 4)
+		sin(Float4::load(args + i)).store(values + i);
+	long long polynomial = getMicroseconds() - start;
+	start = getMicroseconds();
+	for (int i = 0; i < ARGUMENTS; ++i)
+		exact[i] = sinf(args[i]);
+	long long libm = getMicroseconds() - start;
 
-	driver->glColor3f(0, 0.5, 0.1);
-	driver->glBegin(GL_QUADS);
-	for (int x = 0; x < AREA_SIZE - 1; ++x)
-	{
-		for (int z = 0; z < AREA_SIZE - 1; ++z)
-		{
-      			driver->glNormal3f( 1.0f, 0.0f, 0.5f );
-			driver->glVertex3f(scale * (x+1),  scale * height[x+1][z],    scale * z);
-      			driver->glNormal3f( 1.0f, 0.0f, 0.5f );
-			driver->glVertex3f(scale * x,      scale * height[x][z],      scale * z);
-      			driver->glNormal3f( 0.0f, 0.0f, 0.5f );
-			driver->glVertex3f(scale * x,      scale * height[x][z+1],    scale * (z+1));
-      			driver->glNormal3f( 0.0f, 0.0f, 0.5f );
-			driver->glVertex3f(scale * (x+1),  scale * height[x+1][z+1],  scale * (z+1));
+	float maxError = 0;
+	for (int i = 0; i < ARGUMENTS; ++i) {
+		float e = fabsf(values[i] - exact[i]);
+		maxError = e > maxError ? e : maxError;
+	}
+	printf("Polynomial sine: %.0f M/s, libm %.0f M/s, max error %.2g\n",
+	       (float)ARGUMENTS / polynomial, (float)ARGUMENTS / libm, maxError);
+
+	AnimatedSurface surface(ANIMATED_SIZE, WORLD_SCALE * (AREA_SIZE - 1) / (ANIMATED_SIZE - 1),
+				WAVE_LAYERS, sizeof (WAVE_LAYERS) / sizeof (WAVE_LAYERS[0]));
+	unsigned short* heights = new unsigned short[ANIMATED_SIZE * ANIMATED_SIZE];
+	start = getMicroseconds();
+	for (int i = 0; i < PASSES; ++i)
+		surface.evaluate(i / 60.f, heights);
+	long long serial = (getMicroseconds() - start) / PASSES;
+	start = getMicroseconds();
+	for (int i = 0; i < PASSES; ++i)
+		surface.evaluate(i / 60.f, heights, workers);
+	long long parallel = (getMicroseconds() - start) / PASSES;
+
+	// The reference for the last frame, quantized the same way
+	float t = (PASSES - 1) / 60.f;
+	int maxSteps = 0;
+	start = getMicroseconds();
+	for (int z = 0; z < ANIMATED_SIZE; ++z) {
+		for (int x = 0; x < ANIMATED_SIZE; ++x) {
+			float h = surface.sample(x, z, t);
+			int q = (int)((h - surface.getMinHeight()) / surface.getHeightStep() + .5f);
+			int d = abs(q - heights[z * ANIMATED_SIZE + x]);
+			maxSteps = d > maxSteps ? d : maxSteps;
 		}
 	}
-	driver->glEnd();
+	long long reference = getMicroseconds() - start;
+	printf("Animated surface (%dx%d, %d layers): %.2f ms on 1 thread, %.2f ms on %d threads, "
+	       "%.1f ms with libm, at most %d steps of %.2g off\n",
+	       ANIMATED_SIZE, ANIMATED_SIZE, surface.getLayerCount(), serial * .001f, parallel * .001f,
+	       workers->getThreadCount(), reference * .001f, maxSteps, surface.getHeightStep());
+	delete[] heights;
+}
 
-	SDL_GL_SwapBuffers ();
+/*
+ * The octahedral normal of packNormal() from the height differences
+ * across two cells, in the low and high byte. It divides by the sum of
+ * the components anyway, so the normal need not be normalized, and it
+ * always points up.
+ */
+inline unsigned short
+packedFieldNormal (int dx, int dz)
+{
+	float x = dx * .5f, z = dz * .5f;
+	float scale = 127 / (fabsf(x) + 1 + fabsf(z));
+	// Rounded from a positive value, so truncation is enough
+	int px = (int)(x * scale + 127.5f) - 127, pz = (int)(z * scale + 127.5f) - 127;
+	return (unsigned char)px | (unsigned char)pz << 8;
+}
+
+/*
+ * Normals one sample at a time through the neighbour accessors, with x
+ * or z innermost
+ */
+template<class Layout>
+void
+fieldNormals (const Heightfield<short, Layout>& field, Heightfield<unsigned short, Layout>& normals,
+	      bool xInner)
+{
+	int sizeX = field.getSizeX(), sizeZ = field.getSizeZ();
+	int outer = xInner ? sizeZ : sizeX, inner = xInner ? sizeX : sizeZ;
+	for (int i = 0; i < outer; ++i) {
+		for (int j = 0; j < inner; ++j) {
+			int x = xInner ? j : i, z = xInner ? i : j;
+			short x0, x1, z0, z1;
+			field.getNeighbours(x, z, x0, x1, z0, z1);
+			normals.set(x, z, packedFieldNormal(x0 - x1, z0 - z1));
+		}
+	}
+}
+
+/*
+ * The same tile by tile, each read with an apron into a plain array
+ */
+template<class Layout>
+void
+fieldNormalsBlocked (const Heightfield<short, Layout>& field, Heightfield<unsigned short, Layout>& normals)
+{
+	enum {
+		TILE = TiledLayout::TILE,
+		APRON = TILE + 2,
+	};
+	short block[APRON * APRON];
+	unsigned short out[TILE * TILE];
+	for (int tx = 0; tx < field.getSizeX(); tx += TILE) {
+		int w = tx + TILE < field.getSizeX() ? TILE : field.getSizeX() - tx;
+		for (int tz = 0; tz < field.getSizeZ(); tz += TILE) {
+			int h = tz + TILE < field.getSizeZ() ? TILE : field.getSizeZ() - tz;
+			field.readBlock(tx - 1, tz - 1, w + 2, h + 2, block);
+			for (int x = 0; x < w; ++x) {
+				const short* b = block + (x + 1) * (h + 2) + 1;
+				for (int z = 0; z < h; ++z)
+					out[x * h + z] = packedFieldNormal(b[z - h - 2] - b[z + h + 2], b[z - 1] - b[z + 1]);
+			}
+			normals.writeBlock(tx, tz, w, h, out);
+		}
+	}
+}
+
+/*
+ * Bilinear samples along short walks in random directions, like
+ * particles or vehicles following the ground
+ */
+template<class Layout>
+float
+fieldWalks (const Heightfield<short, Layout>& field, const float* walks, int walkCount, int steps)
+{
+	float sum = 0;
+	for (int i = 0; i < walkCount; ++i) {
+		const float* w = walks + 4 * i;
+		for (int s = 0; s < steps; ++s)
+			sum += field.sample(w[0] + s * w[2], w[1] + s * w[3]);
+	}
+	return sum;
+}
+
+/*
+ * Row major against tiled layout on a large field, normals in both
+ * loop orders and by blocks, and bilinear samples along walks
+ */
+void
+benchmarkHeightfield ()
+{
+	enum {
+		SIZE = LARGE_FIELD_SIZE,
+		WALKS = 1 << 16,
+		STEPS = 64,
+	};
+	Heightfield<short, RowLayout> rows(SIZE, SIZE);
+	Heightfield<short, TiledLayout> tiles(SIZE, SIZE);
+	Heightfield<unsigned short, RowLayout> rowNormals(SIZE, SIZE);
+	Heightfield<unsigned short, TiledLayout> tileNormals(SIZE, SIZE);
+
+	// terrainHeight() with ridges across it, so the normals vary
+	float* waveX = new float[SIZE];
+	float* waveZ = new float[SIZE];
+	for (int i = 0; i < SIZE; ++i) {
+		waveX[i] = 10 * sin(i / 24.f) + 3 * sin(i / 5.f);
+		waveZ[i] = 7 * cos((i - 50) / 18.f) + 2 * cos(i / 3.f);
+	}
+	short* row = new short[SIZE];
+	long long start = getMicroseconds();
+	for (int x = 0; x < SIZE; ++x) {
+		for (int z = 0; z < SIZE; ++z)
+			row[z] = (short)(waveX[x] + waveZ[z] + ((x * 7 + z * 13) & 15) - 8);
+		rows.writeRow(x, 0, SIZE, row);
+		tiles.writeRow(x, 0, SIZE, row);
+	}
+	long long fill = getMicroseconds() - start;
+
+	struct Case {
+		const char* name;
+		long long   rows, tiles;
+	} cases[3] = { { "z inner", 0, 0 }, { "x inner", 0, 0 }, { "blocks", 0, 0 } };
+	int mismatches = 0;
+	unsigned short* a = new unsigned short[SIZE];
+	unsigned short* b = new unsigned short[SIZE];
+	for (int c = 0; c < 3; ++c) {
+		start = getMicroseconds();
+		if (c < 2)
+			fieldNormals(rows, rowNormals, c == 1);
+		else
+			fieldNormalsBlocked(rows, rowNormals);
+		cases[c].rows = getMicroseconds() - start;
+		start = getMicroseconds();
+		if (c < 2)
+			fieldNormals(tiles, tileNormals, c == 1);
+		else
+			fieldNormalsBlocked(tiles, tileNormals);
+		cases[c].tiles = getMicroseconds() - start;
+
+		for (int x = 0; x < SIZE; ++x) {
+			rowNormals.readRow(x, 0, SIZE, a);
+			tileNormals.readRow(x, 0, SIZE, b);
+			mismatches += memcmp(a, b, SIZE * sizeof (unsigned short)) != 0;
+		}
+	}
+
+	printf("Heightfield %dx%d shorts: %d MB row major, %d MB tiled, filled in %.0f ms\n", SIZE, SIZE,
+	       (int)(rows.getMemory() >> 20), (int)(tiles.getMemory() >> 20), fill * .001f);
+	for (int c = 0; c < 3; ++c)
+		printf("  Normals, %s: %.0f ms row major, %.0f ms tiled (%.2f ns per sample)\n", cases[c].name,
+		       cases[c].rows * .001f, cases[c].tiles * .001f, cases[c].tiles * 1000.f / SIZE / SIZE);
+
+	float* walks = new float[4 * WALKS];
+	srand(1);
+	for (int i = 0; i < WALKS; ++i) {
+		float a = randomFloat(0, 2 * M_PI);
+		walks[4 * i] = randomFloat(0, SIZE - 1);
+		walks[4 * i + 1] = randomFloat(0, SIZE - 1);
+		walks[4 * i + 2] = .7f * cos(a);
+		walks[4 * i + 3] = .7f * sin(a);
+	}
+	start = getMicroseconds();
+	float rowSum = fieldWalks(rows, walks, WALKS, STEPS);
+	long long rowWalks = getMicroseconds() - start;
+	start = getMicroseconds();
+	float tileSum = fieldWalks(tiles, walks, WALKS, STEPS);
+	long long tileWalks = getMicroseconds() - start;
+	printf("  Bilinear, %d walks of %d samples: %.1f ms row major, %.1f ms tiled, %s\n",
+	       WALKS, STEPS, rowWalks * .001f, tileWalks * .001f,
+	       mismatches || rowSum != tileSum ? "results differ" : "same results");
+
+	delete[] walks;
+	delete[] a;
+	delete[] b;
+	delete[] row;
+	delete[] waveX;
+	delete[] waveZ;
+}
+
+/*
+ * Deriving the data from the heights and writing the cache against
+ * loading it, in a file of its own
+ */
+void
+benchmarkCache ()
+{
+	const char* path = "Terrain.benchmark.cache";
+	remove(path);
+	delete rayCaster;
+	delete horizonMap;
+
+	long long start = getMicroseconds();
+	initDerivedData(path);
+	long long cold = getMicroseconds() - start;
+	unsigned long long built = hashBytes(normals, sizeof (normals));
+	built = hashBytes(chunks, sizeof (chunks), built);
+	built = hashBytes(occluders, sizeof (occluders), built);
+	built = hashBytes(rayCaster->getPyramid(), RayCaster::getPyramidBytes(AREA_SIZE), built);
+	built = hashBytes(horizonMap->getData(), horizonMap->getMemory(), built);
+
+	delete rayCaster;
+	delete horizonMap;
+	memset(normals, 0, sizeof (normals));
+	memset(chunks, 0, sizeof (chunks));
+	memset(occluders, 0, sizeof (occluders));
+	start = getMicroseconds();
+	bool warm = initDerivedData(path);
+	long long loaded = getMicroseconds() - start;
+	unsigned long long restored = hashBytes(normals, sizeof (normals));
+	restored = hashBytes(chunks, sizeof (chunks), restored);
+	restored = hashBytes(occluders, sizeof (occluders), restored);
+	restored = hashBytes(rayCaster->getPyramid(), RayCaster::getPyramidBytes(AREA_SIZE), restored);
+	restored = hashBytes(horizonMap->getData(), horizonMap->getMemory(), restored);
+
+	start = getMicroseconds();
+	unsigned long long key = cacheKey();
+	long long keyTime = getMicroseconds() - start;
+	printf("Terrain cache: cold %.2f ms, warm %.2f ms (%s, %s), key %016llx in %.3f ms\n",
+	       cold * .001f, loaded * .001f, warm ? "loaded" : "not loaded",
+	       restored == built ? "identical" : "different", key, keyTime * .001f);
+	remove(path);
+	delete horizonMap;
+	horizonMap = NULL;
+}
+
+/*
+ * Dust bouncing all over the area, updated on one thread and on the
+ * pool without streaming vertices
+ */
+void
+benchmarkParticles ()
+{
+	enum {
+		MAX_PARTICLES = 2000000,
+		FRAMES = 10,
+	};
+	ParticleSystem system(PARTICLE_KINDS[PARTICLE_DUST], MAX_PARTICLES, heightSampler);
+	Vector wind(PARTICLE_WIND[0], PARTICLE_WIND[1], PARTICLE_WIND[2]);
+	float extent = WORLD_SCALE * (AREA_SIZE - 1);
+	ParticleEmitter e;
+	e.min = Vector(0, 0, 0);
+	e.max = Vector(extent, 1, extent);
+	e.grounded = true;
+	e.velocity = Vector(0, .5, 0);
+	e.spread = 1;
+
+	for (int count = MAX_PARTICLES / 2; count <= MAX_PARTICLES; count *= 2) {
+		long long time[2];
+		long updated[2];
+		int died = 0;
+		for (int parallel = 0; parallel < 2; ++parallel) {
+			system.clear();
+			system.emit(e, count);
+			updated[parallel] = 0;
+			long long start = getMicroseconds();
+			for (int i = 0; i < FRAMES; ++i) {
+				updated[parallel] += system.getCount();
+				system.update(1 / 60.f, wind, parallel ? workers : NULL);
+			}
+			time[parallel] = getMicroseconds() - start;
+			died = count - system.getCount();
+		}
+		printf("Particles (%d): %.0f per ms on 1 thread, %.0f per ms per core on %d threads, "
+		       "%.2f ms per frame, %d died\n",
+		       count, 1000.f * updated[0] / time[0],
+		       1000.f * updated[1] / time[1] / workers->getThreadCount(), workers->getThreadCount(),
+		       time[1] * .001f / FRAMES, died);
+	}
+}
+
+/*
+ * Puts a ridge between the eye and a scatter chunk in the middle of the
+ * area and checks that the horizon and the occlusion buffer each hide
+ * the chunk from select(), and that it is drawn without the ridge
+ */
+bool
+checkScatterOcclusion (ObjectScatter& objects)
+{
+	int chunk = objects.getChunk(AREA_SIZE / 2, AREA_SIZE / 2);
+	Vector min, max;
+	if (!objects.getChunkBounds(chunk, min, max)) {
+		fprintf(stderr, "Scatter occlusion: no objects in the middle of the area\n");
+		return false;
+	}
+
+	// Looking down -z at the chunk from above, over a ridge just below the eye
+	Vector center = (min + max) / 2;
+	Vector eye(center[0], max[1] + 10, center[2] + 30);
+	Matrix projection = perspectiveMatrix(45.0f, (float)SCREEN_WIDTH / SCREEN_HEIGHT, NEAR_PLANE, FAR_PLANE);
+	Matrix clip = projection * translationMatrix(-eye[0], -eye[1], -eye[2]);
+	Frustum frustum(clip);
+	float pixelScale = projection(1, 1) * SCREEN_HEIGHT / 2;
+	Vector ridgeMin(eye[0] - 40, min[1] - 10, eye[2] - 15), ridgeMax(eye[0] + 40, eye[1] - 1, eye[2] - 1);
+
+	// The ridge in both, its top face is what raises the horizon
+	Horizon horizon[2];
+	OcclusionBuffer* buffer = new OcclusionBuffer[2];
+	float x[8], y[8], z[8];
+	for (int i = 0; i < 8; ++i) {
+		x[i] = i & 1 ? ridgeMax[0] : ridgeMin[0];
+		y[i] = i & 2 ? ridgeMax[1] : ridgeMin[1];
+		z[i] = i & 4 ? ridgeMax[2] : ridgeMin[2];
+	}
+	static const unsigned short faces[36] = {
+		0, 1, 3, 0, 3, 2,  4, 6, 7, 4, 7, 5,  0, 2, 6, 0, 6, 4,
+		1, 5, 7, 1, 7, 3,  0, 4, 5, 0, 5, 1,  2, 3, 7, 2, 7, 6,
+	};
+	for (int i = 0; i < 2; ++i) {
+		horizon[i].clear(clip);
+		buffer[i].begin(clip);
+		if (i) {
+			horizon[i].addOccluder(clip, Vector(ridgeMin[0], ridgeMax[1], ridgeMin[2]), ridgeMax);
+			buffer[i].drawMesh(x, y, z, 8, faces, 12);
+		}
+		buffer[i].finish();
+	}
+
+	// Without the ridge, behind it in the horizon, behind it in the buffer
+	static unsigned char hidden[SCATTER_CHUNKS];
+	const char* const NAMES[] = { "without the ridge", "behind the horizon", "behind the occlusion buffer" };
+	int drawn[3];
+	bool passed = true;
+	for (int test = 0; test < 3; ++test) {
+		memset(hidden, 0, sizeof (hidden));
+		hidden[chunk] = isScatterHidden(objects, chunk, clip, &horizon[test == 1], test == 2 ? &buffer[1] : &buffer[0]);
+		objects.select(frustum, eye, pixelScale, MAX_DRAW_DISTANCE, hidden);
+		drawn[test] = objects.getFrameStats().chunks;
+		if (hidden[chunk] != (test > 0) || (test && drawn[test] != drawn[0] - 1)) {
+			fprintf(stderr, "Scatter occlusion: chunk %s %s\n", NAMES[test], test ? "drawn" : "hidden");
+			passed = false;
+		}
+	}
+	delete[] buffer;
+	return passed;
+}
+
+/*
+ * Placement at every level and the culling and LOD selection along the
+ * flythrough, without drawing. Returns false if the culling behind the
+ * terrain fails its check.
+ */
+bool
+benchmarkScatter ()
+{
+	enum {
+		FRAMES = 600,
+	};
+	ObjectScatter scatter(heightSampler, AREA_SIZE, SCATTER_CHUNK_SIZE, WORLD_SCALE, SCATTER_KINDS,
+			      sizeof (SCATTER_KINDS) / sizeof (SCATTER_KINDS[0]));
+	Matrix projection = perspectiveMatrix(45.0f, (float)SCREEN_WIDTH / SCREEN_HEIGHT, NEAR_PLANE, FAR_PLANE);
+	float pixelScale = projection(1, 1) * SCREEN_HEIGHT / 2;
+
+	for (unsigned level = 1; level < sizeof (SCATTER_COUNTS) / sizeof (SCATTER_COUNTS[0]); ++level) {
+		scatter.place(SCATTER_COUNTS[level], NULL);
+		long long serial = scatter.getPlaceTime();
+		scatter.place(SCATTER_COUNTS[level], workers);
+
+		long long select = 0;
+		long lod[3] = { 0, 0, 0 }, triangles = 0;
+		for (int i = 0; i < FRAMES; ++i) {
+			Matrix modelView;
+			Vector eye;
+			flythroughCamera(i / 60.f, modelView, eye);
+			long long start = getMicroseconds();
+			scatter.select(Frustum(projection * modelView), eye, pixelScale, MAX_DRAW_DISTANCE);
+			select += getMicroseconds() - start;
+			const ScatterStats& s = scatter.getFrameStats();
+			for (int j = 0; j < 3; ++j)
+				lod[j] += s.lodInstances[j];
+			triangles += s.triangles;
+		}
+		printf("Scatter (%d): %d placed in %.1f ms on 1 thread, %.1f ms on %d threads, "
+		       "%.1f us per select, %ld/%ld/%ld detail/coarse/impostor and %ld triangles per frame\n",
+		       SCATTER_COUNTS[level], scatter.getInstanceCount(), serial * .001f,
+		       scatter.getPlaceTime() * .001f, workers->getThreadCount(), (float)select / FRAMES,
+		       lod[0] / FRAMES, lod[1] / FRAMES, lod[2] / FRAMES, triangles / FRAMES);
+	}
+	return checkScatterOcclusion(scatter);
+}
+
+/*
+ * Measures the CPU side terrain queries without opening a window
+ */
+int
+runBenchmarks ()
+{
+	workers = new WorkerPool();
+	initHeights();
+	initNormals();
+	initChunks();
+	rayCaster = new RayCaster(&height[0][0], AREA_SIZE, WORLD_SCALE);
+	heightSampler = new HeightSampler(&height[0][0], AREA_SIZE, WORLD_SCALE);
+	heightCollider = new HeightCollider(&height[0][0], AREA_SIZE, WORLD_SCALE);
+	terrainEditor = new TerrainEditor(&height[0][0], AREA_SIZE);
+	initOccluders();
+
+	benchmarkRays();
+	benchmarkSampling();
+	benchmarkCollision();
+	benchmarkViewshed();
+	benchmarkHorizonBake();
+	benchmarkVertexFormat<TerrainVertex>("float");
+	benchmarkVertexFormat<PackedVertex>("packed");
+	benchmarkLightBinning();
+	bool passed = benchmarkFrameBudget();
+	benchmarkEditing();
+	benchmarkAnimatedSurface();
+	benchmarkCache();
+	benchmarkHeightfield();
+	benchmarkParticles();
+	passed = benchmarkScatter() && passed;
+
+	delete rayCaster;
+	delete heightSampler;
+	delete heightCollider;
+	delete terrainEditor;
+	delete workers;
+	return passed ? 0 : 1;
 }
 
 int
 main (int argc, char *argv[])
 {
+	long long startTime = getMicroseconds();
+	if (argc > 1 && !strcmp(argv[1], "--benchmark"))
+		return runBenchmarks();
+	if (argc > 2 && !strcmp(argv[1], "--frame-budget")) {
+		frameBudget.setTarget(atof(argv[2]));
+		resolutionScale.setTarget(atof(argv[2]));
+		useFrameBudget = true;
+	}
+
 	if (SDL_Init (SDL_INIT_VIDEO) < 0) {
 		fprintf (stderr, "Video initialization failed: %s\n",
 			 SDL_GetError ());
@@ -189,12 +3177,17 @@ main (int argc, char *argv[])
 		quit (1);
 	}
 
+	/* Shares the objects of the window's context with the loader thread */
+	sharedContext = new SharedContext();
+
 	if ((SDL_EnableKeyRepeat (100, SDL_DEFAULT_REPEAT_INTERVAL))) {
 		fprintf (stderr, "Setting keyboard repeat failed: %s\n",
 			 SDL_GetError ());
 		quit (1);
 	}
 
+	workers = new WorkerPool();
+
 	if (!initGL ()) {
 		fprintf (stderr, "Could not initialize OpenGL.\n");
 		quit (1);
@@ -203,19 +3196,16 @@ main (int argc, char *argv[])
 	resizeWindow (SCREEN_WIDTH, SCREEN_HEIGHT);
 
 	bool done = false, active = true;
-	int lastTime = SDL_GetTicks(), frames = 0, lastFrameTime = SDL_GetTicks();
+	int frames = 0, lastFrameTime = SDL_GetTicks();
 	while (!done) {
 		/* handle the events in the queue */
 		SDL_Event event;
 		while (SDL_PollEvent (&event)) {
 			switch (event.type) {
 			case SDL_ACTIVEEVENT:
-				if (event.active.gain == 0)
-					active = false;
-				else {
-					active = true;
-					 lastTime = SDL_GetTicks();
-				}
+				active = (event.active.gain != 0);
+				if (active)
+					resumed = true;
 				break;
 
 			case SDL_VIDEORESIZE:
@@ -236,6 +3226,28 @@ main (int argc, char *argv[])
 				handleKeyPress (&event.key.keysym);
 				break;
 
+			case SDL_MOUSEBUTTONDOWN:
+				if (event.button.button == SDL_BUTTON_LEFT) {
+					pickX = event.button.x;
+					pickY = event.button.y;
+				} else if (event.button.button == SDL_BUTTON_RIGHT) {
+					editX = event.button.x;
+					editY = event.button.y;
+				}
+				break;
+
+			case SDL_MOUSEMOTION:
+				if (editX >= 0) {
+					editX = event.motion.x;
+					editY = event.motion.y;
+				}
+				break;
+
+			case SDL_MOUSEBUTTONUP:
+				if (event.button.button == SDL_BUTTON_RIGHT)
+					editX = editY = -1;
+				break;
+
 			case SDL_QUIT:
 				done = true;
 				break;
@@ -243,16 +3255,158 @@ main (int argc, char *argv[])
 		}
 
 		if (active) {
+			// Not while a packet is out, the frame thread starts on the first slot
+			if (pipelineAfterStroke && !strokeFrames) {
+				pipeline.setPipelined(true);
+				pipelineAfterStroke = false;
+			}
+			const RenderPacket& packet = pipeline.acquire();
+			drawScene (packet);
+			if (startTime) {
+				printf("First frame after %.1f ms, derived data %s\n",
+				       (getMicroseconds() - startTime) * .001f,
+				       derivedFromCache ? "from the cache" : "built");
+				startTime = 0;
+			}
+
+			if (pickX >= 0) {
+				pickTerrain(packet, pickX, pickY);
+				pickX = pickY = -1;
+			}
+			if (editX >= 0)
+				editTerrain(packet, editX, editY);
+			else
+				finishStroke();
+
+			if (useFrameBudget)
+				updateFrameBudget(packet);
+			if (useDynamicResolution)
+				updateDynamicResolution();
+
 			int time =  SDL_GetTicks();
 
 			if (++frames % 100 == 99) {
-				printf("%.2f FPS\n", 1000.f * frames / (time - lastFrameTime));
+				const StreamStats& stream = vertexStream->getFrameStats();
+				printf("%.2f FPS, %.2f ms (%s, %s vertices), streamed %d KB, %d fence waits, %d orphans\n",
+				       1000.f * frames / (time - lastFrameTime),
+				       (float)(time - lastFrameTime) / frames,
+				       pipeline.isPipelined() ? "pipelined" : "serial",
+				       vertexFormat == VERTEX_PACKED ? "packed" : "float",
+				       stream.bytes >> 10, stream.fenceWaits, stream.orphans);
+				bool chunked = renderer == RENDERER_CHUNKS;
+				if (chunked && useHorizon) {
+					int chunks = packet.chunkCount + packet.occludedChunks;
+					printf("Horizon: %d of %d chunks occluded\n",
+					       packet.occludedChunks - packet.bufferOccludedChunks, chunks);
+				}
+				if (chunked && useOcclusionBuffer) {
+					printf("Occlusion buffer: %d chunks occluded, %d triangles rasterized in %d us\n",
+					       packet.bufferOccludedChunks, packet.occluderTriangles, packet.occlusionTime);
+				}
+				if (terrainTimer->isAvailable())
+					printf("Terrain pass: %d us GPU\n", terrainTimer->getTime());
+				if (packet.shadows && shadowCascades->isAvailable()) {
+					const ShadowCascade* c = packet.shadowCascades;
+					const int* n = packet.shadowChunkCount;
+					printf("Shadow maps: cascades to %.1f/%.1f/%.1f/%.1f, %d/%d/%d/%d chunks, "
+					       "%d triangles, %d us GPU\n",
+					       c[0].split, c[1].split, c[2].split, c[3].split, n[0], n[1], n[2], n[3],
+					       packet.shadowTriangles, shadowTimer->getTime());
+				}
+				if (chunked && vertexFormat == VERTEX_PACKED && resourceLoader->isAvailable()) {
+					const LoaderStats& l = resourceLoader->getFrameStats();
+					int current = 0;
+					for (int cx = 0; cx < CHUNK_COUNT; ++cx) {
+						for (int cz = 0; cz < CHUNK_COUNT; ++cz) {
+							const ChunkBuffer& b = chunkBuffers[cx][cz];
+							current += b.buffer && b.bufferVersion == b.version;
+						}
+					}
+					printf("Chunk buffers: %d of %d current, %d loaded (%d KB) in %d us on the loader thread, "
+					       "%d pending\n",
+					       current, CHUNK_COUNT * CHUNK_COUNT, l.loads, l.bytes >> 10, l.loadTime, l.pending);
+				}
+				if (useDynamicResolution) {
+					printf("Dynamic resolution: %dx%d of %dx%d (%d%%), upscaled in %d us GPU\n",
+					       renderWidth, renderHeight, viewWidth, viewHeight,
+					       resolutionScale.getScale(), upscaleTimer->getTime());
+				}
+				if (useFrameBudget) {
+					printf("Frame budget: %.2f ms of %.1f ms, LOD error %.2f pixels, draw distance %.1f\n",
+					       frameBudget.getCost(), frameBudget.getTarget(),
+					       packet.lodError, packet.drawDistance);
+				}
+				if (chunked && packet.lights.getStats().lights) {
+					const ClusterStats& l = packet.lights.getStats();
+					printf("Clustered lights: %d lights, %d visible, %d cluster references, %d overflows, "
+					       "binned in %d us, %d KB uploaded\n",
+					       l.lights, l.visibleLights, l.references, l.overflows, l.binTime,
+					       clusteredLighting->getUploadBytes() >> 10);
+				}
+				if (chunked && useVirtualTexture && chunkPrograms[vertexFormat].feedback) {
+					const VirtualTextureStats& v = virtualTexture->getFrameStats();
+					printf("Virtual texture: %d pages requested, %d missing, %d uploaded (%d KB), "
+					       "%d evicted, %d dropped, %d resident, %d pending, feedback %d us\n",
+					       v.requests, v.misses, v.uploads, v.uploadBytes >> 10, v.evictions, v.dropped,
+					       v.residentPages, v.pendingPages, v.feedbackTime);
+					const UploadStats& u = virtualTexture->getUploadStats();
+					printf("Page uploads: %d copies (%d KB) issued in %d us, producer blocked %d times "
+					       "for %d us, %d pending\n",
+					       u.uploads, u.bytes >> 10, u.submitTime, u.stagingWaits, u.stagingWaitTime,
+					       u.pending);
+				}
+				if (particleLevel) {
+					int count = 0, spawned = 0, died = 0, hits = 0, time = 0, bytes = 0;
+					for (int i = 0; i < PARTICLE_SOURCES; ++i) {
+						const ParticleStats& p = particles[i]->getFrameStats();
+						count += p.particles;
+						spawned += p.spawned;
+						died += p.died;
+						hits += p.groundHits;
+						time += p.updateTime;
+						bytes += p.streamBytes;
+					}
+					printf("Particles: %d (%d %s, %d %s, %d %s), %d spawned, %d died, %d ground hits, "
+					       "updated in %d us, %.0f per ms per core on %d threads, %d KB streamed\n",
+					       count, particles[0]->getCount(), PARTICLE_NAMES[0],
+					       particles[1]->getCount(), PARTICLE_NAMES[1],
+					       particles[2]->getCount(), PARTICLE_NAMES[2], spawned, died, hits, time,
+					       time ? 1000.f * count / time / workers->getThreadCount() : 0,
+					       workers->getThreadCount(), bytes >> 10);
+				}
+				if (scatterLevel) {
+					const ScatterStats& s = scatter->getFrameStats();
+					printf("Scatter: %d objects, %d chunks drawn, %d culled, %d behind the terrain, "
+					       "%d/%d/%d detail/coarse/impostor, %d draw calls, %d triangles, "
+					       "selected in %d us, %d us GPU\n",
+					       s.instances, s.chunks, s.culledChunks, s.hiddenChunks,
+					       s.lodInstances[0], s.lodInstances[1],
+					       s.lodInstances[2], s.drawCalls, s.triangles, s.selectTime, scatterTimer->getTime());
+				}
+				if (frameCapture->isCapturing()) {
+					const CaptureStats& c = frameCapture->getFrameStats();
+					const CaptureTotals& t = frameCapture->getTotals();
+					printf("Capture: %d us on the render thread in the last frame, %d frames in flight, "
+					       "%d captured, %d dropped, %d written (%lld KB) so far\n",
+					       c.captureTime, c.pending, t.frames, t.dropped, t.written, t.writeBytes >> 10);
+				}
+				if (renderer == RENDERER_CLIPMAP) {
+					const ClipmapStats& c = clipmap->getFrameStats();
+					printf("Clipmap: %d instances, %d culled, %d draw calls, %d bytes uploaded\n",
+					       c.instances, c.culled, c.drawCalls, c.uploadBytes);
+				}
+				if (renderer == RENDERER_ANIMATED) {
+					const AnimatedSurfaceStats& a = animatedSurface->getFrameStats();
+					printf("Animated surface: %dx%d, %d layers evaluated in %d us on %d threads, "
+					       "%d KB uploaded, %d fence waits\n",
+					       ANIMATED_SIZE, ANIMATED_SIZE, animatedSurface->getLayerCount(), a.evaluateTime,
+					       workers->getThreadCount(), a.uploadBytes >> 10, a.fenceWaits);
+				}
 				lastFrameTime = time;
 				frames = 0;
 			}
 
-			drawScene ((time - lastTime) * .001f);
-			lastTime = time;
+			pipeline.release();
 		}
 	}
 
@@ -0,0 +1,228 @@
+#ifndef _TERRAIN_CACHE_H
+#define _TERRAIN_CACHE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Timer.h"
+
+/*
+ * 64 bit FNV-1a, continued from a previous hash
+ */
+inline unsigned long long hashBytes(const void* data, size_t bytes,
+				    unsigned long long hash = 14695981039346656037ULL) {
+	const unsigned char* p = (const unsigned char*)data;
+	for (size_t i = 0; i < bytes; ++i)
+		hash = (hash ^ p[i]) * 1099511628211ULL;
+	return hash;
+}
+
+/*
+ * File of data derived from the heights, so startup can skip deriving
+ * it again.
+ *
+ * The key is a hash of everything the data depends on, the heights and
+ * the parameters that shape the data. A file with another key, version
+ * or size is ignored. Checking the header and the section table is
+ * enough, the sections are not checksummed. load() maps the file, so
+ * find() returns pointers into the page cache and only the pages that
+ * are read get loaded. The sections stay valid until the cache is
+ * destroyed.
+ *
+ * save() writes a new file next to the old one and renames it over
+ * the old one, so another process never maps a file that is only half
+ * written.
+ */
+class TerrainCache {
+public:
+
+	enum {
+		VERSION = 1,
+		MAX_SECTIONS = 16,
+		// Sections start on cache lines
+		ALIGNMENT = 64,
+	};
+
+	TerrainCache(const char* path, unsigned long long key)
+		: path(path), key(key), base(NULL), mapped(0), sectionCount(0), loadTime(0) {
+	}
+
+	~TerrainCache() {
+		if (base)
+			munmap(base, mapped);
+	}
+
+	/*
+	 * Maps the file, false if it is missing or was built from something
+	 * else
+	 */
+	bool load() {
+		long long start = getMicroseconds();
+		int fd = open(path, O_RDONLY);
+		if (fd < 0)
+			return false;
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof (Header)) {
+			mapped = st.st_size;
+			base = (unsigned char*)mmap(NULL, mapped, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (base == MAP_FAILED)
+				base = NULL;
+		}
+		close(fd);
+		if (!base)
+			return false;
+
+		if (!validate()) {
+			munmap(base, mapped);
+			base = NULL;
+			return false;
+		}
+		loadTime = getMicroseconds() - start;
+		return true;
+	}
+
+	bool isLoaded() const {
+		return base != NULL;
+	}
+
+	/*
+	 * Section of the loaded file with an id, NULL unless it exists with
+	 * exactly the expected size
+	 */
+	const void* find(int id, size_t bytes) const {
+		if (!base)
+			return NULL;
+		const Header* header = (const Header*)base;
+		for (int i = 0; i < header->sectionCount; ++i) {
+			const Section& s = header->sections[i];
+			if (s.id == (unsigned)id)
+				return s.bytes == bytes ? base + s.offset : NULL;
+		}
+		return NULL;
+	}
+
+	/*
+	 * Adds a section to write with save(). The data is not copied and
+	 * has to stay until then.
+	 */
+	bool add(int id, const void* data, size_t bytes) {
+		if (sectionCount == MAX_SECTIONS)
+			return false;
+		pending[sectionCount].id = id;
+		pending[sectionCount].data = data;
+		pending[sectionCount].bytes = bytes;
+		++sectionCount;
+		return true;
+	}
+
+	/*
+	 * Writes the added sections under the key
+	 */
+	bool save() {
+		Header header;
+		memset(&header, 0, sizeof (header));
+		memcpy(header.magic, magic(), sizeof (header.magic));
+		header.version = VERSION;
+		header.key = key;
+		header.sectionCount = sectionCount;
+		unsigned long long offset = align(sizeof (Header));
+		for (int i = 0; i < sectionCount; ++i) {
+			header.sections[i].id = pending[i].id;
+			header.sections[i].offset = offset;
+			header.sections[i].bytes = pending[i].bytes;
+			offset = align(offset + pending[i].bytes);
+		}
+		header.fileSize = offset;
+
+		char temporary[1024];
+		snprintf(temporary, sizeof (temporary), "%s.%d", path, (int)getpid());
+		FILE* file = fopen(temporary, "wb");
+		if (!file)
+			return false;
+		static const char padding[ALIGNMENT] = { 0 };
+		bool ok = fwrite(&header, sizeof (header), 1, file) == 1;
+		unsigned long long written = sizeof (header);
+		for (int i = 0; ok && i < sectionCount; ++i) {
+			size_t pad = header.sections[i].offset - written;
+			ok = fwrite(padding, 1, pad, file) == pad &&
+				fwrite(pending[i].data, 1, pending[i].bytes, file) == pending[i].bytes;
+			written = header.sections[i].offset + pending[i].bytes;
+		}
+		size_t pad = header.fileSize - written;
+		ok = ok && fwrite(padding, 1, pad, file) == pad;
+		ok = fclose(file) == 0 && ok;
+		if (ok && rename(temporary, path) == 0)
+			return true;
+		remove(temporary);
+		return false;
+	}
+
+	// Microseconds the last successful load() took, mapping and validation
+	long long getLoadTime() const {
+		return loadTime;
+	}
+
+	// Bytes of the mapped file
+	size_t getSize() const {
+		return base ? mapped : 0;
+	}
+
+private:
+
+	struct Section {
+		unsigned           id;
+		unsigned           reserved;
+		unsigned long long offset;
+		unsigned long long bytes;
+	};
+
+	struct Header {
+		char               magic[8];
+		unsigned           version;
+		int                sectionCount;
+		unsigned long long key;
+		unsigned long long fileSize;
+		Section            sections[MAX_SECTIONS];
+	};
+
+	struct Pending {
+		int         id;
+		const void* data;
+		size_t      bytes;
+	};
+
+	static const char* magic() {
+		return "TRNCACHE";
+	}
+
+	static unsigned long long align(unsigned long long offset) {
+		return (offset + ALIGNMENT - 1) & ~(unsigned long long)(ALIGNMENT - 1);
+	}
+
+	bool validate() const {
+		const Header* header = (const Header*)base;
+		if (memcmp(header->magic, magic(), sizeof (header->magic)) || header->version != VERSION ||
+		    header->key != key || header->fileSize != mapped ||
+		    header->sectionCount < 0 || header->sectionCount > MAX_SECTIONS)
+			return false;
+		for (int i = 0; i < header->sectionCount; ++i) {
+			const Section& s = header->sections[i];
+			if (s.offset < sizeof (Header) || s.offset > mapped || s.bytes > mapped - s.offset)
+				return false;
+		}
+		return true;
+	}
+
+	const char*        path;
+	unsigned long long key;
+	unsigned char*     base;
+	size_t             mapped;
+	Pending            pending[MAX_SECTIONS];
+	int                sectionCount;
+	long long          loadTime;
+};
+
+#endif
@@ -0,0 +1,157 @@
+#ifndef _TERRAIN_EDITOR_H
+#define _TERRAIN_EDITOR_H
+
+#include <math.h>
+
+enum BrushType {
+	BRUSH_RAISE,
+	BRUSH_LOWER,
+	BRUSH_FLATTEN,
+	BRUSH_SMOOTH,
+	BRUSH_TYPES,
+};
+
+/*
+ * Circular brush in grid units. Raise and lower move the center by
+ * strength height units, flatten and smooth blend towards the target
+ * height or the neighbour average by strength between 0 and 1. The
+ * effect falls off smoothly towards the radius.
+ */
+struct Brush {
+	BrushType type;
+	float     x, z;
+	float     radius;
+	float     strength;
+	float     target;
+};
+
+/*
+ * Grid points [x0, x1) x [z0, z1) whose heights changed, empty if x0
+ * is not below x1
+ */
+struct DirtyRect {
+	int x0, z0, x1, z1;
+
+	bool isEmpty() const {
+		return x0 >= x1 || z0 >= z1;
+	}
+
+	void add(int x, int z) {
+		if (isEmpty()) {
+			x0 = x;
+			z0 = z;
+			x1 = x + 1;
+			z1 = z + 1;
+			return;
+		}
+		if (x < x0) x0 = x;
+		if (z < z0) z0 = z;
+		if (x >= x1) x1 = x + 1;
+		if (z >= z1) z1 = z + 1;
+	}
+
+	void add(const DirtyRect& r) {
+		if (r.isEmpty())
+			return;
+		add(r.x0, r.z0);
+		add(r.x1 - 1, r.z1 - 1);
+	}
+
+	// Grows the rectangle by n on every side, clamped to the grid
+	DirtyRect grow(int n, int size) const {
+		DirtyRect r = { x0 - n > 0 ? x0 - n : 0, z0 - n > 0 ? z0 - n : 0,
+				x1 + n < size ? x1 + n : size, z1 + n < size ? z1 + n : size };
+		return r;
+	}
+};
+
+/*
+ * Applies brushes to the height grid, indexed as height[x * size + z],
+ * and reports the points that changed so everything derived from the
+ * heights can be rebuilt over just that rectangle.
+ */
+class TerrainEditor {
+public:
+
+	TerrainEditor(short* height, int size) : height(height), size(size) {
+		scratch = new short[size * size];
+	}
+
+	~TerrainEditor() {
+		delete[] scratch;
+	}
+
+	DirtyRect apply(const Brush& brush) {
+		DirtyRect dirty = { 0, 0, 0, 0 };
+		int x0 = clamp((int)floor(brush.x - brush.radius)), x1 = clamp((int)ceil(brush.x + brush.radius));
+		int z0 = clamp((int)floor(brush.z - brush.radius)), z1 = clamp((int)ceil(brush.z + brush.radius));
+
+		// Smoothing reads the neighbours before they change
+		if (brush.type == BRUSH_SMOOTH) {
+			for (int x = x0 > 0 ? x0 - 1 : 0; x <= x1 + 1 && x < size; ++x) {
+				for (int z = z0 > 0 ? z0 - 1 : 0; z <= z1 + 1 && z < size; ++z)
+					scratch[x * size + z] = height[x * size + z];
+			}
+		}
+
+		for (int x = x0; x <= x1; ++x) {
+			for (int z = z0; z <= z1; ++z) {
+				float dx = (x - brush.x) / brush.radius, dz = (z - brush.z) / brush.radius;
+				float d = dx * dx + dz * dz;
+				if (d >= 1)
+					continue;
+				float weight = (1 - d) * (1 - d);
+
+				short& h = height[x * size + z];
+				float target = h;
+				switch (brush.type) {
+				case BRUSH_RAISE:
+					target = h + brush.strength * weight;
+					break;
+				case BRUSH_LOWER:
+					target = h - brush.strength * weight;
+					break;
+				case BRUSH_FLATTEN:
+					target = h + (brush.target - h) * brush.strength * weight;
+					break;
+				case BRUSH_SMOOTH:
+					target = h + (average(x, z) - h) * brush.strength * weight;
+					break;
+				default:
+					break;
+				}
+
+				int next = (int)floor(target + .5f);
+				next = next < -32768 ? -32768 : next > 32767 ? 32767 : next;
+				if (next == h)
+					continue;
+				h = (short)next;
+				dirty.add(x, z);
+			}
+		}
+		return dirty;
+	}
+
+private:
+
+	float average(int x, int z) const {
+		int sum = 0, count = 0;
+		for (int i = x > 0 ? x - 1 : 0; i <= x + 1 && i < size; ++i) {
+			for (int j = z > 0 ? z - 1 : 0; j <= z + 1 && j < size; ++j) {
+				sum += scratch[i * size + j];
+				++count;
+			}
+		}
+		return (float)sum / count;
+	}
+
+	int clamp(int i) const {
+		return i < 0 ? 0 : i >= size ? size - 1 : i;
+	}
+
+	short* height;
+	int    size;
+	short* scratch;
+};
+
+#endif
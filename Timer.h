@@ -0,0 +1,16 @@
+#ifndef _TIMER_H
+#define _TIMER_H
+
+#include <sys/time.h>
+
+/*
+ * Wall clock in microseconds, for measurements below the millisecond
+ * resolution of SDL_GetTicks
+ */
+inline long long getMicroseconds() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+#endif
@@ -0,0 +1,319 @@
+#ifndef _UPLOAD_QUEUE_H
+#define _UPLOAD_QUEUE_H
+
+#include <stdio.h>
+#include <string.h>
+#include "SDL.h"
+#include "GLDriver.h"
+#include "Timer.h"
+
+/*
+ * Per frame statistics of an upload queue. The submit time is what the
+ * render thread spent issuing copies, the staging waits are the times
+ * the worker found no free staging buffer and how long it waited.
+ */
+struct UploadStats {
+	int uploads;
+	int bytes;
+	int submitTime;
+	int stagingWaits;
+	int stagingWaitTime;
+	int pending;
+};
+
+/*
+ * Texture uploads staged in pixel buffer objects by a worker thread.
+ *
+ * request() queues a function that fills up to stagingSize bytes. The
+ * worker thread runs it into a free staging buffer and collect() hands
+ * the finished ones to the render thread, which picks the destination
+ * and copies them with texSubImage2D(). The copy reads the buffer object
+ * on the GPU timeline, so the render thread does not wait while the
+ * driver copies. A fence after the copy recycles the staging buffer once
+ * the GPU is done with it, polled without waiting in endFrame().
+ *
+ * The staging buffers are slices of one persistently mapped buffer, the
+ * only kind of mapping another thread may write to. Without
+ * GL_ARB_buffer_storage they live in client memory and the copy is the
+ * usual synchronous one.
+ */
+class UploadQueue {
+public:
+
+	typedef void (*FillFunc)(void* data, int tag, unsigned char* staging);
+
+	/*
+	 * A filled staging buffer and the tag it was requested with
+	 */
+	struct Upload {
+		int tag;
+		int staging;
+	};
+
+	enum {
+		MAX_STAGING = 64,
+		MAX_REQUESTS = 256,
+	};
+
+	UploadQueue(int stagingSize, int stagingCount)
+		: stagingSize(stagingSize), buffer(0), base(NULL), running(true) {
+		memset(&stats, 0, sizeof (stats));
+		memset(&frameStats, 0, sizeof (frameStats));
+		memset(fence, 0, sizeof (fence));
+		this->stagingCount = stagingCount < MAX_STAGING ? stagingCount : MAX_STAGING;
+
+		persistent = hasGLExtension("GL_ARB_buffer_storage") && hasGLExtension("GL_ARB_sync") &&
+			hasGLExtension("GL_ARB_pixel_buffer_object");
+		if (persistent) {
+			GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			driver->glGenBuffers(1, &buffer);
+			driver->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+			driver->glBufferStorage(GL_PIXEL_UNPACK_BUFFER, this->stagingCount * stagingSize, NULL, flags);
+			base = (unsigned char*)driver->glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0,
+									this->stagingCount * stagingSize, flags);
+			driver->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		}
+		if (!base) {
+			persistent = false;
+			base = new unsigned char[this->stagingCount * stagingSize];
+		}
+
+		for (int i = 0; i < this->stagingCount; ++i)
+			freeStaging[i] = i;
+		freeCount = this->stagingCount;
+		requestHead = requestCount = doneCount = 0;
+		stagingWaits = stagingWaitTime = 0;
+
+		lock = SDL_CreateMutex();
+		fillLock = SDL_CreateMutex();
+		requestsReady = SDL_CreateSemaphore(0);
+		stagingFree = SDL_CreateSemaphore(this->stagingCount);
+		thread = SDL_CreateThread(threadMain, this);
+		if (!thread)
+			fprintf(stderr, "Could not create upload thread: %s\n", SDL_GetError());
+	}
+
+	~UploadQueue() {
+		running = false;
+		if (thread) {
+			SDL_SemPost(requestsReady);
+			SDL_SemPost(stagingFree);
+			SDL_WaitThread(thread, NULL);
+		}
+		SDL_DestroySemaphore(requestsReady);
+		SDL_DestroySemaphore(stagingFree);
+		SDL_DestroyMutex(fillLock);
+		SDL_DestroyMutex(lock);
+
+		for (int i = 0; i < stagingCount; ++i) {
+			if (fence[i])
+				driver->glDeleteSync(fence[i]);
+		}
+		if (persistent) {
+			driver->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+			driver->glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			driver->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			driver->glDeleteBuffers(1, &buffer);
+		} else {
+			delete[] base;
+		}
+	}
+
+	bool isAvailable() const {
+		return thread != NULL;
+	}
+
+	// True if the copies are asynchronous
+	bool isPersistent() const {
+		return persistent;
+	}
+
+	/*
+	 * Queues a fill of bytes for the worker thread. Returns false if the
+	 * queue is full.
+	 */
+	bool request(FillFunc fill, void* data, int tag, int bytes) {
+		SDL_mutexP(lock);
+		bool queued = requestCount < MAX_REQUESTS;
+		if (queued) {
+			Request& r = requests[(requestHead + requestCount++) % MAX_REQUESTS];
+			r.fill = fill;
+			r.data = data;
+			r.tag = tag;
+			r.bytes = bytes;
+		}
+		SDL_mutexV(lock);
+		if (queued)
+			SDL_SemPost(requestsReady);
+		return queued;
+	}
+
+	/*
+	 * Waits for the fill in progress and holds off the next ones until
+	 * resume(), while the render thread changes the data they read
+	 */
+	void pause() {
+		SDL_mutexP(fillLock);
+	}
+
+	void resume() {
+		SDL_mutexV(fillLock);
+	}
+
+	/*
+	 * Takes up to max finished uploads in the order they were requested.
+	 * Each must be passed to texSubImage2D() or release().
+	 */
+	int collect(Upload* uploads, int max) {
+		SDL_mutexP(lock);
+		int count = doneCount < max ? doneCount : max;
+		memcpy(uploads, done, count * sizeof (Upload));
+		memmove(done, done + count, (doneCount - count) * sizeof (Upload));
+		doneCount -= count;
+		SDL_mutexV(lock);
+		return count;
+	}
+
+	/*
+	 * Copies a finished upload into the bound texture and recycles its
+	 * staging buffer once the GPU has read it
+	 */
+	void texSubImage2D(const Upload& upload, GLenum target, GLint level, GLint x, GLint y,
+			   GLsizei width, GLsizei height, GLenum format, GLenum type) {
+		long long start = getMicroseconds();
+		int s = upload.staging;
+		if (persistent) {
+			driver->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+			driver->glTexSubImage2D(target, level, x, y, width, height, format, type,
+						(const char*)0 + s * stagingSize);
+			driver->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			fence[s] = driver->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		} else {
+			driver->glTexSubImage2D(target, level, x, y, width, height, format, type,
+						base + s * stagingSize);
+			release(upload);
+		}
+		++stats.uploads;
+		stats.bytes += stagingBytes[s];
+		stats.submitTime += (int)(getMicroseconds() - start);
+	}
+
+	/*
+	 * Gives a finished upload back without copying it
+	 */
+	void release(const Upload& upload) {
+		SDL_mutexP(lock);
+		freeStaging[freeCount++] = upload.staging;
+		SDL_mutexV(lock);
+		SDL_SemPost(stagingFree);
+	}
+
+	/*
+	 * Recycles the staging buffers the GPU is done with and closes the
+	 * statistics of the frame
+	 */
+	void endFrame() {
+		for (int i = 0; i < stagingCount; ++i) {
+			if (!fence[i])
+				continue;
+			GLenum status = driver->glClientWaitSync(fence[i], 0, 0);
+			if (status == GL_TIMEOUT_EXPIRED)
+				continue;
+			driver->glDeleteSync(fence[i]);
+			fence[i] = 0;
+			Upload u = { -1, i };
+			release(u);
+		}
+
+		SDL_mutexP(lock);
+		stats.pending = requestCount + stagingCount - freeCount;
+		stats.stagingWaits = stagingWaits;
+		stats.stagingWaitTime = stagingWaitTime;
+		stagingWaits = stagingWaitTime = 0;
+		SDL_mutexV(lock);
+		frameStats = stats;
+		memset(&stats, 0, sizeof (stats));
+	}
+
+	// Bytes of staging memory
+	int getMemory() const {
+		return stagingCount * stagingSize;
+	}
+
+	const UploadStats& getFrameStats() const {
+		return frameStats;
+	}
+
+private:
+
+	struct Request {
+		FillFunc fill;
+		void*    data;
+		int      tag;
+		int      bytes;
+	};
+
+	static int threadMain(void* data) {
+		UploadQueue* self = (UploadQueue*)data;
+		for (;;) {
+			SDL_SemWait(self->requestsReady);
+			if (!self->running)
+				break;
+			bool waited = SDL_SemTryWait(self->stagingFree) != 0;
+			long long start = getMicroseconds();
+			if (waited)
+				SDL_SemWait(self->stagingFree);
+			if (!self->running)
+				break;
+
+			SDL_mutexP(self->lock);
+			if (waited) {
+				++self->stagingWaits;
+				self->stagingWaitTime += (int)(getMicroseconds() - start);
+			}
+			Request r = self->requests[self->requestHead];
+			self->requestHead = (self->requestHead + 1) % MAX_REQUESTS;
+			--self->requestCount;
+			int staging = self->freeStaging[--self->freeCount];
+			SDL_mutexV(self->lock);
+
+			SDL_mutexP(self->fillLock);
+			r.fill(r.data, r.tag, self->base + staging * self->stagingSize);
+			SDL_mutexV(self->fillLock);
+			self->stagingBytes[staging] = r.bytes;
+
+			SDL_mutexP(self->lock);
+			Upload& u = self->done[self->doneCount++];
+			u.tag = r.tag;
+			u.staging = staging;
+			SDL_mutexV(self->lock);
+		}
+		return 0;
+	}
+
+	int            stagingSize, stagingCount;
+	bool           persistent;
+	GLuint         buffer;
+	unsigned char* base;
+	GLsync         fence[MAX_STAGING];
+	int            stagingBytes[MAX_STAGING];
+
+	// Shared with the worker thread under the lock
+	SDL_Thread*   thread;
+	SDL_mutex*    lock;
+	SDL_mutex*    fillLock;
+	SDL_sem*      requestsReady;
+	SDL_sem*      stagingFree;
+	volatile bool running;
+	Request       requests[MAX_REQUESTS];
+	int           requestHead, requestCount;
+	int           freeStaging[MAX_STAGING];
+	int           freeCount;
+	Upload        done[MAX_STAGING];
+	int           doneCount;
+	int           stagingWaits, stagingWaitTime;
+
+	UploadStats stats, frameStats;
+};
+
+#endif
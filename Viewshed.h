@@ -0,0 +1,212 @@
+#ifndef _VIEWSHED_H
+#define _VIEWSHED_H
+
+#include <string.h>
+#include "WorkerPool.h"
+
+/*
+ * Observer standing on grid point (x, z). Heights are in world units
+ * above the ground, radius is in grid cells.
+ */
+struct Observer {
+	int   x, z;
+	float eyeHeight;
+	float targetHeight;
+	int   radius;
+};
+
+/*
+ * Cells one observer can see, one bit per cell.
+ *
+ * The bits are kept per octant around the observer, ring by ring, so
+ * the octants can be computed in parallel without sharing a word.
+ */
+class VisibilityMap {
+public:
+
+	VisibilityMap() : radius(-1), bits(NULL) {
+	}
+
+	~VisibilityMap() {
+		delete[] bits;
+	}
+
+	bool isVisible(int x, int z) const {
+		int dx = x - observer.x, dz = z - observer.z;
+		if (!dx && !dz)
+			return true;
+
+		// Octant with the major axis first, matching Viewshed::sweep
+		int ax = dx < 0 ? -dx : dx, az = dz < 0 ? -dz : dz;
+		int i = ax > az ? ax : az, j = ax > az ? az : ax;
+		if (i > radius)
+			return false;
+		int octant;
+		if (ax > az)
+			octant = dx > 0 ? (dz >= 0 ? 0 : 7) : (dz >= 0 ? 3 : 4);
+		else
+			octant = dz > 0 ? (dx >= 0 ? 1 : 2) : (dx >= 0 ? 6 : 5);
+		int bit = i * (i + 1) / 2 + j;
+		return octantBits(octant)[bit >> 5] >> (bit & 31) & 1;
+	}
+
+	int getVisibleCount() const {
+		int count = 0;
+		for (int i = 0; i < 8 * octantWords; ++i) {
+			for (unsigned w = bits[i]; w; w &= w - 1)
+				++count;
+		}
+		return count;
+	}
+
+	// Bytes held by the bitmap
+	int getMemory() const {
+		return 8 * octantWords * sizeof (unsigned);
+	}
+
+private:
+
+	friend class Viewshed;
+
+	void reset(const Observer& o) {
+		if (o.radius != radius) {
+			delete[] bits;
+			radius = o.radius;
+			int cells = (radius + 1) * (radius + 2) / 2;
+			octantWords = (cells + 31) / 32;
+			bits = new unsigned[8 * octantWords];
+		}
+		observer = o;
+		memset(bits, 0, 8 * octantWords * sizeof (unsigned));
+	}
+
+	unsigned* octantBits(int octant) const {
+		return bits + octant * octantWords;
+	}
+
+	Observer  observer;
+	int       radius;
+	int       octantWords;
+	unsigned* bits;
+};
+
+/*
+ * Viewsheds over a height grid by horizon propagation (XDraw).
+ *
+ * Each octant around the observer is swept ring by ring. A cell looks
+ * back at the two cells of the previous ring its line of sight passes
+ * between and interpolates the steepest slope seen along that line so
+ * far. The cell is visible if it rises above that slope. This is
+ * O(radius²) per observer against O(radius³) for independent rays, at
+ * the cost of a small error from the interpolation.
+ *
+ * The grid is size x size heights indexed as height[x * size + z] and
+ * scaled by scale on all axes. Observers and octants are computed in
+ * parallel across the pool.
+ */
+class Viewshed {
+public:
+
+	enum {
+		MAX_RADIUS = 8192,
+	};
+
+	Viewshed(const short* height, int size, float scale)
+		: height(height), size(size), scale(scale) {
+	}
+
+	void compute(const Observer& observer, VisibilityMap& map, WorkerPool* pool = NULL) const {
+		compute(&observer, &map, 1, pool);
+	}
+
+	void compute(const Observer* observers, VisibilityMap* maps, int count, WorkerPool* pool = NULL) const {
+		for (int i = 0; i < count; ++i) {
+			Observer o = observers[i];
+			if (o.radius > MAX_RADIUS)
+				o.radius = MAX_RADIUS;
+			maps[i].reset(o);
+		}
+
+		Batch batch = { this, maps };
+		if (pool)
+			pool->run(batchJob, &batch, 8 * count, 1);
+		else
+			batchJob(&batch, 0, 8 * count);
+	}
+
+private:
+
+	struct Batch {
+		const Viewshed* viewshed;
+		VisibilityMap*  maps;
+	};
+
+	static void batchJob(void* data, int begin, int end) {
+		Batch* batch = (Batch*)data;
+		for (int i = begin; i < end; ++i)
+			batch->viewshed->sweep(batch->maps[i / 8], i % 8);
+	}
+
+	void sweep(VisibilityMap& map, int octant) const {
+		static const int axes[8][4] = {
+			// dx from (i, j), dz from (i, j)
+			{  1,  0,  0,  1 },
+			{  0,  1,  1,  0 },
+			{  0, -1,  1,  0 },
+			{ -1,  0,  0,  1 },
+			{ -1,  0,  0, -1 },
+			{  0, -1, -1,  0 },
+			{  0,  1, -1,  0 },
+			{  1,  0,  0, -1 },
+		};
+		const int* a = axes[octant];
+		const Observer& o = map.observer;
+		unsigned* bits = map.octantBits(octant);
+
+		// Heights and slopes in grid units, slope over the major axis
+		float eye = height[o.x * size + o.z] + o.eyeHeight / scale;
+		float target = o.targetHeight / scale;
+		float ring[2][MAX_RADIUS + 1];
+		float* last = ring[0];
+		float* next = ring[1];
+		int radius2 = o.radius * o.radius;
+
+		for (int i = 1; i <= o.radius; ++i) {
+			for (int j = 0; j <= i; ++j) {
+				// Slope of the line of sight where it crosses the previous ring
+				float horizon;
+				if (i == 1) {
+					horizon = -1e30;
+				} else {
+					float p = (float)j * (i - 1) / i;
+					int k = (int)p;
+					float f = p - k;
+					horizon = f > 0 ? last[k] + f * (last[k + 1] - last[k]) : last[k];
+				}
+
+				int x = o.x + a[0] * i + a[1] * j;
+				int z = o.z + a[2] * i + a[3] * j;
+				if (x < 0 || z < 0 || x >= size || z >= size) {
+					next[j] = horizon;
+					continue;
+				}
+
+				float ground = height[x * size + z] - eye;
+				if ((ground + target) / i >= horizon && i * i + j * j <= radius2) {
+					int bit = i * (i + 1) / 2 + j;
+					bits[bit >> 5] |= 1u << (bit & 31);
+				}
+				next[j] = ground / i > horizon ? ground / i : horizon;
+			}
+			float* t = last;
+			last = next;
+			next = t;
+		}
+	}
+
+	const short* height;
+	int          size;
+	float        scale;
+};
+
+#endif
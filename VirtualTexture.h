@@ -0,0 +1,434 @@
+#ifndef _VIRTUAL_TEXTURE_H
+#define _VIRTUAL_TEXTURE_H
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include "GLDriver.h"
+#include "Timer.h"
+#include "UploadQueue.h"
+
+struct VirtualTextureStats {
+	int requests;
+	int misses;
+	int uploads;
+	int uploadBytes;
+	int evictions;
+	int dropped;
+	int residentPages;
+	int pendingPages;
+	int feedbackTime;
+};
+
+/*
+ * Virtual texture with a fixed size page cache.
+ *
+ * The virtual texture is PAGES x PAGES pages of PAGE_SIZE texels at the
+ * finest level, with a mip chain down to a single page. Only the pages
+ * the feedback pass asks for are resident, in slots of a physical atlas
+ * with ATLAS_SLOTS x ATLAS_SLOTS pages. The least recently requested
+ * page gives up its slot, so the GPU and CPU memory stays the same
+ * however large the virtual texture is.
+ *
+ * The feedback pass renders the page each pixel needs into a small
+ * viewport with the feedback shader. processFeedback() reads it back,
+ * and missing pages are queued on an upload queue, whose thread fills
+ * them through the page function into staging buffers. update() copies
+ * finished pages into the atlas without waiting for the driver and
+ * points the indirection table, one texel per page and level, at the
+ * finest resident page covering each page.
+ *
+ * Pages have a border of BORDER texels on every side for bilinear
+ * filtering across page edges. The page function fills a square of
+ * texels of a level starting at x, y, which may reach one texel beyond
+ * the edge of the texture. It runs on the upload thread.
+ */
+class VirtualTexture {
+public:
+
+	typedef void (*PageFunc)(int level, int x, int y, int size, unsigned char* rgba);
+
+	enum {
+		PAGE_SIZE = 128,
+		BORDER = 1,
+		SLOT_SIZE = PAGE_SIZE + 2 * BORDER,
+		LEVELS = 7,
+		PAGES = 1 << (LEVELS - 1),
+		TEXELS = PAGES * PAGE_SIZE,
+		TOTAL_PAGES = ((1 << 2 * LEVELS) - 1) / 3,
+		ATLAS_SLOTS = 16,
+		SLOTS = ATLAS_SLOTS * ATLAS_SLOTS,
+		ATLAS_SIZE = ATLAS_SLOTS * SLOT_SIZE,
+		PAGE_BUFFERS = 32,
+		MAX_UPLOADS = 8,
+		MAX_FEEDBACK = 256 * 256,
+	};
+
+	/*
+	 * GLSL helpers. The level bias of the feedback pass compensates for
+	 * its lower resolution. virtualTexture() has alpha 0 until the first
+	 * page is resident.
+	 */
+	static const char* shaderSource() {
+		static char source[2048];
+		if (source[0])
+			return source;
+		snprintf(source, sizeof (source),
+			 "float virtualLevel(vec2 uv, float bias) {\n"
+			 "	vec2 dx = dFdx(uv * %d.), dy = dFdy(uv * %d.);\n"
+			 "	return clamp(.5 * log2(max(dot(dx, dx), dot(dy, dy))) + bias, 0., %d.);\n"
+			 "}\n"
+			 "vec4 virtualFeedback(vec2 uv, float bias) {\n"
+			 "	int level = int(virtualLevel(uv, bias));\n"
+			 "	int pages = %d >> level;\n"
+			 "	ivec2 page = clamp(ivec2(uv * float(pages)), 0, pages - 1);\n"
+			 "	return vec4(vec3(page, level + 1) / 255., 1.);\n"
+			 "}\n"
+			 "vec4 virtualTexture(sampler2D indirection, sampler2D atlas, vec2 uv) {\n"
+			 "	int level = int(virtualLevel(uv, 0.));\n"
+			 "	int pages = %d >> level;\n"
+			 "	vec4 e = texelFetch(indirection, clamp(ivec2(uv * float(pages)), 0, pages - 1), level) * 255.;\n"
+			 "	float resident = float(%d >> int(e.z + .5));\n"
+			 "	vec2 t = clamp(uv, 0., 1.) * resident;\n"
+			 "	vec2 local = t - min(floor(t), resident - 1.);\n"
+			 "	vec2 p = (floor(e.xy + .5) * %d. + %d. + local * %d.) / %d.;\n"
+			 "	return vec4(textureLod(atlas, p, 0.).rgb, step(.5, e.w));\n"
+			 "}\n",
+			 TEXELS, TEXELS, LEVELS - 1, PAGES, PAGES, PAGES,
+			 SLOT_SIZE, BORDER, PAGE_SIZE, ATLAS_SIZE);
+		return source;
+	}
+
+	VirtualTexture(PageFunc produce)
+		: produce(produce), frame(0), dirty(true) {
+		memset(&stats, 0, sizeof (stats));
+		memset(&frameStats, 0, sizeof (frameStats));
+
+		int offset = 0;
+		for (int l = 0; l < LEVELS; ++l) {
+			levelOffset[l] = offset;
+			offset += (PAGES >> l) * (PAGES >> l);
+		}
+		for (int i = 0; i < TOTAL_PAGES; ++i) {
+			pageState[i] = PAGE_ABSENT;
+			pageUsed[i] = -1;
+		}
+		for (int i = 0; i < SLOTS; ++i)
+			slotPage[i] = -1;
+		memset(indirection, 0, sizeof (indirection));
+
+		driver->glGenTextures(1, &atlas);
+		driver->glBindTexture(GL_TEXTURE_2D, atlas);
+		driver->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		driver->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		driver->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, ATLAS_SIZE, ATLAS_SIZE, 0,
+				     GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+		driver->glGenTextures(1, &indirectionTexture);
+		driver->glBindTexture(GL_TEXTURE_2D, indirectionTexture);
+		driver->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+		driver->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		driver->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, LEVELS - 1);
+		for (int l = 0; l < LEVELS; ++l)
+			driver->glTexImage2D(GL_TEXTURE_2D, l, GL_RGBA8, PAGES >> l, PAGES >> l, 0,
+					     GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		driver->glBindTexture(GL_TEXTURE_2D, 0);
+
+		queue = new UploadQueue(SLOT_SIZE * SLOT_SIZE * 4, PAGE_BUFFERS);
+
+		// The last level is the fallback for everything and never evicted
+		int root = levelOffset[LEVELS - 1];
+		pageUsed[root] = INT_MAX;
+		request(root);
+	}
+
+	~VirtualTexture() {
+		// Stops the producer before the textures go
+		delete queue;
+		driver->glDeleteTextures(1, &atlas);
+		driver->glDeleteTextures(1, &indirectionTexture);
+	}
+
+	bool isAvailable() const {
+		return queue->isAvailable();
+	}
+
+	/*
+	 * Reads back the width x height feedback pixels at the origin of the
+	 * current framebuffer and queues the pages that are missing
+	 */
+	void processFeedback(int width, int height) {
+		long long start = getMicroseconds();
+		memset(&stats, 0, sizeof (stats));
+		++frame;
+
+		if (width * height > MAX_FEEDBACK)
+			height = MAX_FEEDBACK / width;
+		driver->glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, feedback);
+
+		for (int i = 0; i < width * height; ++i) {
+			const unsigned char* p = feedback + 4 * i;
+			if (!p[2] || p[2] > LEVELS)
+				continue;
+			int level = p[2] - 1, pages = PAGES >> level;
+			if (p[0] < pages && p[1] < pages)
+				usePage(level, p[0], p[1]);
+		}
+		stats.feedbackTime = (int)(getMicroseconds() - start);
+	}
+
+	/*
+	 * Uploads up to MAX_UPLOADS finished pages into the atlas and
+	 * refreshes the indirection table
+	 */
+	void update() {
+		UploadQueue::Upload finished[MAX_UPLOADS];
+		int count = queue->collect(finished, MAX_UPLOADS);
+		driver->glBindTexture(GL_TEXTURE_2D, atlas);
+		for (int i = 0; i < count; ++i)
+			upload(finished[i]);
+
+		if (dirty)
+			updateIndirection();
+		driver->glBindTexture(GL_TEXTURE_2D, 0);
+		queue->endFrame();
+		stats.pendingPages = queue->getFrameStats().pending;
+
+		stats.residentPages = 0;
+		for (int i = 0; i < SLOTS; ++i)
+			stats.residentPages += slotPage[i] >= 0;
+		frameStats = stats;
+	}
+
+	/*
+	 * Produces the pages over [u0, u1) x [v0, v1) of the texture again
+	 * after their source changed. Resident pages stay visible until the
+	 * new version arrives. Those that do not fit into the request queue
+	 * are evicted and come back through the feedback.
+	 */
+	void invalidate(float u0, float v0, float u1, float v1) {
+		for (int level = LEVELS - 1; level >= 0; --level) {
+			int pages = PAGES >> level;
+			int x0 = clampPage((int)floor(u0 * pages), pages), x1 = clampPage((int)ceil(u1 * pages) - 1, pages);
+			int y0 = clampPage((int)floor(v0 * pages), pages), y1 = clampPage((int)ceil(v1 * pages) - 1, pages);
+			for (int y = y0; y <= y1; ++y) {
+				for (int x = x0; x <= x1; ++x) {
+					int page = pageIndex(level, x, y);
+					if (pageState[page] == PAGE_ABSENT || enqueue(page))
+						continue;
+					if (pageState[page] == PAGE_RESIDENT) {
+						slotPage[pageSlot[page]] = -1;
+						pageState[page] = PAGE_ABSENT;
+						dirty = true;
+					}
+				}
+			}
+		}
+	}
+
+	/*
+	 * Holds off the page producer while the source of the pages changes
+	 */
+	void pause() {
+		queue->pause();
+	}
+
+	void resume() {
+		queue->resume();
+	}
+
+	/*
+	 * Binds the indirection table to texture unit unit and the atlas to
+	 * the unit after it
+	 */
+	void bind(int unit) const {
+		driver->glActiveTexture(GL_TEXTURE0 + unit);
+		driver->glBindTexture(GL_TEXTURE_2D, indirectionTexture);
+		driver->glActiveTexture(GL_TEXTURE0 + unit + 1);
+		driver->glBindTexture(GL_TEXTURE_2D, atlas);
+		driver->glActiveTexture(GL_TEXTURE0);
+	}
+
+	void unbind(int unit) const {
+		driver->glActiveTexture(GL_TEXTURE0 + unit + 1);
+		driver->glBindTexture(GL_TEXTURE_2D, 0);
+		driver->glActiveTexture(GL_TEXTURE0 + unit);
+		driver->glBindTexture(GL_TEXTURE_2D, 0);
+		driver->glActiveTexture(GL_TEXTURE0);
+	}
+
+	// Bytes of the atlas, indirection table, staging buffers and feedback
+	int getMemory() const {
+		return ATLAS_SIZE * ATLAS_SIZE * 4 + 2 * sizeof (indirection) +
+			queue->getMemory() + sizeof (feedback);
+	}
+
+	const VirtualTextureStats& getFrameStats() const {
+		return frameStats;
+	}
+
+	// Page copies of the last update
+	const UploadStats& getUploadStats() const {
+		return queue->getFrameStats();
+	}
+
+private:
+
+	enum PageState {
+		PAGE_ABSENT,
+		PAGE_PENDING,
+		PAGE_RESIDENT,
+	};
+
+	int pageIndex(int level, int x, int y) const {
+		return levelOffset[level] + y * (PAGES >> level) + x;
+	}
+
+	void pageCoordinates(int page, int& level, int& x, int& y) const {
+		level = 0;
+		while (level + 1 < LEVELS && page >= levelOffset[level + 1])
+			++level;
+		int pages = PAGES >> level;
+		x = (page - levelOffset[level]) % pages;
+		y = (page - levelOffset[level]) / pages;
+	}
+
+	/*
+	 * Marks a page and its ancestors as used this frame and requests the
+	 * missing ones, coarse pages first so they can stand in sooner
+	 */
+	void usePage(int level, int x, int y) {
+		int page = pageIndex(level, x, y);
+		if (pageUsed[page] == frame)
+			return;
+		++stats.requests;
+		if (pageState[page] != PAGE_RESIDENT)
+			++stats.misses;
+
+		int missing[LEVELS], count = 0;
+		for (; level < LEVELS; ++level, x >>= 1, y >>= 1) {
+			page = pageIndex(level, x, y);
+			if (pageUsed[page] == frame)
+				break;
+			if (pageUsed[page] != INT_MAX)
+				pageUsed[page] = frame;
+			if (pageState[page] == PAGE_ABSENT)
+				missing[count++] = page;
+		}
+		while (count--)
+			request(missing[count]);
+	}
+
+	void request(int page) {
+		if (enqueue(page))
+			pageState[page] = PAGE_PENDING;
+	}
+
+	bool enqueue(int page) {
+		return queue->request(producePage, this, page, SLOT_SIZE * SLOT_SIZE * 4);
+	}
+
+	static int clampPage(int i, int pages) {
+		return i < 0 ? 0 : i >= pages ? pages - 1 : i;
+	}
+
+	// Runs on the upload thread
+	static void producePage(void* data, int page, unsigned char* rgba) {
+		VirtualTexture* self = (VirtualTexture*)data;
+		int level, x, y;
+		self->pageCoordinates(page, level, x, y);
+		self->produce(level, x * PAGE_SIZE - BORDER, y * PAGE_SIZE - BORDER, SLOT_SIZE, rgba);
+	}
+
+	/*
+	 * Puts a finished page into a free slot or the least recently used
+	 * one. Pages used this frame are never evicted, if all are in use
+	 * the page is dropped and requested again later. A page produced
+	 * again after invalidate() keeps its slot.
+	 */
+	void upload(const UploadQueue::Upload& finished) {
+		int page = finished.tag;
+		int slot = -1, oldest = frame;
+		if (pageState[page] == PAGE_RESIDENT) {
+			slot = pageSlot[page];
+			oldest = -1;
+		}
+		for (int i = 0; i < SLOTS && oldest >= 0; ++i) {
+			int used = slotPage[i] < 0 ? -1 : pageUsed[slotPage[i]];
+			if (used < oldest) {
+				oldest = used;
+				slot = i;
+			}
+		}
+		if (slot < 0) {
+			pageState[page] = PAGE_ABSENT;
+			queue->release(finished);
+			++stats.dropped;
+			return;
+		}
+
+		if (slotPage[slot] >= 0 && slotPage[slot] != page) {
+			pageState[slotPage[slot]] = PAGE_ABSENT;
+			++stats.evictions;
+		}
+		slotPage[slot] = page;
+		pageSlot[page] = slot;
+		pageState[page] = PAGE_RESIDENT;
+		dirty = true;
+
+		queue->texSubImage2D(finished, GL_TEXTURE_2D, 0, slot % ATLAS_SLOTS * SLOT_SIZE,
+				     slot / ATLAS_SLOTS * SLOT_SIZE, SLOT_SIZE, SLOT_SIZE,
+				     GL_RGBA, GL_UNSIGNED_BYTE);
+		++stats.uploads;
+		stats.uploadBytes += SLOT_SIZE * SLOT_SIZE * 4;
+	}
+
+	/*
+	 * Every page points at itself if resident, else at whatever its
+	 * parent points at
+	 */
+	void updateIndirection() {
+		driver->glBindTexture(GL_TEXTURE_2D, indirectionTexture);
+		for (int level = LEVELS - 1; level >= 0; --level) {
+			int pages = PAGES >> level;
+			for (int y = 0; y < pages; ++y) {
+				for (int x = 0; x < pages; ++x) {
+					int page = pageIndex(level, x, y);
+					unsigned char* e = indirection + 4 * page;
+					if (pageState[page] == PAGE_RESIDENT) {
+						e[0] = pageSlot[page] % ATLAS_SLOTS;
+						e[1] = pageSlot[page] / ATLAS_SLOTS;
+						e[2] = level;
+						e[3] = 255;
+					} else if (level + 1 < LEVELS) {
+						memcpy(e, indirection + 4 * pageIndex(level + 1, x >> 1, y >> 1), 4);
+					} else {
+						memset(e, 0, 4);
+					}
+				}
+			}
+			driver->glTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, pages, pages, GL_RGBA,
+						GL_UNSIGNED_BYTE, indirection + 4 * levelOffset[level]);
+			stats.uploadBytes += pages * pages * 4;
+		}
+		dirty = false;
+	}
+
+	PageFunc      produce;
+	GLuint        atlas, indirectionTexture;
+	int           levelOffset[LEVELS];
+	unsigned char pageState[TOTAL_PAGES];
+	int           pageUsed[TOTAL_PAGES];
+	short         pageSlot[TOTAL_PAGES];
+	int           slotPage[SLOTS];
+	unsigned char indirection[4 * TOTAL_PAGES];
+	unsigned char feedback[4 * MAX_FEEDBACK];
+	int           frame;
+	bool          dirty;
+	UploadQueue*  queue;
+
+	VirtualTextureStats stats, frameStats;
+};
+
+#endif
@@ -0,0 +1,131 @@
+#ifndef _WORKER_POOL_H
+#define _WORKER_POOL_H
+
+#include <stdio.h>
+#include <unistd.h>
+#include "SDL.h"
+
+/*
+ * Fixed set of worker threads for data parallel jobs.
+ *
+ * run() splits the index range [0, count) into batches of grain
+ * indices which the workers and the calling thread take in turn, and
+ * returns when all of them are done. Jobs must not call run() again;
+ * calls from different threads are serialized.
+ */
+class WorkerPool {
+public:
+
+	typedef void (*JobFunc)(void* data, int begin, int end);
+
+	enum {
+		MAX_THREADS = 64,
+	};
+
+	/*
+	 * threads counts the calling thread, 0 uses one per processor
+	 */
+	WorkerPool(int threads = 0) : workerCount(0), job(NULL) {
+		if (threads <= 0)
+			threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		if (threads > MAX_THREADS)
+			threads = MAX_THREADS;
+
+		lock = SDL_CreateMutex();
+		runLock = SDL_CreateMutex();
+		start = SDL_CreateSemaphore(0);
+		done = SDL_CreateSemaphore(0);
+		for (int i = 1; i < threads; ++i) {
+			thread[workerCount] = SDL_CreateThread(threadMain, this);
+			if (!thread[workerCount]) {
+				fprintf(stderr, "Could not create worker thread: %s\n", SDL_GetError());
+				break;
+			}
+			++workerCount;
+		}
+	}
+
+	~WorkerPool() {
+		job = NULL;
+		for (int i = 0; i < workerCount; ++i)
+			SDL_SemPost(start);
+		for (int i = 0; i < workerCount; ++i)
+			SDL_WaitThread(thread[i], NULL);
+		SDL_DestroySemaphore(start);
+		SDL_DestroySemaphore(done);
+		SDL_DestroyMutex(lock);
+		SDL_DestroyMutex(runLock);
+	}
+
+	int getThreadCount() const {
+		return workerCount + 1;
+	}
+
+	void run(JobFunc job, void* data, int count, int grain) {
+		if (grain < 1)
+			grain = 1;
+		// Not worth waking anybody up
+		if (count <= grain || !workerCount) {
+			if (count > 0)
+				job(data, 0, count);
+			return;
+		}
+
+		SDL_LockMutex(runLock);
+		this->job = job;
+		this->data = data;
+		this->count = count;
+		this->grain = grain;
+		next = 0;
+
+		int helpers = (count + grain - 1) / grain - 1;
+		if (helpers > workerCount)
+			helpers = workerCount;
+		for (int i = 0; i < helpers; ++i)
+			SDL_SemPost(start);
+		work();
+		for (int i = 0; i < helpers; ++i)
+			SDL_SemWait(done);
+		SDL_UnlockMutex(runLock);
+	}
+
+private:
+
+	void work() {
+		for (;;) {
+			SDL_LockMutex(lock);
+			int begin = next;
+			next += grain;
+			SDL_UnlockMutex(lock);
+			if (begin >= count)
+				break;
+			job(data, begin, begin + grain < count ? begin + grain : count);
+		}
+	}
+
+	static int threadMain(void* data) {
+		WorkerPool* self = (WorkerPool*)data;
+		for (;;) {
+			SDL_SemWait(self->start);
+			if (!self->job)
+				break;
+			self->work();
+			SDL_SemPost(self->done);
+		}
+		return 0;
+	}
+
+	SDL_Thread* thread[MAX_THREADS];
+	int         workerCount;
+	SDL_mutex*  lock;
+	SDL_mutex*  runLock;
+	SDL_sem*    start;
+	SDL_sem*    done;
+
+	JobFunc volatile job;
+	void*       data;
+	int         count, grain;
+	int         next;
+};
+
+#endif